@@ -1,10 +1,14 @@
 # Simple Microsoft IDL parser.
 # Generates cross-platform compatible C++ headers from Microsoft IDL files.
 
+import argparse
+import concurrent.futures
 import hashlib
+import json
 import os
 import re
 import sys
+import time
 
 VERBOSE = False #True
 
@@ -17,56 +21,40 @@ def RemoveMidPragmas (source):
         result += line + '\n'
     return result
 
-def ExtractComments (source, comments):
-    '''Extract comments & replace them with a hash value'''
-
-    def ReplaceFun (match):
-        beginidx, endidx = match.regs[0]
-        substr = source[beginidx:endidx]
+# single-pass tokenizer pattern for "..." strings that might contain escape characters, multi-line "/*...*/" comments & "//..." comments
+TOKEN_PATTERN = re.compile('"(?:[^"\\\\]|\\\\.)*"|/\\*.*?\\*/|//[^\\n]*', re.DOTALL)
+# pattern for "\0<index>\0" placeholders substituted for strings & comments. NUL delimiters cannot occur in IDL, so that
+# placeholders never merge with adjacent identifiers or literals
+TOKEN_KEY_PATTERN = re.compile('\0[0-9]+\0')
 
-        hash = hashlib.md5(substr.encode()).hexdigest()
-        comments[hash] = substr
-        return hash
 
-    # pattern that detects multi-line "/*...*/" strings non-greedy
-    pattern = re.compile('/\\*.*?\\*/', re.DOTALL)
-    source = pattern.sub(ReplaceFun, source)
+def ExtractComments (source, comments):
+    '''Extract comments & text strings in a single pass & replace them with a placeholder'''
 
-    # pattern that detects "//..." strings
-    pattern = re.compile('//.*')
-    source = pattern.sub(ReplaceFun, source)
-    return source
+    def ReplaceFun (match):
+        key = '\0' + str(len(comments)) + '\0'
+        comments[key] = match.group(0)
+        return key
 
+    return TOKEN_PATTERN.sub(ReplaceFun, source)
 
-def ExtractStrings (source, comments):
-    '''Extract text strings & replace them with a hash value'''
 
-    def ReplaceFun (match):
-        beginidx, endidx = match.regs[0]
-        substr = source[beginidx:endidx]
+def ReplaceComments (source, comments):
+    '''Substitute placeholders back with their original text strings'''
+    return TOKEN_KEY_PATTERN.sub(lambda match: comments.get(match.group(0), match.group(0)), source)
 
-        hash = hashlib.md5(substr.encode()).hexdigest()
-        comments[hash] = substr
-        return hash
 
-    # pattern that detects "..." strings that might contain escape characters
-    pattern = re.compile('"([^"\\\\]|\\\\.)*"')
-    source = pattern.sub(ReplaceFun, source)
-    return source
+def RemoveComments (source, comments):
+    '''Remove placeholders for comments & text strings'''
+    return TOKEN_KEY_PATTERN.sub(lambda match: '' if match.group(0) in comments else match.group(0), source)
 
 
-def ReplaceComments (source, comments):
-    '''Substitute hash values back with their original text strings'''
-    for i in range(2): # two passes to account for nested comments
-        for key in comments:
-            source = source.replace(key, comments[key])
-    return source
-
+UUID_PATTERN = re.compile('(?<![a-zA-Z0-9_])uuid\\(')
 
 def ParseUuidString (str):
     '''Return uuid string on {0xFFFFFFFF,0xFFFF,0xFFFF,{0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF}} form'''
-    # identify UUID
-    uuid = str[str.find('uuid(')+5:]
+    # identify UUID. Skip "async_uuid(...)" attributes
+    uuid = str[UUID_PATTERN.search(str).end():]
     uuid = ''.join(uuid[:uuid.find(')')].split('-'))
     uuid = '{0x'+uuid[:8]+',0x'+uuid[8:12]+',0x'+uuid[12:16]+',{0x'+uuid[16:18]+',0x'+uuid[18:20]+',0x'+uuid[20:22]+',0x'+uuid[22:24]+',0x'+uuid[24:26]+',0x'+uuid[26:28]+',0x'+uuid[28:30]+',0x'+uuid[30:32]+'}}'
     return uuid
@@ -80,7 +68,7 @@ def ParseAttributes (source):
         substr = source[beginidx:endidx]
 
         uuid_statement = ''
-        if 'uuid(' in substr:
+        if UUID_PATTERN.search(substr):
             # identify which struct/interface the uuid belongs to
             later_tokens = source[endidx:].split()
             if later_tokens[0] == 'interface':
@@ -93,6 +81,10 @@ def ParseAttributes (source):
                 coclass = later_tokens[1] # class name
                 uuid = ParseUuidString(substr)
                 uuid_statement = '\nstatic constexpr GUID CLSID_'+coclass+' = '+uuid+';\n'
+            elif later_tokens[0] == 'library':
+                library = later_tokens[1] # library name
+                uuid = ParseUuidString(substr)
+                uuid_statement = '\nstatic constexpr GUID LIBID_'+library+' = '+uuid+';\n'
         else:
             # preserve brackets in "float res[3]"-style arguments
             if substr[1:-1].isdigit():
@@ -113,6 +105,24 @@ def ParseAttributes (source):
     return modified, interfaces
 
 
+# method name prefixes for property accessors
+PROPERTY_PREFIXES = {'propget': 'get_', 'propput': 'put_', 'propputref': 'putref_'}
+
+def ParseProperties (source):
+    '''Rename [propget], [propput] & [propputref] methods to get_X, put_X & putref_X like MIDL'''
+
+    def ReplaceFun (match):
+        attributes, space, name = match.groups()
+        for attr in SplitTopLevel(attributes):
+            if attr in PROPERTY_PREFIXES:
+                name = PROPERTY_PREFIXES[attr]+name
+        return '['+attributes+']'+space+name
+
+    # pattern to match '[id(1), propget] HRESULT Fun'
+    pattern = re.compile('\\[([^\\[\\]]*)\\](\\s*HRESULT\\s+)([a-zA-Z0-9_]+)')
+    return pattern.sub(ReplaceFun, source)
+
+
 def ParseInterfaces (source):
     '''Parse IDL interface statements'''
 
@@ -245,15 +255,563 @@ def ParseImport (source):
     return source, last_import
 
 
-def ParseIdlFile (idl_file, h_file, c_file):
+# types that cannot be marshaled through pointers without size_is() information
+SCALAR_TYPES = {'void', 'const', 'char', 'short', 'int', 'long', 'float', 'double', 'unsigned', 'signed', 'byte', 'boolean',
+                'BYTE', 'USHORT', 'UINT', 'ULONG', 'LONG', 'DWORD', 'BOOL', 'VARIANT_BOOL', '__int64', 'ULONGLONG',
+                'int8_t', 'int16_t', 'int32_t', 'int64_t', 'uint8_t', 'uint16_t', 'uint32_t', 'uint64_t', 'size_t'}
+
+
+def SplitTopLevel (text):
+    '''Split text on commas that are not nested inside (...) or [...]'''
+    if not any(ch in text for ch in '(['):
+        parts = text.split(',') # fast path without nesting
+        return [part.strip() for part in parts if part.strip()]
+    parts = []
+    depth = 0
+    start = 0
+    for idx, ch in enumerate(text):
+        if ch in '([':
+            depth += 1
+        elif ch in ')]':
+            depth -= 1
+        elif (ch == ',') and (depth == 0):
+            parts.append(text[start:idx])
+            start = idx+1
+    parts.append(text[start:])
+    return [part.strip() for part in parts if part.strip()]
+
+
+def IsMarshalable (type):
+    '''Check if a by-value argument type can be marshaled'''
+    if type.count('*') == 0:
+        return True # trivially copyable type
+    if type.count('*') > 1:
+        return False
+    return not (set(type.replace('*', ' ').split()) & SCALAR_TYPES) # BSTR, SAFEARRAY & interface pointers
+
+
+PARAM_PATTERN     = re.compile('(\\[(.*?)\\])?\\s*(.*)', re.DOTALL)
+SAFEARRAY_PATTERN = re.compile('SAFEARRAY\\(([a-zA-Z0-9_\\s\\*]+?)\\)')
+DECL_PATTERN      = re.compile('(.*?)([a-zA-Z_][a-zA-Z0-9_]*)\\s*(\\[\\s*([0-9]+)\\s*\\])?$')
+POINTER_PATTERN   = re.compile('\\s*\\*')
+
+def ParseMethodParams (params, comments):
+    '''Parse "[in] int a, [out, retval] int* b" arguments. Returns list of (direction, type, name, array size, IDL type, retval) tuples & unsupported reason'''
+    result = []
+    unsupported = None
+    for param in SplitTopLevel(params):
+        match = PARAM_PATTERN.match(param)
+        attributes = SplitTopLevel(match.group(2)) if match.group(2) else []
+        decl = match.group(3)
+        decl = RemoveComments(decl, comments)
+        safearray = SAFEARRAY_PATTERN.search(decl)
+        if safearray:
+            decl = SAFEARRAY_PATTERN.sub('SAFEARRAY*', decl)
+        decl = ' '.join(decl.split())
+        if decl in ['', 'void']:
+            continue
+
+        match = DECL_PATTERN.match(decl)
+        if not match or not match.group(1).strip():
+            return None, 'unnamed argument'
+        type = POINTER_PATTERN.sub('*', match.group(1).strip())
+        name = match.group(2)
+        size = match.group(4)
+
+        if 'out' in attributes:
+            direction = 'inout' if 'in' in attributes else 'out'
+        else:
+            direction = 'in'
+
+        reason = None
+        for attr in attributes:
+            if attr.split('(')[0].strip() in ['size_is', 'length_is', 'max_is', 'iid_is', 'string']:
+                reason = attr+' argument'
+        if reason:
+            pass
+        elif size:
+            if (direction == 'inout') or not IsMarshalable(type):
+                reason = 'array argument '+name
+        elif direction == 'in':
+            if not IsMarshalable(type):
+                reason = 'pointer argument '+name
+        elif not type.endswith('*') or not IsMarshalable(type[:-1]):
+            reason = 'pointer argument '+name
+
+        # declared type with SAFEARRAY element type, for IDispatch support
+        idl_type = type.replace('SAFEARRAY', 'SAFEARRAY('+' '.join(safearray.group(1).split())+')', 1) if safearray else type
+        retval = 'retval' in attributes
+
+        if reason:
+            # keep declared type for the E_NOTIMPL proxy signature
+            unsupported = unsupported or reason
+            result.append(('in', type, name, size, None, retval))
+            continue
+        if (direction != 'in') and not size:
+            type = type[:-1] # value type
+            idl_type = idl_type[:-1]
+        result.append((direction, type, name, size, idl_type, retval))
+    return result, unsupported
+
+
+def ParseInterfaceMethods (source, comments):
+    '''Parse interface definitions. Returns list of (name, base, uuid, attributes, methods) tuples'''
+    interfaces = []
+    pattern = re.compile('\\[([^\\[\\]]*)\\]\\s*interface\\s+([a-zA-Z0-9_]+)\\s*:\\s*([a-zA-Z0-9_]+)\\s*{(.*?)}\\s*;', re.DOTALL)
+    for match in pattern.finditer(source):
+        attributes, name, base, body = match.groups()
+        methods = []
+        for method in re.finditer('(\\[([^\\[\\]]*)\\]\\s*)?HRESULT\\s+([a-zA-Z0-9_]+)\\s*\\((.*?)\\)\\s*;', body, re.DOTALL):
+            params, unsupported = ParseMethodParams(method.group(4), comments)
+            method_attributes = SplitTopLevel(method.group(2)) if method.group(2) else []
+            methods.append((method.group(3), params, unsupported, method_attributes))
+        interfaces.append((name, base, bool(UUID_PATTERN.search(attributes)), SplitTopLevel(attributes), methods))
+    return interfaces
+
+
+def GenerateProxy (name, methods):
+    '''Generate client-side proxy class'''
+    code = 'class '+name+'_Proxy : public CInterfaceProxy<'+name+'> {\n'
+    code += 'public:\n'
+    code += '    using CInterfaceProxy::CInterfaceProxy;\n'
+    for idx, (method, params, unsupported, method_attributes) in enumerate(methods):
+        args = ', '.join(type+('' if direction == 'in' else '*')+' '+arg+('['+size+']' if size else '') for direction, type, arg, size, *_ in params)
+        code += '\n    HRESULT '+method+' ('+args+') override {\n'
+        if unsupported:
+            for direction, type, arg, size, *_ in params:
+                code += '        (void)'+arg+';\n'
+            code += '        return E_NOTIMPL; // cannot marshal '+unsupported+'\n'
+            code += '    }\n'
+            continue
+
+        code += '        CProxyCall rpc(m_manager, __uuidof('+name+'), '+str(idx)+');\n'
+        for direction, type, arg, size, *_ in params:
+            if size:
+                if direction == 'in':
+                    code += '        rpc.InArray('+arg+', '+size+');\n'
+            elif direction == 'in':
+                code += '        rpc.In('+arg+');\n'
+            elif direction == 'inout':
+                code += '        rpc.In(*'+arg+');\n'
+        code += '        rpc.Invoke();\n'
+        for direction, type, arg, size, *_ in params:
+            if size:
+                if direction == 'out':
+                    code += '        rpc.OutArray('+arg+', '+size+');\n'
+            elif direction == 'out':
+                code += '        rpc.Out('+arg+');\n'
+            elif direction == 'inout':
+                code += '        rpc.InOut('+arg+');\n'
+        code += '        return rpc.Result();\n'
+        code += '    }\n'
+    code += '};\n'
+    return code
+
+
+def GenerateStub (name, methods):
+    '''Generate server-side stub function'''
+    code = 'static HRESULT '+name+'_Stub (void* ptr, unsigned int method, MarshalReader& in, MarshalWriter& out) {\n'
+    code += '    auto* itf = static_cast<'+name+'*>(ptr);\n'
+    supported = [params for method, params, unsupported, method_attributes in methods if not unsupported]
+    if not any(params for params in supported):
+        code += '    (void)in;\n'
+    if not any(direction != 'in' for params in supported for direction, type, arg, size, *_ in params):
+        code += '    (void)out;\n'
+    code += '    switch (method) {\n'
+    for idx, (method, params, unsupported, method_attributes) in enumerate(methods):
+        if unsupported:
+            continue
+        code += '    case '+str(idx)+': { // '+method+'\n'
+        for direction, type, arg, size, *_ in params:
+            if size:
+                code += '        MarshalArray<'+type+', '+size+'> arg_'+arg+';\n'
+            else:
+                code += '        MarshalArg<'+type+'> arg_'+arg+';\n'
+        for direction, type, arg, size, *_ in params:
+            if size and (direction == 'in'):
+                code += '        in.ReadArray(arg_'+arg+'.value, '+size+');\n'
+            elif not size and (direction in ['in', 'inout']):
+                code += '        in.Read(arg_'+arg+'.value);\n'
+        if params:
+            code += '        if (in.Failed())\n'
+            code += '            return RPC_E_INVALID_DATA;\n'
+        args = ', '.join(('' if size or (direction == 'in') else '&')+'arg_'+arg+'.value' for direction, type, arg, size, *_ in params)
+        if not any(direction != 'in' for direction, type, arg, size, *_ in params):
+            code += '        return itf->'+method+'('+args+');\n'
+            code += '    }\n'
+            continue
+
+        code += '        HRESULT hr = itf->'+method+'('+args+');\n'
+        code += '        if (SUCCEEDED(hr)) {\n'
+        for direction, type, arg, size, *_ in params:
+            if size and (direction == 'out'):
+                code += '            out.WriteArray(arg_'+arg+'.value, '+size+');\n'
+            elif not size and (direction in ['out', 'inout']):
+                code += '            out.Write(arg_'+arg+'.value);\n'
+        code += '        }\n'
+        code += '        return hr;\n'
+        code += '    }\n'
+    code += '    }\n'
+    code += '    return RPC_E_INVALIDMETHOD;\n'
+    code += '}\n'
+    return code
+
+
+def GenerateProxyStubs (interfaces, h_file):
+    '''Generate out-of-process proxy/stub code for all remotable interfaces'''
+    methods_by_name = {}
+
+    code = '// Out-of-process proxy/stub code generated by IdlParse.py\n'
+    code += '#include "Marshal.hpp"\n'
+    code += '#include "'+h_file+'"\n'
+    for name, base, has_uuid, attributes, methods in interfaces:
+        # flatten methods from base interfaces in the same file
+        if base in methods_by_name:
+            methods = methods_by_name[base] + methods
+        elif base != 'IUnknown':
+            code += '\n// '+name+': proxy/stub not generated, since base interface '+base+' is not in the same file\n'
+            continue
+        methods_by_name[name] = methods
+
+        if not has_uuid or ('local' in attributes):
+            continue # not remotable
+        if any(params is None for method, params, unsupported, method_attributes in methods):
+            code += '\n// '+name+': proxy/stub not generated, due to unnamed method arguments\n'
+            continue
+
+        code += '\nnamespace {\n'
+        code += GenerateProxy(name, methods)
+        code += '} // namespace\n\n'
+        code += GenerateStub(name, methods)
+        code += 'MARSHALER_ENTRY_AUTO('+name+', '+name+'_Proxy, '+name+'_Stub)\n'
+    return code
+
+
+def AsyncSignatures (params, unsupported):
+    '''Begin_X & Finish_X argument lists for a method, following MIDL: [in] & [in,out] arguments are passed to Begin_X, and [out] & [in,out] arguments to Finish_X'''
+    if unsupported:
+        return ', '.join(type+' '+arg for direction, type, arg, size, *_ in params), ''
+    begin = []
+    finish = []
+    for direction, type, arg, size, *_ in params:
+        array = '['+size+']' if size else ''
+        if direction == 'in':
+            begin.append(type+' '+arg+array)
+        elif direction == 'out':
+            finish.append(type+('' if size else '*')+' '+arg+array)
+        else:
+            begin.append(type+'* '+arg)
+            finish.append(type+'* '+arg)
+    return ', '.join(begin), ', '.join(finish)
+
+
+def GenerateAsyncCall (name, async_name, methods):
+    '''Generate client-side call object that executes the synchronous methods on the thread pool'''
+    call_name = async_name+'_Call'
+    code = '/** Client-side call object for '+async_name+'. Executes '+name+' methods on the thread pool. */\n'
+    code += 'class '+call_name+' : public CAsyncCall<'+name+', '+async_name+'> {\n'
+    code += 'public:\n'
+    members = ''
+    for idx, (method, params, unsupported, method_attributes) in enumerate(methods):
+        begin_args, finish_args = AsyncSignatures(params, unsupported)
+        code += '    HRESULT Begin_'+method+' ('+begin_args+') override {\n'
+        if unsupported:
+            for direction, type, arg, size, *_ in params:
+                code += '        (void)'+arg+';\n'
+            code += '        return E_NOTIMPL; // cannot copy '+unsupported+'\n'
+            code += '    }\n'
+            code += '    HRESULT Finish_'+method+' () override {\n'
+            code += '        return E_NOTIMPL;\n'
+            code += '    }\n'
+            continue
+
+        for direction, type, arg, size, *_ in params:
+            members += '    CAsyncArg<'+type+'> m_'+method+'_'+arg+('['+size+']' if size else '')+';\n'
+
+        # copy [in] arguments
+        code += '        return BeginCall('+str(idx)+', [&] {\n'
+        for direction, type, arg, size, *_ in params:
+            member = 'm_'+method+'_'+arg
+            if size and (direction == 'in'):
+                code += '            for (size_t i = 0; i < '+size+'; ++i)\n'
+                code += '                '+member+'[i].Set('+arg+'[i]);\n'
+            elif direction == 'in':
+                code += '            '+member+'.Set('+arg+');\n'
+            elif direction == 'inout':
+                code += '            '+member+'.Set(*'+arg+');\n'
+        code += '        }, [](CAsyncCall* call) -> HRESULT {\n'
+        code += '            auto* self = static_cast<'+call_name+'*>(call);\n'
+        call_args = []
+        for direction, type, arg, size, *_ in params:
+            member = 'self->m_'+method+'_'+arg
+            if size:
+                code += '            '+type+' arg_'+arg+'['+size+'] = {};\n'
+                if direction == 'in':
+                    code += '            for (size_t i = 0; i < '+size+'; ++i)\n'
+                    code += '                arg_'+arg+'[i] = '+member+'[i].value;\n'
+                call_args.append('arg_'+arg)
+            elif direction == 'in':
+                call_args.append(member+'.value')
+            else:
+                call_args.append('&'+member+'.value')
+        code += '            HRESULT hr = self->m_server->'+method+'('+', '.join(call_args)+');\n'
+        for direction, type, arg, size, *_ in params:
+            member = 'self->m_'+method+'_'+arg
+            if size and (direction == 'out'):
+                code += '            for (size_t i = 0; i < '+size+'; ++i)\n'
+                code += '                '+member+'[i].value = arg_'+arg+'[i];\n'
+            elif size:
+                code += '            for (size_t i = 0; i < '+size+'; ++i)\n'
+                code += '                '+member+'[i].Clear();\n'
+            elif direction == 'in':
+                code += '            '+member+'.Clear();\n'
+        code += '            return hr;\n'
+        code += '        });\n'
+        code += '    }\n'
+
+        # return [out] arguments
+        code += '    HRESULT Finish_'+method+' ('+finish_args+') override {\n'
+        outs = [param for param in params if param[0] != 'in']
+        if not outs:
+            code += '        return FinishCall('+str(idx)+', [](bool) {});\n'
+            code += '    }\n'
+            continue
+        code += '        return FinishCall('+str(idx)+', [&](bool succeeded) {\n'
+        for direction, type, arg, size, *_ in outs:
+            member = 'm_'+method+'_'+arg
+            if size:
+                code += '            for (size_t i = 0; i < '+size+'; ++i) {\n'
+                code += '                if (succeeded)\n'
+                code += '                    '+member+'[i].Take(&'+arg+'[i]);\n'
+                code += '                else\n'
+                code += '                    '+member+'[i].Clear();\n'
+                code += '            }\n'
+            elif direction == 'out':
+                code += '            if (succeeded) {\n'
+                code += '                '+member+'.Take('+arg+');\n'
+                code += '            } else {\n'
+                code += '                *'+arg+' = {};\n'
+                code += '                '+member+'.Clear();\n'
+                code += '            }\n'
+            else:
+                code += '            if (succeeded) {\n'
+                code += '                CAsyncArg<'+type+'>{*'+arg+'}.Clear(); // free previous value\n'
+                code += '                '+member+'.Take('+arg+');\n'
+                code += '            } else {\n'
+                code += '                '+member+'.Clear();\n'
+                code += '            }\n'
+        code += '        });\n'
+        code += '    }\n'
+    if members:
+        code += '\nprivate:\n'+members
+    code += '};\n'
+    code += 'ASYNC_CALL_ENTRY_AUTO('+async_name+', '+call_name+')\n'
+    return code
+
+
+def GenerateAsyncInterfaces (interfaces):
+    '''Generate AsyncIFoo interfaces with Begin_X/Finish_X method pairs & call objects for [async_uuid] interfaces'''
+    methods_by_name = {}
+
+    code = ''
+    for name, base, has_uuid, attributes, methods in interfaces:
+        # flatten methods from base interfaces in the same file
+        methods = methods_by_name.get(base, []) + methods
+        methods_by_name[name] = methods
+
+        async_uuid = [attr for attr in attributes if attr.startswith('async_uuid(')]
+        if not async_uuid:
+            continue
+        async_name = 'Async'+name
+        if (base != 'IUnknown') and (base not in methods_by_name):
+            code += '\n// '+async_name+': not generated, since base interface '+base+' is not in the same file\n'
+            continue
+        if any(params is None for method, params, unsupported, method_attributes in methods):
+            code += '\n// '+async_name+': not generated, due to unnamed method arguments\n'
+            continue
+
+        code += '\nextern "C" {\n'
+        code += 'static constexpr GUID IID_'+async_name+' = '+ParseUuidString(async_uuid[0][6:])+';\n\n'
+        code += '/** Asynchronous version of '+name+'. Create with CoCreateAsyncCall. */\n'
+        code += 'struct '+async_name+' : virtual public IUnknown {\n'
+        for method, params, unsupported, method_attributes in methods:
+            begin_args, finish_args = AsyncSignatures(params, unsupported)
+            code += '    virtual HRESULT Begin_'+method+' ('+begin_args+') = 0;\n'
+            code += '    virtual HRESULT Finish_'+method+' ('+finish_args+') = 0;\n'
+        code += '};\n'
+        code += '} //extern "C"\n'
+        code += 'DEFINE_UUIDOF('+async_name+')\n\n'
+        code += GenerateAsyncCall(name, async_name, methods)
+    return code
+
+
+# VARTYPE of automation-compatible IDL types
+VARIANT_TYPES = {'char': 'VT_I1', 'byte': 'VT_UI1', 'BYTE': 'VT_UI1', 'boolean': 'VT_UI1',
+                 'short': 'VT_I2', 'USHORT': 'VT_UI2', 'unsigned short': 'VT_UI2', 'WORD': 'VT_UI2',
+                 'int': 'VT_INT', 'unsigned int': 'VT_UINT', 'UINT': 'VT_UINT',
+                 'long': 'VT_I4', 'LONG': 'VT_I4', 'unsigned long': 'VT_UI4', 'ULONG': 'VT_UI4', 'DWORD': 'VT_UI4',
+                 '__int64': 'VT_I8', 'hyper': 'VT_I8', 'LONGLONG': 'VT_I8', 'ULONGLONG': 'VT_UI8',
+                 'float': 'VT_R4', 'double': 'VT_R8', 'VARIANT_BOOL': 'VT_BOOL', 'SCODE': 'VT_ERROR',
+                 'BSTR': 'VT_BSTR', 'VARIANT': 'VT_VARIANT', 'IUnknown*': 'VT_UNKNOWN', 'IDispatch*': 'VT_DISPATCH'}
+
+def VariantType (idl_type, dual_interfaces):
+    '''Map IDL type to VARTYPE. Returns None for types that are not automation-compatible'''
+    safearray = re.match('SAFEARRAY\\((.*)\\)\\*$', idl_type)
+    if safearray:
+        element = VariantType(re.sub('\\s*\\*', '*', safearray.group(1)), dual_interfaces)
+        return 'VT_ARRAY | '+element if element else None
+    if idl_type in VARIANT_TYPES:
+        return VARIANT_TYPES[idl_type]
+    if re.match('I[A-Z][a-zA-Z0-9_]*\\*$', idl_type):
+        return 'VT_DISPATCH' if idl_type[:-1] in dual_interfaces else 'VT_UNKNOWN' # QueryInterface on [in]
+    return None
+
+
+def GenerateDispatchThunk (name, method, params):
+    '''Generate IDispatch::Invoke thunk for a method. Returns code & unsupported reason'''
+    args = [(type, arg, vt) for direction, type, arg, size, vt, retval in params if direction == 'in']
+    retvals = [(type, arg, vt) for direction, type, arg, size, vt, retval in params if direction != 'in']
+    code  = '[](void* itf, DISPPARAMS* params, VARIANT* result, UINT* arg_err, HRESULT* method_hr) -> HRESULT {\n'
+    code += '            DispatchArgs<'+str(len(args))+'> args(params, arg_err);\n'
+    if args:
+        code += '            HRESULT hr = S_OK;\n'
+    for idx, (type, arg, vt) in enumerate(args):
+        code += '            '+type+' arg_'+arg+' = {};\n'
+        if (vt in ['VT_UNKNOWN', 'VT_DISPATCH']) and (type not in ['IUnknown*', 'IDispatch*']):
+            code += '            if (FAILED(hr = args.GetInterface('+str(idx)+', arg_'+arg+')))\n'
+        else:
+            code += '            if (FAILED(hr = args.Get<'+vt+'>('+str(idx)+', arg_'+arg+')))\n'
+        code += '                return hr;\n'
+    for type, arg, vt in retvals:
+        code += '            '+type+' arg_'+arg+' = {};\n'
+    call_args = ', '.join(('' if direction == 'in' else '&')+'arg_'+arg for direction, type, arg, size, vt, retval in params)
+    code += '            *method_hr = static_cast<'+name+'*>(itf)->'+method+'('+call_args+');\n'
+    if retvals:
+        type, arg, vt = retvals[0]
+        code += '            if (SUCCEEDED(*method_hr))\n'
+        code += '                args.SetResult<'+vt+'>(result, arg_'+arg+');\n'
+    else:
+        code += '            (void)result;\n'
+    code += '            return S_OK;\n'
+    code += '        }'
+    return code
+
+
+def GenerateDispatchTables (interfaces):
+    '''Generate DispatchTableOf<T>() specializations for IDispatch-derived interfaces'''
+    dual_interfaces = {'IDispatch'}
+    methods_by_name = {}
+
+    code = ''
+    for name, base, has_uuid, attributes, methods in interfaces:
+        if base not in dual_interfaces:
+            continue
+        dual_interfaces.add(name)
+        # flatten methods from base interfaces in the same file
+        methods = methods_by_name.get(base, []) + methods
+        methods_by_name[name] = methods
+
+        members = ''
+        dispids = {}
+        for idx, (method, params, unsupported, method_attributes) in enumerate(methods):
+            flag = 'DISPATCH_METHOD'
+            dispatch_name = method
+            for attr, prefix in PROPERTY_PREFIXES.items():
+                if (attr in method_attributes) and method.startswith(prefix):
+                    flag = 'DISPATCH_'+attr.upper().replace('PROP', 'PROPERTY')
+                    dispatch_name = method[len(prefix):]
+            dispid = [attr[3:-1].strip() for attr in method_attributes if attr.startswith('id(')]
+            # property accessors share DISPID. Otherwise auto-assigned like MIDL
+            dispid = dispid[0] if dispid else dispids.get(dispatch_name, hex(0x60020000+idx))
+            dispids.setdefault(dispatch_name, dispid)
+
+            reason = None
+            if params is None:
+                reason = 'unnamed argument'
+            else:
+                params = [(direction, type, arg, size, VariantType(idl_type, dual_interfaces) if idl_type else None, retval) for direction, type, arg, size, idl_type, retval in params]
+                outs = [param for param in params if param[0] != 'in']
+                for direction, type, arg, size, vt, retval in params:
+                    if size or not vt:
+                        reason = 'argument '+arg
+                if (len(outs) > 1) or (outs and not (outs[0][5] and (outs[0] is params[-1]))):
+                    reason = 'non-retval [out] argument'
+            if reason:
+                members += '        // '+method+': not supported, due to '+reason+'\n'
+                continue
+            arg_count = len([param for param in params if param[0] == 'in'])
+            members += '        {L"'+dispatch_name+'", '+dispid+', '+flag+', '+str(arg_count)+', '+GenerateDispatchThunk(name, method, params)+'},\n'
+
+        code += '\ntemplate <>\n'
+        code += 'inline const DispatchTable& DispatchTableOf<'+name+'> () {\n'
+        if '{L"' in members:
+            code += '    static const DispatchMember members[] = {\n'+members+'    };\n'
+            code += '    static const DispatchTable table(members, sizeof(members)/sizeof(members[0]));\n'
+        else:
+            code += members.replace('        //', '    //')
+            code += '    static const DispatchTable table(nullptr, 0);\n'
+        code += '    return table;\n'
+        code += '}\n'
+    return code
+
+
+STRUCT_PATTERN = re.compile('(\\[([^\\[\\]]*)\\]\\s*)?struct\\s+([a-zA-Z0-9_]+)\\s*{(.*?)}\\s*([a-zA-Z0-9_]*)\\s*;', re.DOTALL)
+# member types that are owned by the record
+OWNED_VARIANT_TYPES = {'VT_BSTR', 'VT_UNKNOWN', 'VT_DISPATCH', 'VT_VARIANT'}
+
+def GenerateRecordInfos (source, comments):
+    '''Generate IsRecordType<T> & RecordInfoOf<T>() specializations for struct definitions'''
+    code = ''
+    for match in STRUCT_PATTERN.finditer(source):
+        attributes, tag, body, typedef_name = match.group(2), match.group(3), match.group(4), match.group(5)
+        name = typedef_name or tag
+        uuid = ParseUuidString(attributes) if attributes and UUID_PATTERN.search(attributes) else '{}'
+
+        fields = ''
+        for decl in RemoveComments(body, comments).split(';'):
+            decl = re.sub('\\[(?!\\s*[0-9]+\\s*\\])[^\\[\\]]*\\]', '', decl) # member attributes, but not "float pos[3]" sizes
+            safearray = SAFEARRAY_PATTERN.search(decl)
+            if safearray:
+                decl = SAFEARRAY_PATTERN.sub('SAFEARRAY*', decl)
+            decl = ' '.join(decl.split())
+            if not decl:
+                continue
+            decl_match = DECL_PATTERN.match(decl)
+            if not decl_match or not decl_match.group(1).strip():
+                raise Exception('Unsupported member in struct '+name+': '+decl)
+            type = POINTER_PATTERN.sub('*', decl_match.group(1).strip())
+            member = decl_match.group(2)
+            idl_type = type.replace('SAFEARRAY', 'SAFEARRAY('+' '.join(safearray.group(1).split())+')', 1) if safearray else type
+            vt = VariantType(idl_type, set()) or ('VT_ARRAY' if safearray else 'VT_EMPTY') # VT_EMPTY members are copied bitwise
+            if decl_match.group(4) and ((vt in OWNED_VARIANT_TYPES) or vt.startswith('VT_ARRAY')):
+                raise Exception('Unsupported array of owned members in struct '+name+': '+member)
+            fields += '        {L"'+member+'", offsetof('+name+', '+member+'), '+vt+'},\n'
+
+        code += '\ntemplate <>\n'
+        code += 'struct IsRecordType<'+name+'> : std::true_type {};\n'
+        code += 'template <>\n'
+        code += 'inline IRecordInfo* RecordInfoOf<'+name+'> () {\n'
+        code += '    static const RecordField fields[] = {\n'+fields+'    };\n'
+        code += '    static CComRecordInfo info('+uuid+', L"'+name+'", sizeof('+name+'), fields, sizeof(fields)/sizeof(fields[0]));\n'
+        code += '    return &info;\n'
+        code += '}\n'
+    return code
+
+
+def ParseIdlFile (idl_file, h_file, c_file, p_file):
     with open(idl_file, 'r') as f:
         source = f.read()
 
     # parse IDL file
     comments = {}
     source = RemoveMidPragmas(source)
-    source = ExtractStrings(source, comments)
     source = ExtractComments(source, comments)
+    source = ParseProperties(source)
+    interface_methods = ParseInterfaceMethods(source, comments)
+    proxy_stubs = GenerateProxyStubs(interface_methods, h_file)
+    dispatch_tables = GenerateDispatchTables(interface_methods)
+    async_interfaces = GenerateAsyncInterfaces(interface_methods)
+    record_infos = GenerateRecordInfos(source, comments)
     source, interfaces = ParseAttributes(source)
     source = ParseInterfaces(source)
     source = ParseSafeArray(source)
@@ -270,20 +828,109 @@ def ParseIdlFile (idl_file, h_file, c_file):
         f.write('} //extern "C"\n')
         for interface in interfaces:
             f.write('DEFINE_UUIDOF('+interface+')\n')
+        f.write(dispatch_tables)
+        f.write(async_interfaces)
+        f.write(record_infos)
     
     with open(c_file, 'w') as f:
         f.write('#include "'+h_file+'"\n')
 
+    with open(p_file, 'w') as f:
+        f.write(proxy_stubs)
+
+
+# cache of content hashes for skipping unchanged files. Stored in the output folder
+CACHE_FILE = '.idlparse_cache.json'
+
+def OutputFiles (filepath):
+    '''Generated header, _i.c & _p.cpp files in the current folder'''
+    path, filename = os.path.split(filepath)
+    return filename[:-4]+'.h', filename[:-4]+'_i.c', filename[:-4]+'_p.cpp'
+
+
+def ContentHash (filepath, search_dirs, hashes, active=None):
+    '''Hash of file content & imported IDL files that can be found, so that dependents are regenerated on changes'''
+    filepath = os.path.abspath(filepath)
+    if filepath in hashes:
+        return hashes[filepath]
+    active = active or set()
+    if filepath in active:
+        return '' # import cycle
+    active.add(filepath)
+
+    with open(filepath, 'rb') as f:
+        content = f.read()
+    hash = hashlib.sha256(content)
+    for imported in re.findall(b'import\\s*"([a-zA-Z0-9_\\.]+?)"', content):
+        imported = imported.decode()
+        for folder in [os.path.dirname(filepath)] + search_dirs:
+            candidate = os.path.join(folder, imported)
+            if os.path.isfile(candidate):
+                hash.update(ContentHash(candidate, search_dirs, hashes, active).encode())
+                break
+    active.remove(filepath)
+    hashes[filepath] = hash.hexdigest()
+    return hashes[filepath]
+
+
+def ParseFile (filepath):
+    '''Parse a single IDL file. Returns elapsed time in seconds'''
+    start = time.perf_counter()
+    ParseIdlFile(filepath, *OutputFiles(filepath))
+    return time.perf_counter() - start
+
+
+def Main (args):
+    parser = argparse.ArgumentParser(description='Generate cross-platform C++ headers & proxy/stub code from Microsoft IDL files into the current folder.')
+    parser.add_argument('files', nargs='+', help='IDL files')
+    parser.add_argument('-j', '--jobs', type=int, default=os.cpu_count() or 1, help='number of parallel processes (default: CPU count)')
+    parser.add_argument('--no-cache', action='store_true', help='regenerate all files, also if unchanged')
+    parser.add_argument('--timings', action='store_true', help='report per-file timings')
+    args = parser.parse_args(args)
+    for filepath in args.files:
+        if filepath[-4:] != '.idl':
+            raise Exception('Not an IDL file: '+filepath)
+
+    # tool changes also invalidate the cache
+    with open(os.path.abspath(__file__), 'rb') as f:
+        tool_hash = hashlib.sha256(f.read()).hexdigest()
+    cache = {}
+    if not args.no_cache and os.path.isfile(CACHE_FILE):
+        with open(CACHE_FILE, 'r') as f:
+            cache = json.load(f)
+
+    search_dirs = sorted(set(os.path.dirname(os.path.abspath(filepath)) for filepath in args.files))
+    hashes = {}
+    keys = {}
+    pending = []
+    for filepath in args.files:
+        key = hashlib.sha256((tool_hash+ContentHash(filepath, search_dirs, hashes)).encode()).hexdigest()
+        keys[filepath] = key
+        if (cache.get(os.path.abspath(filepath)) == key) and all(os.path.isfile(output) for output in OutputFiles(filepath)):
+            if args.timings:
+                print('  cached   '+filepath)
+            continue
+        pending.append(filepath)
+
+    def Done (filepath, elapsed):
+        cache[os.path.abspath(filepath)] = keys[filepath]
+        if args.timings:
+            print('%7.1f ms  %s' % (elapsed*1000, filepath))
+
+    try:
+        if (args.jobs > 1) and (len(pending) > 1):
+            with concurrent.futures.ProcessPoolExecutor(max_workers=args.jobs) as executor:
+                futures = {executor.submit(ParseFile, filepath): filepath for filepath in pending}
+                for future in concurrent.futures.as_completed(futures):
+                    Done(futures[future], future.result())
+        else:
+            for filepath in pending:
+                Done(filepath, ParseFile(filepath))
+    finally:
+        # also store progress on failure
+        with open(CACHE_FILE, 'w') as f:
+            json.dump(cache, f, indent=1, sort_keys=True)
 
-if __name__ == "__main__":
-    if len(sys.argv) < 2:
-        raise Exception('No IDL file arguments provided')
 
-    # load files
-    for filepath in sys.argv[1:]:
-        #print('Parsing '+filepath)
-        assert(filepath[-4:] == '.idl')
-        
-        # write generated headers to current dir.
-        path, filename = os.path.split(filepath)
-        ParseIdlFile(filepath, filename[:-4]+'.h', filename[:-4]+'_i.c')
+if __name__ == "__main__":
+    Main(sys.argv[1:])
@@ -0,0 +1,1457 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Marshal.hpp"
+
+
+namespace {
+
+/** Wire format: Each message is prefixed by its uint32 byte size.
+    REQUEST: kind, call ID, object ID, IID, method index, [in] arguments
+    REPLY:   kind, call ID, HRESULT, [out] arguments
+    RELEASE: kind, object ID, reference count
+    ADDREF:  kind, object ID, reference count */
+enum MESSAGE : unsigned char {
+    MSG_REQUEST = 1,
+    MSG_REPLY   = 2,
+    MSG_RELEASE = 3,
+    MSG_ADDREF  = 4,
+};
+
+/** Object reference kinds. */
+enum OBJREF : unsigned char {
+    OBJREF_NULL     = 0,
+    OBJREF_SENDER   = 1, ///< object exported by the sender
+    OBJREF_RECEIVER = 2, ///< object returned to its owner. Carries one reference
+};
+
+const uint64_t     ACTIVATOR_ID = 0;          ///< pseudo-object for CreateInstance requests
+const unsigned int METHOD_QUERYINTERFACE = 0; ///< IID_IUnknown method index
+const uint32_t     MAX_MESSAGE_SIZE = 1u << 30;
+const uint64_t     REF_BATCH = 8;              ///< remote references requested at once by MSG_ADDREF
+const size_t       MAX_HANDLES = 64;           ///< file descriptors per message
+const size_t       SHARED_MEMORY_THRESHOLD = 256*1024; ///< smaller SAFEARRAY data is copied into the message
+const size_t       MAX_WORKERS = 64;           ///< concurrent incoming calls per channel. Deeper callback nesting blocks
+const auto         WORKER_IDLE_TIMEOUT = std::chrono::seconds(10); ///< idle workers exit after this
+
+static constexpr GUID IID_MarshalProxyManager = {0x5d0c7a2e,0x9b41,0x4f3a,{0x86,0x2d,0x1c,0x7e,0x4b,0x90,0xa3,0x55}};
+
+#ifdef MSG_NOSIGNAL
+const int SEND_FLAGS = MSG_NOSIGNAL; // don't raise SIGPIPE if the peer died
+#else
+const int SEND_FLAGS = 0; // SO_NOSIGPIPE set on socket instead
+#endif
+#ifdef MSG_CMSG_CLOEXEC
+const int RECV_FLAGS = MSG_CMSG_CLOEXEC; // don't leak received file descriptors into spawned processes
+#else
+const int RECV_FLAGS = 0;
+#endif
+
+struct Marshaler {
+    IID                    iid {};
+    MarshalProxyFactory    proxy = nullptr;
+    MarshalStubFunction    stub = nullptr;
+    MarshalReleaseFunction release = nullptr;
+};
+
+// never destroyed, since channel threads might outlive static destructors
+std::mutex& MarshalerMutex () {
+    static auto* s_mutex = new std::mutex;
+    return *s_mutex;
+}
+std::vector<Marshaler>& Marshalers () {
+    static auto* s_marshalers = new std::vector<Marshaler>;
+    return *s_marshalers;
+}
+
+bool FindMarshaler (const IID& iid, Marshaler& result) {
+    std::lock_guard<std::mutex> lock(MarshalerMutex());
+    for (auto& elm : Marshalers()) {
+        if (elm.iid == iid) {
+            result = elm;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WriteRequestHeader (MarshalWriter& msg, uint64_t call_id, uint64_t object, const IID& iid, unsigned int method) {
+    unsigned char kind = MSG_REQUEST;
+    msg.WriteBytes(&kind, sizeof(kind));
+    msg.WriteVarint(call_id);
+    msg.WriteVarint(object);
+    msg.Write(iid);
+    msg.WriteVarint(method);
+}
+
+void DisableSigPipe (int fd) {
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#else
+    (void)fd;
+#endif
+}
+
+/** Received message, with file descriptors passed alongside it. */
+struct Message {
+    unsigned char* data = nullptr;
+    size_t         size = 0;
+    int*           handles = nullptr;
+    size_t         handle_count = 0;
+
+    /** Transfer ownership to a reader. */
+    void MoveTo (MarshalReader& reader) {
+        reader.Attach(data, size);
+        reader.AttachHandles(handles, handle_count);
+        *this = Message();
+    }
+
+    void Free () {
+        MarshalReader reader(nullptr);
+        MoveTo(reader);
+    }
+};
+
+
+/** Sealed memfd with SAFEARRAY data. The file descriptor is passed to other processes with SCM_RIGHTS, so that the receiver
+    maps the pages instead of copying the content through the socket. */
+class SharedMemory : public IUnknown {
+public:
+    /** Copy data into a new memfd sealed against modification. Returns -1 if memfd isn't available. */
+    static int Create (const void* data, size_t size) {
+#ifdef MFD_ALLOW_SEALING
+        int fd = memfd_create("SAFEARRAY", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0)
+            return -1;
+        for (size_t offset = 0; offset < size; ) {
+            ssize_t written = pwrite(fd, static_cast<const unsigned char*>(data) + offset, size - offset, offset);
+            if ((written < 0) && (errno == EINTR))
+                continue;
+            if (written <= 0) {
+                close(fd);
+                return -1;
+            }
+            offset += written;
+        }
+        // freeze content & size, so that the sender cannot modify the receiver's array or crash it with SIGBUS
+        if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+#else
+        (void)data;
+        (void)size;
+        return -1; // memfd not available
+#endif
+    }
+
+    /** Map shared memory received from another process copy-on-write, so that changes stay local. Takes over the file descriptor. */
+    static SharedMemory* Map (int fd, size_t size) {
+#ifdef F_GET_SEALS
+        const int required = F_SEAL_SHRINK | F_SEAL_WRITE;
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat info {};
+        if ((seals < 0) || ((seals & required) != required) || (fstat(fd, &info) != 0) || (static_cast<uint64_t>(info.st_size) < size)) {
+            close(fd);
+            return nullptr;
+        }
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd); // not needed after mapping
+        if (data == MAP_FAILED)
+            return nullptr;
+        return new SharedMemory(data, size);
+#else
+        (void)size;
+        close(fd);
+        return nullptr;
+#endif
+    }
+
+    HRESULT QueryInterface (const IID& iid, void** obj) override {
+        if (iid == IID_IUnknown) {
+            *obj = this;
+            AddRef();
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return ++m_ref;
+    }
+    ULONG Release () override {
+        ULONG ref = --m_ref;
+        if (ref == 0)
+            delete this;
+        return ref;
+    }
+
+    void* Data () const {
+        return m_data;
+    }
+
+private:
+    SharedMemory (void* data, size_t size) : m_data(data), m_size(size) {
+    }
+    virtual ~SharedMemory () {
+        munmap(m_data, m_size);
+    }
+
+    void*              m_data = nullptr;
+    const size_t       m_size = 0;
+    std::atomic<ULONG> m_ref {1};
+};
+
+} // namespace
+
+
+/** Connection to another process. Owns the objects exported to the peer & tracks proxies for objects imported from the peer.
+    A reader thread routes replies to waiting callers, whereas incoming requests are executed by a pool of worker threads
+    that grows on demand up to MAX_WORKERS, so that nested calls in both directions rarely run out of threads. */
+class MarshalChannel {
+public:
+    MarshalChannel (int fd, pid_t pid) : m_fd(fd), m_pid(pid) {
+    }
+
+    void AddRef () {
+        ++m_ref;
+    }
+    void Release () {
+        if (--m_ref == 0)
+            delete this;
+    }
+
+    bool Connected () const {
+        return m_connected;
+    }
+
+    uint64_t NextCallId () {
+        return ++m_next_call;
+    }
+
+    /** Receive messages until the connection is closed. */
+    void Run () {
+        for (;;) {
+            uint32_t size = 0;
+            if (!Receive(&size, sizeof(size)) || (size == 0) || (size > MAX_MESSAGE_SIZE))
+                break;
+
+            Message msg;
+            msg.size = size;
+            msg.data = static_cast<unsigned char*>(CoTaskMemAlloc(size));
+            bool received = msg.data && Receive(msg.data, size);
+            // file descriptors were attached to the first byte of the message
+            if (!m_received.empty()) {
+                msg.handles = static_cast<int*>(CoTaskMemAlloc(m_received.size()*sizeof(int)));
+                std::copy(m_received.begin(), m_received.end(), msg.handles);
+                msg.handle_count = m_received.size();
+                m_received.clear();
+            }
+            if (!received) {
+                msg.Free();
+                break;
+            }
+
+            if (msg.data[0] == MSG_REPLY) {
+                Complete(msg);
+            } else if (msg.data[0] == MSG_ADDREF) {
+                AddRefExport(msg); // in order, so that the object stays alive for subsequent messages
+            } else if ((msg.data[0] == MSG_REQUEST) || (msg.data[0] == MSG_RELEASE)) {
+                Enqueue(msg); // release might trigger outgoing calls from destructors
+            } else {
+                msg.Free();
+                break; // protocol error
+            }
+        }
+        for (int fd : m_received)
+            close(fd);
+        m_received.clear();
+        Disconnect();
+    }
+
+    bool Send (MarshalWriter& msg) {
+        uint32_t size = static_cast<uint32_t>(msg.Size());
+        iovec iov[2] = {{&size, sizeof(size)}, {msg.Data(), msg.Size()}};
+        msghdr hdr {};
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = 2;
+
+        alignas(cmsghdr) char control[CMSG_SPACE(MAX_HANDLES*sizeof(int))] = {};
+        if (msg.HandleCount()) {
+            hdr.msg_control = control;
+            hdr.msg_controllen = CMSG_SPACE(msg.HandleCount()*sizeof(int));
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(msg.HandleCount()*sizeof(int));
+            memcpy(CMSG_DATA(cmsg), msg.Handles(), msg.HandleCount()*sizeof(int));
+        }
+
+        std::lock_guard<std::mutex> lock(m_send_mutex);
+        while (hdr.msg_iovlen > 0) {
+            ssize_t sent = sendmsg(m_fd, &hdr, SEND_FLAGS);
+            if (sent < 0) {
+                if (errno == EINTR)
+                    continue;
+                shutdown(m_fd, SHUT_RDWR); // wake up reader thread to fail pending calls
+                return false;
+            }
+            hdr.msg_control = nullptr; // file descriptors are sent with the first byte
+            hdr.msg_controllen = 0;
+            // skip sent bytes
+            while ((hdr.msg_iovlen > 0) && (static_cast<size_t>(sent) >= hdr.msg_iov->iov_len)) {
+                sent -= hdr.msg_iov->iov_len;
+                hdr.msg_iov++;
+                hdr.msg_iovlen--;
+            }
+            if (hdr.msg_iovlen > 0) {
+                hdr.msg_iov->iov_base = static_cast<char*>(hdr.msg_iov->iov_base) + sent;
+                hdr.msg_iov->iov_len -= sent;
+            }
+        }
+        return true;
+    }
+
+    /** Send a request & wait for the reply. Returns the remote HRESULT, with the reply positioned at the [out] arguments. */
+    HRESULT Call (MarshalWriter& request, uint64_t call_id, MarshalReader& reply) {
+        Pending pending;
+        pending.call_id = call_id;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_connected)
+                return RPC_E_DISCONNECTED;
+            m_pending.push_back(&pending);
+        }
+
+        Send(request); // failures are reported through Disconnect
+
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            pending.cv.wait(lock, [&pending] { return pending.done; });
+        }
+        if (!pending.reply.data)
+            return RPC_E_DISCONNECTED;
+
+        pending.reply.MoveTo(reply);
+        unsigned char kind = 0;
+        reply.ReadBytes(&kind, sizeof(kind));
+        reply.ReadVarint(); // call ID
+        HRESULT hr = E_FAIL;
+        reply.Read(hr);
+        if (reply.Failed())
+            return RPC_E_INVALID_DATA;
+        return hr;
+    }
+
+    /** Add a reference to an exported object. Takes over the identity reference. */
+    uint64_t Export (IUnknown* identity) {
+        std::lock_guard<std::mutex> lock(m_export_mutex);
+        auto it = m_export_ids.find(identity);
+        if (it != m_export_ids.end()) {
+            m_exports[it->second].refs++;
+            identity->Release(); // already owned
+            return it->second;
+        }
+
+        uint64_t id = ++m_next_export;
+        Exported& entry = m_exports[id];
+        entry.identity = identity;
+        entry.refs = 1;
+        m_export_ids[identity] = id;
+        return id;
+    }
+
+    /** Get an object returned to its owner. Consumes the reference carried by the message. */
+    HRESULT FindExport (uint64_t id, const IID& iid, void** itf) {
+        IUnknown* identity = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_export_mutex);
+            auto it = m_exports.find(id);
+            if (it == m_exports.end())
+                return RPC_E_DISCONNECTED;
+            identity = it->second.identity;
+            identity->AddRef();
+        }
+        HRESULT hr = identity->QueryInterface(iid, itf);
+        identity->Release();
+        ReleaseExport(id, 1);
+        return hr;
+    }
+
+    void ReleaseExport (uint64_t id, uint64_t count) {
+        Exported entry;
+        {
+            std::lock_guard<std::mutex> lock(m_export_mutex);
+            auto it = m_exports.find(id);
+            if (it == m_exports.end())
+                return;
+            if (it->second.refs > count) {
+                it->second.refs -= count;
+                return;
+            }
+            entry = std::move(it->second);
+            m_exports.erase(it);
+            m_export_ids.erase(entry.identity);
+        }
+        entry.Clear(); // release outside lock
+    }
+
+    /** Request additional references to an object exported by the peer, so that they can be passed back to it. */
+    void SendAddRef (uint64_t id, uint64_t count) {
+        MarshalWriter msg(this);
+        unsigned char kind = MSG_ADDREF;
+        msg.WriteBytes(&kind, sizeof(kind));
+        msg.WriteVarint(id);
+        msg.WriteVarint(count);
+        Send(msg);
+    }
+
+    /** Get or create proxy for an object exported by the peer. Consumes one remote reference. */
+    HRESULT Import (uint64_t id, const IID& iid, void** itf);
+
+    /** Called by the proxy manager when the last local reference is released. */
+    void Forget (MarshalProxyManager* manager);
+
+private:
+    struct Pending {
+        uint64_t                call_id = 0;
+        bool                    done = false;
+        Message                 reply; ///< reply.data is nullptr if disconnected
+        std::condition_variable cv;
+    };
+
+    struct Exported {
+        struct Itf {
+            IID                    iid {};
+            void*                  ptr = nullptr;
+            MarshalStubFunction    stub = nullptr;
+            MarshalReleaseFunction release = nullptr;
+        };
+
+        void Clear () {
+            for (Itf& elm : itfs)
+                elm.release(elm.ptr);
+            itfs.clear();
+            if (identity)
+                identity->Release();
+            identity = nullptr;
+        }
+
+        IUnknown*        identity = nullptr;
+        uint64_t         refs = 0;    ///< references held by the peer
+        std::vector<Itf> itfs;        ///< cached QueryInterface results for stub calls
+    };
+
+    ~MarshalChannel () {
+        close(m_fd);
+    }
+
+    /** Read exactly "size" bytes. File descriptors passed alongside are collected in m_received. */
+    bool Receive (void* data, size_t size) {
+        auto* ptr = static_cast<unsigned char*>(data);
+        while (size > 0) {
+            iovec iov = {ptr, size};
+            alignas(cmsghdr) char control[CMSG_SPACE(MAX_HANDLES*sizeof(int))];
+            msghdr hdr {};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = sizeof(control);
+            ssize_t received = recvmsg(m_fd, &hdr, RECV_FLAGS);
+            if (received < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+                    continue;
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0))/sizeof(int);
+                for (size_t i = 0; i < count; ++i) {
+                    int fd = -1;
+                    memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+                    m_received.push_back(fd);
+                }
+            }
+            if (hdr.msg_flags & MSG_CTRUNC)
+                return false; // too many file descriptors
+            if (received == 0)
+                return false; // peer closed connection
+            ptr += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    void Complete (Message& msg) {
+        MarshalReader reader(this);
+        reader.Attach(msg.data, msg.size);
+        unsigned char kind = 0;
+        reader.ReadBytes(&kind, sizeof(kind));
+        uint64_t call_id = reader.ReadVarint();
+        reader.Detach();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i < m_pending.size(); ++i) {
+            Pending* pending = m_pending[i];
+            if (pending->call_id == call_id) {
+                m_pending.erase(m_pending.begin() + i);
+                pending->reply = msg; // ownership transferred
+                pending->done = true;
+                pending->cv.notify_one();
+                return;
+            }
+        }
+        msg.Free(); // ignore unknown replies
+    }
+
+    void Enqueue (Message& msg) {
+        std::lock_guard<std::mutex> lock(m_work_mutex);
+        m_queue.push_back(msg);
+        if ((m_queue.size() > m_waiting) && (m_workers < MAX_WORKERS)) {
+            ++m_workers; // all workers busy
+            std::thread(&MarshalChannel::Worker, this).detach();
+        } else {
+            m_work_cv.notify_one();
+        }
+    }
+
+    void Worker () {
+        std::unique_lock<std::mutex> lock(m_work_mutex);
+        for (;;) {
+            if (!m_queue.empty()) {
+                Message msg = m_queue.front();
+                m_queue.pop_front();
+                lock.unlock();
+                Process(msg);
+                lock.lock();
+                continue;
+            }
+            if (m_closing)
+                break;
+
+            ++m_waiting;
+            std::cv_status status = m_work_cv.wait_for(lock, WORKER_IDLE_TIMEOUT);
+            --m_waiting;
+            if ((status == std::cv_status::timeout) && m_queue.empty())
+                break; // retire idle worker
+        }
+        --m_workers;
+        m_exit_cv.notify_all();
+    }
+
+    void AddRefExport (Message& msg) {
+        MarshalReader in(this);
+        msg.MoveTo(in);
+        unsigned char kind = 0;
+        in.ReadBytes(&kind, sizeof(kind));
+        uint64_t id = in.ReadVarint();
+        uint64_t count = in.ReadVarint();
+        if (in.Failed())
+            return;
+
+        std::lock_guard<std::mutex> lock(m_export_mutex);
+        auto it = m_exports.find(id);
+        if (it != m_exports.end())
+            it->second.refs += count;
+    }
+
+    void Process (Message& msg) {
+        MarshalReader in(this);
+        msg.MoveTo(in);
+        unsigned char kind = 0;
+        in.ReadBytes(&kind, sizeof(kind));
+
+        if (kind == MSG_RELEASE) {
+            uint64_t id = in.ReadVarint();
+            uint64_t count = in.ReadVarint();
+            if (!in.Failed())
+                ReleaseExport(id, count);
+            return;
+        }
+
+        uint64_t call_id = in.ReadVarint();
+        uint64_t object = in.ReadVarint();
+        IID iid {};
+        in.Read(iid);
+        auto method = static_cast<unsigned int>(in.ReadVarint());
+
+        MarshalWriter out(this);
+        kind = MSG_REPLY;
+        out.WriteBytes(&kind, sizeof(kind));
+        out.WriteVarint(call_id);
+        const size_t hr_offset = out.Size();
+        HRESULT hr = S_OK;
+        out.Write(hr); // placeholder
+
+        if (in.Failed())
+            hr = RPC_E_INVALID_DATA;
+        else if (object == ACTIVATOR_ID)
+            hr = Activate(in, out);
+        else if (iid == IID_IUnknown)
+            hr = (method == METHOD_QUERYINTERFACE) ? QueryInterface(object, in, out) : RPC_E_INVALIDMETHOD;
+        else
+            hr = Invoke(object, iid, method, in, out);
+        if (SUCCEEDED(hr) && FAILED(out.Result()))
+            hr = out.Result(); // [out] arguments cannot be encoded. The caller ignores them
+
+        memcpy(out.Data() + hr_offset, &hr, sizeof(hr));
+        Send(out);
+    }
+
+    HRESULT Activate (MarshalReader& in, MarshalWriter& out) {
+        GUID clsid {};
+        in.Read(clsid);
+        if (in.Failed())
+            return RPC_E_INVALID_DATA;
+
+        ATL::CComPtr<IUnknown> obj;
+        HRESULT hr = obj.CoCreateInstance(clsid, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG);
+        if (FAILED(hr))
+            return hr;
+
+        out.WriteInterface(obj, IID_IUnknown);
+        return S_OK;
+    }
+
+    HRESULT QueryInterface (uint64_t object, MarshalReader& in, MarshalWriter& out) {
+        IID iid {};
+        in.Read(iid);
+        if (in.Failed())
+            return RPC_E_INVALID_DATA;
+
+        IUnknown* identity = nullptr;
+        HRESULT hr = Lookup(object, iid, &identity, nullptr, nullptr);
+        if (FAILED(hr))
+            return hr;
+
+        out.WriteInterface(identity, iid);
+        identity->Release();
+        return S_OK;
+    }
+
+    HRESULT Invoke (uint64_t object, const IID& iid, unsigned int method, MarshalReader& in, MarshalWriter& out) {
+        IUnknown* identity = nullptr;
+        void* itf = nullptr;
+        MarshalStubFunction stub = nullptr;
+        HRESULT hr = Lookup(object, iid, &identity, &itf, &stub);
+        if (FAILED(hr))
+            return hr;
+
+        hr = stub(itf, method, in, out);
+        identity->Release();
+        return hr;
+    }
+
+    /** Get exported object & cast it to a marshalable interface. Returns an AddRef'ed identity pointer. */
+    HRESULT Lookup (uint64_t object, const IID& iid, IUnknown** identity, void** itf, MarshalStubFunction* stub) {
+        std::lock_guard<std::mutex> lock(m_export_mutex);
+        auto it = m_exports.find(object);
+        if (it == m_exports.end())
+            return RPC_E_DISCONNECTED;
+        Exported& entry = it->second;
+
+        Exported::Itf* cached = nullptr;
+        for (Exported::Itf& elm : entry.itfs) {
+            if (elm.iid == iid)
+                cached = &elm;
+        }
+        if (!cached && !(iid == IID_IUnknown)) {
+            Marshaler marshaler;
+            if (!FindMarshaler(iid, marshaler))
+                return E_NOINTERFACE; // cannot be marshaled
+
+            void* ptr = nullptr;
+            HRESULT hr = entry.identity->QueryInterface(iid, &ptr);
+            if (FAILED(hr))
+                return hr;
+
+            entry.itfs.push_back({iid, ptr, marshaler.stub, marshaler.release});
+            cached = &entry.itfs.back();
+        }
+
+        if (itf)
+            *itf = cached ? cached->ptr : entry.identity;
+        if (stub)
+            *stub = cached ? cached->stub : nullptr;
+        *identity = entry.identity;
+        (*identity)->AddRef(); // keep alive during call
+        return S_OK;
+    }
+
+    /** Fail pending calls, stop worker threads & release exported objects. */
+    void Disconnect () {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_connected = false;
+            for (Pending* pending : m_pending) {
+                pending->done = true;
+                pending->cv.notify_one();
+            }
+            m_pending.clear();
+        }
+        shutdown(m_fd, SHUT_RDWR);
+
+        {
+            std::unique_lock<std::mutex> lock(m_work_mutex);
+            m_closing = true;
+            m_work_cv.notify_all();
+            m_exit_cv.wait(lock, [this] { return m_workers == 0; }); // workers drain the queue before exiting
+        }
+
+        std::unordered_map<uint64_t, Exported> exports;
+        {
+            std::lock_guard<std::mutex> lock(m_export_mutex);
+            exports.swap(m_exports);
+            m_export_ids.clear();
+        }
+        for (auto& elm : exports)
+            elm.second.Clear();
+
+        if (m_pid > 0)
+            waitpid(m_pid, nullptr, 0); // reap local server process
+    }
+
+    const int            m_fd = -1;
+    const pid_t          m_pid = 0; ///< local server process (client-side only)
+    std::atomic<ULONG>   m_ref {1};
+    std::atomic<bool>    m_connected {true};
+    std::atomic<uint64_t> m_next_call {0};
+    std::mutex           m_send_mutex;
+
+    std::mutex            m_mutex; ///< protects m_pending
+    std::vector<Pending*> m_pending;
+    std::vector<int>      m_received; ///< file descriptors received by the reader thread for the current message
+
+    std::mutex              m_work_mutex; ///< protects worker state below
+    std::condition_variable m_work_cv;
+    std::deque<Message>     m_queue;
+    std::condition_variable m_exit_cv;     ///< signaled when a worker exits
+    size_t                  m_workers = 0; ///< number of detached worker threads
+    size_t                  m_waiting = 0; ///< number of idle workers
+    bool                    m_closing = false;
+
+    std::mutex                              m_export_mutex; ///< protects export tables
+    std::unordered_map<uint64_t, Exported>  m_exports;
+    std::unordered_map<IUnknown*, uint64_t> m_export_ids;
+    uint64_t                                m_next_export = ACTIVATOR_ID;
+
+    std::mutex                                         m_import_mutex; ///< protects m_imports
+    std::unordered_map<uint64_t, MarshalProxyManager*> m_imports;
+};
+
+
+/** Client-side identity of a remote object. Owns the interface proxies for the object. */
+class MarshalProxyManager : public IUnknown {
+public:
+    MarshalProxyManager (MarshalChannel* channel, uint64_t id) : m_channel(channel), m_id(id) {
+        m_channel->AddRef();
+    }
+    ~MarshalProxyManager () {
+        for (Proxy& elm : m_proxies)
+            delete elm.unk;
+        m_channel->Release();
+    }
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if (!obj)
+            return E_POINTER;
+        *obj = nullptr;
+        if ((iid == IID_IUnknown) || (iid == IID_MarshalProxyManager)) {
+            *obj = static_cast<IUnknown*>(this);
+            AddRef();
+            return S_OK;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (Proxy& elm : m_proxies) {
+                if (elm.iid == iid) {
+                    *obj = elm.itf;
+                    AddRef();
+                    return S_OK;
+                }
+            }
+        }
+
+        Marshaler marshaler;
+        if (!FindMarshaler(iid, marshaler))
+            return E_NOINTERFACE; // cannot be marshaled
+
+        // cast remote object. The reply is imported through this object
+        uint64_t call_id = m_channel->NextCallId();
+        MarshalWriter request(m_channel);
+        WriteRequestHeader(request, call_id, m_id, IID_IUnknown, METHOD_QUERYINTERFACE);
+        request.Write(iid);
+        MarshalReader reply(m_channel);
+        HRESULT hr = m_channel->Call(request, call_id, reply);
+        if (FAILED(hr))
+            return hr;
+        return reply.ReadInterface(iid, obj);
+    }
+    ULONG AddRef () override {
+        return ++m_ref;
+    }
+    ULONG Release () override {
+        ULONG ref = --m_ref;
+        if (!ref)
+            m_channel->Forget(this); // deletes this
+        return ref;
+    }
+
+    /** Increment reference count unless the object is being destroyed. */
+    bool TryAddRef () {
+        ULONG ref = m_ref.load();
+        while (ref > 0) {
+            if (m_ref.compare_exchange_weak(ref, ref + 1))
+                return true;
+        }
+        return false;
+    }
+
+    /** Get proxy for an interface the remote object is known to implement. */
+    HRESULT GetProxy (const IID& iid, void** itf) {
+        if (iid == IID_IUnknown) {
+            *itf = static_cast<IUnknown*>(this);
+            AddRef();
+            return S_OK;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (Proxy& elm : m_proxies) {
+            if (elm.iid == iid) {
+                *itf = elm.itf;
+                AddRef();
+                return S_OK;
+            }
+        }
+
+        Marshaler marshaler;
+        if (!FindMarshaler(iid, marshaler))
+            return E_NOINTERFACE;
+
+        Proxy proxy;
+        proxy.iid = iid;
+        proxy.unk = marshaler.proxy(this, &proxy.itf);
+        m_proxies.push_back(proxy);
+        *itf = proxy.itf;
+        AddRef();
+        return S_OK;
+    }
+
+    MarshalChannel* Channel () const {
+        return m_channel;
+    }
+    uint64_t Id () const {
+        return m_id;
+    }
+
+    std::atomic<uint64_t> remote_refs {0}; ///< references to return to the exporter
+
+private:
+    struct Proxy {
+        IID       iid {};
+        void*     itf = nullptr; ///< interface pointer
+        IUnknown* unk = nullptr; ///< for deletion
+    };
+
+    MarshalChannel*    m_channel = nullptr;
+    const uint64_t     m_id = 0;
+    std::atomic<ULONG> m_ref {1};
+    std::mutex         m_mutex; ///< protects m_proxies
+    std::vector<Proxy> m_proxies;
+};
+
+
+HRESULT MarshalChannel::Import (uint64_t id, const IID& iid, void** itf) {
+    MarshalProxyManager* manager = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_import_mutex);
+        auto it = m_imports.find(id);
+        if ((it != m_imports.end()) && it->second->TryAddRef()) {
+            manager = it->second;
+        } else {
+            manager = new MarshalProxyManager(this, id); // replaces manager being destroyed
+            m_imports[id] = manager;
+        }
+        manager->remote_refs++;
+    }
+
+    HRESULT hr = manager->GetProxy(iid, itf);
+    manager->Release();
+    return hr;
+}
+
+void MarshalChannel::Forget (MarshalProxyManager* manager) {
+    {
+        std::lock_guard<std::mutex> lock(m_import_mutex);
+        auto it = m_imports.find(manager->Id());
+        if ((it != m_imports.end()) && (it->second == manager))
+            m_imports.erase(it);
+    }
+
+    uint64_t refs = manager->remote_refs.load();
+    if (refs && m_connected) {
+        MarshalWriter msg(this);
+        unsigned char kind = MSG_RELEASE;
+        msg.WriteBytes(&kind, sizeof(kind));
+        msg.WriteVarint(manager->Id());
+        msg.WriteVarint(refs);
+        Send(msg);
+    }
+    delete manager; // might delete this
+}
+
+
+MarshalWriter::MarshalWriter (MarshalChannel* channel) : m_channel(channel) {
+}
+
+MarshalWriter::~MarshalWriter () {
+    for (size_t i = 0; i < m_handle_count; ++i)
+        close(m_handles[i]);
+    CoTaskMemFree(m_handles);
+    CoTaskMemFree(m_data);
+}
+
+int MarshalWriter::AddHandle (int fd) {
+    if (!m_channel || (m_handle_count >= MAX_HANDLES))
+        return -1;
+    if (!m_handles) {
+        m_handles = static_cast<int*>(CoTaskMemAlloc(MAX_HANDLES*sizeof(int)));
+        if (!m_handles)
+            return -1;
+    }
+    int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0); // keep open until sent, even if the owner is released
+    if (dup_fd < 0)
+        return -1;
+    m_handles[m_handle_count] = dup_fd;
+    return static_cast<int>(m_handle_count++);
+}
+
+void MarshalWriter::WriteBytes (const void* data, size_t size) {
+    if (m_size + size > m_capacity) {
+        size_t capacity = std::max<size_t>(2*m_capacity, std::max<size_t>(m_size + size, 256));
+        auto* ptr = static_cast<unsigned char*>(CoTaskMemRealloc(m_data, capacity));
+        if (!ptr)
+            throw std::bad_alloc();
+        m_data = ptr;
+        m_capacity = capacity;
+    }
+    memcpy(m_data + m_size, data, size);
+    m_size += size;
+}
+
+void MarshalWriter::WriteVarint (uint64_t val) {
+    unsigned char buf[10];
+    size_t size = 0;
+    do {
+        unsigned char byte = val & 0x7F;
+        val >>= 7;
+        buf[size++] = val ? (byte | 0x80) : byte;
+    } while (val);
+    WriteBytes(buf, size);
+}
+
+void MarshalWriter::WriteString (BSTR str) {
+    if (!str) {
+        WriteVarint(0);
+        return;
+    }
+    unsigned int len = SysStringLen(str);
+    WriteVarint(len + 1);
+    for (unsigned int i = 0; i < len; ++i)
+        WriteVarint(static_cast<uint32_t>(str[i])); // 1 byte per ASCII character
+}
+
+void MarshalWriter::WriteInterface (IUnknown* itf, const IID& iid) {
+    (void)iid; // interface type is implied by the method signature
+    if (!itf || !m_channel) {
+        WriteVarint(OBJREF_NULL);
+        return;
+    }
+
+    MarshalProxyManager* manager = nullptr;
+    if (SUCCEEDED(itf->QueryInterface(IID_MarshalProxyManager, reinterpret_cast<void**>(&manager)))) {
+        if (manager->Channel() == m_channel) {
+            // return object to its owner. Transfer one of the proxy's remote references to the message, since the proxy
+            // might be released before the receiver has decoded the message
+            uint64_t refs = manager->remote_refs.load();
+            while ((refs > 1) && !manager->remote_refs.compare_exchange_weak(refs, refs - 1)) {
+            }
+            if (refs <= 1) {
+                m_channel->SendAddRef(manager->Id(), REF_BATCH); // arrives before this message
+                manager->remote_refs += REF_BATCH - 1;
+            }
+            WriteVarint(OBJREF_RECEIVER);
+            WriteVarint(manager->Id());
+            manager->Release();
+            return;
+        }
+        manager->Release(); // proxy for another process. Export as regular object
+    }
+
+    IUnknown* identity = nullptr;
+    if (FAILED(itf->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&identity)))) {
+        WriteVarint(OBJREF_NULL);
+        return;
+    }
+    WriteVarint(OBJREF_SENDER);
+    WriteVarint(m_channel->Export(identity));
+}
+
+
+MarshalReader::MarshalReader (MarshalChannel* channel) : m_channel(channel) {
+}
+
+MarshalReader::~MarshalReader () {
+    AttachHandles(nullptr, 0);
+    CoTaskMemFree(m_data);
+}
+
+void MarshalReader::AttachHandles (int* fds, size_t count) {
+    for (size_t i = 0; i < m_handle_count; ++i) {
+        if (m_handles[i] >= 0)
+            close(m_handles[i]); // not taken over
+    }
+    CoTaskMemFree(m_handles);
+    m_handles = fds;
+    m_handle_count = count;
+}
+
+int MarshalReader::TakeHandle (uint64_t idx) {
+    if (idx >= m_handle_count) {
+        m_failed = true;
+        return -1;
+    }
+    int fd = m_handles[idx];
+    m_handles[idx] = -1;
+    if (fd < 0)
+        m_failed = true; // already taken
+    return fd;
+}
+
+void MarshalReader::Attach (unsigned char* data, size_t size) {
+    CoTaskMemFree(m_data);
+    m_data = data;
+    m_size = size;
+    m_pos = 0;
+    m_failed = false;
+}
+
+unsigned char* MarshalReader::Detach () {
+    unsigned char* data = m_data;
+    m_data = nullptr;
+    m_size = 0;
+    m_pos = 0;
+    return data;
+}
+
+bool MarshalReader::ReadBytes (void* data, size_t size) {
+    if (m_failed || (size > m_size - m_pos)) {
+        m_failed = true;
+        memset(data, 0, size);
+        return false;
+    }
+    memcpy(data, m_data + m_pos, size);
+    m_pos += size;
+    return true;
+}
+
+uint64_t MarshalReader::ReadVarint () {
+    uint64_t val = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        unsigned char byte = 0;
+        if (!ReadBytes(&byte, 1))
+            return 0;
+        val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return val;
+    }
+    m_failed = true; // too long
+    return 0;
+}
+
+BSTR MarshalReader::ReadString () {
+    uint64_t len = ReadVarint();
+    if (len-- == 0)
+        return nullptr;
+    if (len > m_size - m_pos) {
+        m_failed = true; // at least 1 byte per character
+        return nullptr;
+    }
+
+    BSTR str = SysAllocStringLen(nullptr, static_cast<UINT>(len));
+    for (uint64_t i = 0; i < len; ++i)
+        str[i] = static_cast<wchar_t>(ReadVarint());
+    return str;
+}
+
+HRESULT MarshalReader::ReadInterface (const IID& iid, void** itf) {
+    *itf = nullptr;
+    uint64_t kind = ReadVarint();
+    if (kind == OBJREF_NULL)
+        return S_OK;
+
+    uint64_t id = ReadVarint();
+    HRESULT hr = RPC_E_INVALID_DATA;
+    if (!m_failed && m_channel) {
+        if (kind == OBJREF_SENDER)
+            hr = m_channel->Import(id, iid, itf);
+        else if (kind == OBJREF_RECEIVER)
+            hr = m_channel->FindExport(id, iid, itf);
+    }
+    if (FAILED(hr))
+        m_failed = true;
+    return hr;
+}
+
+
+/** SAFEARRAY encoding: type, followed by element VARTYPE & size, byte count & either inline bytes or a shared-memory handle for data arrays,
+    or element count & elements for string/pointer arrays. Record arrays cannot be marshaled, and fail the message with DISP_E_BADVARTYPE. */
+struct SafeArrayMarshaler {
+    static void Write (MarshalWriter& out, SAFEARRAY* sa) {
+        if (!sa || (sa->type == SAFEARRAY::TYPE_EMPTY)) {
+            out.WriteVarint(0);
+            return;
+        }
+        if (sa->type == SAFEARRAY::TYPE_RECORDS) {
+            out.Fail(DISP_E_BADVARTYPE); // rejected before sending, instead of by the peer
+            return;
+        }
+        out.WriteVarint(sa->type);
+        switch (sa->type) {
+        case SAFEARRAY::TYPE_DATA:
+            out.WriteVarint(sa->vt);
+            out.WriteVarint(sa->elm_size);
+            out.WriteVarint(sa->data.size());
+            if (!WriteShared(out, sa)) {
+                out.WriteVarint(0); // inline
+                out.WriteBytes(sa->data.data(), sa->data.size());
+            }
+            break;
+        case SAFEARRAY::TYPE_STRINGS:
+            out.WriteVarint(sa->strings.size());
+            for (size_t i = 0; i < sa->strings.size(); ++i)
+                out.WriteString(sa->strings[i]);
+            break;
+        case SAFEARRAY::TYPE_POINTERS:
+            out.WriteVarint(sa->pointers.size());
+            for (size_t i = 0; i < sa->pointers.size(); ++i)
+                out.WriteInterface(sa->pointers[i], IID_IUnknown);
+            break;
+        default:
+            break;
+        }
+    }
+
+    static SAFEARRAY* Read (MarshalReader& in, size_t remaining) {
+        uint64_t type = in.ReadVarint();
+        if (in.Failed() || (type == 0))
+            return nullptr;
+
+        if (type == SAFEARRAY::TYPE_DATA) {
+            uint64_t vt = in.ReadVarint();
+            uint64_t elm_size = in.ReadVarint();
+            uint64_t size = in.ReadVarint();
+            if (in.Failed() || (vt > VT_TYPEMASK) || (elm_size == 0) || (elm_size > UINT32_MAX) || (size % elm_size) || (size/elm_size > UINT32_MAX)) {
+                in.Fail();
+                return nullptr;
+            }
+            uint64_t handle = in.ReadVarint();
+            if (handle)
+                return ReadShared(in, handle - 1, static_cast<VARTYPE>(vt), static_cast<unsigned int>(elm_size), size);
+            if (size > remaining) {
+                in.Fail();
+                return nullptr;
+            }
+            SAFEARRAY* sa = SAFEARRAY::Create(static_cast<VARTYPE>(vt), static_cast<unsigned int>(elm_size), static_cast<unsigned int>(size/elm_size));
+            in.ReadBytes(sa->data.data(), size);
+            return sa;
+        }
+
+        uint64_t count = in.ReadVarint();
+        if (in.Failed() || (count > remaining) || ((type != SAFEARRAY::TYPE_STRINGS) && (type != SAFEARRAY::TYPE_POINTERS))) {
+            in.Fail();
+            return nullptr;
+        }
+        SAFEARRAY* sa = SAFEARRAY::Create(static_cast<SAFEARRAY::TYPE>(type));
+        if (type == SAFEARRAY::TYPE_STRINGS) {
+            sa->strings.resize(count);
+            for (size_t i = 0; i < count; ++i)
+                sa->strings[i].Attach(in.ReadString());
+        } else {
+            sa->pointers.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                IUnknown* ptr = nullptr;
+                in.ReadInterface(IID_IUnknown, reinterpret_cast<void**>(&ptr));
+                sa->pointers[i].Attach(ptr);
+            }
+        }
+        return sa;
+    }
+
+    static void Free (SAFEARRAY* sa) {
+        if (sa)
+            SAFEARRAY::Destroy(sa);
+    }
+
+private:
+    /** Pass large data arrays as shared memory. The data is copied into a new sealed memfd on every send,
+        so that later changes by the sender don't affect the receiver. */
+    static bool WriteShared (MarshalWriter& out, SAFEARRAY* sa) {
+        const size_t size = sa->data.size();
+        if (size < SHARED_MEMORY_THRESHOLD)
+            return false;
+
+        int fd = SharedMemory::Create(sa->data.data(), size);
+        if (fd < 0)
+            return false;
+        int idx = out.AddHandle(fd);
+        close(fd); // duplicate kept open until sent
+        if (idx < 0)
+            return false;
+        out.WriteVarint(idx + 1);
+        return true;
+    }
+
+    static SAFEARRAY* ReadShared (MarshalReader& in, uint64_t handle, VARTYPE vt, unsigned int elm_size, uint64_t size) {
+        int fd = in.TakeHandle(handle);
+        if (fd < 0)
+            return nullptr;
+        SharedMemory* shm = SharedMemory::Map(fd, size);
+        if (!shm) {
+            in.Fail();
+            return nullptr;
+        }
+        SAFEARRAY* sa = SAFEARRAY::Create(vt, elm_size, static_cast<unsigned int>(size/elm_size), shm, shm->Data());
+        shm->Release(); // owned by SAFEARRAY
+        return sa;
+    }
+};
+
+void MarshalWriter::WriteSafeArray (SAFEARRAY* sa) {
+    SafeArrayMarshaler::Write(*this, sa);
+}
+
+SAFEARRAY* MarshalReader::ReadSafeArray () {
+    return SafeArrayMarshaler::Read(*this, m_size - m_pos);
+}
+
+void MarshalTraits<SAFEARRAY*>::Free (SAFEARRAY*& val) {
+    SafeArrayMarshaler::Free(val);
+    val = nullptr;
+}
+
+
+CProxyCall::CProxyCall (MarshalProxyManager* manager, const IID& iid, unsigned int method) : m_channel(manager->Channel()), m_call_id(m_channel->NextCallId()), m_request(m_channel), m_reply(m_channel) {
+    WriteRequestHeader(m_request, m_call_id, manager->Id(), iid, method);
+}
+
+CProxyCall::~CProxyCall () {
+}
+
+void CProxyCall::Invoke () {
+    m_hr = m_request.Result();
+    if (FAILED(m_hr))
+        return; // arguments cannot be encoded
+    m_hr = m_channel->Call(m_request, m_call_id, m_reply);
+}
+
+
+HRESULT CoInternalProxyQueryInterface (MarshalProxyManager* manager, const IID& iid, void** ppv) {
+    return manager->QueryInterface(iid, ppv);
+}
+ULONG CoInternalProxyAddRef (MarshalProxyManager* manager) {
+    return manager->AddRef();
+}
+ULONG CoInternalProxyRelease (MarshalProxyManager* manager) {
+    return manager->Release();
+}
+
+HRESULT CoRegisterInterfaceMarshaler (const IID& iid, MarshalProxyFactory proxy, MarshalStubFunction stub, MarshalReleaseFunction release) {
+    if (!proxy || !stub || !release)
+        return E_POINTER;
+
+    std::lock_guard<std::mutex> lock(MarshalerMutex());
+    for (auto& elm : Marshalers()) {
+        if (elm.iid == iid) {
+            elm = {iid, proxy, stub, release}; // replace existing
+            return S_OK;
+        }
+    }
+    Marshalers().push_back({iid, proxy, stub, release});
+    return S_OK;
+}
+
+
+namespace {
+
+struct LocalServer {
+    GUID            clsid {};
+    std::string     executable;
+    MarshalChannel* channel = nullptr; ///< connection to running process
+};
+
+std::mutex& LocalServerMutex () {
+    static auto* s_mutex = new std::mutex;
+    return *s_mutex;
+}
+std::vector<LocalServer>& LocalServers () {
+    static auto* s_servers = new std::vector<LocalServer>;
+    return *s_servers;
+}
+
+/** Start local server process. Returns channel with one reference for the caller & one for the reader thread. */
+MarshalChannel* Spawn (const std::string& executable) {
+    if (access(executable.c_str(), X_OK) != 0)
+        return nullptr;
+
+    int fds[2] = {-1, -1};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return nullptr;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC); // only inherited by the new server
+
+    // prepare arguments before fork, since only async-signal-safe functions are allowed in the child
+    std::string fd_arg = std::to_string(fds[1]);
+    char* argv[] = {const_cast<char*>(executable.c_str()), const_cast<char*>("-Embedding"), const_cast<char*>(fd_arg.c_str()), nullptr};
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // child process
+        fcntl(fds[1], F_SETFD, 0);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return nullptr;
+    }
+
+    DisableSigPipe(fds[0]);
+    auto* channel = new MarshalChannel(fds[0], pid);
+    channel->AddRef(); // for reader thread
+    std::thread([channel] {
+        channel->Run();
+        channel->Release();
+    }).detach();
+    return channel;
+}
+
+HRESULT ActivateLocalServer (const GUID& clsid, IUnknown** obj) {
+    MarshalChannel* channel = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(LocalServerMutex());
+        LocalServer* server = nullptr;
+        for (auto& elm : LocalServers()) {
+            if (elm.clsid == clsid)
+                server = &elm;
+        }
+        if (!server)
+            return REGDB_E_CLASSNOTREG;
+
+        if (server->channel && !server->channel->Connected()) {
+            // server died. Start a new process
+            for (auto& elm : LocalServers()) {
+                if ((elm.channel == server->channel) && (&elm != server))
+                    elm.channel = nullptr;
+            }
+            server->channel->Release();
+            server->channel = nullptr;
+        }
+        if (!server->channel) {
+            // share process with other classes from the same executable
+            for (auto& elm : LocalServers()) {
+                if ((elm.executable == server->executable) && elm.channel && elm.channel->Connected()) {
+                    server->channel = elm.channel;
+                    server->channel->AddRef();
+                    break;
+                }
+            }
+        }
+        if (!server->channel)
+            server->channel = Spawn(server->executable);
+        if (!server->channel)
+            return CO_E_SERVER_EXEC_FAILURE;
+
+        channel = server->channel;
+        channel->AddRef();
+    }
+
+    uint64_t call_id = channel->NextCallId();
+    MarshalWriter request(channel);
+    WriteRequestHeader(request, call_id, ACTIVATOR_ID, IID_IUnknown, 0);
+    request.Write(clsid);
+    HRESULT hr = E_FAIL;
+    {
+        MarshalReader reply(channel);
+        hr = channel->Call(request, call_id, reply);
+        if (SUCCEEDED(hr))
+            hr = reply.ReadInterface(IID_IUnknown, reinterpret_cast<void**>(obj));
+    }
+    channel->Release();
+    return hr;
+}
+
+} // namespace
+
+
+HRESULT CoRegisterLocalServer (const GUID& clsid, const char* executable) {
+    if (!executable)
+        return E_POINTER;
+
+    {
+        std::lock_guard<std::mutex> lock(LocalServerMutex());
+        bool found = false;
+        for (auto& elm : LocalServers()) {
+            if (elm.clsid == clsid) {
+                if (elm.executable != executable) {
+                    // replace existing
+                    if (elm.channel)
+                        elm.channel->Release();
+                    elm.channel = nullptr;
+                    elm.executable = executable;
+                }
+                found = true;
+            }
+        }
+        if (!found)
+            LocalServers().push_back({clsid, executable, nullptr});
+    }
+
+    CoInternalSetLocalServerActivator(ActivateLocalServer);
+    return S_OK;
+}
+
+HRESULT CoRunLocalServer (int argc, char* argv[]) {
+    int fd = -1;
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "-Embedding") == 0)
+            fd = atoi(argv[i+1]);
+    }
+    if (fd < 0)
+        return S_FALSE; // regular startup
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC); // not inherited by child processes
+    DisableSigPipe(fd);
+    auto* channel = new MarshalChannel(fd, 0);
+    channel->Run();
+    channel->Release();
+    return S_OK;
+}
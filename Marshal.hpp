@@ -0,0 +1,345 @@
+#pragma once
+/* Out-of-process COM activation & marshaling over Unix domain sockets.
+   Classes registered with CoRegisterLocalServer are activated in a separate worker process when
+   requesting CLSCTX_LOCAL_SERVER, so that crashes in a component don't take down the client.
+   Proxy/stub code is generated by IdlParse.py into <name>_p.cpp files that must be linked into both processes.
+   Large SAFEARRAY data is passed as sealed memfd shared memory on Linux, so that the receiver maps the pages copy-on-write instead of reading them from the socket.
+   Not available on iOS & WebAssembly due to lack of fork/exec. */
+#include "NonWindows.hpp"
+
+
+/** Non-Windows replacement for the LocalServer32 registry key. The executable is started with "-Embedding <fd>"
+    arguments on first activation, and the process is shared by all classes registered with the same executable.
+    A new process is started if the previous one died. */
+HRESULT CoRegisterLocalServer (const GUID& clsid, const char* executable);
+
+/** Local server entry point that should be called at the start of main().
+    Returns S_FALSE if the process wasn't started as a local server. Otherwise, serves activation & method calls
+    until the client disconnects, and then returns S_OK. */
+HRESULT CoRunLocalServer (int argc, char* argv[]);
+
+
+class MarshalChannel;      ///< internal connection state
+class MarshalProxyManager; ///< internal client-side state for a remote object
+
+/** Compact binary encoder for method arguments. Lengths & object IDs are encoded as LEB128 varints. */
+class MarshalWriter {
+public:
+    MarshalWriter (MarshalChannel* channel);
+    ~MarshalWriter ();
+
+    void WriteBytes (const void* data, size_t size);
+    void WriteVarint (uint64_t val);
+    void WriteString (BSTR str);
+    void WriteSafeArray (SAFEARRAY* sa);
+    /** Export an object reference. The receiver gets a proxy, or the original pointer if the object is returned to its owner. */
+    void WriteInterface (IUnknown* itf, const IID& iid);
+    /** Attach a duplicate of a file descriptor to the message. Returns the handle index to encode, or -1 on failure. */
+    int  AddHandle (int fd);
+    /** Mark the message as not encodable, so that it is not sent. The first error is kept. */
+    void Fail (HRESULT hr) {
+        if (SUCCEEDED(m_hr))
+            m_hr = hr;
+    }
+    HRESULT Result () const {
+        return m_hr;
+    }
+
+    template <class T>
+    void Write (const T& val);
+    template <class T>
+    void WriteArray (const T* arr, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            Write(arr[i]);
+    }
+
+    unsigned char* Data () {
+        return m_data;
+    }
+    size_t Size () const {
+        return m_size;
+    }
+    MarshalChannel* Channel () const {
+        return m_channel;
+    }
+    const int* Handles () const {
+        return m_handles;
+    }
+    size_t HandleCount () const {
+        return m_handle_count;
+    }
+
+    MarshalWriter (const MarshalWriter&) = delete;
+    MarshalWriter& operator = (const MarshalWriter&) = delete;
+
+private:
+    unsigned char*  m_data = nullptr;
+    size_t          m_size = 0;
+    size_t          m_capacity = 0;
+    MarshalChannel* m_channel = nullptr;
+    int*            m_handles = nullptr; ///< file descriptors passed with SCM_RIGHTS
+    size_t          m_handle_count = 0;
+    HRESULT         m_hr = S_OK;
+};
+
+/** Decoder for MarshalWriter content. Malformed input sets the Failed() flag and yields zero-initialized values. */
+class MarshalReader {
+public:
+    MarshalReader (MarshalChannel* channel);
+    ~MarshalReader ();
+
+    /** Take over ownership of a CoTaskMemAlloc-allocated message. */
+    void Attach (unsigned char* data, size_t size);
+    /** Release ownership of the message. */
+    unsigned char* Detach ();
+    /** Take over ownership of a CoTaskMemAlloc-allocated array of file descriptors received with the message. */
+    void AttachHandles (int* fds, size_t count);
+
+    bool     ReadBytes (void* data, size_t size);
+    uint64_t ReadVarint ();
+    BSTR     ReadString ();
+    SAFEARRAY* ReadSafeArray ();
+    /** Import an object reference. Returns an AddRef'ed proxy or original pointer. */
+    HRESULT  ReadInterface (const IID& iid, void** itf);
+    /** Take over a file descriptor received with the message. Returns -1 on invalid index. */
+    int      TakeHandle (uint64_t idx);
+
+    template <class T>
+    void Read (T& val);
+    template <class T>
+    void ReadArray (T* arr, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            Read(arr[i]);
+    }
+
+    bool Failed () const {
+        return m_failed;
+    }
+    /** Flag malformed input. */
+    void Fail () {
+        m_failed = true;
+    }
+    MarshalChannel* Channel () const {
+        return m_channel;
+    }
+
+    MarshalReader (const MarshalReader&) = delete;
+    MarshalReader& operator = (const MarshalReader&) = delete;
+
+private:
+    unsigned char*  m_data = nullptr;
+    size_t          m_size = 0;
+    size_t          m_pos = 0;
+    bool            m_failed = false;
+    MarshalChannel* m_channel = nullptr;
+    int*            m_handles = nullptr; ///< file descriptors not yet taken over are closed on destruction
+    size_t          m_handle_count = 0;
+};
+
+
+/** Encoding & ownership rules for a method argument type.
+    The default handles trivially copyable types like integers, floating-point values, enums & GUIDs. */
+template <class T, class = void>
+struct MarshalTraits {
+    static_assert(std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value, "type cannot be marshaled");
+
+    static void Write (MarshalWriter& out, const T& val) {
+        out.WriteBytes(&val, sizeof(T));
+    }
+    static void Read (MarshalReader& in, T& val) {
+        if (!in.ReadBytes(&val, sizeof(T)))
+            val = T();
+    }
+    static void Free (T& /*val*/) {
+    }
+};
+template <>
+struct MarshalTraits<BSTR> {
+    static void Write (MarshalWriter& out, BSTR val) {
+        out.WriteString(val);
+    }
+    static void Read (MarshalReader& in, BSTR& val) {
+        val = in.ReadString();
+    }
+    static void Free (BSTR& val) {
+        SysFreeString(val);
+        val = nullptr;
+    }
+};
+template <>
+struct MarshalTraits<SAFEARRAY*> {
+    static void Write (MarshalWriter& out, SAFEARRAY* val) {
+        out.WriteSafeArray(val);
+    }
+    static void Read (MarshalReader& in, SAFEARRAY*& val) {
+        val = in.ReadSafeArray();
+    }
+    static void Free (SAFEARRAY*& val);
+};
+template <class T>
+struct MarshalTraits<T*, std::enable_if_t<std::is_base_of<IUnknown, T>::value>> {
+    static void Write (MarshalWriter& out, T* val) {
+        out.WriteInterface(val, __uuidof(T));
+    }
+    static void Read (MarshalReader& in, T*& val) {
+        val = nullptr;
+        in.ReadInterface(__uuidof(T), reinterpret_cast<void**>(&val));
+    }
+    static void Free (T*& val) {
+        if (val)
+            val->Release();
+        val = nullptr;
+    }
+};
+
+template <class T>
+void MarshalWriter::Write (const T& val) {
+    MarshalTraits<T>::Write(*this, val);
+}
+template <class T>
+void MarshalReader::Read (T& val) {
+    MarshalTraits<T>::Read(*this, val);
+}
+
+
+/** Stub-side argument storage. Frees the value after the reply has been encoded. */
+template <class T>
+struct MarshalArg {
+    MarshalArg () = default;
+    ~MarshalArg () {
+        MarshalTraits<T>::Free(value);
+    }
+    MarshalArg (const MarshalArg&) = delete;
+    MarshalArg& operator = (const MarshalArg&) = delete;
+
+    T value = T();
+};
+/** Stub-side storage for fixed-size "float pos[3]"-style arguments. */
+template <class T, size_t N>
+struct MarshalArray {
+    MarshalArray () = default;
+    ~MarshalArray () {
+        for (T& elm : value)
+            MarshalTraits<T>::Free(elm);
+    }
+    MarshalArray (const MarshalArray&) = delete;
+    MarshalArray& operator = (const MarshalArray&) = delete;
+
+    T value[N] = {};
+};
+
+
+/** Client-side call of a remote method. Used by generated proxies:
+    In() for [in] & [in,out] arguments, followed by Invoke(), Out()/InOut() and Result(). */
+class CProxyCall {
+public:
+    CProxyCall (MarshalProxyManager* manager, const IID& iid, unsigned int method);
+    ~CProxyCall ();
+
+    template <class T>
+    void In (const T& val) {
+        m_request.Write(val);
+    }
+    template <class T>
+    void InArray (const T* arr, size_t count) {
+        m_request.WriteArray(arr, count);
+    }
+
+    /** Send the request and wait for the reply. Incoming calls are processed by other threads meanwhile. */
+    void Invoke ();
+
+    /** Decode [out] argument. Zero-initialized on failure. */
+    template <class T>
+    void Out (T* ptr) {
+        if (!ptr)
+            return;
+        *ptr = T();
+        if (SUCCEEDED(m_hr))
+            m_reply.Read(*ptr);
+    }
+    template <class T>
+    void OutArray (T* arr, size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            Out(&arr[i]);
+    }
+    /** Decode [in,out] argument. The previous value is freed on success & left untouched on failure. */
+    template <class T>
+    void InOut (T* ptr) {
+        if (!ptr || FAILED(m_hr))
+            return;
+        T tmp = T();
+        m_reply.Read(tmp);
+        MarshalTraits<T>::Free(*ptr);
+        *ptr = tmp;
+    }
+
+    HRESULT Result () const {
+        if (SUCCEEDED(m_hr) && m_reply.Failed())
+            return RPC_E_INVALID_DATA;
+        return m_hr;
+    }
+
+    CProxyCall (const CProxyCall&) = delete;
+    CProxyCall& operator = (const CProxyCall&) = delete;
+
+private:
+    MarshalChannel* m_channel = nullptr;
+    uint64_t        m_call_id = 0;
+    MarshalWriter   m_request;
+    MarshalReader   m_reply;
+    HRESULT         m_hr = E_FAIL;
+};
+
+
+/** Internal functions. SHALL ONLY be accessed through CInterfaceProxy<T>. */
+HRESULT CoInternalProxyQueryInterface (MarshalProxyManager* manager, const IID& iid, void** ppv);
+ULONG   CoInternalProxyAddRef (MarshalProxyManager* manager);
+ULONG   CoInternalProxyRelease (MarshalProxyManager* manager);
+
+/** Base class for generated out-of-process proxies. The reference count & identity is shared by all interface
+    proxies for the same remote object, so that QueryInterface(IID_IUnknown) comparisons work as expected. */
+template <class INTERFACE>
+class CInterfaceProxy : public INTERFACE {
+public:
+    CInterfaceProxy (MarshalProxyManager* manager) : m_manager(manager) {
+    }
+    virtual ~CInterfaceProxy () {
+    }
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        return CoInternalProxyQueryInterface(m_manager, iid, obj);
+    }
+    ULONG AddRef () override {
+        return CoInternalProxyAddRef(m_manager);
+    }
+    ULONG Release () override {
+        return CoInternalProxyRelease(m_manager);
+    }
+
+    /** Proxy factory for CoRegisterInterfaceMarshaler. Returns the IUnknown pointer used for deleting the proxy. */
+    template <class PROXY>
+    static IUnknown* Create (MarshalProxyManager* manager, void** itf) {
+        auto* proxy = new PROXY(manager);
+        *itf = static_cast<INTERFACE*>(proxy);
+        return static_cast<INTERFACE*>(proxy);
+    }
+    /** Release function for CoRegisterInterfaceMarshaler. */
+    static void ReleaseTarget (void* itf) {
+        static_cast<INTERFACE*>(itf)->Release();
+    }
+
+protected:
+    MarshalProxyManager* m_manager = nullptr; ///< owns this proxy
+};
+
+typedef IUnknown* (*MarshalProxyFactory)(MarshalProxyManager* manager, void** itf);
+/** Server-side dispatch of a method call. Decodes arguments from "in", invokes the method and encodes [out]
+    arguments to "out" if the call succeeded. Returns the method HRESULT. */
+typedef HRESULT (*MarshalStubFunction)(void* itf, unsigned int method, MarshalReader& in, MarshalWriter& out);
+typedef void (*MarshalReleaseFunction)(void* itf);
+
+/** Register generated proxy/stub code for an interface. */
+HRESULT CoRegisterInterfaceMarshaler (const IID& iid, MarshalProxyFactory proxy, MarshalStubFunction stub, MarshalReleaseFunction release);
+
+#define MARSHALER_ENTRY_AUTO(INTERFACE, PROXY, STUB) \
+    __attribute__((weak)) __attribute__((used)) HRESULT tmp_marshaler_##INTERFACE = CoRegisterInterfaceMarshaler(__uuidof(INTERFACE), CInterfaceProxy<INTERFACE>::Create<PROXY>, STUB, CInterfaceProxy<INTERFACE>::ReleaseTarget);
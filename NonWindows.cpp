@@ -1,10 +1,476 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cwchar>
+#include <cwctype>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cxxabi.h>   // for __cxa_demangle
+#include <fcntl.h>    // for open
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <unistd.h>   // for close
+#if __has_include(<dlfcn.h>)
+  #include <dlfcn.h> // for dladdr & dlopen
+  #define HAVE_DLFCN
+#endif
+#if __has_include(<execinfo.h>)
+  #include <execinfo.h> // for backtrace
+  #define HAVE_BACKTRACE
+#endif
+#ifdef __SSE2__
+  #include <emmintrin.h> // for SafeArrayChangeType kernels
+#endif
+#ifdef __APPLE__
+  #include <malloc/malloc.h> // for malloc_size
+#else
+  #include <malloc.h> // for malloc_usable_size
+#endif
 #include "NonWindows.hpp"
 
 
+namespace {
+
+/** Default IMalloc implementation that forwards to the C runtime heap. */
+class CDefaultMalloc : public IMalloc {
+public:
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if (!obj)
+            return E_POINTER;
+        if ((iid == IID_IUnknown) || (iid == IID_IMalloc)) {
+            *obj = static_cast<IMalloc*>(this);
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return 1; // static object
+    }
+    ULONG Release () override {
+        return 1; // static object
+    }
+
+    void* Alloc (size_t cb) override {
+        return malloc(cb);
+    }
+    void* Realloc (void* pv, size_t cb) override {
+        return realloc(pv, cb);
+    }
+    void Free (void* pv) override {
+        free(pv);
+    }
+    size_t GetSize (void* pv) override {
+        if (!pv)
+            return static_cast<size_t>(-1);
+#ifdef __APPLE__
+        return malloc_size(pv);
+#else
+        return malloc_usable_size(pv);
+#endif
+    }
+    int DidAlloc (void* /*pv*/) override {
+        return -1; // unknown
+    }
+    void HeapMinimize () override {
+    }
+};
+
+CDefaultMalloc        s_default_malloc;
+IMalloc* const        DEFAULT_MALLOC = &s_default_malloc; ///< constant-initialized, so safe to compare against during static initialization
+std::atomic<IMalloc*> s_malloc {nullptr}; ///< active allocator. nullptr until first allocation or CoSetMalloc
+
+/** Get active allocator. Locks in the default allocator on first use. */
+inline IMalloc* ActiveMalloc () {
+    IMalloc* m = s_malloc.load(std::memory_order_acquire);
+    if (m)
+        return m;
+
+    IMalloc* expected = nullptr;
+    if (s_malloc.compare_exchange_strong(expected, DEFAULT_MALLOC, std::memory_order_acq_rel))
+        return DEFAULT_MALLOC;
+    return expected; // CoSetMalloc or another thread got there first
+}
+
+} // namespace
+
+
+__attribute__((visibility("default")))
+HRESULT CoGetMalloc (DWORD dwMemContext, IMalloc** ppMalloc) {
+    if (!ppMalloc)
+        return E_POINTER;
+    if (dwMemContext != MEMCTX_TASK) {
+        *ppMalloc = nullptr;
+        return E_INVALIDARG;
+    }
+
+    *ppMalloc = ActiveMalloc();
+    (*ppMalloc)->AddRef();
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoSetMalloc (IMalloc* pMalloc) {
+    if (!pMalloc)
+        return E_POINTER;
+
+    IMalloc* expected = nullptr;
+    if (!s_malloc.compare_exchange_strong(expected, pMalloc, std::memory_order_acq_rel))
+        return E_ILLEGAL_METHOD_CALL; // memory already allocated
+
+    pMalloc->AddRef(); // never released
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+void* CoTaskMemAlloc (size_t cb) {
+    IMalloc* m = ActiveMalloc();
+    if (m == DEFAULT_MALLOC)
+        return malloc(cb); // skip virtual call
+    return m->Alloc(cb);
+}
+
+__attribute__((visibility("default")))
+void* CoTaskMemRealloc (void* pv, size_t cb) {
+    IMalloc* m = ActiveMalloc();
+    if (m == DEFAULT_MALLOC)
+        return realloc(pv, cb);
+    return m->Realloc(pv, cb);
+}
+
+__attribute__((visibility("default")))
+void CoTaskMemFree (void* pv) {
+    if (!pv)
+        return;
+
+    IMalloc* m = ActiveMalloc();
+    if (m == DEFAULT_MALLOC)
+        free(pv);
+    else
+        m->Free(pv);
+}
+
+
+__attribute__((visibility("default")))
+BSTR SysAllocString (const wchar_t* psz) {
+    if (!psz)
+        return nullptr;
+
+    return SysAllocStringLen(psz, static_cast<UINT>(wcslen(psz)));
+}
+
+__attribute__((visibility("default")))
+BSTR SysAllocStringLen (const wchar_t* strIn, UINT ui) {
+    auto* str = static_cast<BSTR>(CoTaskMemAlloc((ui + 1)*sizeof(wchar_t)));
+    if (!str)
+        return nullptr;
+
+    if (strIn)
+        memcpy(str, strIn, ui*sizeof(wchar_t));
+    else
+        memset(str, 0, ui*sizeof(wchar_t));
+    str[ui] = L'\0'; // null-termination
+    return str;
+}
+
+__attribute__((visibility("default")))
+void SysFreeString (BSTR bstrString) {
+    CoTaskMemFree(bstrString);
+}
+
+__attribute__((visibility("default")))
+unsigned int SysStringLen (BSTR pbstr) {
+    if (!pbstr)
+        return 0;
+
+    return static_cast<unsigned int>(wcslen(pbstr));
+}
+
+
+namespace {
+namespace registry {
+
+struct Entry {
+    GUID                         clsid {};
+    std::wstring                 name;
+    IUnknownFactory::Factory     factory = nullptr;
+    IUnknownFactory::BulkFactory bulk_factory = nullptr;
+};
+
+/** Immutable list of registered classes, except for in-place appends beyond "count" when there's spare capacity.
+    Capacity is doubled on growth, so that registering N classes costs O(N). */
+struct Snapshot {
+    Snapshot (size_t _capacity) : capacity(_capacity), entries(new const Entry*[_capacity]) {
+    }
+    ~Snapshot () {
+        delete [] entries;
+    }
+
+    const size_t        capacity;
+    std::atomic<size_t> count {0};
+    const Entry**       entries;
+};
+
+// constant-initialized, so that registration from static initializers in any order is safe
+std::mutex             s_mutex;        ///< serializes writers
+std::atomic<Snapshot*> s_current {nullptr};
+std::atomic<unsigned>  s_epoch {0};
+std::atomic<size_t>    s_readers[2] = {}; ///< in-flight lookups per epoch parity
+
+/** Lock-free read access to the current snapshot. Writers wait for lookups that might still
+    reference a replaced snapshot to finish before freeing it (sleepable RCU with two reader counters). */
+class ReadGuard {
+public:
+    ReadGuard () : m_idx(s_epoch.load() & 1) {
+        s_readers[m_idx]++;
+        m_snapshot = s_current.load();
+    }
+    ~ReadGuard () {
+        s_readers[m_idx]--;
+    }
+
+    /** Returns the first entry matching pred(entry). Only valid during the lifetime of the guard. */
+    template <class PRED>
+    const Entry* Find (PRED pred) const {
+        if (!m_snapshot)
+            return nullptr;
+        size_t count = m_snapshot->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i) {
+            if (pred(*m_snapshot->entries[i]))
+                return m_snapshot->entries[i];
+        }
+        return nullptr;
+    }
+
+private:
+    unsigned  m_idx = 0;
+    Snapshot* m_snapshot = nullptr;
+};
+
+/** Wait until no lookup references a replaced snapshot. Lookups that started before the first epoch flip
+    might have incremented either counter, so both counters are drained, each while new lookups use the other. */
+void Synchronize () {
+    for (int phase = 0; phase < 2; ++phase) {
+        unsigned idx = s_epoch.fetch_add(1) & 1;
+        while (s_readers[idx].load() != 0)
+            std::this_thread::yield();
+    }
+}
+
+/** Publish a new snapshot & free the previous one after a grace period. Caller must hold s_mutex. */
+void Replace (Snapshot* next) {
+    Snapshot* prev = s_current.exchange(next);
+    if (prev) {
+        Synchronize();
+        delete prev;
+    }
+}
+
+/** Append an entry. Caller must not hold s_mutex. */
+void Add (const GUID& clsid, const wchar_t* name, IUnknownFactory::Factory factory, IUnknownFactory::BulkFactory bulk_factory) {
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Snapshot* cur = s_current.load();
+    size_t count = cur ? cur->count.load() : 0;
+    auto* entry = new Entry{clsid, name, factory, bulk_factory};
+    if (cur && (count < cur->capacity)) {
+        // append in-place. Concurrent lookups either see the new entry or not
+        cur->entries[count] = entry;
+        cur->count.store(count + 1, std::memory_order_release);
+        return;
+    }
+
+    auto* next = new Snapshot(cur ? 2*cur->capacity : 64);
+    for (size_t i = 0; i < count; ++i)
+        next->entries[i] = cur->entries[i];
+    next->entries[count] = entry;
+    next->count = count + 1;
+    Replace(next);
+}
+
+#ifdef __ELF__
+std::atomic<ObjectEntrySection*> s_pending_sections {nullptr};
+std::atomic<size_t>              s_pending_count {0}; ///< queued sections that are not yet fully registered
+std::mutex                       s_pending_mutex;
+
+/** Push a section onto the pending list. */
+void PushPendingSection (ObjectEntrySection* section) {
+    ObjectEntrySection* head = s_pending_sections.load();
+    do {
+        section->next = head;
+    } while (!s_pending_sections.compare_exchange_weak(head, section));
+}
+
+/** Register OBJECT_ENTRY_AUTO entries from modules loaded since the last call. Lookups block while
+    another thread is registering, so that they don't miss classes. Must be called before taking a ReadGuard. */
+void AddPendingSections () {
+    if (s_pending_count.load(std::memory_order_acquire) == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(s_pending_mutex);
+    ObjectEntrySection* section = s_pending_sections.exchange(nullptr);
+    while (section) {
+        ObjectEntrySection* next = section->next; // section might be freed by module unload after registration
+        for (const ObjectEntry* elm = section->begin; elm != section->end; ++elm) {
+            std::wstring name(elm->name, elm->name + strlen(elm->name)); // class names are ASCII
+            Add(elm->clsid, name.c_str(), elm->factory, elm->bulk_factory);
+        }
+        s_pending_count--;
+        section = next;
+    }
+}
+#else
+void AddPendingSections () {
+}
+#endif
+
+/** Remove entries matching pred(entry). Returns the number of removed entries. */
+template <class PRED>
+size_t Remove (PRED pred) {
+    AddPendingSections(); // also consider classes from sections that are not yet registered
+    std::lock_guard<std::mutex> lock(s_mutex);
+    Snapshot* cur = s_current.load();
+    if (!cur)
+        return 0;
+
+    auto* next = new Snapshot(cur->capacity);
+    std::vector<const Entry*> removed;
+    size_t count = cur->count.load();
+    for (size_t i = 0; i < count; ++i) {
+        if (pred(*cur->entries[i]))
+            removed.push_back(cur->entries[i]);
+        else
+            next->entries[next->count++] = cur->entries[i];
+    }
+    if (removed.empty()) {
+        delete next;
+        return 0;
+    }
+
+    Replace(next); // also waits for lookups that might reference the removed entries
+    for (const Entry* entry : removed)
+        delete entry;
+    return removed.size();
+}
+
+} // namespace registry
+} // namespace
+
+
+__attribute__((visibility("default")))
+void IUnknownFactory::Register (const GUID& clsid, const wchar_t* name, Factory factory, BulkFactory bulk_factory) {
+    registry::Add(clsid, name, factory, bulk_factory);
+}
+
+#ifdef __ELF__
+__attribute__((visibility("default")))
+bool CoInternalRegisterObjectSection (ObjectEntrySection* section) {
+    if (section->begin == section->end)
+        return false; // no OBJECT_ENTRY_AUTO in module
+
+    registry::s_pending_count++;
+    registry::PushPendingSection(section);
+    return true;
+}
+
+__attribute__((visibility("default")))
+void CoInternalUnregisterObjectSection (ObjectEntrySection* section) {
+    if (registry::s_pending_count.load() == 0)
+        return; // already registered
+
+    std::lock_guard<std::mutex> lock(registry::s_pending_mutex);
+    std::vector<ObjectEntrySection*> others;
+    for (ObjectEntrySection* elm = registry::s_pending_sections.exchange(nullptr); elm; elm = elm->next) {
+        if (elm == section)
+            registry::s_pending_count--;
+        else
+            others.push_back(elm);
+    }
+    for (auto it = others.rbegin(); it != others.rend(); ++it)
+        registry::PushPendingSection(*it); // restore original order
+}
+#endif
+
+__attribute__((visibility("default")))
+HRESULT IUnknownFactory::UnregisterClass (const GUID& clsid) {
+    size_t removed = registry::Remove([&clsid](const registry::Entry& entry) {
+        return entry.clsid == clsid;
+    });
+    return removed ? S_OK : S_FALSE;
+}
+
+__attribute__((visibility("default")))
+IUnknownFactory::Factory IUnknownFactory::FindFactory (const GUID& clsid) {
+    registry::AddPendingSections();
+    registry::ReadGuard guard;
+    const registry::Entry* entry = guard.Find([&clsid](const registry::Entry& entry) {
+        return entry.clsid == clsid;
+    });
+    return entry ? entry->factory : nullptr;
+}
+
+__attribute__((visibility("default")))
+IUnknownFactory::Factory IUnknownFactory::FindFactory (const wchar_t* name) {
+    registry::AddPendingSections();
+    registry::ReadGuard guard;
+    const registry::Entry* entry = guard.Find([name](const registry::Entry& entry) {
+        return entry.name == name;
+    });
+    return entry ? entry->factory : nullptr;
+}
+
 __attribute__((visibility("default")))
-Buffer<IUnknownFactory::Entry> & IUnknownFactory::Factories () {
-    static Buffer<Entry> s_factory;
-    return s_factory;
+bool IUnknownFactory::FindClassId (const wchar_t* name, GUID& clsid) {
+    registry::AddPendingSections();
+    registry::ReadGuard guard;
+    const registry::Entry* entry = guard.Find([name](const registry::Entry& entry) {
+        return entry.name == name;
+    });
+    if (entry)
+        clsid = entry->clsid;
+    return entry != nullptr;
+}
+
+__attribute__((visibility("default")))
+IUnknownFactory::BulkFactory IUnknownFactory::FindBulkFactory (const GUID& clsid) {
+    registry::AddPendingSections();
+    registry::ReadGuard guard;
+    const registry::Entry* entry = guard.Find([&clsid](const registry::Entry& entry) {
+        return entry.clsid == clsid;
+    });
+    return entry ? entry->bulk_factory : nullptr;
+}
+
+namespace {
+namespace catalog {
+void Evict (const char* module);
+} // namespace catalog
+} // namespace
+
+__attribute__((visibility("default")))
+HRESULT CoRevokeModuleClasses (const void* address) {
+#ifdef HAVE_DLFCN
+    Dl_info module = {};
+    if (!address || !dladdr(address, &module))
+        return E_INVALIDARG;
+
+    size_t removed = registry::Remove([&module](const registry::Entry& entry) {
+        Dl_info info = {};
+        return dladdr(reinterpret_cast<void*>(entry.factory), &info) && (info.dli_fbase == module.dli_fbase);
+    });
+    catalog::Evict(module.dli_fname);
+    return removed ? S_OK : S_FALSE;
+#else
+    (void)address;
+    return E_NOTIMPL;
+#endif
 }
 
 
@@ -83,3 +549,3426 @@ unsigned int ATL::CComSafeArray<IUnknown*>::GetCount () const {
     assert(m_ptr->type == SAFEARRAY::TYPE_POINTERS);
     return static_cast<unsigned int>(m_ptr->pointers.size());
 }
+
+__attribute__((visibility("default")))
+HRESULT SafeArrayDestroy (SAFEARRAY* psa) {
+    if (psa)
+        SAFEARRAY::Destroy(psa);
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT SafeArrayCopy (SAFEARRAY* psa, SAFEARRAY** ppsaOut) {
+    if (!ppsaOut)
+        return E_POINTER;
+    *ppsaOut = psa ? SAFEARRAY::Create(*psa) : nullptr;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT SafeArrayGetRecordInfo (SAFEARRAY* psa, IRecordInfo** prinfo) {
+    if (!psa || !prinfo)
+        return E_POINTER;
+    *prinfo = nullptr;
+    if (psa->type != SAFEARRAY::TYPE_RECORDS)
+        return E_INVALIDARG;
+    return psa->record.CopyTo(prinfo);
+}
+
+__attribute__((visibility("default")))
+HRESULT SafeArrayGetVartype (SAFEARRAY* psa, VARTYPE* pvt) {
+    if (!psa || !pvt)
+        return E_POINTER;
+    *pvt = psa->vt;
+    return S_OK;
+}
+
+
+__attribute__((visibility("default")))
+CComRecordInfo::CComRecordInfo (const GUID& guid, const wchar_t* name, ULONG size, const RecordField* fields, ULONG count) : m_guid(guid), m_name(name), m_size(size), m_fields(fields), m_count(count) {
+    auto IsOwned = [](VARTYPE vt) {
+        return (vt == VT_BSTR) || (vt == VT_UNKNOWN) || (vt == VT_DISPATCH) || (vt == VT_VARIANT) || (vt & VT_ARRAY);
+    };
+    for (ULONG i = 0; i < count; ++i) {
+        if (IsOwned(fields[i].vt))
+            ++m_owned_count;
+    }
+    m_owned = new RecordField[m_owned_count ? m_owned_count : 1];
+    ULONG idx = 0;
+    for (ULONG i = 0; i < count; ++i) {
+        if (IsOwned(fields[i].vt))
+            m_owned[idx++] = fields[i];
+    }
+}
+
+__attribute__((visibility("default")))
+CComRecordInfo::~CComRecordInfo () {
+    delete [] m_owned;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::QueryInterface (const GUID& iid, void** obj) {
+    if (!obj)
+        return E_POINTER;
+    if ((iid == IID_IUnknown) || (iid == IID_IRecordInfo)) {
+        *obj = static_cast<IRecordInfo*>(this);
+        return S_OK;
+    }
+    *obj = nullptr;
+    return E_NOINTERFACE;
+}
+
+__attribute__((visibility("default")))
+ULONG CComRecordInfo::AddRef () {
+    return 1; // static instance
+}
+
+__attribute__((visibility("default")))
+ULONG CComRecordInfo::Release () {
+    return 1; // static instance
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::RecordInit (void* pvNew) {
+    if (!pvNew)
+        return E_INVALIDARG;
+    memset(pvNew, 0, m_size);
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::RecordClear (void* pvExisting) {
+    if (!pvExisting)
+        return E_INVALIDARG;
+    auto* rec = static_cast<unsigned char*>(pvExisting);
+    for (ULONG i = 0; i < m_owned_count; ++i) {
+        void* member = rec + m_owned[i].offset;
+        VARTYPE vt = m_owned[i].vt;
+        if (vt == VT_BSTR) {
+            SysFreeString(*static_cast<BSTR*>(member));
+        } else if ((vt == VT_UNKNOWN) || (vt == VT_DISPATCH)) {
+            if (auto* itf = *static_cast<IUnknown**>(member))
+                itf->Release();
+        } else if (vt == VT_VARIANT) {
+            VariantClear(static_cast<VARIANT*>(member));
+        } else {
+            SafeArrayDestroy(*static_cast<SAFEARRAY**>(member));
+        }
+    }
+    memset(pvExisting, 0, m_size);
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::RecordCopy (void* pvExisting, void* pvNew) {
+    if (!pvExisting || !pvNew)
+        return E_INVALIDARG;
+    if (pvExisting == pvNew)
+        return S_OK;
+
+    RecordClear(pvNew);
+    memcpy(pvNew, pvExisting, m_size); // bitwise members
+    auto* src = static_cast<const unsigned char*>(pvExisting);
+    auto* dst = static_cast<unsigned char*>(pvNew);
+    HRESULT hr = S_OK;
+    for (ULONG i = 0; i < m_owned_count; ++i) {
+        const void* from = src + m_owned[i].offset;
+        void* to = dst + m_owned[i].offset;
+        VARTYPE vt = m_owned[i].vt;
+        if (vt == VT_BSTR) {
+            BSTR str = *static_cast<const BSTR*>(from);
+            *static_cast<BSTR*>(to) = str ? SysAllocStringLen(str, SysStringLen(str)) : nullptr;
+        } else if ((vt == VT_UNKNOWN) || (vt == VT_DISPATCH)) {
+            if (auto* itf = *static_cast<IUnknown* const*>(from))
+                itf->AddRef();
+        } else if (vt == VT_VARIANT) {
+            VariantInit(static_cast<VARIANT*>(to));
+            HRESULT var_hr = VariantCopy(static_cast<VARIANT*>(to), static_cast<const VARIANT*>(from));
+            if (FAILED(var_hr))
+                hr = var_hr;
+        } else {
+            *static_cast<SAFEARRAY**>(to) = nullptr;
+            HRESULT sa_hr = SafeArrayCopy(*static_cast<SAFEARRAY* const*>(from), static_cast<SAFEARRAY**>(to));
+            if (FAILED(sa_hr))
+                hr = sa_hr;
+        }
+    }
+    return hr;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::GetGuid (GUID* pguid) {
+    if (!pguid)
+        return E_POINTER;
+    *pguid = m_guid;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::GetName (BSTR* pbstrName) {
+    if (!pbstrName)
+        return E_POINTER;
+    *pbstrName = SysAllocString(m_name);
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::GetSize (ULONG* pcbSize) {
+    if (!pcbSize)
+        return E_POINTER;
+    *pcbSize = m_size;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::GetFieldNames (ULONG* pcNames, BSTR* rgBstrNames) {
+    if (!pcNames)
+        return E_POINTER;
+    if (rgBstrNames) {
+        for (ULONG i = 0; i < std::min(*pcNames, m_count); ++i)
+            rgBstrNames[i] = SysAllocString(m_fields[i].name);
+    }
+    *pcNames = m_count;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+BOOL CComRecordInfo::IsMatchingType (IRecordInfo* pRecordInfo) {
+    if (!pRecordInfo)
+        return false;
+    if (pRecordInfo == this)
+        return true;
+    GUID guid {};
+    if (FAILED(pRecordInfo->GetGuid(&guid)))
+        return false;
+    if (!(guid == IID_NULL) && !(m_guid == IID_NULL))
+        return guid == m_guid;
+
+    // struct without uuid: compare name & layout instead, since all such types share the null GUID
+    auto* other = dynamic_cast<CComRecordInfo*>(pRecordInfo);
+    if (!other || (other->m_size != m_size) || (other->m_count != m_count) || (wcscmp(other->m_name, m_name) != 0))
+        return false;
+    for (ULONG i = 0; i < m_count; ++i) {
+        const RecordField& a = m_fields[i];
+        const RecordField& b = other->m_fields[i];
+        if ((a.offset != b.offset) || (a.vt != b.vt) || (wcscmp(a.name, b.name) != 0))
+            return false;
+    }
+    return true;
+}
+
+__attribute__((visibility("default")))
+void* CComRecordInfo::RecordCreate () {
+    void* rec = CoTaskMemAlloc(m_size);
+    if (rec)
+        memset(rec, 0, m_size);
+    return rec;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::RecordCreateCopy (void* pvSource, void** ppvDest) {
+    if (!pvSource || !ppvDest)
+        return E_INVALIDARG;
+    *ppvDest = RecordCreate();
+    if (!*ppvDest)
+        return E_OUTOFMEMORY;
+    return RecordCopy(pvSource, *ppvDest);
+}
+
+__attribute__((visibility("default")))
+HRESULT CComRecordInfo::RecordDestroy (void* pvRecord) {
+    if (!pvRecord)
+        return S_OK;
+    RecordClear(pvRecord);
+    CoTaskMemFree(pvRecord);
+    return S_OK;
+}
+
+
+namespace {
+
+/** Thread-local object pool used by CComPooledAllocator.
+    Blocks are carved from slabs that are aligned to their own size, so that the owning
+    thread cache can be found from the block address without any per-object header. */
+namespace pool {
+
+constexpr size_t GRANULARITY = 16;                  ///< block size increment
+constexpr size_t CLASSES     = 32;                  ///< number of size classes
+constexpr size_t MAX_SIZE    = GRANULARITY*CLASSES; ///< larger objects use the global allocator
+constexpr size_t SLAB_SIZE   = 64*1024;             ///< slab size & alignment
+constexpr size_t REGION_SLABS = 8;                  ///< slabs per CoTaskMemAlloc region
+constexpr size_t BATCH_SIZE  = 32;                  ///< max. blocks in a batch returned to another thread
+
+struct Cache;
+
+/** Free-list link stored inside free blocks. */
+struct Node {
+    Node* next;
+};
+
+/** Header at the start of each slab. */
+struct alignas(GRANULARITY) Slab {
+    Cache* owner;
+};
+
+/** Per-thread block cache. Only touched by its owning thread, except for the 'remote' inboxes. */
+struct Cache {
+    Node*              free[CLASSES] = {};   ///< blocks available for allocation
+    std::atomic<Node*> remote[CLASSES] = {}; ///< blocks released by other threads
+    char*              bump[CLASSES] = {};   ///< uncarved part of the current slab
+    char*              bump_end[CLASSES] = {};
+    char*              region = nullptr;     ///< unused part of the current slab region
+    char*              region_end = nullptr;
+
+    // batch of blocks released by this thread, but owned by another thread. Locked, so that the owner can
+    // reclaim partial batches when it runs dry. The lock is only contended in that case
+    std::mutex         batch_mutex;
+    Cache*             batch_owner = nullptr;
+    size_t             batch_class = 0;
+    Node*              batch_head = nullptr;
+    Node*              batch_tail = nullptr;
+    size_t             batch_count = 0;
+
+    Cache*             next_orphan = nullptr; ///< link in list of caches without thread
+    Cache*             next_cache = nullptr;  ///< link in list of all caches
+
+    void* Allocate (size_t cls) {
+        Node* node = free[cls];
+        if (!node) {
+            // reclaim blocks released by other threads
+            node = remote[cls].exchange(nullptr, std::memory_order_acquire);
+        }
+        if (node) {
+            free[cls] = node->next;
+            return node;
+        }
+
+        size_t block_size = (cls + 1)*GRANULARITY;
+        if (bump[cls] + block_size > bump_end[cls]) {
+            // reclaim partial batches of blocks that other threads released, before using more memory
+            ReclaimBatches();
+            node = remote[cls].exchange(nullptr, std::memory_order_acquire);
+            if (node) {
+                free[cls] = node->next;
+                return node;
+            }
+
+            // start on a new slab
+            auto* slab = NewSlab();
+            slab->owner = this;
+            bump[cls] = reinterpret_cast<char*>(slab + 1);
+            bump_end[cls] = reinterpret_cast<char*>(slab) + SLAB_SIZE;
+        }
+        void* ptr = bump[cls];
+        bump[cls] += block_size;
+        return ptr;
+    }
+
+    /** Carve a SLAB_SIZE-aligned slab from the current region. Regions are allocated with
+        CoTaskMemAlloc, which doesn't support alignment, so each region has one slab of slack. */
+    Slab* NewSlab () {
+        if (region == region_end) {
+            auto* ptr = static_cast<char*>(CoTaskMemAlloc((REGION_SLABS + 1)*SLAB_SIZE));
+            if (!ptr)
+                throw std::bad_alloc();
+            region = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(ptr) + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1));
+            region_end = region + REGION_SLABS*SLAB_SIZE;
+        }
+        auto* slab = reinterpret_cast<Slab*>(region);
+        region += SLAB_SIZE;
+        return slab;
+    }
+
+    void Free (Cache* owner, size_t cls, void* ptr) {
+        auto* node = static_cast<Node*>(ptr);
+        if (owner == this) {
+            node->next = free[cls];
+            free[cls] = node;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        if ((owner != batch_owner) || (cls != batch_class) || (batch_count == BATCH_SIZE))
+            FlushBatchLocked();
+
+        // append to batch for other thread
+        node->next = batch_head;
+        batch_head = node;
+        if (!batch_tail)
+            batch_tail = node;
+        batch_owner = owner;
+        batch_class = cls;
+        batch_count++;
+    }
+
+    void FlushBatch () {
+        std::lock_guard<std::mutex> lock(batch_mutex);
+        FlushBatchLocked();
+    }
+
+    /** Return pending batch to the owning thread in one atomic operation. Caller must hold batch_mutex. */
+    void FlushBatchLocked () {
+        if (!batch_head)
+            return;
+
+        PushRemote(batch_owner, batch_class, batch_head, batch_tail);
+        batch_owner = nullptr;
+        batch_head = nullptr;
+        batch_tail = nullptr;
+        batch_count = 0;
+    }
+
+    void ReclaimBatches ();
+
+    static void PushRemote (Cache* owner, size_t cls, Node* head, Node* tail) {
+        Node* prev = owner->remote[cls].load(std::memory_order_relaxed);
+        do {
+            tail->next = prev;
+        } while (!owner->remote[cls].compare_exchange_weak(prev, head, std::memory_order_release, std::memory_order_relaxed));
+    }
+};
+
+std::mutex s_orphans_mutex;
+Cache*     s_orphans = nullptr; ///< caches released by exited threads, for reuse by new threads
+std::atomic<Cache*> s_caches {nullptr}; ///< all caches. Never freed
+
+/** Flush the partial batches of other threads that hold blocks of this cache. */
+void Cache::ReclaimBatches () {
+    for (Cache* cache = s_caches.load(std::memory_order_acquire); cache; cache = cache->next_cache) {
+        if (cache == this)
+            continue;
+        std::lock_guard<std::mutex> lock(cache->batch_mutex);
+        if (cache->batch_owner == this)
+            cache->FlushBatchLocked();
+    }
+}
+
+Cache* AcquireCache () {
+    {
+        std::lock_guard<std::mutex> lock(s_orphans_mutex);
+        if (s_orphans) {
+            Cache* cache = s_orphans;
+            s_orphans = cache->next_orphan;
+            cache->next_orphan = nullptr;
+            return cache;
+        }
+    }
+    auto* cache = new Cache();
+    cache->next_cache = s_caches.load(std::memory_order_relaxed);
+    while (!s_caches.compare_exchange_weak(cache->next_cache, cache, std::memory_order_release, std::memory_order_relaxed)) {
+    }
+    return cache;
+}
+
+void ReleaseCache (Cache* cache) {
+    cache->FlushBatch();
+
+    // keep cache alive, since other threads might still release blocks to it
+    std::lock_guard<std::mutex> lock(s_orphans_mutex);
+    cache->next_orphan = s_orphans;
+    s_orphans = cache;
+}
+
+thread_local Cache* t_cache = nullptr;
+thread_local bool   t_exited = false;
+
+/** Returns the thread's cache to the orphan list on thread exit. */
+struct CacheHolder {
+    ~CacheHolder() {
+        if (t_cache)
+            ReleaseCache(t_cache);
+        t_cache = nullptr;
+        t_exited = true;
+    }
+};
+thread_local CacheHolder t_holder;
+
+Cache* ThreadCache () {
+    if (t_cache || t_exited)
+        return t_cache;
+
+    (void)&t_holder; // register thread-exit cleanup
+    t_cache = AcquireCache();
+    return t_cache;
+}
+
+} // namespace pool
+} // namespace
+
+
+__attribute__((visibility("default")))
+void* CComPooledAllocator::Allocate (size_t size) {
+    if (size > pool::MAX_SIZE)
+        return CComGlobalAllocator::Allocate(size);
+
+    size_t cls = (size - 1)/pool::GRANULARITY;
+    if (pool::Cache* cache = pool::ThreadCache())
+        return cache->Allocate(cls);
+
+    // called during thread exit: borrow a cache temporarily
+    pool::Cache* cache = pool::AcquireCache();
+    void* ptr = cache->Allocate(cls);
+    pool::ReleaseCache(cache);
+    return ptr;
+}
+
+__attribute__((visibility("default")))
+void CComPooledAllocator::Free (void* ptr, size_t size) {
+    if (!ptr)
+        return;
+    if (size > pool::MAX_SIZE) {
+        CComGlobalAllocator::Free(ptr, size);
+        return;
+    }
+
+    size_t cls = (size - 1)/pool::GRANULARITY;
+    auto* slab = reinterpret_cast<pool::Slab*>(reinterpret_cast<uintptr_t>(ptr) & ~(pool::SLAB_SIZE - 1));
+    if (pool::Cache* cache = pool::ThreadCache()) {
+        cache->Free(slab->owner, cls, ptr);
+        return;
+    }
+
+    // called during thread exit: return block directly to its owner
+    auto* node = static_cast<pool::Node*>(ptr);
+    pool::Cache::PushRemote(slab->owner, cls, node, node);
+}
+
+__attribute__((visibility("default")))
+HRESULT CComWeakRefBlock::QueryInterface (const GUID& iid, void** obj) {
+    if (!obj)
+        return E_POINTER;
+    *obj = nullptr;
+    if (iid == IID_IWeakRef) {
+        *obj = static_cast<IWeakRef*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    // pin the object with a temporary strong reference, unless it's already being destroyed
+    ULONG strong = m_strong->load();
+    do {
+        if (!strong)
+            return E_NOT_SET;
+    } while (!m_strong->compare_exchange_weak(strong, strong + 1));
+
+    HRESULT hr = m_object->QueryInterface(iid, obj);
+    if (SUCCEEDED(hr))
+        (*m_strong)--; // cannot reach zero, since QueryInterface added a reference
+    else
+        m_object->Release(); // might destroy the object
+    return hr;
+}
+
+__attribute__((visibility("default")))
+ULONG CComWeakRefBlock::AddRef () {
+    return ++m_weak;
+}
+
+__attribute__((visibility("default")))
+ULONG CComWeakRefBlock::Release () {
+    ULONG weak = --m_weak;
+    if (!weak) {
+        FreeFunction free = m_free;
+        size_t size = m_size;
+        this->~CComWeakRefBlock();
+        free(this, size); // block is at the start of the allocation
+    }
+    return weak;
+}
+
+
+namespace {
+namespace biased {
+
+void ReleaseOwner (CComBiasedOwner* owner) {
+    if (--owner->refs == 0)
+        delete owner;
+}
+
+thread_local bool t_exited = false;
+
+/** Flags the thread's owner state as exited & merges the queued objects on thread exit. */
+struct OwnerHolder {
+    ~OwnerHolder() {
+        CComBiasedOwner::ThreadExit();
+        t_exited = true;
+    }
+};
+thread_local OwnerHolder t_holder;
+
+} // namespace biased
+} // namespace
+
+__attribute__((visibility("default")))
+thread_local CComBiasedOwner* CComBiasedRefCount::t_owner = nullptr;
+
+__attribute__((visibility("default")))
+CComBiasedRefCount::CComBiasedRefCount () {
+    if (!t_owner) {
+        if (biased::t_exited) {
+            // created during thread exit: fall back to the shared counter only
+            m_shared.store(MERGED, std::memory_order_relaxed);
+            m_biased = DETACHED;
+            return;
+        }
+        (void)&biased::t_holder; // register thread-exit cleanup
+        t_owner = new CComBiasedOwner();
+    }
+    ProcessQueue(); // bound the delay of deferred destruction
+    m_owner = t_owner;
+    m_owner->refs++;
+}
+
+__attribute__((visibility("default")))
+CComBiasedRefCount::~CComBiasedRefCount () {
+    if (m_owner)
+        biased::ReleaseOwner(m_owner);
+}
+
+__attribute__((visibility("default")))
+ULONG CComBiasedRefCount::ReleaseSlow (IUnknown* obj) {
+    CComBiasedOwner* owner = m_owner;
+    if (owner && (owner == t_owner) && (m_biased != DETACHED)) {
+        ULONG ref = --m_biased;
+        if (!ref) {
+            // implicit merge: the shared counter holds the total count from now on
+            m_biased = DETACHED;
+            int64_t prev = m_shared.fetch_or(MERGED);
+            if (!(prev & QUEUED) && ((prev >> SHIFT) == 0))
+                ref = 0; // caller deletes the object
+            else
+                ref = 1; // other threads hold references, or the owner queue does
+        }
+        ProcessQueue(); // after the last access to this object, since it might be queued
+        return ref;
+    }
+
+    int64_t prev = m_shared.load(std::memory_order_relaxed);
+    int64_t next = 0;
+    bool enqueue = false;
+    do {
+        next = prev - ONE;
+        // queue the object to the owner the first time that other threads hold a negative count
+        enqueue = !(prev & (MERGED | QUEUED)) && (next < 0);
+        if (enqueue)
+            next |= QUEUED;
+    } while (!m_shared.compare_exchange_weak(prev, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (enqueue) {
+        // pin the owner state, since the object might be merged & deleted as soon as it's queued
+        CComBiasedOwner* record = m_owner;
+        record->refs++;
+        m_object_offset = static_cast<int32_t>(reinterpret_cast<char*>(obj) - reinterpret_cast<char*>(this));
+        CComBiasedRefCount* head = record->queue.load(std::memory_order_relaxed);
+        do {
+            m_next = head;
+        } while (!record->queue.compare_exchange_weak(head, this));
+
+        if (record->exited.load()) {
+            // owner thread is gone: merge on its behalf
+            CComBiasedRefCount* node = record->queue.exchange(nullptr);
+            while (node) {
+                CComBiasedRefCount* following = node->m_next; // node might be deleted by Merge
+                node->Merge();
+                node = following;
+            }
+        }
+        biased::ReleaseOwner(record);
+        return 1;
+    }
+    if ((next & MERGED) && !(next & QUEUED) && ((next >> SHIFT) == 0))
+        return 0; // caller deletes the object
+    return (next >= ONE) ? static_cast<ULONG>(next >> SHIFT) : 1;
+}
+
+__attribute__((visibility("default")))
+void CComBiasedRefCount::Merge () {
+    auto* obj = reinterpret_cast<IUnknown*>(reinterpret_cast<char*>(this) + m_object_offset);
+    ULONG biased = (m_biased != DETACHED) ? m_biased : 0;
+    m_biased = DETACHED;
+
+    int64_t prev = m_shared.load(std::memory_order_relaxed);
+    int64_t next = 0;
+    do {
+        next = prev & ~QUEUED;
+        if (!(prev & MERGED))
+            next = (next + biased*ONE) | MERGED;
+    } while (!m_shared.compare_exchange_weak(prev, next, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if ((next >> SHIFT) == 0)
+        delete obj;
+}
+
+__attribute__((visibility("default")))
+size_t CComBiasedRefCount::ProcessQueue () {
+    CComBiasedOwner* owner = t_owner;
+    if (!owner || !owner->queue.load(std::memory_order_relaxed))
+        return 0;
+
+    size_t count = 0;
+    CComBiasedRefCount* node = owner->queue.exchange(nullptr);
+    while (node) {
+        CComBiasedRefCount* following = node->m_next; // node might be deleted by Merge
+        node->Merge();
+        node = following;
+        ++count;
+    }
+    return count;
+}
+
+__attribute__((visibility("default")))
+void CComBiasedOwner::ThreadExit () {
+    CComBiasedOwner* owner = CComBiasedRefCount::t_owner;
+    if (!owner)
+        return;
+
+    owner->exited = true; // later releases from other threads merge by themselves
+    CComBiasedRefCount::ProcessQueue();
+    CComBiasedRefCount::t_owner = nullptr;
+    biased::ReleaseOwner(owner);
+}
+
+namespace {
+namespace counters {
+
+const ULONG MAX_CLASSES = 256;        ///< class index 0 collects classes beyond the limit
+const ULONG MAX_INTERFACE_SLOTS = 512; ///< per-shard (class, IID) slots. QueryInterface calls beyond the limit are only counted per class
+
+struct InterfaceSlot {
+    std::atomic<ULONG>     cls {0}; ///< class index + 1. Published after "iid" is written
+    GUID                   iid {};
+    std::atomic<ULONGLONG> hits {0};
+    std::atomic<ULONGLONG> misses {0};
+};
+
+/** Counters that are only written by the owning thread, so that increments don't need atomic read-modify-write.
+    Snapshots read them concurrently with relaxed loads. */
+struct Shard {
+    std::atomic<ULONGLONG> counters[MAX_CLASSES][OBJECT_COUNTER_COUNT] = {};
+    InterfaceSlot          interfaces[MAX_INTERFACE_SLOTS];
+
+    static void Add (std::atomic<ULONGLONG>& counter, ULONGLONG val) {
+        counter.store(counter.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+    }
+
+    /** Find or insert slot for (cls, iid). Returns nullptr if the table is full. Only called by the owner. */
+    InterfaceSlot* Find (ULONG cls, const GUID& iid) {
+        size_t idx = (iid.Data1 ^ (cls*0x9E3779B1u)) % MAX_INTERFACE_SLOTS;
+        for (size_t probe = 0; probe < MAX_INTERFACE_SLOTS; ++probe) {
+            InterfaceSlot& slot = interfaces[(idx + probe) % MAX_INTERFACE_SLOTS];
+            ULONG slot_cls = slot.cls.load(std::memory_order_relaxed);
+            if (slot_cls == 0) {
+                slot.iid = iid;
+                slot.cls.store(cls + 1, std::memory_order_release);
+                return &slot;
+            }
+            if ((slot_cls == cls + 1) && (slot.iid == iid))
+                return &slot;
+        }
+        return nullptr;
+    }
+
+    /** Accumulate counters from another shard. */
+    void Merge (const Shard& other) {
+        for (ULONG cls = 0; cls < MAX_CLASSES; ++cls) {
+            for (int c = 0; c < OBJECT_COUNTER_COUNT; ++c)
+                Add(counters[cls][c], other.counters[cls][c].load(std::memory_order_relaxed));
+        }
+        for (const InterfaceSlot& src : other.interfaces) {
+            ULONG cls = src.cls.load(std::memory_order_acquire);
+            if (!cls)
+                continue;
+            if (InterfaceSlot* dst = Find(cls - 1, src.iid)) {
+                Add(dst->hits, src.hits.load(std::memory_order_relaxed));
+                Add(dst->misses, src.misses.load(std::memory_order_relaxed));
+            }
+        }
+    }
+};
+
+/** Class names & shards. Leaked to outlive thread_local shards during process exit. */
+struct Registry {
+    std::mutex          mutex;
+    const char*         names[MAX_CLASSES] = {"(other)"};
+    ULONG               class_count = 1;
+    std::vector<Shard*> shards;  ///< shards of running threads
+    Shard               retired; ///< totals from exited threads
+};
+
+Registry& GetRegistry () {
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+/** Sum of all shards. Caller must hold the registry mutex. */
+std::unique_ptr<Shard> Aggregate (Registry& registry) {
+    auto total = std::make_unique<Shard>();
+    total->Merge(registry.retired);
+    for (Shard* shard : registry.shards)
+        total->Merge(*shard);
+    return total;
+}
+
+thread_local Shard* t_shard = nullptr;
+thread_local bool   t_exited = false;
+
+/** Moves the thread's counters to the retired totals on thread exit. */
+struct ShardHolder {
+    ~ShardHolder() {
+        if (t_shard) {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.retired.Merge(*t_shard);
+            registry.shards.erase(std::find(registry.shards.begin(), registry.shards.end(), t_shard));
+            delete t_shard;
+        }
+        t_shard = nullptr;
+        t_exited = true;
+    }
+};
+thread_local ShardHolder t_holder;
+
+/** Run fun(shard) on the thread's shard, or on the retired totals if called during thread exit. */
+template <class FUN>
+void WithShard (FUN fun) {
+    if (!t_shard && !t_exited) {
+        (void)&t_holder; // register thread-exit cleanup
+        auto* shard = new Shard();
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.shards.push_back(shard);
+        t_shard = shard;
+    }
+    if (t_shard) {
+        fun(*t_shard);
+        return;
+    }
+
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    fun(registry.retired);
+}
+
+} // namespace counters
+} // namespace
+
+
+__attribute__((visibility("default")))
+ULONG CoInternalRegisterCountedClass (const char* name) {
+    counters::Registry& registry = counters::GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if (registry.class_count == counters::MAX_CLASSES)
+        return 0; // shared overflow slot
+
+    registry.names[registry.class_count] = name;
+    return registry.class_count++;
+}
+
+__attribute__((visibility("default")))
+void CoInternalCountObjectEvent (ULONG cls, ObjectCounter counter) {
+    counters::WithShard([&](counters::Shard& shard) {
+        counters::Shard::Add(shard.counters[cls][counter], 1);
+    });
+}
+
+__attribute__((visibility("default")))
+void CoInternalCountQueryInterface (ULONG cls, const GUID& iid, bool hit) {
+    counters::WithShard([&](counters::Shard& shard) {
+        counters::Shard::Add(shard.counters[cls][hit ? OBJECT_COUNTER_QI_HIT : OBJECT_COUNTER_QI_MISS], 1);
+        if (counters::InterfaceSlot* slot = shard.Find(cls, iid))
+            counters::Shard::Add(hit ? slot->hits : slot->misses, 1);
+    });
+}
+
+__attribute__((visibility("default")))
+ULONG CoGetClassCounters (CoClassCounters* classes, ULONG capacity) {
+    counters::Registry& registry = counters::GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto total = counters::Aggregate(registry);
+
+    ULONG count = 0;
+    for (ULONG cls = 0; cls < registry.class_count; ++cls) {
+        const auto& c = total->counters[cls];
+        if ((cls == 0) && !c[OBJECT_COUNTER_CREATED] && !c[OBJECT_COUNTER_ADDREF] && !c[OBJECT_COUNTER_QI_HIT] && !c[OBJECT_COUNTER_QI_MISS])
+            continue; // skip unused overflow slot
+
+        if (classes && (count < capacity)) {
+            classes[count] = {registry.names[cls], c[OBJECT_COUNTER_CREATED], c[OBJECT_COUNTER_DESTROYED], c[OBJECT_COUNTER_ADDREF],
+                              c[OBJECT_COUNTER_RELEASE], c[OBJECT_COUNTER_QI_HIT], c[OBJECT_COUNTER_QI_MISS]};
+        }
+        count++;
+    }
+    return count;
+}
+
+__attribute__((visibility("default")))
+ULONG CoGetInterfaceCounters (CoInterfaceCounters* interfaces, ULONG capacity) {
+    counters::Registry& registry = counters::GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    auto total = counters::Aggregate(registry);
+
+    ULONG count = 0;
+    for (const counters::InterfaceSlot& slot : total->interfaces) {
+        ULONG cls = slot.cls.load(std::memory_order_relaxed);
+        if (!cls)
+            continue;
+
+        if (interfaces && (count < capacity))
+            interfaces[count] = {registry.names[cls - 1], slot.iid, slot.hits.load(), slot.misses.load()};
+        count++;
+    }
+    return count;
+}
+
+__attribute__((visibility("default")))
+void CoDumpObjectCounters (FILE* file) {
+    std::vector<CoClassCounters> classes(CoGetClassCounters(nullptr, 0));
+    classes.resize(CoGetClassCounters(classes.data(), static_cast<ULONG>(classes.size())));
+    std::vector<CoInterfaceCounters> interfaces(CoGetInterfaceCounters(nullptr, 0));
+    interfaces.resize(CoGetInterfaceCounters(interfaces.data(), static_cast<ULONG>(interfaces.size())));
+
+    fprintf(file, "%-32s %10s %10s %10s %12s %12s %10s %10s\n", "class", "live", "created", "destroyed", "addrefs", "releases", "qi_hits", "qi_misses");
+    for (const CoClassCounters& c : classes) {
+        fprintf(file, "%-32s %10lld %10llu %10llu %12llu %12llu %10llu %10llu\n", c.name, static_cast<LONGLONG>(c.created - c.destroyed),
+            c.created, c.destroyed, c.addrefs, c.releases, c.qi_hits, c.qi_misses);
+    }
+
+    fprintf(file, "\n%-32s %-38s %10s %10s\n", "class", "iid", "hits", "misses");
+    for (const CoInterfaceCounters& i : interfaces) {
+        char iid_str[39] = {};
+        snprintf(iid_str, sizeof(iid_str), "{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+            i.iid.Data1, i.iid.Data2, i.iid.Data3,
+            i.iid.Data4[0], i.iid.Data4[1], i.iid.Data4[2], i.iid.Data4[3],
+            i.iid.Data4[4], i.iid.Data4[5], i.iid.Data4[6], i.iid.Data4[7]);
+        fprintf(file, "%-32s %-38s %10llu %10llu\n", i.name, iid_str, i.hits, i.misses);
+    }
+}
+
+
+namespace {
+namespace tracker {
+
+const int    MAX_FRAMES = 16;
+const size_t SHARDS = 64; ///< reduce lock contention from concurrent object creation
+
+struct Record {
+    const std::type_info*     type = nullptr;
+    const std::atomic<ULONG>* refs = nullptr; ///< null for classes with custom reference-counting
+    ULONG                     ref_count = 0;  ///< copy of *refs when taking a snapshot
+    ULONGLONG                 seq = 0;        ///< creation order
+    int                       depth = 0;
+    void*                     frames[MAX_FRAMES] = {};
+
+    bool SameOrigin (const Record& other) const {
+        return (*type == *other.type) && (depth == other.depth) && (memcmp(frames, other.frames, depth*sizeof(void*)) == 0);
+    }
+    /** Arbitrary but consistent ordering of class & creation backtrace. */
+    bool OriginBefore (const Record& other) const {
+        if (!(*type == *other.type))
+            return type->before(*other.type);
+        if (depth != other.depth)
+            return depth < other.depth;
+        return memcmp(frames, other.frames, depth*sizeof(void*)) < 0;
+    }
+};
+
+struct Shard {
+    std::mutex                              mutex;
+    std::unordered_map<const void*, Record> objects;
+};
+
+std::atomic<ULONGLONG> s_seq {0};
+
+/** Leaked to outlive objects that are destroyed during process exit. */
+Shard* Shards () {
+    static Shard* shards = new Shard[SHARDS];
+    return shards;
+}
+
+Shard& ShardOf (const void* obj) {
+    return Shards()[(reinterpret_cast<uintptr_t>(obj) >> 4) % SHARDS];
+}
+
+bool ReadEnabled () {
+    const char* val = getenv("COM_LEAK_TRACKER");
+    if (!val || !*val || (strcmp(val, "0") == 0))
+        return false;
+
+    atexit([] {
+        size_t live = 0;
+        for (size_t i = 0; i < SHARDS; ++i) {
+            std::lock_guard<std::mutex> lock(Shards()[i].mutex);
+            live += Shards()[i].objects.size();
+        }
+        if (live > 0)
+            CoDumpLiveObjects(stderr); // only report leaks
+    });
+    return true;
+}
+
+bool Enabled () {
+    static const bool enabled = ReadEnabled();
+    return enabled;
+}
+
+std::string Demangle (const char* name) {
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    if (!demangled)
+        return name;
+    std::string result(demangled);
+    free(demangled);
+    return result;
+}
+
+} // namespace tracker
+} // namespace
+
+
+__attribute__((visibility("default")))
+void CoInternalTrackObject (const void* obj, const std::type_info& type, const std::atomic<ULONG>* refs) {
+    if (!tracker::Enabled())
+        return;
+
+    tracker::Record record;
+    record.type = &type;
+    record.refs = refs;
+    record.seq = tracker::s_seq++;
+#ifdef HAVE_BACKTRACE
+    record.depth = backtrace(record.frames, tracker::MAX_FRAMES);
+#endif
+
+    tracker::Shard& shard = tracker::ShardOf(obj);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.objects[obj] = record;
+}
+
+__attribute__((visibility("default")))
+void CoInternalUntrackObject (const void* obj) {
+    if (!tracker::Enabled())
+        return;
+
+    tracker::Shard& shard = tracker::ShardOf(obj);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.objects.erase(obj);
+}
+
+__attribute__((visibility("default")))
+ULONG CoDumpLiveObjects (FILE* file) {
+    if (!tracker::Enabled())
+        return 0;
+
+    // snapshot reference-counts while holding the lock, so that the objects cannot be destroyed meanwhile
+    std::vector<std::pair<const void*, tracker::Record>> objects;
+    for (size_t i = 0; i < tracker::SHARDS; ++i) {
+        tracker::Shard& shard = tracker::Shards()[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto& elm : shard.objects) {
+            elm.second.ref_count = elm.second.refs ? elm.second.refs->load() : 0;
+            objects.push_back(elm);
+        }
+    }
+
+    // group objects by class & creation backtrace. Groups are listed in creation order of their first object
+    std::sort(objects.begin(), objects.end(), [](const auto& a, const auto& b) {
+        if (!a.second.SameOrigin(b.second))
+            return a.second.OriginBefore(b.second);
+        return a.second.seq < b.second.seq;
+    });
+    std::vector<std::pair<size_t, size_t>> groups; // [begin, end) ranges in "objects"
+    for (size_t i = 0; i < objects.size(); ++i) {
+        if (groups.empty() || !objects[i].second.SameOrigin(objects[groups.back().first].second))
+            groups.push_back({i, i});
+        groups.back().second = i + 1;
+    }
+    std::sort(groups.begin(), groups.end(), [&objects](const auto& a, const auto& b) {
+        return objects[a.first].second.seq < objects[b.first].second.seq;
+    });
+
+    fprintf(file, "Live COM objects: %zu\n", objects.size());
+    for (const auto& group : groups) {
+        const tracker::Record& first = objects[group.first].second;
+        const size_t count = group.second - group.first;
+        fprintf(file, "%zu x %s:", count, tracker::Demangle(first.type->name()).c_str());
+        const size_t MAX_LISTED = 8;
+        for (size_t k = group.first; k < std::min(group.second, group.first + MAX_LISTED); ++k) {
+            const auto& elm = objects[k];
+            if (elm.second.refs)
+                fprintf(file, " %p (refs=%u)", elm.first, elm.second.ref_count);
+            else
+                fprintf(file, " %p", elm.first);
+        }
+        if (count > MAX_LISTED)
+            fprintf(file, " ...");
+        fprintf(file, "\n");
+
+#ifdef HAVE_BACKTRACE
+        char** symbols = backtrace_symbols(first.frames, first.depth);
+        for (int f = 1; symbols && (f < first.depth); ++f) // skip CoInternalTrackObject frame
+            fprintf(file, "    #%d %s\n", f - 1, symbols[f]);
+        free(symbols);
+#endif
+    }
+    fflush(file);
+    return static_cast<ULONG>(objects.size());
+}
+
+
+namespace {
+namespace apartment {
+
+/** Wake-up signal for a thread that waits for incoming calls or call completion. */
+struct Signal {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::atomic<bool>       sleeping {false};
+
+    /** Wake waiting thread after a state change. Cheap if the thread isn't waiting. */
+    void Notify () {
+        if (!sleeping.load())
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_one();
+    }
+
+    /** Wait until ready() returns true or timeout. Returns false on timeout. */
+    template <class PRED>
+    bool Wait (PRED ready, DWORD timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true);
+        bool result = true;
+        if (timeout == INFINITE)
+            cv.wait(lock, ready);
+        else
+            result = cv.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+        sleeping.store(false);
+        return result;
+    }
+
+    /** Mark call as completed & wake the waiting thread. Doesn't touch the call afterwards. */
+    static void Complete (ApartmentCall* call) {
+        auto* signal = static_cast<Signal*>(call->waiter);
+        std::lock_guard<std::mutex> lock(signal->mutex);
+        call->done.store(true);
+        signal->cv.notify_one();
+    }
+};
+
+
+/** COM apartment. STAs own a lock-free multi-producer single-consumer call queue that is drained by the owner thread. */
+class Apartment : public IUnknown {
+public:
+    Apartment (bool _sta) : sta(_sta) {
+        m_head.store(&m_stub);
+        m_tail = &m_stub;
+    }
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if (iid == IID_IUnknown) {
+            *obj = static_cast<IUnknown*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return ++m_ref;
+    }
+    ULONG Release () override {
+        ULONG ref = --m_ref;
+        if (!ref)
+            delete this;
+        return ref;
+    }
+
+    /** Enqueue call from any thread. Returns false if the apartment is shut down. */
+    bool Post (ApartmentCall* call) {
+        ++m_posting;
+        if (m_closed.load()) {
+            --m_posting;
+            return false;
+        }
+        Push(call);
+        --m_posting;
+        signal.Notify();
+        return true;
+    }
+
+    /** Execute all pending calls. Only called by owner thread. */
+    size_t ProcessPending () {
+        size_t count = 0;
+        while (ApartmentCall* call = Pop()) {
+            bool async = call->async;
+            call->fun(call); // async calls might delete themselves
+            if (!async)
+                Signal::Complete(call);
+            ++count;
+        }
+        return count;
+    }
+
+    /** Check for pending calls. Only called by owner thread. */
+    bool Pending () const {
+        return (m_tail != &m_stub) || m_stub.next.load() || (m_head.load() != &m_stub);
+    }
+
+    /** Reject new calls & execute the ones already queued. Only called by owner thread. */
+    void Close () {
+        m_closed.store(true);
+        while (m_posting.load())
+            std::this_thread::yield(); // wait for in-flight Post calls
+
+        while (Pending())
+            ProcessPending();
+    }
+
+    const bool sta;
+    Signal     signal; ///< wakes the owner thread
+
+private:
+    // Intrusive MPSC queue by Dmitry Vyukov
+    void Push (ApartmentCall* call) {
+        call->next.store(nullptr, std::memory_order_relaxed);
+        ApartmentCall* prev = m_head.exchange(call, std::memory_order_acq_rel);
+        prev->next.store(call, std::memory_order_release);
+    }
+
+    ApartmentCall* Pop () {
+        ApartmentCall* tail = m_tail;
+        ApartmentCall* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next)
+                return nullptr;
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load(std::memory_order_acquire))
+            return nullptr; // producer in the middle of Push
+
+        Push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        return nullptr;
+    }
+
+    std::atomic<ULONG>          m_ref {0};
+    std::atomic<ApartmentCall*> m_head;        ///< last pushed call (producers)
+    ApartmentCall*              m_tail = nullptr; ///< next call to pop (owner thread)
+    ApartmentCall               m_stub;
+    std::atomic<bool>           m_closed {false};
+    std::atomic<int>            m_posting {0}; ///< number of threads in Post
+};
+
+
+/** Multi-threaded apartment. Never destroyed. */
+Apartment* Mta () {
+    static Apartment* mta = [] {
+        auto* apt = new Apartment(false);
+        apt->AddRef();
+        return apt;
+    }();
+    return mta;
+}
+
+thread_local Apartment* t_apartment = nullptr; ///< apartment explicitly joined by CoInitializeEx
+thread_local ULONG      t_init_count = 0;
+thread_local Signal     t_signal;              ///< completion signal for threads outside an STA
+
+/** Leave the apartment on thread exit if CoUninitialize wasn't called. */
+struct ApartmentHolder {
+    ~ApartmentHolder() {
+        while (t_init_count > 0)
+            CoUninitialize();
+    }
+};
+thread_local ApartmentHolder t_holder;
+
+Apartment* CurrentApartment () {
+    return t_apartment ? t_apartment : Mta(); // implicit MTA if not initialized
+}
+
+/** Check if calls to objects in an apartment can be made directly from the current thread. */
+bool IsDirect (Apartment* apt) {
+    return !apt->sta || (apt == t_apartment);
+}
+
+
+std::mutex& ProxyMutex () {
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+struct ProxyEntry {
+    IID                      iid;
+    ApartmentProxyFactory    factory = nullptr;
+    ApartmentReleaseFunction release = nullptr;
+};
+std::vector<ProxyEntry>& Proxies () {
+    static std::vector<ProxyEntry> s_proxies;
+    return s_proxies;
+}
+
+ApartmentProxyFactory FindProxy (const IID& iid) {
+    std::lock_guard<std::mutex> lock(ProxyMutex());
+    for (auto& elm : Proxies()) {
+        if (elm.iid == iid)
+            return elm.factory;
+    }
+    return nullptr;
+}
+
+ApartmentReleaseFunction FindRelease (const IID& iid) {
+    std::lock_guard<std::mutex> lock(ProxyMutex());
+    for (auto& elm : Proxies()) {
+        if (elm.iid == iid)
+            return elm.release;
+    }
+    return nullptr;
+}
+
+
+static constexpr GUID IID_MarshalStream = {0x8a1e6f3d,0x5b2c,0x4d7e,{0x9f,0x10,0x2a,0x3b,0x4c,0x5d,0x6e,0x7f}};
+
+/** Opaque stream that carries an interface pointer and its owner apartment between threads. */
+class MarshalStream : public IStream {
+public:
+    MarshalStream (Apartment* apt, IUnknown* itf) : apartment(apt), itf(itf) {
+    }
+    ~MarshalStream () {
+        if (itf)
+            CoInternalApartmentRelease(apartment, itf);
+    }
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if ((iid == IID_IUnknown) || (iid == IID_ISequentialStream) || (iid == IID_IStream) || (iid == IID_MarshalStream)) {
+            *obj = static_cast<IStream*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return ++m_ref;
+    }
+    ULONG Release () override {
+        ULONG ref = --m_ref;
+        if (!ref)
+            delete this;
+        return ref;
+    }
+
+    HRESULT Read (void* /*pv*/, ULONG /*cb*/, ULONG* /*pcbRead*/) override {
+        return E_NOTIMPL; // opaque content
+    }
+    HRESULT Write (const void* /*pv*/, ULONG /*cb*/, ULONG* /*pcbWritten*/) override {
+        return E_NOTIMPL; // opaque content
+    }
+
+    CComPtr<IUnknown> apartment;
+    IUnknown*         itf = nullptr; ///< owned reference to the marshaled interface
+
+private:
+    std::atomic<ULONG> m_ref {0};
+};
+
+} // namespace apartment
+} // namespace
+
+
+__attribute__((visibility("default")))
+HRESULT CoInitializeEx (void* /*pvReserved*/, DWORD dwCoInit) {
+    using namespace apartment;
+    bool sta = (dwCoInit & COINIT_APARTMENTTHREADED) != 0;
+    if (t_init_count > 0) {
+        if (t_apartment->sta != sta)
+            return RPC_E_CHANGED_MODE;
+        ++t_init_count;
+        return S_FALSE; // already initialized
+    }
+
+    (void)&t_holder; // register thread-exit cleanup
+    t_apartment = sta ? new Apartment(true) : Mta();
+    t_apartment->AddRef();
+    t_init_count = 1;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+void CoUninitialize () {
+    using namespace apartment;
+    if (t_init_count == 0)
+        return;
+    if (--t_init_count > 0)
+        return;
+
+    if (t_apartment->sta)
+        t_apartment->Close();
+    t_apartment->Release();
+    t_apartment = nullptr;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoProcessApartmentCalls (DWORD dwTimeout) {
+    using namespace apartment;
+    Apartment* apt = t_apartment;
+    if (!apt || !apt->sta)
+        return CO_E_NOTINITIALIZED;
+
+    size_t count = apt->ProcessPending() + CComBiasedRefCount::ProcessQueue();
+    while (!count && (dwTimeout > 0)) {
+        if (!apt->signal.Wait([apt] { return apt->Pending(); }, dwTimeout))
+            break; // timeout
+        count = apt->ProcessPending(); // might be zero if a producer is in the middle of Push
+    }
+    return count ? S_OK : S_FALSE;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoMarshalInterThreadInterfaceInStream (const IID& riid, IUnknown* pUnk, IStream** ppStm) {
+    using namespace apartment;
+    if (!pUnk || !ppStm)
+        return E_POINTER;
+    *ppStm = nullptr;
+
+    // keep the IUnknown identity, since other interfaces cannot be released without knowing their type
+    // (IdlParse.py interfaces use virtual inheritance from IUnknown)
+    IUnknown* itf = nullptr;
+    HRESULT hr = pUnk->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&itf));
+    if (FAILED(hr))
+        return hr;
+
+    // validate that the object implements riid
+    void* requested = nullptr;
+    if (FAILED(pUnk->QueryInterface(riid, &requested)) || !requested) {
+        itf->Release();
+        return E_NOINTERFACE;
+    }
+    if (ApartmentReleaseFunction release = FindRelease(riid))
+        release(requested); // release with the correct static type
+    else
+        itf->Release(); // no type information. Objects without apartment proxies share one reference-count for all interfaces
+
+    *ppStm = new MarshalStream(CurrentApartment(), itf);
+    (*ppStm)->AddRef();
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoGetInterfaceAndReleaseStream (IStream* pStm, const IID& iid, void** ppv) {
+    using namespace apartment;
+    if (!pStm || !ppv)
+        return E_POINTER;
+    *ppv = nullptr;
+
+    MarshalStream* stream = nullptr;
+    HRESULT hr = pStm->QueryInterface(IID_MarshalStream, reinterpret_cast<void**>(&stream));
+    if (SUCCEEDED(hr)) {
+        IUnknown* itf = stream->itf;
+        stream->itf = nullptr; // can only be unmarshaled once
+        if (itf) {
+            hr = CoInternalApartmentQueryInterface(stream->apartment, itf, iid, ppv);
+            CoInternalApartmentRelease(stream->apartment, itf);
+        } else {
+            hr = E_UNEXPECTED;
+        }
+
+        stream->Release();
+    }
+    pStm->Release();
+    return hr;
+}
+
+
+__attribute__((visibility("default")))
+HRESULT CoInternalApartmentCall (IUnknown* apartment, ApartmentCall* call) {
+    using namespace apartment;
+    auto* apt = static_cast<Apartment*>(apartment);
+    if (IsDirect(apt)) {
+        call->fun(call);
+        return S_OK;
+    }
+
+    Apartment* self = (t_apartment && t_apartment->sta) ? t_apartment : nullptr;
+    Signal& signal = self ? self->signal : t_signal;
+    const bool async = call->async; // async calls might be deleted as soon as they're posted
+    if (!async)
+        call->waiter = &signal;
+
+    if (!apt->Post(call)) {
+        call->hr = RPC_E_DISCONNECTED;
+        if (async)
+            call->fun(call); // allow cleanup
+        return RPC_E_DISCONNECTED;
+    }
+    if (async)
+        return S_OK;
+
+    // wait for completion. STA threads process incoming calls meanwhile to avoid deadlocks
+    while (!call->done.load()) {
+        if (self) {
+            self->ProcessPending();
+            signal.Wait([call, self] { return call->done.load() || self->Pending(); }, INFINITE);
+        } else {
+            signal.Wait([call] { return call->done.load(); }, INFINITE);
+        }
+    }
+    std::lock_guard<std::mutex> lock(signal.mutex); // wait for Signal::Complete to finish
+    return call->hr;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoInternalApartmentQueryInterface (IUnknown* apartment, IUnknown* target, const IID& iid, void** ppv) {
+    using namespace apartment;
+    *ppv = nullptr;
+    auto* apt = static_cast<Apartment*>(apartment);
+    if (IsDirect(apt))
+        return target->QueryInterface(iid, ppv);
+
+    ApartmentProxyFactory factory = FindProxy(iid);
+    if (!factory)
+        return E_NOINTERFACE; // interface cannot be marshaled
+
+    // cast in owner apartment
+    struct QueryCall : ApartmentCall {
+        IUnknown*  target = nullptr;
+        const IID* iid = nullptr;
+        void*      result = nullptr;
+        HRESULT    qi_hr = E_FAIL;
+    };
+    QueryCall call;
+    call.target = target;
+    call.iid = &iid;
+    call.fun = [](ApartmentCall* c) {
+        auto* self = static_cast<QueryCall*>(c);
+        self->qi_hr = self->target->QueryInterface(*self->iid, &self->result);
+    };
+    HRESULT hr = CoInternalApartmentCall(apartment, &call);
+    if (FAILED(hr))
+        return hr;
+    if (FAILED(call.qi_hr))
+        return call.qi_hr;
+
+    return factory(apartment, call.result, ppv); // proxy takes over reference
+}
+
+__attribute__((visibility("default")))
+void CoInternalApartmentRelease (IUnknown* apartment, IUnknown* target) {
+    using namespace apartment;
+    auto* apt = static_cast<Apartment*>(apartment);
+    if (IsDirect(apt)) {
+        target->Release();
+        return;
+    }
+
+    // release asynchronously in owner apartment
+    struct ReleaseCall : ApartmentCall {
+        IUnknown* target = nullptr;
+    };
+    auto* call = new ReleaseCall;
+    call->async = true;
+    call->target = target;
+    call->fun = [](ApartmentCall* c) {
+        auto* self = static_cast<ReleaseCall*>(c);
+        if (SUCCEEDED(self->hr))
+            self->target->Release();
+        // leak object if the owner apartment is gone
+        delete self;
+    };
+    CoInternalApartmentCall(apartment, call);
+}
+
+__attribute__((visibility("default")))
+HRESULT CoRegisterApartmentProxy (const IID& iid, ApartmentProxyFactory factory, ApartmentReleaseFunction release) {
+    using namespace apartment;
+    if (!factory)
+        return E_POINTER;
+
+    std::lock_guard<std::mutex> lock(ProxyMutex());
+    for (auto& elm : Proxies()) {
+        if (elm.iid == iid) {
+            elm.factory = factory; // replace existing
+            elm.release = release;
+            return S_OK;
+        }
+    }
+    Proxies().push_back({iid, factory, release});
+    return S_OK;
+}
+
+
+namespace {
+namespace git {
+
+/** Table slot, padded to a cache line, so that lookups of different cookies don't contend. The control word packs a
+    generation counter (upper 32 bits) with "registered", "revoked" & "freeing" flags (bits 0-2). */
+struct alignas(64) Slot {
+    std::atomic<uint64_t> ctrl {1ull << 32};
+    IUnknown*             apartment = nullptr; ///< owner apartment. Written before setting the registered flag
+    IUnknown*             itf = nullptr;       ///< IUnknown identity of the registered object
+};
+
+static constexpr uint64_t REGISTERED = 1;
+static constexpr uint64_t REVOKED    = 2; ///< revoked, but the object is not yet released
+static constexpr uint64_t FREEING    = 4; ///< object release claimed by one thread
+
+/** Per-thread hazard pointer to the slot of an in-flight lookup. Lookups only write to their own hazard record instead
+    of pinning the slot, so that lookups of the same cookie don't contend on the slot either. Revoked objects are released
+    by the last thread that clears a hazard to the slot. Records are never freed, but reused after thread exit. */
+struct alignas(64) Hazard {
+    std::atomic<Slot*> slot {nullptr};
+    std::atomic<bool>  in_use {true};
+    Hazard*            next = nullptr;
+};
+std::atomic<Hazard*> s_hazards {nullptr};
+
+thread_local Hazard* t_hazard = nullptr;
+thread_local bool    t_exited = false;
+
+/** Returns the thread's hazard record to the pool on thread exit. */
+struct HazardHolder {
+    ~HazardHolder() {
+        if (t_hazard)
+            t_hazard->in_use.store(false);
+        t_hazard = nullptr;
+        t_exited = true;
+    }
+};
+thread_local HazardHolder t_holder;
+
+/** Claim an unused hazard record, or add a new one. */
+Hazard* ClaimHazard () {
+    for (Hazard* hazard = s_hazards.load(); hazard; hazard = hazard->next) {
+        bool in_use = false;
+        if (hazard->in_use.compare_exchange_strong(in_use, true))
+            return hazard;
+    }
+    auto* hazard = new Hazard(); // never freed
+    hazard->next = s_hazards.load();
+    while (!s_hazards.compare_exchange_weak(hazard->next, hazard)) {
+    }
+    return hazard;
+}
+
+/** Hazard record of the current thread. Lookups during thread exit occupy a record for the rest of the process lifetime. */
+Hazard* ThreadHazard () {
+    if (t_hazard)
+        return t_hazard;
+    if (!t_exited)
+        (void)&t_holder; // register thread-exit cleanup
+    return t_hazard = ClaimHazard();
+}
+
+/** Hazard record for a lookup. Lookups nested in calls that an STA thread processes while waiting on its own lookup
+    claim another record, so that the outer slot stays protected. */
+Hazard* AcquireHazard () {
+    Hazard* hazard = ThreadHazard();
+    if (!hazard->slot.load())
+        return hazard;
+    return ClaimHazard();
+}
+
+void ReleaseHazard (Hazard* hazard) {
+    hazard->slot.store(nullptr);
+    if (hazard != t_hazard)
+        hazard->in_use.store(false); // nested lookup
+}
+
+/** Returns true if an in-flight lookup references "slot". */
+bool IsHazard (const Slot* slot) {
+    for (Hazard* hazard = s_hazards.load(); hazard; hazard = hazard->next) {
+        if (hazard->slot.load() == slot)
+            return true;
+    }
+    return false;
+}
+
+/** Cookies are <generation:12><index:20>. The generation tag is never 0, so that 0 is not a valid cookie. */
+static constexpr unsigned int INDEX_BITS = 20;
+static constexpr DWORD        INDEX_MASK = (1u << INDEX_BITS) - 1;
+static constexpr uint32_t     TAG_MASK   = 0xFFF;
+static constexpr unsigned int CHUNK_BITS = 10;
+
+inline uint32_t Generation (uint64_t ctrl) {
+    return static_cast<uint32_t>(ctrl >> 32);
+}
+
+/** Handle table that is never shrunk, so that lookups can access slots without locking.
+    Slots are allocated in chunks on demand. Register & revoke serialize on a mutex for the free list. */
+class Table : public IGlobalInterfaceTable {
+public:
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if (!obj)
+            return E_POINTER;
+        if ((iid == IID_IUnknown) || (iid == IID_IGlobalInterfaceTable)) {
+            *obj = static_cast<IGlobalInterfaceTable*>(this);
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return 2; // process-wide singleton
+    }
+    ULONG Release () override {
+        return 1;
+    }
+
+    HRESULT RegisterInterfaceInGlobal (IUnknown* pUnk, const IID& riid, DWORD* pdwCookie) override {
+        if (!pUnk || !pdwCookie)
+            return E_INVALIDARG;
+        *pdwCookie = 0;
+
+        // keep the IUnknown identity, since other interfaces cannot be released without knowing their type
+        IUnknown* check = nullptr;
+        HRESULT hr = pUnk->QueryInterface(riid, reinterpret_cast<void**>(&check));
+        if (FAILED(hr))
+            return hr;
+        check->Release();
+        IUnknown* itf = nullptr;
+        hr = pUnk->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&itf));
+        if (FAILED(hr))
+            return hr;
+
+        DWORD idx = 0;
+        Slot* slot = Allocate(&idx);
+        if (!slot) {
+            itf->Release();
+            return E_OUTOFMEMORY;
+        }
+        slot->apartment = apartment::CurrentApartment();
+        slot->apartment->AddRef();
+        slot->itf = itf;
+        uint64_t ctrl = slot->ctrl.load();
+        slot->ctrl.store(ctrl | REGISTERED); // publish
+
+        *pdwCookie = ((Generation(ctrl) & TAG_MASK) << INDEX_BITS) | idx;
+        return S_OK;
+    }
+
+    HRESULT RevokeInterfaceFromGlobal (DWORD dwCookie) override {
+        Slot* slot = Find(dwCookie);
+        if (!slot)
+            return E_INVALIDARG;
+
+        uint64_t ctrl = slot->ctrl.load();
+        do {
+            if (!Matches(ctrl, dwCookie))
+                return E_INVALIDARG; // stale or already revoked
+        } while (!slot->ctrl.compare_exchange_weak(ctrl, (ctrl & ~REGISTERED) | REVOKED));
+
+        TryFree(slot, dwCookie & INDEX_MASK); // otherwise freed by the last lookup
+        return S_OK;
+    }
+
+    HRESULT GetInterfaceFromGlobal (DWORD dwCookie, const IID& riid, void** ppv) override {
+        if (!ppv)
+            return E_INVALIDARG;
+        *ppv = nullptr;
+        Slot* slot = Find(dwCookie);
+        if (!slot)
+            return E_INVALIDARG;
+
+        // publish hazard before checking the slot, so that a concurrent revoke either sees the hazard
+        // or the lookup sees the revocation. Both are sequentially consistent
+        Hazard* hazard = AcquireHazard();
+        hazard->slot.store(slot);
+        HRESULT hr = E_INVALIDARG;
+        if (Matches(slot->ctrl.load(), dwCookie))
+            hr = CoInternalApartmentQueryInterface(slot->apartment, slot->itf, riid, ppv);
+        ReleaseHazard(hazard);
+
+        if (slot->ctrl.load() & REVOKED)
+            TryFree(slot, dwCookie & INDEX_MASK); // revoked during lookup
+        return hr;
+    }
+
+private:
+    static bool Matches (uint64_t ctrl, DWORD cookie) {
+        return (ctrl & REGISTERED) && ((Generation(ctrl) & TAG_MASK) == (cookie >> INDEX_BITS));
+    }
+
+    Slot* Find (DWORD cookie) const {
+        DWORD idx = cookie & INDEX_MASK;
+        Slot* chunk = m_chunks[idx >> CHUNK_BITS].load(std::memory_order_acquire);
+        return chunk ? &chunk[idx & ((1u << CHUNK_BITS) - 1)] : nullptr;
+    }
+
+    Slot* Allocate (DWORD* idx) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free.empty()) {
+            *idx = m_free.back();
+            m_free.pop_back();
+            return Find(*idx);
+        }
+        if (m_size > INDEX_MASK)
+            return nullptr; // table full
+
+        *idx = m_size++;
+        std::atomic<Slot*>& chunk = m_chunks[*idx >> CHUNK_BITS];
+        if (!chunk.load())
+            chunk.store(new Slot[1u << CHUNK_BITS], std::memory_order_release); // never freed
+        return Find(*idx);
+    }
+
+    /** Free a revoked slot unless a lookup still references it. The revoke and each lookup that references the
+        slot afterwards call this, and only one of them claims the release. */
+    void TryFree (Slot* slot, DWORD idx) {
+        if (IsHazard(slot))
+            return; // freed by that lookup
+        uint64_t ctrl = slot->ctrl.load();
+        if ((ctrl & REVOKED) && slot->ctrl.compare_exchange_strong(ctrl, (ctrl & ~REVOKED) | FREEING))
+            Free(slot, idx);
+    }
+
+    /** Release the object and return the slot to the free list with a new generation. */
+    void Free (Slot* slot, DWORD idx) {
+        CoInternalApartmentRelease(slot->apartment, slot->itf);
+        slot->apartment->Release();
+        slot->apartment = nullptr;
+        slot->itf = nullptr;
+
+        uint32_t generation = Generation(slot->ctrl.load()) + 1;
+        if ((generation & TAG_MASK) == 0)
+            generation++; // tag 0 is reserved for the invalid cookie
+        slot->ctrl.store(static_cast<uint64_t>(generation) << 32);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(idx);
+    }
+
+    std::atomic<Slot*> m_chunks[(INDEX_MASK + 1) >> CHUNK_BITS] = {};
+    std::mutex         m_mutex;    ///< protects m_free & m_size
+    std::vector<DWORD> m_free;
+    DWORD              m_size = 0; ///< slots in use or on the free list
+};
+
+HRESULT CreateTable (IUnknown* outer, IUnknown** obj) {
+    if (outer)
+        return CLASS_E_NOAGGREGATION;
+    static Table* table = new Table(); // leaked, so that cookies stay valid during static destruction
+    *obj = table;
+    return S_OK;
+}
+
+// registered on startup like OBJECT_ENTRY_AUTO classes. The registry is constant-initialized
+__attribute__((used)) const bool s_registered = (registry::Add(CLSID_StdGlobalInterfaceTable, L"StdGlobalInterfaceTable", CreateTable, nullptr), true);
+
+} // namespace git
+} // namespace
+
+
+static std::atomic<LocalServerActivator> s_local_activator {nullptr};
+
+__attribute__((visibility("default")))
+void CoInternalSetLocalServerActivator (LocalServerActivator activator) {
+    s_local_activator = activator;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoInternalCreateLocalInstance (const GUID& clsid, IUnknown** obj) {
+    LocalServerActivator activator = s_local_activator.load();
+    if (!activator)
+        return REGDB_E_CLASSNOTREG; // Marshal.cpp not in use
+    return activator(clsid, obj);
+}
+
+
+namespace {
+namespace async {
+
+struct Task {
+    void (*fun)(void* arg) = nullptr;
+    void* arg = nullptr;
+};
+
+/** Work-stealing thread pool. Each worker pops its own queue from the back (LIFO, cache-warm)
+    and steals from the front of other queues (FIFO) when idle. Leaked, so that workers can outlive static destructors. */
+class Pool {
+public:
+    Pool () : m_count(std::max(2u, std::thread::hardware_concurrency())), m_queues(new Queue[m_count]) {
+        for (size_t idx = 0; idx < m_count; ++idx)
+            std::thread(&Pool::Run, this, idx).detach();
+    }
+
+    void Submit (Task task) {
+        // queue on current worker if called from the pool. Otherwise, distribute round-robin
+        size_t idx = (t_pool == this) ? t_worker : (m_next++ % m_count);
+        {
+            std::lock_guard<std::mutex> lock(m_queues[idx].mutex);
+            m_queues[idx].tasks.push_back(task);
+        }
+        m_pending++;
+        if (m_sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_cv.notify_one();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex       mutex;
+        std::deque<Task> tasks;
+    };
+
+    static constexpr std::chrono::seconds BIASED_QUEUE_INTERVAL {1};
+
+    void Run (size_t idx) {
+        t_pool = this;
+        t_worker = idx;
+        for (unsigned int idle = 0;; ++idle) {
+            Task task;
+            if (Pop(idx, task)) {
+                task.fun(task.arg);
+                idle = 0;
+                continue;
+            }
+            if (idle < 64) {
+                std::this_thread::yield(); // spin briefly before sleeping, since work often arrives in bursts
+                continue;
+            }
+
+            // destroy biased objects that other threads released, since workers might not touch them again.
+            // Repeated every BIASED_QUEUE_INTERVAL while sleeping
+            CComBiasedRefCount::ProcessQueue();
+
+            // sleep until work is submitted. m_pending & m_sleeping are both sequentially consistent,
+            // so that either Submit sees a sleeping worker or the worker sees the pending task
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_sleeping++;
+            m_cv.wait_for(lock, BIASED_QUEUE_INTERVAL, [this] { return m_pending.load() > 0; });
+            m_sleeping--;
+        }
+    }
+
+    /** Pop from own queue, or steal from the other queues. */
+    bool Pop (size_t idx, Task& task) {
+        {
+            Queue& own = m_queues[idx];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                m_pending--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i < m_count; ++i) {
+            Queue& other = m_queues[(idx + i) % m_count];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = other.tasks.front();
+                other.tasks.pop_front();
+                m_pending--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const size_t            m_count;
+    Queue*                  m_queues;
+    std::atomic<size_t>     m_next {0};
+    std::atomic<size_t>     m_pending {0};  ///< queued tasks
+    std::atomic<size_t>     m_sleeping {0}; ///< idle workers
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+
+    static thread_local Pool*  t_pool;
+    static thread_local size_t t_worker;
+};
+thread_local Pool*  Pool::t_pool = nullptr;
+thread_local size_t Pool::t_worker = 0;
+
+Pool& GetPool () {
+    static Pool* pool = new Pool(); // leaked
+    return *pool;
+}
+
+/** Elastic thread pool for tasks that may block, e.g. synchronous calls to out-of-process proxies. Tasks are handed to an idle
+    thread if available, and a new thread is started otherwise, up to BLOCKING_THREADS_PER_CORE threads per CPU core. Further
+    tasks are queued until a thread becomes available. Threads exit after being idle for BLOCKING_IDLE_TIMEOUT. Leaked, like Pool. */
+class BlockingPool {
+public:
+    BlockingPool () : m_max_threads(std::max(16u, BLOCKING_THREADS_PER_CORE*std::thread::hardware_concurrency())) {
+    }
+
+    /** Returns false if no thread could be started to run the task. */
+    bool Submit (Task task) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(task);
+        if (m_idle > m_tasks.size() - 1) {
+            m_cv.notify_one();
+            return true;
+        }
+        if (m_threads == m_max_threads)
+            return true; // run when a thread becomes available
+
+        try {
+            std::thread(&BlockingPool::Run, this).detach();
+        } catch (const std::system_error&) {
+            if (m_threads > 0)
+                return true; // run by an existing thread
+            m_tasks.pop_back();
+            return false;
+        }
+        m_threads++;
+        return true;
+    }
+
+private:
+    static constexpr std::chrono::seconds BLOCKING_IDLE_TIMEOUT {10};
+    static constexpr unsigned int         BLOCKING_THREADS_PER_CORE = 4;
+
+    void Run () {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_idle++;
+            bool woken = m_cv.wait_for(lock, BLOCKING_IDLE_TIMEOUT, [this] { return !m_tasks.empty(); });
+            m_idle--;
+            if (!woken) {
+                m_threads--;
+                return; // idle timeout
+            }
+
+            Task task = m_tasks.front();
+            m_tasks.pop_front();
+            lock.unlock();
+            task.fun(task.arg);
+            CComBiasedRefCount::ProcessQueue(); // see Pool::Run
+            lock.lock();
+        }
+    }
+
+    const size_t            m_max_threads;
+    std::mutex              m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Task>        m_tasks;
+    size_t                  m_idle = 0;    ///< threads waiting for tasks
+    size_t                  m_threads = 0; ///< running threads
+};
+
+BlockingPool& GetBlockingPool () {
+    static BlockingPool* pool = new BlockingPool(); // leaked
+    return *pool;
+}
+
+/** Striped wait lists for threads blocked in ISynchronize::Wait, so that call objects don't need their own mutex. */
+struct WaitSlot {
+    std::mutex              mutex;
+    std::condition_variable cv;
+};
+WaitSlot& GetWaitSlot (const void* obj) {
+    static WaitSlot* slots = new WaitSlot[64]; // leaked
+    return slots[(reinterpret_cast<uintptr_t>(obj) >> 6) % 64];
+}
+
+std::mutex& FactoryMutex () {
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+std::vector<std::pair<IID, AsyncCallFactory>>& Factories () {
+    static std::vector<std::pair<IID, AsyncCallFactory>> s_factories;
+    return s_factories;
+}
+
+} // namespace async
+} // namespace
+
+__attribute__((visibility("default")))
+HRESULT CoSubmitWork (void (*fun)(void* arg), void* arg) {
+    if (!fun)
+        return E_POINTER;
+    async::GetPool().Submit({fun, arg});
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoSubmitBlockingWork (void (*fun)(void* arg), void* arg) {
+    if (!fun)
+        return E_POINTER;
+    return async::GetBlockingPool().Submit({fun, arg}) ? S_OK : E_OUTOFMEMORY;
+}
+
+__attribute__((visibility("default")))
+HRESULT CAsyncCallState::Wait (DWORD /*dwFlags*/, DWORD dwMilliseconds) {
+    auto signaled = [this] {
+        return m_state.load() == SIGNALED;
+    };
+    if (signaled())
+        return S_OK;
+    if (m_state.load() == IDLE)
+        return RPC_E_CALL_COMPLETE; // no call to wait for
+    if (dwMilliseconds == 0)
+        return RPC_S_CALLPENDING;
+
+    // spin briefly, since short calls complete faster than a sleep & wake-up cycle
+    for (int i = 0; i < 64; ++i) {
+        std::this_thread::yield();
+        if (signaled())
+            return S_OK;
+    }
+
+    async::WaitSlot& slot = async::GetWaitSlot(this);
+    std::unique_lock<std::mutex> lock(slot.mutex);
+    if (dwMilliseconds == INFINITE) {
+        slot.cv.wait(lock, signaled);
+        return S_OK;
+    }
+    return slot.cv.wait_for(lock, std::chrono::milliseconds(dwMilliseconds), signaled) ? S_OK : RPC_S_CALLPENDING;
+}
+
+__attribute__((visibility("default")))
+HRESULT CAsyncCallState::Signal () {
+    ULONG prev = m_state.exchange(SIGNALED);
+    if (prev == NOTIFY)
+        CoSubmitWork(m_notify_fun, m_notify_arg);
+
+    async::WaitSlot& slot = async::GetWaitSlot(this);
+    std::lock_guard<std::mutex> lock(slot.mutex); // don't signal between predicate check & sleep of a waiter
+    slot.cv.notify_all();
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CAsyncCallState::Reset () {
+    m_state = IDLE;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CAsyncCallState::Notify (void (*fun)(void* arg), void* arg) {
+    if (!fun)
+        return E_POINTER;
+
+    m_notify_fun = fun;
+    m_notify_arg = arg;
+    ULONG state = PENDING;
+    if (m_state.compare_exchange_strong(state, NOTIFY))
+        return S_OK; // Signal will submit notification
+    if (state == SIGNALED)
+        return CoSubmitWork(fun, arg); // already completed
+    return E_UNEXPECTED;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoRegisterAsyncCall (const IID& async_iid, AsyncCallFactory factory) {
+    if (!factory)
+        return E_POINTER;
+
+    std::lock_guard<std::mutex> lock(async::FactoryMutex());
+    for (auto& elm : async::Factories()) {
+        if (elm.first == async_iid) {
+            elm.second = factory; // replace existing
+            return S_OK;
+        }
+    }
+    async::Factories().push_back({async_iid, factory});
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoCreateAsyncCall (IUnknown* server, const IID& async_iid, IUnknown** call) {
+    if (!server || !call)
+        return E_POINTER;
+    *call = nullptr;
+
+    // server-provided call objects
+    ATL::CComPtr<ICallFactory> call_factory;
+    if (SUCCEEDED(server->QueryInterface(IID_ICallFactory, reinterpret_cast<void**>(&call_factory)))) {
+        HRESULT hr = call_factory->CreateCall(async_iid, nullptr, IID_IUnknown, call);
+        if (hr != E_NOINTERFACE)
+            return hr;
+    }
+
+    AsyncCallFactory factory = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(async::FactoryMutex());
+        for (auto& elm : async::Factories()) {
+            if (elm.first == async_iid)
+                factory = elm.second;
+        }
+    }
+    if (!factory)
+        return E_NOINTERFACE;
+    return factory(server, call);
+}
+
+
+namespace {
+namespace connections {
+
+/** Striped writer locks, so that connection lists don't need their own mutex. */
+std::mutex& WriterMutex (const void* list) {
+    static std::mutex* mutexes = new std::mutex[16]; // leaked
+    return mutexes[(reinterpret_cast<uintptr_t>(list) >> 6) % 16];
+}
+
+/** Snapshot with a reference to each sink. Entries shall be filled in by the caller. */
+CComConnectionList::Snapshot* NewSnapshot (ULONG count) {
+    auto* snapshot = new CComConnectionList::Snapshot;
+    snapshot->refs = 1;
+    snapshot->count = count;
+    snapshot->entries = new CComConnectionList::Entry[count];
+    return snapshot;
+}
+
+void AddRef (const CComConnectionList::Entry& entry) {
+    if (entry.unk)
+        entry.unk->AddRef();
+    else
+        entry.weak->AddRef();
+}
+
+/** Weakly-held sinks are dead when they can no longer be upgraded. The upgraded reference of a live sink is appended
+    to "probes" instead of being released, since it might be the last one, and sinks might (un)advise from their destructor.
+    The caller shall release them with ReleaseAll after unlocking. */
+bool IsDead (const CComConnectionList::Entry& entry, std::vector<IUnknown*>& probes) {
+    if (!entry.weak)
+        return false;
+    IUnknown* obj = nullptr;
+    if (FAILED(entry.weak->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&obj))))
+        return true;
+    probes.push_back(obj);
+    return false;
+}
+
+void ReleaseAll (const std::vector<IUnknown*>& probes) {
+    for (IUnknown* obj : probes)
+        obj->Release();
+}
+
+/** Enumerator holding a reference to an immutable snapshot. */
+class EnumConnections : public IEnumConnections {
+public:
+    EnumConnections (CComConnectionList::Snapshot* snapshot, ULONG pos) : m_snapshot(snapshot), m_pos(pos) {
+    }
+    ~EnumConnections () override {
+        CComConnectionList::Release(m_snapshot);
+    }
+
+    HRESULT QueryInterface (const IID& iid, void** obj) override {
+        if (!obj)
+            return E_POINTER;
+        if (!(iid == IID_IUnknown) && !(iid == IID_IEnumConnections)) {
+            *obj = nullptr;
+            return E_NOINTERFACE;
+        }
+        *obj = static_cast<IEnumConnections*>(this);
+        AddRef();
+        return S_OK;
+    }
+    ULONG AddRef () override {
+        return ++m_refs;
+    }
+    ULONG Release () override {
+        ULONG refs = --m_refs;
+        if (!refs)
+            delete this;
+        return refs;
+    }
+
+    /** Dead weakly-held sinks are skipped. */
+    HRESULT Next (ULONG cConnections, CONNECTDATA* rgcd, ULONG* pcFetched) override {
+        if (!rgcd || (!pcFetched && (cConnections != 1)))
+            return E_POINTER;
+
+        ULONG fetched = 0;
+        while ((fetched < cConnections) && m_snapshot && (m_pos < m_snapshot->count)) {
+            const CComConnectionList::Entry& entry = m_snapshot->entries[m_pos++];
+            IUnknown* unk = entry.unk;
+            if (unk)
+                unk->AddRef();
+            else if (FAILED(entry.weak->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&unk))))
+                continue;
+            rgcd[fetched].pUnk = unk;
+            rgcd[fetched].dwCookie = entry.cookie;
+            fetched++;
+        }
+        if (pcFetched)
+            *pcFetched = fetched;
+        return (fetched == cConnections) ? S_OK : S_FALSE;
+    }
+    HRESULT Skip (ULONG cConnections) override {
+        ULONG count = m_snapshot ? m_snapshot->count : 0;
+        if (cConnections > count - m_pos) {
+            m_pos = count;
+            return S_FALSE;
+        }
+        m_pos += cConnections;
+        return S_OK;
+    }
+    HRESULT Reset () override {
+        m_pos = 0;
+        return S_OK;
+    }
+    HRESULT Clone (IEnumConnections** ppEnum) override {
+        if (!ppEnum)
+            return E_POINTER;
+        if (m_snapshot)
+            m_snapshot->refs++;
+        *ppEnum = new EnumConnections(m_snapshot, m_pos);
+        return S_OK;
+    }
+
+private:
+    std::atomic<ULONG>            m_refs {1};
+    CComConnectionList::Snapshot* m_snapshot = nullptr; ///< nullptr if empty
+    ULONG                         m_pos = 0;
+};
+
+} // namespace connections
+} // namespace
+
+__attribute__((visibility("default")))
+CComConnectionList::~CComConnectionList () {
+    Release(m_current.exchange(nullptr));
+}
+
+__attribute__((visibility("default")))
+HRESULT CComConnectionList::Add (void* sink, IUnknown* unk, DWORD* cookie) {
+    if (!sink || !unk || !cookie)
+        return E_POINTER;
+
+    Entry entry = {sink, unk, nullptr, 0};
+    if (SUCCEEDED(unk->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&entry.weak)))) {
+        // hold sink weakly, so that the connection doesn't keep it alive
+        unk->Release();
+        entry.sink = nullptr;
+        entry.unk = nullptr;
+    }
+
+    std::vector<IUnknown*> probes;
+    std::unique_lock<std::mutex> lock(connections::WriterMutex(this));
+    entry.cookie = ++m_next_cookie;
+    if (!entry.cookie)
+        entry.cookie = ++m_next_cookie; // 0 is not a valid cookie
+
+    // copy live entries, so that dead weakly-held sinks don't accumulate
+    Snapshot* cur = m_current.load();
+    ULONG count = cur ? cur->count : 0;
+    Snapshot* next = connections::NewSnapshot(count + 1);
+    ULONG live = 0;
+    for (ULONG i = 0; i < count; ++i) {
+        if (connections::IsDead(cur->entries[i], probes))
+            continue;
+        next->entries[live] = cur->entries[i];
+        connections::AddRef(next->entries[live]);
+        live++;
+    }
+    next->entries[live++] = entry; // takes over reference from caller
+    next->count = live;
+
+    Snapshot* prev = Publish(next);
+    lock.unlock();
+    Release(prev); // might release dead sinks
+    connections::ReleaseAll(probes);
+    *cookie = entry.cookie;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComConnectionList::Remove (DWORD cookie) {
+    std::vector<IUnknown*> probes;
+    std::unique_lock<std::mutex> lock(connections::WriterMutex(this));
+    Snapshot* cur = m_current.load();
+    ULONG count = cur ? cur->count : 0;
+    ULONG idx = 0;
+    while ((idx < count) && (cur->entries[idx].cookie != cookie))
+        ++idx;
+    if (idx == count)
+        return CONNECT_E_NOCONNECTION;
+
+    Snapshot* next = nullptr;
+    if (count > 1) {
+        next = connections::NewSnapshot(count - 1);
+        ULONG live = 0;
+        for (ULONG i = 0; i < count; ++i) {
+            if ((i == idx) || connections::IsDead(cur->entries[i], probes))
+                continue;
+            next->entries[live] = cur->entries[i];
+            connections::AddRef(next->entries[live]);
+            live++;
+        }
+        next->count = live;
+    }
+
+    Snapshot* prev = Publish(next);
+    lock.unlock();
+    Release(prev); // sink is released together with the last snapshot referencing it
+    connections::ReleaseAll(probes);
+    return S_OK;
+}
+
+/** Replace the current snapshot & return the previous one after a grace period, so that concurrent Acquire calls
+    either see the new snapshot or have already referenced the previous one. Caller must hold the writer lock,
+    and release the previous snapshot after unlocking, since sinks might (un)advise from their destructor. */
+CComConnectionList::Snapshot* CComConnectionList::Publish (Snapshot* next) {
+    Snapshot* prev = m_current.exchange(next);
+    if (!prev)
+        return nullptr;
+
+    // drain both reader counters, each while new readers use the other (see registry::Synchronize)
+    for (int phase = 0; phase < 2; ++phase) {
+        ULONG idx = m_epoch.fetch_add(1) & 1;
+        while (m_readers[idx].load() != 0)
+            std::this_thread::yield();
+    }
+    return prev;
+}
+
+__attribute__((visibility("default")))
+CComConnectionList::Snapshot* CComConnectionList::Acquire () {
+    ULONG idx = m_epoch.load() & 1;
+    m_readers[idx]++;
+    Snapshot* snapshot = m_current.load();
+    if (snapshot)
+        snapshot->refs++;
+    m_readers[idx]--;
+    return snapshot;
+}
+
+__attribute__((visibility("default")))
+void CComConnectionList::Release (Snapshot* snapshot) {
+    if (!snapshot || --snapshot->refs)
+        return;
+
+    for (ULONG i = 0; i < snapshot->count; ++i) {
+        const Entry& entry = snapshot->entries[i];
+        if (entry.unk)
+            entry.unk->Release();
+        else
+            entry.weak->Release();
+    }
+    delete [] snapshot->entries;
+    delete snapshot;
+}
+
+__attribute__((visibility("default")))
+HRESULT CComConnectionList::Enumerate (IEnumConnections** ppEnum) {
+    if (!ppEnum)
+        return E_POINTER;
+    *ppEnum = new connections::EnumConnections(Acquire(), 0);
+    return S_OK;
+}
+
+
+namespace {
+namespace catalog {
+
+struct Entry {
+    GUID             clsid {};
+    std::string_view prog_id; ///< points into the memory-mapped file
+    std::string_view library;
+};
+
+/** Memory-mapped class catalog. Kept until process exit, since the index refers to the mapping. */
+struct Catalog {
+    std::string        directory; ///< for resolving relative library paths
+    std::vector<Entry> by_clsid;  ///< sorted by CLSID
+    std::vector<Entry> by_prog_id;
+};
+
+std::recursive_mutex                   s_mutex;  ///< recursive, since static initializers in a loaded library might activate classes
+std::vector<Catalog*>                  s_catalogs;
+std::atomic<bool>                      s_active {false}; ///< skip locking if no catalog is registered
+std::unordered_map<std::string, void*> s_libraries;      ///< libraries loaded through the catalog, by path
+
+/** Parse "{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}" string. */
+bool ParseGuid (std::string_view str, GUID& guid) {
+    if ((str.size() != 38) || (str.front() != '{') || (str.back() != '}'))
+        return false;
+
+    char buffer[39] = {};
+    str.copy(buffer, str.size());
+    unsigned int data2 = 0, data3 = 0, data4[8] = {};
+    int fields = sscanf(buffer, "{%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x}", &guid.Data1, &data2, &data3,
+        &data4[0], &data4[1], &data4[2], &data4[3], &data4[4], &data4[5], &data4[6], &data4[7]);
+    if (fields != 11)
+        return false;
+
+    guid.Data2 = static_cast<unsigned short>(data2);
+    guid.Data3 = static_cast<unsigned short>(data3);
+    for (int i = 0; i < 8; ++i)
+        guid.Data4[i] = static_cast<unsigned char>(data4[i]);
+    return true;
+}
+
+/** Split off the next whitespace-separated token. */
+std::string_view NextToken (std::string_view& line) {
+    size_t begin = line.find_first_not_of(" \t\r");
+    if (begin == std::string_view::npos) {
+        line = {};
+        return {};
+    }
+    size_t end = line.find_first_of(" \t\r", begin);
+    std::string_view token = line.substr(begin, end - begin);
+    line = (end == std::string_view::npos) ? std::string_view() : line.substr(end);
+    return token;
+}
+
+/** Look up the library for a class. Caller must hold s_mutex. */
+const Entry* Find (const Catalog& catalog, const GUID* clsid, const std::string& prog_id) {
+    if (clsid) {
+        auto it = std::lower_bound(catalog.by_clsid.begin(), catalog.by_clsid.end(), *clsid, [](const Entry& e, const GUID& val) {
+            return e.clsid < val;
+        });
+        if ((it != catalog.by_clsid.end()) && (it->clsid == *clsid))
+            return &*it;
+    } else {
+        auto it = std::lower_bound(catalog.by_prog_id.begin(), catalog.by_prog_id.end(), prog_id, [](const Entry& e, const std::string& val) {
+            return e.prog_id < val;
+        });
+        if ((it != catalog.by_prog_id.end()) && (it->prog_id == prog_id))
+            return &*it;
+    }
+    return nullptr;
+}
+
+/** Drop the reference to a library loaded through the catalog, given the path of any of its modules. */
+void Evict (const char* module) {
+#ifdef HAVE_DLFCN
+    if (!s_active || !module)
+        return;
+    void* handle = dlopen(module, RTLD_NOW | RTLD_NOLOAD); // same handle as the catalog's if it's the same library
+    if (!handle)
+        return;
+
+    std::lock_guard<std::recursive_mutex> lock(s_mutex);
+    for (auto it = s_libraries.begin(); it != s_libraries.end(); ++it) {
+        if (it->second == handle) {
+            dlclose(it->second);
+            s_libraries.erase(it);
+            break;
+        }
+    }
+    dlclose(handle);
+#else
+    (void)module;
+#endif
+}
+
+} // namespace catalog
+} // namespace
+
+
+__attribute__((visibility("default")))
+HRESULT CoRegisterClassCatalog (const char* filename) {
+    if (!filename)
+        return E_INVALIDARG;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return E_INVALIDARG;
+    struct stat info = {};
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return E_FAIL;
+    }
+    const char* data = "";
+    if (info.st_size > 0) {
+        void* ptr = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            return E_OUTOFMEMORY;
+        }
+        data = static_cast<const char*>(ptr);
+    }
+    close(fd); // mapping stays valid
+
+    auto* catalog = new catalog::Catalog();
+    std::string_view dir(filename);
+    size_t slash = dir.rfind('/');
+    catalog->directory = (slash == std::string_view::npos) ? "." : std::string(dir.substr(0, slash));
+
+    std::string_view content(data, info.st_size);
+    while (!content.empty()) {
+        size_t eol = content.find('\n');
+        std::string_view line = content.substr(0, eol);
+        content = (eol == std::string_view::npos) ? std::string_view() : content.substr(eol + 1);
+
+        std::string_view clsid = catalog::NextToken(line);
+        if (clsid.empty() || (clsid.front() == '#'))
+            continue;
+        catalog::Entry entry;
+        entry.prog_id = catalog::NextToken(line);
+        entry.library = catalog::NextToken(line);
+        if (!catalog::ParseGuid(clsid, entry.clsid) || entry.library.empty()) {
+            fprintf(stderr, "CoRegisterClassCatalog: Skipping malformed line \"%.*s\" in %s\n", static_cast<int>(clsid.size()), clsid.data(), filename);
+            continue;
+        }
+        if (entry.prog_id == "-")
+            entry.prog_id = {};
+
+        catalog->by_clsid.push_back(entry);
+        if (!entry.prog_id.empty())
+            catalog->by_prog_id.push_back(entry);
+    }
+    std::sort(catalog->by_clsid.begin(), catalog->by_clsid.end(), [](const catalog::Entry& a, const catalog::Entry& b) {
+        return a.clsid < b.clsid;
+    });
+    std::sort(catalog->by_prog_id.begin(), catalog->by_prog_id.end(), [](const catalog::Entry& a, const catalog::Entry& b) {
+        return a.prog_id < b.prog_id;
+    });
+
+    std::lock_guard<std::recursive_mutex> lock(catalog::s_mutex);
+    catalog::s_catalogs.push_back(catalog);
+    catalog::s_active = true;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT CoInternalLoadClassLibrary (const GUID* clsid, const wchar_t* prog_id, DWORD context) {
+    if (!catalog::s_active)
+        return S_FALSE;
+
+    std::string narrow_prog_id;
+    if (prog_id) {
+        for (const wchar_t* ch = prog_id; *ch; ++ch)
+            narrow_prog_id += static_cast<char>(*ch); // ProgIDs are ASCII
+    }
+
+    std::lock_guard<std::recursive_mutex> lock(catalog::s_mutex);
+    for (const catalog::Catalog* cat : catalog::s_catalogs) {
+        const catalog::Entry* entry = catalog::Find(*cat, clsid, narrow_prog_id);
+        if (!entry)
+            continue;
+
+        std::string path(entry->library);
+        if (path.front() != '/')
+            path = cat->directory + '/' + path;
+        if (catalog::s_libraries.count(path))
+            return S_OK; // already loaded
+
+#ifdef HAVE_DLFCN
+        // OBJECT_ENTRY_AUTO classes in the library are registered on the retried lookup
+        void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!library) {
+            const char* error = dlerror();
+            if (!(context & CLSCTX_NO_FAILURE_LOG))
+                fprintf(stderr, "CoCreateInstance error: %s\n", error);
+            return E_FAIL;
+        }
+        catalog::s_libraries[path] = library; // kept loaded until revoked with CoRevokeModuleClasses
+        return S_OK;
+#else
+        return E_NOTIMPL;
+#endif
+    }
+    return S_FALSE;
+}
+
+__attribute__((visibility("default")))
+HRESULT CLSIDFromProgID (const wchar_t* prog_id, GUID* clsid) {
+    if (!prog_id || !clsid)
+        return E_INVALIDARG;
+
+    if (IUnknownFactory::FindClassId(IUnknownFactory::ComponentName(prog_id).c_str(), *clsid))
+        return S_OK;
+
+    if (catalog::s_active) {
+        std::string narrow_prog_id;
+        for (const wchar_t* ch = prog_id; *ch; ++ch)
+            narrow_prog_id += static_cast<char>(*ch); // ProgIDs are ASCII
+
+        std::lock_guard<std::recursive_mutex> lock(catalog::s_mutex);
+        for (const catalog::Catalog* cat : catalog::s_catalogs) {
+            if (const catalog::Entry* entry = catalog::Find(*cat, nullptr, narrow_prog_id)) {
+                *clsid = entry->clsid;
+                return S_OK;
+            }
+        }
+    }
+    return REGDB_E_CLASSNOTREG;
+}
+
+
+namespace {
+
+/** Numeric VARIANT content widened to 64bit. */
+struct VariantNumber {
+    enum KIND {
+        SIGNED,
+        UNSIGNED,
+        REAL,
+    };
+    KIND      kind = SIGNED;
+    LONGLONG  i = 0;
+    ULONGLONG u = 0;
+    double    d = 0;
+};
+
+/** Widen numeric (or VT_EMPTY) content. Returns false for other types. */
+bool ReadNumber (const VARIANT& v, VariantNumber& n) {
+    n = VariantNumber();
+    switch (v.vt) {
+    case VT_EMPTY: n.i = 0;         return true;
+    case VT_I1:    n.i = v.cVal;    return true;
+    case VT_I2:    n.i = v.iVal;    return true;
+    case VT_I4:    n.i = v.lVal;    return true;
+    case VT_I8:    n.i = v.llVal;   return true;
+    case VT_INT:   n.i = v.intVal;  return true;
+    case VT_BOOL:  n.i = v.boolVal; return true;
+    case VT_UI1:   n.kind = VariantNumber::UNSIGNED; n.u = v.bVal;    return true;
+    case VT_UI2:   n.kind = VariantNumber::UNSIGNED; n.u = v.uiVal;   return true;
+    case VT_UI4:   n.kind = VariantNumber::UNSIGNED; n.u = v.ulVal;   return true;
+    case VT_UI8:   n.kind = VariantNumber::UNSIGNED; n.u = v.ullVal;  return true;
+    case VT_UINT:  n.kind = VariantNumber::UNSIGNED; n.u = v.uintVal; return true;
+    case VT_R4:    n.kind = VariantNumber::REAL;     n.d = v.fltVal;  return true;
+    case VT_R8:    n.kind = VariantNumber::REAL;     n.d = v.dblVal;  return true;
+    default:
+        return false;
+    }
+}
+
+/** Range-checked narrowing. Real numbers are rounded half to even like on Windows. */
+template <class T>
+HRESULT NarrowNumber (const VariantNumber& n, T& out) {
+    if constexpr (std::is_floating_point<T>::value) {
+        double d = (n.kind == VariantNumber::SIGNED) ? static_cast<double>(n.i) : (n.kind == VariantNumber::UNSIGNED) ? static_cast<double>(n.u) : n.d;
+        if (std::isfinite(d) && (std::fabs(d) > static_cast<double>(std::numeric_limits<T>::max())))
+            return DISP_E_OVERFLOW;
+        out = static_cast<T>(d);
+    } else {
+        typedef std::numeric_limits<T> limits;
+        if (n.kind == VariantNumber::REAL) {
+            // compare against powers of two, since the integer limits aren't exactly representable as double
+            double r = std::nearbyint(n.d);
+            double hi = std::ldexp(1.0, limits::digits);
+            double lo = limits::is_signed ? -hi : 0.0;
+            if (!((r >= lo) && (r < hi)))
+                return DISP_E_OVERFLOW;
+            out = static_cast<T>(r);
+        } else if (n.kind == VariantNumber::SIGNED) {
+            if (limits::is_signed ? ((n.i < static_cast<LONGLONG>(limits::min())) || (n.i > static_cast<LONGLONG>(limits::max())))
+                                  : ((n.i < 0) || (static_cast<ULONGLONG>(n.i) > static_cast<ULONGLONG>(limits::max()))))
+                return DISP_E_OVERFLOW;
+            out = static_cast<T>(n.i);
+        } else {
+            if (n.u > static_cast<ULONGLONG>(limits::max()))
+                return DISP_E_OVERFLOW;
+            out = static_cast<T>(n.u);
+        }
+    }
+    return S_OK;
+}
+
+/** Shallow (non-owning) copy of VT_BYREF content. Returns false for unsupported types. */
+bool Dereference (const VARIANT& src, VARIANT& out) {
+    VariantInit(&out);
+    if (!src.byref)
+        return false;
+
+    VARTYPE vt = src.vt & ~VT_BYREF;
+    if (vt == VT_VARIANT) {
+        out = *src.pvarVal;
+        return !(out.vt & VT_BYREF);
+    }
+    out.vt = vt;
+    if (vt & VT_ARRAY) {
+        out.parray = *static_cast<SAFEARRAY**>(src.byref);
+        return true;
+    }
+    switch (vt) {
+    case VT_I1:       out.cVal     = *static_cast<char*>(src.byref);          return true;
+    case VT_UI1:      out.bVal     = *static_cast<BYTE*>(src.byref);          return true;
+    case VT_I2:       out.iVal     = *static_cast<short*>(src.byref);         return true;
+    case VT_UI2:      out.uiVal    = *static_cast<USHORT*>(src.byref);        return true;
+    case VT_I4:       out.lVal     = *static_cast<LONG*>(src.byref);          return true;
+    case VT_UI4:      out.ulVal    = *static_cast<ULONG*>(src.byref);         return true;
+    case VT_I8:       out.llVal    = *static_cast<LONGLONG*>(src.byref);      return true;
+    case VT_UI8:      out.ullVal   = *static_cast<ULONGLONG*>(src.byref);     return true;
+    case VT_INT:      out.intVal   = *static_cast<int*>(src.byref);           return true;
+    case VT_UINT:     out.uintVal  = *static_cast<unsigned int*>(src.byref);  return true;
+    case VT_R4:       out.fltVal   = *static_cast<float*>(src.byref);         return true;
+    case VT_R8:       out.dblVal   = *static_cast<double*>(src.byref);        return true;
+    case VT_BOOL:     out.boolVal  = *static_cast<VARIANT_BOOL*>(src.byref);  return true;
+    case VT_ERROR:    out.scode    = *static_cast<LONG*>(src.byref);          return true;
+    case VT_BSTR:     out.bstrVal  = *static_cast<BSTR*>(src.byref);          return true;
+    case VT_UNKNOWN:  out.punkVal  = *static_cast<IUnknown**>(src.byref);     return true;
+    case VT_DISPATCH: out.pdispVal = *static_cast<IDispatch**>(src.byref);    return true;
+    default:
+        out.vt = VT_EMPTY;
+        return false;
+    }
+}
+
+/** Owning copy of VARIANT content with the same type. */
+HRESULT CopyVariant (const VARIANT& src, VARIANT& out) {
+    out = src;
+    if (src.vt & VT_BYREF)
+        return S_OK; // not owned
+    if (src.vt & VT_ARRAY)
+        return SafeArrayCopy(src.parray, &out.parray);
+
+    switch (src.vt) {
+    case VT_BSTR:
+        if (src.bstrVal) {
+            out.bstrVal = SysAllocStringLen(src.bstrVal, SysStringLen(src.bstrVal));
+            if (!out.bstrVal) {
+                out.vt = VT_EMPTY;
+                return E_OUTOFMEMORY;
+            }
+        }
+        return S_OK;
+    case VT_UNKNOWN:
+        if (src.punkVal)
+            src.punkVal->AddRef();
+        return S_OK;
+    case VT_DISPATCH:
+        if (src.pdispVal)
+            src.pdispVal->AddRef();
+        return S_OK;
+    default:
+        return S_OK;
+    }
+}
+
+bool IsSpace (wchar_t c) {
+    return (c == L' ') || (c == L'\t') || (c == L'\n') || (c == L'\r');
+}
+
+/** Parse decimal number or "True"/"False" string with optional surrounding whitespace. Returns false on invalid input. */
+bool ParseNumber (const wchar_t* str, VariantNumber& n) {
+    n = VariantNumber();
+    if (!str)
+        return false;
+    while (IsSpace(*str))
+        ++str;
+    const wchar_t* end = str + wcslen(str);
+    while ((end > str) && IsSpace(end[-1]))
+        --end;
+    if (end == str)
+        return false;
+
+    std::wstring tmp(str, end); // null-terminated copy without trailing whitespace
+    if (wcscasecmp(tmp.c_str(), L"true") == 0) {
+        n.i = VARIANT_TRUE;
+        return true;
+    } else if (wcscasecmp(tmp.c_str(), L"false") == 0) {
+        n.i = VARIANT_FALSE;
+        return true;
+    }
+
+    // prefer exact integer parsing to preserve 64bit precision
+    wchar_t* last = nullptr;
+    errno = 0;
+    n.i = wcstoll(tmp.c_str(), &last, 10);
+    if (!*last && (errno == 0))
+        return true;
+    if ((tmp[0] != L'-') && (errno == ERANGE)) {
+        errno = 0;
+        n.u = wcstoull(tmp.c_str(), &last, 10);
+        if (!*last && (errno == 0)) {
+            n.kind = VariantNumber::UNSIGNED;
+            return true;
+        }
+    }
+    n.kind = VariantNumber::REAL;
+    n.d = wcstod(tmp.c_str(), &last);
+    return !*last;
+}
+
+/** Format numeric VARIANT content. Floating-point values use 7 (VT_R4) or 15 (VT_R8) significant digits like on Windows. */
+BSTR FormatNumber (const VARIANT& src, const VariantNumber& n, USHORT flags) {
+    wchar_t buffer[64] = {};
+    if ((src.vt == VT_BOOL) && (flags & VARIANT_ALPHABOOL))
+        return SysAllocString(src.boolVal ? L"True" : L"False");
+    else if (src.vt == VT_EMPTY)
+        return SysAllocString(L"");
+    else if (n.kind == VariantNumber::SIGNED)
+        swprintf(buffer, 64, L"%lld", n.i);
+    else if (n.kind == VariantNumber::UNSIGNED)
+        swprintf(buffer, 64, L"%llu", n.u);
+    else
+        swprintf(buffer, 64, (src.vt == VT_R4) ? L"%.7G" : L"%.15G", n.d);
+    return SysAllocString(buffer);
+}
+
+template <class T>
+HRESULT NarrowInto (const VariantNumber& n, VARTYPE vt, T& member, VARIANT& out) {
+    HRESULT hr = NarrowNumber(n, member);
+    if (SUCCEEDED(hr))
+        out.vt = vt;
+    return hr;
+}
+
+} // namespace
+
+
+__attribute__((visibility("default")))
+void VariantInit (VARIANT* pvarg) {
+    pvarg->vt = VT_EMPTY;
+    pvarg->wReserved1 = 0;
+    pvarg->wReserved2 = 0;
+    pvarg->wReserved3 = 0;
+    pvarg->brecVal.pvRecord = nullptr;
+    pvarg->brecVal.pRecInfo = nullptr;
+}
+
+__attribute__((visibility("default")))
+HRESULT VariantClear (VARIANT* pvarg) {
+    if (!pvarg)
+        return E_POINTER;
+
+    if (pvarg->vt & VT_BYREF) {
+        // not owned
+    } else if (pvarg->vt & VT_ARRAY) {
+        SafeArrayDestroy(pvarg->parray);
+    } else {
+        switch (pvarg->vt) {
+        case VT_BSTR:
+            SysFreeString(pvarg->bstrVal);
+            break;
+        case VT_UNKNOWN:
+            if (pvarg->punkVal)
+                pvarg->punkVal->Release();
+            break;
+        case VT_DISPATCH:
+            if (pvarg->pdispVal)
+                pvarg->pdispVal->Release();
+            break;
+        default:
+            break;
+        }
+    }
+    VariantInit(pvarg);
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT VariantCopy (VARIANT* pvargDest, const VARIANT* pvargSrc) {
+    if (!pvargDest || !pvargSrc)
+        return E_POINTER;
+    if (pvargDest == pvargSrc)
+        return S_OK;
+
+    VARIANT tmp;
+    HRESULT hr = CopyVariant(*pvargSrc, tmp);
+    if (FAILED(hr))
+        return hr;
+    VariantClear(pvargDest);
+    *pvargDest = tmp;
+    return S_OK;
+}
+
+__attribute__((visibility("default")))
+HRESULT VariantChangeType (VARIANT* pvargDest, const VARIANT* pvarSrc, USHORT wFlags, VARTYPE vt) {
+    if (!pvargDest || !pvarSrc)
+        return E_POINTER;
+
+    VARIANT src = *pvarSrc; // non-owning
+    if ((src.vt & VT_BYREF) && !Dereference(*pvarSrc, src))
+        return DISP_E_BADVARTYPE;
+
+    // convert into temporary, since pvargDest & pvarSrc might alias
+    VARIANT tmp;
+    VariantInit(&tmp);
+    HRESULT hr = S_OK;
+    VariantNumber n;
+    if (src.vt == vt) {
+        hr = CopyVariant(src, tmp);
+    } else if ((vt == VT_UNKNOWN) && (src.vt == VT_DISPATCH)) {
+        tmp.vt = VT_UNKNOWN;
+        tmp.punkVal = src.pdispVal;
+        if (tmp.punkVal)
+            tmp.punkVal->AddRef();
+    } else if ((vt == VT_DISPATCH) && (src.vt == VT_UNKNOWN)) {
+        tmp.vt = VT_DISPATCH;
+        tmp.pdispVal = nullptr;
+        if (src.punkVal && FAILED(src.punkVal->QueryInterface(IID_IDispatch, reinterpret_cast<void**>(&tmp.pdispVal))))
+            hr = DISP_E_TYPEMISMATCH;
+    } else if (vt == VT_EMPTY) {
+        // cleared
+    } else if ((src.vt & VT_ARRAY) && (vt & VT_ARRAY)) {
+        tmp.parray = nullptr;
+        if (src.parray)
+            hr = SafeArrayChangeType(src.parray, vt & VT_TYPEMASK, &tmp.parray);
+        if (SUCCEEDED(hr))
+            tmp.vt = vt;
+        else if (hr == DISP_E_BADVARTYPE)
+            hr = DISP_E_TYPEMISMATCH;
+    } else if ((src.vt == VT_BSTR) ? !ParseNumber(src.bstrVal, n) : !ReadNumber(src, n)) {
+        hr = DISP_E_TYPEMISMATCH;
+    } else {
+        switch (vt) {
+        case VT_I1:   hr = NarrowInto(n, vt, tmp.cVal, tmp);    break;
+        case VT_UI1:  hr = NarrowInto(n, vt, tmp.bVal, tmp);    break;
+        case VT_I2:   hr = NarrowInto(n, vt, tmp.iVal, tmp);    break;
+        case VT_UI2:  hr = NarrowInto(n, vt, tmp.uiVal, tmp);   break;
+        case VT_I4:   hr = NarrowInto(n, vt, tmp.lVal, tmp);    break;
+        case VT_UI4:  hr = NarrowInto(n, vt, tmp.ulVal, tmp);   break;
+        case VT_I8:   hr = NarrowInto(n, vt, tmp.llVal, tmp);   break;
+        case VT_UI8:  hr = NarrowInto(n, vt, tmp.ullVal, tmp);  break;
+        case VT_INT:  hr = NarrowInto(n, vt, tmp.intVal, tmp);  break;
+        case VT_UINT: hr = NarrowInto(n, vt, tmp.uintVal, tmp); break;
+        case VT_R4:   hr = NarrowInto(n, vt, tmp.fltVal, tmp);  break;
+        case VT_R8:   hr = NarrowInto(n, vt, tmp.dblVal, tmp);  break;
+        case VT_BOOL:
+            tmp.vt = VT_BOOL;
+            tmp.boolVal = ((n.kind == VariantNumber::REAL) ? (n.d != 0) : (n.i != 0) || (n.u != 0)) ? VARIANT_TRUE : VARIANT_FALSE;
+            break;
+        case VT_BSTR:
+            tmp.bstrVal = FormatNumber(src, n, wFlags);
+            if (tmp.bstrVal)
+                tmp.vt = VT_BSTR;
+            else
+                hr = E_OUTOFMEMORY;
+            break;
+        default:
+            hr = DISP_E_TYPEMISMATCH;
+            break;
+        }
+    }
+    if (FAILED(hr)) {
+        VariantClear(&tmp);
+        return hr;
+    }
+
+    VariantClear(pvargDest);
+    *pvargDest = tmp;
+    return S_OK;
+}
+
+
+namespace {
+namespace convert {
+
+/** Scalar conversion with the same rules as VariantChangeType. Used for tails & on targets without SIMD kernels. */
+template <class S, class D>
+HRESULT ConvertScalar (const S* src, D* dst, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        VariantNumber n;
+        if constexpr (std::is_floating_point<S>::value) {
+            n.kind = VariantNumber::REAL;
+            n.d = src[i];
+        } else if constexpr (std::is_signed<S>::value) {
+            n.i = src[i];
+        } else {
+            n.kind = VariantNumber::UNSIGNED;
+            n.u = src[i];
+        }
+        HRESULT hr = NarrowNumber(n, dst[i]);
+        if (FAILED(hr))
+            return hr;
+    }
+    return S_OK;
+}
+
+#ifdef __SSE2__
+constexpr size_t LANES = 8; ///< elements per SIMD step
+
+/** 8 elements widened to 32bit integers, floats or doubles. */
+struct I32x8 {
+    __m128i v[2];
+};
+struct F32x8 {
+    __m128 v[2];
+};
+struct F64x8 {
+    __m128d v[4];
+};
+
+/** Intermediate type that all source values are widened to without overflow. */
+template <class S, class D>
+using Hub = std::conditional_t<std::is_same<S, double>::value || std::is_same<D, double>::value, F64x8,
+            std::conditional_t<std::is_same<S, float>::value || std::is_same<D, float>::value, F32x8, I32x8>>;
+
+inline void Load (const BYTE* src, I32x8& out) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), zero);
+    out.v[0] = _mm_unpacklo_epi16(x, zero);
+    out.v[1] = _mm_unpackhi_epi16(x, zero);
+}
+inline void Load (const short* src, I32x8& out) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    out.v[0] = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16); // sign extension
+    out.v[1] = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+}
+inline void Load (const LONG* src, I32x8& out) {
+    out.v[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    out.v[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 4));
+}
+inline void Load (const float* src, F32x8& out) {
+    out.v[0] = _mm_loadu_ps(src);
+    out.v[1] = _mm_loadu_ps(src + 4);
+}
+inline void Load (const double* src, F64x8& out) {
+    for (int k = 0; k < 4; ++k)
+        out.v[k] = _mm_loadu_pd(src + 2*k);
+}
+/** Integer to float widening. */
+template <class S>
+inline void Load (const S* src, F32x8& out) {
+    I32x8 tmp;
+    Load(src, tmp);
+    for (int k = 0; k < 2; ++k)
+        out.v[k] = _mm_cvtepi32_ps(tmp.v[k]);
+}
+/** Integer or float to double widening. */
+template <class S>
+inline void Load (const S* src, F64x8& out) {
+    if constexpr (std::is_same<S, float>::value) {
+        F32x8 tmp;
+        Load(src, tmp);
+        for (int k = 0; k < 2; ++k) {
+            out.v[2*k]     = _mm_cvtps_pd(tmp.v[k]);
+            out.v[2*k + 1] = _mm_cvtps_pd(_mm_movehl_ps(tmp.v[k], tmp.v[k]));
+        }
+    } else {
+        I32x8 tmp;
+        Load(src, tmp);
+        for (int k = 0; k < 2; ++k) {
+            out.v[2*k]     = _mm_cvtepi32_pd(tmp.v[k]);
+            out.v[2*k + 1] = _mm_cvtepi32_pd(_mm_unpackhi_epi64(tmp.v[k], tmp.v[k]));
+        }
+    }
+}
+
+/** Flag lanes outside [lo, hi]. */
+inline __m128i OutOfRange (const I32x8& in, int lo, int hi) {
+    __m128i bad = _mm_setzero_si128();
+    for (int k = 0; k < 2; ++k) {
+        bad = _mm_or_si128(bad, _mm_cmplt_epi32(in.v[k], _mm_set1_epi32(lo)));
+        bad = _mm_or_si128(bad, _mm_cmpgt_epi32(in.v[k], _mm_set1_epi32(hi)));
+    }
+    return bad;
+}
+
+inline void Store (const I32x8& in, BYTE* dst, __m128i& bad) {
+    bad = _mm_or_si128(bad, OutOfRange(in, 0, 255));
+    __m128i x = _mm_packs_epi32(in.v[0], in.v[1]);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(x, x));
+}
+inline void Store (const I32x8& in, short* dst, __m128i& bad) {
+    bad = _mm_or_si128(bad, OutOfRange(in, -32768, 32767));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_packs_epi32(in.v[0], in.v[1]));
+}
+inline void Store (const I32x8& in, LONG* dst, __m128i& /*bad*/) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), in.v[0]);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 4), in.v[1]);
+}
+inline void Store (const F32x8& in, float* dst, __m128i& /*bad*/) {
+    _mm_storeu_ps(dst, in.v[0]);
+    _mm_storeu_ps(dst + 4, in.v[1]);
+}
+inline void Store (const F64x8& in, double* dst, __m128i& /*bad*/) {
+    for (int k = 0; k < 4; ++k)
+        _mm_storeu_pd(dst + 2*k, in.v[k]);
+}
+/** Range-checked float to double narrowing. Infinity & NaN are passed through. */
+inline void Store (const F64x8& in, float* dst, __m128i& bad) {
+    const __m128d sign = _mm_set1_pd(-0.0);
+    const __m128d max = _mm_set1_pd(std::numeric_limits<float>::max());
+    const __m128d inf = _mm_set1_pd(std::numeric_limits<double>::infinity());
+    for (int k = 0; k < 4; ++k) {
+        __m128d abs = _mm_andnot_pd(sign, in.v[k]);
+        bad = _mm_or_si128(bad, _mm_castpd_si128(_mm_and_pd(_mm_cmpgt_pd(abs, max), _mm_cmplt_pd(abs, inf))));
+    }
+    _mm_storeu_ps(dst, _mm_movelh_ps(_mm_cvtpd_ps(in.v[0]), _mm_cvtpd_ps(in.v[1])));
+    _mm_storeu_ps(dst + 4, _mm_movelh_ps(_mm_cvtpd_ps(in.v[2]), _mm_cvtpd_ps(in.v[3])));
+}
+/** Real to integer conversion. Rounds half to even with the current rounding mode like std::nearbyint.
+    Out-of-range values & NaN are converted to INT_MIN, so that only 32bit results need an explicit range check. */
+template <class D>
+inline void Store (const F32x8& in, D* dst, __m128i& bad) {
+    if constexpr (std::is_same<D, LONG>::value) {
+        const __m128 lo = _mm_set1_ps(-2147483648.0f);
+        const __m128 hi = _mm_set1_ps(2147483648.0f);
+        for (int k = 0; k < 2; ++k)
+            bad = _mm_or_si128(bad, _mm_castps_si128(_mm_or_ps(_mm_cmpnge_ps(in.v[k], lo), _mm_cmpnlt_ps(in.v[k], hi))));
+    }
+    I32x8 tmp;
+    for (int k = 0; k < 2; ++k)
+        tmp.v[k] = _mm_cvtps_epi32(in.v[k]);
+    Store(tmp, dst, bad);
+}
+template <class D>
+inline void Store (const F64x8& in, D* dst, __m128i& bad) {
+    if constexpr (std::is_same<D, LONG>::value) {
+        // bounds of values that round to the 32bit range
+        const __m128d lo = _mm_set1_pd(-2147483648.5);
+        const __m128d hi = _mm_set1_pd(2147483647.5);
+        for (int k = 0; k < 4; ++k)
+            bad = _mm_or_si128(bad, _mm_castpd_si128(_mm_or_pd(_mm_cmpnge_pd(in.v[k], lo), _mm_cmpnlt_pd(in.v[k], hi))));
+    }
+    I32x8 tmp;
+    for (int k = 0; k < 2; ++k)
+        tmp.v[k] = _mm_unpacklo_epi64(_mm_cvtpd_epi32(in.v[2*k]), _mm_cvtpd_epi32(in.v[2*k + 1]));
+    Store(tmp, dst, bad);
+}
+#endif
+
+template <class S, class D>
+HRESULT ConvertArray (const S* src, D* dst, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    Hub<S, D> tmp;
+    __m128i bad = _mm_setzero_si128();
+    for (; i + LANES <= count; i += LANES) {
+        Load(src + i, tmp);
+        Store(tmp, dst + i, bad);
+    }
+    if (_mm_movemask_epi8(bad))
+        return DISP_E_OVERFLOW;
+#endif
+    return ConvertScalar(src + i, dst + i, count - i);
+}
+
+template <class S>
+HRESULT ConvertFrom (const S* src, VARTYPE vt, void* dst, size_t count) {
+    switch (vt) {
+    case VT_UI1: return ConvertArray(src, static_cast<BYTE*>(dst), count);
+    case VT_I2:  return ConvertArray(src, static_cast<short*>(dst), count);
+    case VT_I4:  return ConvertArray(src, static_cast<LONG*>(dst), count);
+    case VT_R4:  return ConvertArray(src, static_cast<float*>(dst), count);
+    case VT_R8:  return ConvertArray(src, static_cast<double*>(dst), count);
+    default:
+        return DISP_E_BADVARTYPE;
+    }
+}
+
+HRESULT Convert (VARTYPE from, const void* src, VARTYPE to, void* dst, size_t count) {
+    switch (from) {
+    case VT_UI1: return ConvertFrom(static_cast<const BYTE*>(src), to, dst, count);
+    case VT_I2:  return ConvertFrom(static_cast<const short*>(src), to, dst, count);
+    case VT_I4:  return ConvertFrom(static_cast<const LONG*>(src), to, dst, count);
+    case VT_R4:  return ConvertFrom(static_cast<const float*>(src), to, dst, count);
+    case VT_R8:  return ConvertFrom(static_cast<const double*>(src), to, dst, count);
+    default:
+        return DISP_E_BADVARTYPE;
+    }
+}
+
+/** Element size of convertible types. Zero for other types. */
+unsigned int ElementSize (VARTYPE vt) {
+    switch (vt) {
+    case VT_UI1: return sizeof(BYTE);
+    case VT_I2:  return sizeof(short);
+    case VT_I4:  return sizeof(LONG);
+    case VT_R4:  return sizeof(float);
+    case VT_R8:  return sizeof(double);
+    default:
+        return 0;
+    }
+}
+
+} // namespace convert
+} // namespace
+
+__attribute__((visibility("default")))
+HRESULT SafeArrayChangeType (SAFEARRAY* psa, VARTYPE vt, SAFEARRAY** ppsaOut) {
+    if (!psa || !ppsaOut)
+        return E_POINTER;
+    *ppsaOut = nullptr;
+
+    const unsigned int elm_size = convert::ElementSize(vt);
+    if ((psa->type != SAFEARRAY::TYPE_DATA) || !elm_size || (convert::ElementSize(psa->vt) != psa->elm_size))
+        return DISP_E_BADVARTYPE;
+    if (psa->vt == vt)
+        return SafeArrayCopy(psa, ppsaOut);
+
+    const size_t count = psa->data.size()/psa->elm_size;
+    SAFEARRAY* out = SAFEARRAY::Create(vt, elm_size, static_cast<unsigned int>(count));
+    HRESULT hr = convert::Convert(psa->vt, psa->data.data(), vt, out->data.data(), count);
+    if (FAILED(hr)) {
+        SAFEARRAY::Destroy(out);
+        return hr;
+    }
+    *ppsaOut = out;
+    return S_OK;
+}
+
+
+namespace {
+
+/** Case-insensitive FNV-1a hash. */
+UINT HashName (const wchar_t* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name) {
+        hash ^= static_cast<uint32_t>(towlower(*name));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool EqualNames (const wchar_t* a, const wchar_t* b) {
+    for (; *a && *b; ++a, ++b) {
+        if (towlower(*a) != towlower(*b))
+            return false;
+    }
+    return *a == *b;
+}
+
+UINT HashDispatchId (DISPID dispid, WORD flag) {
+    uint32_t hash = static_cast<uint32_t>(dispid)*2654435761u;
+    return hash ^ (hash >> 15) ^ flag;
+}
+
+} // namespace
+
+
+__attribute__((visibility("default")))
+DispatchTable::DispatchTable (const DispatchMember* members, UINT count) : m_members(members), m_count(count) {
+    UINT size = 8;
+    while (size < 2*count)
+        size *= 2;
+    m_mask = size - 1;
+    m_names = new int[size];
+    m_ids = new int[size];
+    for (UINT i = 0; i < size; ++i) {
+        m_names[i] = -1;
+        m_ids[i] = -1;
+    }
+
+    for (UINT idx = 0; idx < count; ++idx) {
+        const DispatchMember& member = members[idx];
+        // property get & put members share name & DISPID
+        UINT slot = HashName(member.name) & m_mask;
+        while ((m_names[slot] >= 0) && !EqualNames(members[m_names[slot]].name, member.name))
+            slot = (slot + 1) & m_mask;
+        if (m_names[slot] < 0)
+            m_names[slot] = idx;
+
+        slot = HashDispatchId(member.dispid, member.flags) & m_mask;
+        while (m_ids[slot] >= 0)
+            slot = (slot + 1) & m_mask;
+        m_ids[slot] = idx;
+    }
+}
+
+__attribute__((visibility("default")))
+DispatchTable::~DispatchTable () {
+    delete [] m_names;
+    delete [] m_ids;
+}
+
+__attribute__((visibility("default")))
+const DispatchMember* DispatchTable::Find (DISPID dispid, WORD flag) const {
+    for (UINT slot = HashDispatchId(dispid, flag) & m_mask; m_ids[slot] >= 0; slot = (slot + 1) & m_mask) {
+        const DispatchMember& member = m_members[m_ids[slot]];
+        if ((member.dispid == dispid) && (member.flags == flag))
+            return &member;
+    }
+    return nullptr;
+}
+
+__attribute__((visibility("default")))
+HRESULT DispatchTable::GetIDsOfNames (const IID& riid, LPOLESTR* names, UINT count, DISPID* dispids) const {
+    if (!(riid == IID_NULL))
+        return DISP_E_UNKNOWNINTERFACE;
+    if (!names || !dispids)
+        return E_POINTER;
+
+    for (UINT i = 0; i < count; ++i)
+        dispids[i] = DISPID_UNKNOWN;
+    if (!count)
+        return S_OK;
+
+    HRESULT hr = DISP_E_UNKNOWNNAME;
+    for (UINT slot = HashName(names[0]) & m_mask; m_names[slot] >= 0; slot = (slot + 1) & m_mask) {
+        const DispatchMember& member = m_members[m_names[slot]];
+        if (EqualNames(member.name, names[0])) {
+            dispids[0] = member.dispid;
+            hr = S_OK;
+            break;
+        }
+    }
+    if (count > 1)
+        return DISP_E_UNKNOWNNAME; // argument names not supported
+    return hr;
+}
+
+__attribute__((visibility("default")))
+HRESULT DispatchTable::Invoke (void* itf, DISPID dispid, const IID& riid, WORD flags, DISPPARAMS* params, VARIANT* result, EXCEPINFO* excepinfo, UINT* arg_err) const {
+    if (!(riid == IID_NULL))
+        return DISP_E_UNKNOWNINTERFACE;
+    if (!params)
+        return E_POINTER;
+
+    const DispatchMember* member = nullptr;
+    if (flags & (DISPATCH_PROPERTYPUT | DISPATCH_PROPERTYPUTREF)) {
+        // new value is passed as the named DISPID_PROPERTYPUT argument
+        if ((params->cNamedArgs > 1) || (params->cNamedArgs && (params->rgdispidNamedArgs[0] != DISPID_PROPERTYPUT)))
+            return DISP_E_NONAMEDARGS;
+        if (flags & DISPATCH_PROPERTYPUT)
+            member = Find(dispid, DISPATCH_PROPERTYPUT);
+        if (!member && (flags & DISPATCH_PROPERTYPUTREF))
+            member = Find(dispid, DISPATCH_PROPERTYPUTREF);
+    } else {
+        if (params->cNamedArgs)
+            return DISP_E_NONAMEDARGS;
+        if (flags & DISPATCH_METHOD)
+            member = Find(dispid, DISPATCH_METHOD);
+        if (!member && (flags & DISPATCH_PROPERTYGET))
+            member = Find(dispid, DISPATCH_PROPERTYGET);
+    }
+    if (!member)
+        return DISP_E_MEMBERNOTFOUND;
+    if (params->cArgs != member->arg_count)
+        return DISP_E_BADPARAMCOUNT;
+
+    HRESULT method_hr = S_OK;
+    HRESULT hr = member->thunk(itf, params, result, arg_err, &method_hr);
+    if (FAILED(hr))
+        return hr; // argument error
+    if (FAILED(method_hr)) {
+        if (excepinfo) {
+            *excepinfo = EXCEPINFO();
+            excepinfo->scode = method_hr;
+        }
+        return DISP_E_EXCEPTION;
+    }
+    return method_hr;
+}
+
+
+__attribute__((visibility("default")))
+bool ATL::CComVariant::operator == (const VARIANT& other) const {
+    if (vt != other.vt)
+        return false;
+    if (vt & (VT_BYREF | VT_ARRAY))
+        return byref == other.byref;
+
+    switch (vt) {
+    case VT_EMPTY:
+    case VT_NULL:
+        return true;
+    case VT_I1:
+    case VT_UI1:
+        return bVal == other.bVal;
+    case VT_I2:
+    case VT_UI2:
+    case VT_BOOL:
+        return iVal == other.iVal;
+    case VT_I4:
+    case VT_UI4:
+    case VT_INT:
+    case VT_UINT:
+    case VT_ERROR:
+        return lVal == other.lVal;
+    case VT_I8:
+    case VT_UI8:
+        return llVal == other.llVal;
+    case VT_R4:
+        return fltVal == other.fltVal;
+    case VT_R8:
+        return dblVal == other.dblVal;
+    case VT_BSTR:
+        return wcscmp(bstrVal ? bstrVal : L"", other.bstrVal ? other.bstrVal : L"") == 0;
+    case VT_UNKNOWN:
+        return punkVal == other.punkVal;
+    case VT_DISPATCH:
+        return pdispVal == other.pdispVal;
+    default:
+        return false;
+    }
+}
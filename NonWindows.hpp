@@ -11,12 +11,19 @@
 
 #include <cassert>
 #include <atomic>
+#include <cstddef>
+#include <cstdio>
 #include <string>
-#include <string.h> // for wcsdup
+#include <string.h> // for wcslen
 #include <codecvt>
 #include <locale>
+#include <new>
 #include <iostream>
 #include <type_traits>
+#include <typeinfo>
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
 
 
 /** Taken from guiddef.h. */
@@ -48,6 +55,7 @@ typedef unsigned int   DWORD;   ///< 32bit unsigned
 typedef long           BOOL;
 typedef unsigned char  BYTE;
 typedef unsigned short USHORT;  ///< 16bit unsigned
+typedef unsigned short WORD;    ///< 16bit unsigned
 typedef unsigned int   UINT;    ///< 32bit int
 typedef unsigned int   ULONG;   ///< 32bit unsigned (cannot use 'long' since it's 64bit on 64bit Linux)
 typedef int            LONG;    ///< 32bit int (cannot use 'long' since it can be 64bit)
@@ -56,6 +64,7 @@ typedef wchar_t*       BSTR;    ///< zero terminated double-byte text string
 typedef int32_t        HRESULT; ///< 32bit signed int (negative values indicate failure)
 typedef void*          HWND;    ///< window handle
 typedef unsigned long long  ULONGLONG; ///< 64bit unsigned
+typedef long long           LONGLONG;  ///< 64bit int
 static_assert(sizeof(int) == 4, "int size not 32bit");
 #define __int64       long long ///< 64bit int (cannot use typedef due to "unsigned __int64" code)
 
@@ -75,6 +84,28 @@ static_assert(sizeof(int) == 4, "int size not 32bit");
 #define E_OUTOFMEMORY  static_cast<int32_t>(0x8007000EL)
 #define E_INVALIDARG   static_cast<int32_t>(0x80070057L)
 #define E_NOT_SET      static_cast<int32_t>(0x80070490L)
+#define E_ILLEGAL_METHOD_CALL static_cast<int32_t>(0x8000000EL)
+#define CO_E_NOTINITIALIZED   static_cast<int32_t>(0x800401F0L)
+#define RPC_E_DISCONNECTED    static_cast<int32_t>(0x80010108L)
+#define RPC_E_CHANGED_MODE    static_cast<int32_t>(0x80010106L)
+#define RPC_E_INVALIDMETHOD   static_cast<int32_t>(0x80010104L)
+#define RPC_E_INVALID_DATA    static_cast<int32_t>(0x8001000FL)
+#define RPC_E_CALL_COMPLETE   static_cast<int32_t>(0x80010117L)
+#define RPC_S_CALLPENDING     static_cast<int32_t>(0x80010115L)
+#define CLASS_E_NOAGGREGATION static_cast<int32_t>(0x80040110L)
+#define CONNECT_E_NOCONNECTION  static_cast<int32_t>(0x80040200L)
+#define CONNECT_E_CANNOTCONNECT static_cast<int32_t>(0x80040202L)
+#define REGDB_E_CLASSNOTREG   static_cast<int32_t>(0x80040154L)
+#define CO_E_SERVER_EXEC_FAILURE static_cast<int32_t>(0x80080005L)
+#define DISP_E_UNKNOWNINTERFACE static_cast<int32_t>(0x80020001L)
+#define DISP_E_MEMBERNOTFOUND   static_cast<int32_t>(0x80020003L)
+#define DISP_E_TYPEMISMATCH     static_cast<int32_t>(0x80020005L)
+#define DISP_E_UNKNOWNNAME      static_cast<int32_t>(0x80020006L)
+#define DISP_E_NONAMEDARGS      static_cast<int32_t>(0x80020007L)
+#define DISP_E_BADVARTYPE       static_cast<int32_t>(0x80020008L)
+#define DISP_E_EXCEPTION        static_cast<int32_t>(0x80020009L)
+#define DISP_E_OVERFLOW         static_cast<int32_t>(0x8002000AL)
+#define DISP_E_BADPARAMCOUNT    static_cast<int32_t>(0x8002000EL)
 
 
 enum CLSCTX { 
@@ -120,6 +151,24 @@ inline const char* InternalHresultToString(HRESULT hr) {
     case E_OUTOFMEMORY: return "E_OUTOFMEMORY";
     case E_INVALIDARG:  return "E_INVALIDARG";
     case E_NOT_SET:     return "E_NOT_SET";
+    case E_ILLEGAL_METHOD_CALL: return "E_ILLEGAL_METHOD_CALL";
+    case CO_E_NOTINITIALIZED:   return "CO_E_NOTINITIALIZED";
+    case RPC_E_DISCONNECTED:    return "RPC_E_DISCONNECTED";
+    case RPC_E_CHANGED_MODE:    return "RPC_E_CHANGED_MODE";
+    case RPC_E_INVALIDMETHOD:   return "RPC_E_INVALIDMETHOD";
+    case RPC_E_INVALID_DATA:    return "RPC_E_INVALID_DATA";
+    case CLASS_E_NOAGGREGATION: return "CLASS_E_NOAGGREGATION";
+    case REGDB_E_CLASSNOTREG:   return "REGDB_E_CLASSNOTREG";
+    case CO_E_SERVER_EXEC_FAILURE: return "CO_E_SERVER_EXEC_FAILURE";
+    case DISP_E_UNKNOWNINTERFACE:  return "DISP_E_UNKNOWNINTERFACE";
+    case DISP_E_MEMBERNOTFOUND:    return "DISP_E_MEMBERNOTFOUND";
+    case DISP_E_TYPEMISMATCH:      return "DISP_E_TYPEMISMATCH";
+    case DISP_E_UNKNOWNNAME:       return "DISP_E_UNKNOWNNAME";
+    case DISP_E_NONAMEDARGS:       return "DISP_E_NONAMEDARGS";
+    case DISP_E_BADVARTYPE:        return "DISP_E_BADVARTYPE";
+    case DISP_E_EXCEPTION:         return "DISP_E_EXCEPTION";
+    case DISP_E_OVERFLOW:          return "DISP_E_OVERFLOW";
+    case DISP_E_BADPARAMCOUNT:     return "DISP_E_BADPARAMCOUNT";
     default:            return "HRESULT error";
     }
 }
@@ -134,6 +183,18 @@ inline void CHECK (HRESULT hr) {
 }
 
 
+// Task memory allocation. Routed through the process-wide IMalloc allocator (see CoGetMalloc).
+void* CoTaskMemAlloc (size_t cb);
+void* CoTaskMemRealloc (void* pv, size_t cb);
+void  CoTaskMemFree (void* pv);
+
+// BSTR allocation. Strings are allocated with CoTaskMemAlloc.
+BSTR         SysAllocString (const wchar_t* psz);
+BSTR         SysAllocStringLen (const wchar_t* strIn, UINT ui);
+void         SysFreeString (BSTR bstrString);
+unsigned int SysStringLen (BSTR pbstr);
+
+
 /** API-compatible subset of the Microsoft _com_error class documented on https://docs.microsoft.com/en-us/cpp/cpp/com-error-class */
 class _com_error {
 public:
@@ -231,7 +292,7 @@ public:
         Clear();
         
         if (s)
-            m_str = wcsdup(s);
+            m_str = SysAllocString(s);
     }
 
     BSTR* GetAddress() {
@@ -254,7 +315,7 @@ private:
         if (!m_str)
             return;
 
-        free(m_str);
+        SysFreeString(m_str);
         m_str = nullptr;
     }
     
@@ -271,14 +332,17 @@ public:
     }
     CComBSTR (const wchar_t* str) {
         if (str)
-            m_str = wcsdup(str);
+            m_str = SysAllocString(str);
     }
     CComBSTR (int /*size*/, const wchar_t* str) {
-        m_str = wcsdup(str);
+        m_str = SysAllocString(str);
     }
     CComBSTR (const CComBSTR & other) {
         m_str = other.Copy();
     }
+    CComBSTR (CComBSTR && other) noexcept {
+        std::swap(m_str, other.m_str);
+    }
 
     ~CComBSTR() {
         Empty();
@@ -291,6 +355,9 @@ public:
         Empty();
         m_str = other.Copy();
     }
+    void operator = (CComBSTR && other) noexcept {
+        std::swap(m_str, other.m_str);
+    }
 
     /** Returns string length excluding null termination. */
     unsigned int Length () const {
@@ -326,14 +393,14 @@ public:
         if (!m_str)
             return nullptr;
 
-        return wcsdup(m_str);
+        return SysAllocString(m_str);
     }
     
     void Empty() {
         if (!m_str)
             return;
 
-        free(m_str);
+        SysFreeString(m_str);
         m_str = nullptr;
     }
     
@@ -368,6 +435,13 @@ extern "C" {
 // interface ID values for well-known interfaces
 static constexpr GUID IID_IUnknown       = {0x00000000,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
 static constexpr GUID IID_IMessageFilter = {0x00000016,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID IID_IMalloc        = {0x00000002,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID IID_ISequentialStream = {0x0c733a30,0x2a1c,0x11ce,{0xad,0xe5,0x00,0xaa,0x00,0x44,0x77,0x3d}};
+static constexpr GUID IID_IStream        = {0x0000000c,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID IID_IGlobalInterfaceTable      = {0x00000146,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID CLSID_StdGlobalInterfaceTable = {0x00000323,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID IID_IWeakRef        = {0x146532F9,0x763D,0x44C9,{0x87,0x5A,0x7B,0x5B,0x73,0x2B,0x90,0x46}};
+static constexpr GUID IID_IRecordInfo     = {0x0000002F,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
 
 /** IUnknown base-class for Non-Windows platforms. */
 struct IUnknown {
@@ -384,18 +458,461 @@ struct IUnknown {
 
     virtual ULONG Release () = 0;
 };
+
+/** Memory allocator interface. */
+struct IMalloc : public IUnknown {
+    virtual void*  Alloc (size_t cb) = 0;
+    virtual void*  Realloc (void* pv, size_t cb) = 0;
+    virtual void   Free (void* pv) = 0;
+    virtual size_t GetSize (void* pv) = 0;
+    virtual int    DidAlloc (void* pv) = 0;
+    virtual void   HeapMinimize () = 0;
+};
+
+/** Sequential stream interface. */
+struct ISequentialStream : public IUnknown {
+    virtual HRESULT Read (void* pv, ULONG cb, ULONG* pcbRead) = 0;
+    virtual HRESULT Write (const void* pv, ULONG cb, ULONG* pcbWritten) = 0;
+};
+
+/** Subset of the IStream interface (seeking & storage methods not included). */
+struct IStream : public ISequentialStream {
+};
+
+/** Process-wide table of interface pointers that can be retrieved from any thread, any number of times.
+    Obtained with CoCreateInstance(CLSID_StdGlobalInterfaceTable). GetInterfaceFromGlobal is lock-free, and returns
+    a cross-apartment proxy if the object belongs to another STA. Cookies carry a generation tag, so that stale
+    cookies are rejected with E_INVALIDARG, unless their slot has since been reused 4095 times. */
+struct IGlobalInterfaceTable : public IUnknown {
+    virtual HRESULT RegisterInterfaceInGlobal (IUnknown* pUnk, const IID& riid, DWORD* pdwCookie) = 0;
+    virtual HRESULT RevokeInterfaceFromGlobal (DWORD dwCookie) = 0;
+    virtual HRESULT GetInterfaceFromGlobal (DWORD dwCookie, const IID& riid, void** ppv) = 0;
+};
+
+/** IUnknown-based alternative to Microsoft's IWeakReference. Implemented by SharedRef (see SharedRef.hpp) and by
+    classes with DECLARE_WEAK_REFERENCES. References to this interface are weak, and casting back to other interfaces
+    only succeed if the object is still alive. */
+struct IWeakRef : public IUnknown {
+};
+
+/** Subset of the IRecordInfo interface (type information & field access methods not included).
+    Describes the layout of a record (UDT) type, so that arrays of records can be copied & freed. */
+struct IRecordInfo : public IUnknown {
+    /** Initialize a record with all members zeroed. */
+    virtual HRESULT RecordInit (void* pvNew) = 0;
+    /** Free the owned members & zero the record. */
+    virtual HRESULT RecordClear (void* pvExisting) = 0;
+    /** Free the owned members of pvNew & replace them with a deep copy of pvExisting. */
+    virtual HRESULT RecordCopy (void* pvExisting, void* pvNew) = 0;
+    virtual HRESULT GetGuid (GUID* pguid) = 0;
+    virtual HRESULT GetName (BSTR* pbstrName) = 0;
+    virtual HRESULT GetSize (ULONG* pcbSize) = 0;
+    /** Call with rgBstrNames=nullptr to get the member count. */
+    virtual HRESULT GetFieldNames (ULONG* pcNames, BSTR* rgBstrNames) = 0;
+    virtual BOOL    IsMatchingType (IRecordInfo* pRecordInfo) = 0;
+    /** Allocate a zero-initialized record with CoTaskMemAlloc. */
+    virtual void*   RecordCreate () = 0;
+    virtual HRESULT RecordCreateCopy (void* pvSource, void** ppvDest) = 0;
+    /** Free the owned members & the record. */
+    virtual HRESULT RecordDestroy (void* pvRecord) = 0;
+};
 } // extern "C"
 DEFINE_UUIDOF(IUnknown)
+DEFINE_UUIDOF(IMalloc)
+DEFINE_UUIDOF(ISequentialStream)
+DEFINE_UUIDOF(IStream)
+DEFINE_UUIDOF(IGlobalInterfaceTable)
+DEFINE_UUIDOF(IWeakRef)
+DEFINE_UUIDOF(IRecordInfo)
+
+#define MEMCTX_TASK 1
+
+/** Get the process-wide allocator used by CoTaskMemAlloc, BSTRs, SAFEARRAYs and COM objects. */
+HRESULT CoGetMalloc (DWORD dwMemContext, IMalloc** ppMalloc);
+
+/** Non-Windows extension for replacing the process-wide allocator, e.g. with an arena or instrumented backend.
+    Must be called before the first allocation, typically from a __attribute__((constructor(101))) function.
+    Returns E_ILLEGAL_METHOD_CALL if memory has already been allocated. The allocator is kept alive until process exit. */
+HRESULT CoSetMalloc (IMalloc* pMalloc);
+
+
+enum COINIT {
+  COINIT_MULTITHREADED      = 0x0,
+  COINIT_APARTMENTTHREADED  = 0x2,
+  COINIT_DISABLE_OLE1DDE    = 0x4,
+  COINIT_SPEED_OVER_MEMORY  = 0x8,
+};
+#define INFINITE 0xFFFFFFFF
+
+/** Initialize COM on the current thread. COINIT_APARTMENTTHREADED creates a single-threaded apartment (STA) that
+    owns all objects created on the thread. Other threads call into an STA through proxies obtained with
+    CoMarshalInterThreadInterfaceInStream, and the calls are executed on the owner thread by CoProcessApartmentCalls.
+    Threads that are not initialized are implicitly part of the multi-threaded apartment (MTA). */
+HRESULT CoInitializeEx (void* pvReserved, DWORD dwCoInit);
+void    CoUninitialize ();
+
+/** Non-Windows replacement for the STA message loop. Executes all pending incoming calls on the current STA thread in one batch.
+    Waits up to dwTimeout milliseconds for calls to arrive. Returns S_OK if calls were processed and S_FALSE on timeout. */
+HRESULT CoProcessApartmentCalls (DWORD dwTimeout);
+
+/** Marshal an interface pointer for use by another thread. The stream can only be unmarshaled once. */
+HRESULT CoMarshalInterThreadInterfaceInStream (const IID& riid, IUnknown* pUnk, IStream** ppStm);
+/** Unmarshal an interface pointer & release the stream. Returns a cross-apartment proxy if the object belongs to another STA. */
+HRESULT CoGetInterfaceAndReleaseStream (IStream* pStm, const IID& iid, void** ppv);
+
+
+/** Internal cross-apartment call record. Use CApartmentProxy<T>::Invoke instead of accessing it directly. */
+struct ApartmentCall {
+    void   (*fun)(ApartmentCall* call) = nullptr; ///< executed on the target apartment thread
+    HRESULT hr = S_OK;                            ///< RPC_E_DISCONNECTED if the call couldn't be delivered
+    bool    async = false;                        ///< fire-and-forget call. fun is also invoked if delivery fails to allow cleanup
+    std::atomic<bool>           done {false};
+    std::atomic<ApartmentCall*> next {nullptr};
+    void*   waiter = nullptr;
+};
+
+/** Internal apartment functions. SHALL ONLY be accessed through CApartmentProxy<T>. */
+HRESULT CoInternalApartmentCall (IUnknown* apartment, ApartmentCall* call);
+HRESULT CoInternalApartmentQueryInterface (IUnknown* apartment, IUnknown* target, const IID& iid, void** ppv);
+void    CoInternalApartmentRelease (IUnknown* apartment, IUnknown* target);
+
+typedef HRESULT(*ApartmentProxyFactory)(IUnknown* apartment, void* target, void** proxy);
+typedef void(*ApartmentReleaseFunction)(void* itf);
+/** Non-Windows extension for registering cross-apartment proxies for an interface.
+    The factory takes over the target reference, also on failure, since only the proxy knows the target type.
+    The optional release function releases a raw interface pointer with the correct static type. */
+HRESULT CoRegisterApartmentProxy (const IID& iid, ApartmentProxyFactory factory, ApartmentReleaseFunction release = nullptr);
+
+typedef HRESULT(*LocalServerActivator)(const GUID& clsid, IUnknown** obj);
+/** Internal hook for CLSCTX_LOCAL_SERVER activation. Installed by CoRegisterLocalServer (see Marshal.hpp). */
+void    CoInternalSetLocalServerActivator (LocalServerActivator activator);
+/** Internal function. Returns REGDB_E_CLASSNOTREG if no local server is registered for the class. */
+HRESULT CoInternalCreateLocalInstance (const GUID& clsid, IUnknown** obj);
+
+/** Non-Windows replacement for the InprocServer32 registry keys. Reads a class catalog with "{CLSID} <ProgID> <library>" lines,
+    so that activation of a class loads its library on first use instead of all component libraries being loaded at startup.
+    Use "-" for classes without a ProgID. Relative library paths are resolved against the catalog directory, and lines starting with '#' are ignored.
+    The file is memory-mapped & indexed once. Can be called several times to combine catalogs. */
+HRESULT CoRegisterClassCatalog (const char* filename);
+/** Internal function. Loads the library that implements a class according to the class catalog.
+    Returns S_OK if the library is loaded, and S_FALSE if the class isn't in any catalog. Load failures are logged unless "context" contains CLSCTX_NO_FAILURE_LOG. */
+HRESULT CoInternalLoadClassLibrary (const GUID* clsid, const wchar_t* prog_id, DWORD context);
+/** Non-Windows replacement for the HKCR\<ProgID>\CLSID registry keys. Looks up registered classes by component name and the class catalog by full ProgID.
+    Returns REGDB_E_CLASSNOTREG if the ProgID is unknown. */
+HRESULT CLSIDFromProgID (const wchar_t* prog_id, GUID* clsid);
+
+
+/** Per-class lifecycle & QueryInterface counters aggregated over all threads.
+    Only collected for classes with a COM map in translation units built with _ATL_OBJECT_COUNTERS defined. The macro doesn't
+    affect class layout, but all translation units that use a class should agree on it, since the linker picks one copy of its inline methods. */
+struct CoClassCounters {
+    const char* name;      ///< class name passed to BEGIN_COM_MAP
+    ULONGLONG   created;
+    ULONGLONG   destroyed; ///< live objects = created - destroyed
+    ULONGLONG   addrefs;
+    ULONGLONG   releases;
+    ULONGLONG   qi_hits;
+    ULONGLONG   qi_misses;
+};
+/** Per-class & interface QueryInterface counters. */
+struct CoInterfaceCounters {
+    const char* name; ///< class name passed to BEGIN_COM_MAP
+    GUID        iid;
+    ULONGLONG   hits;
+    ULONGLONG   misses;
+};
+
+/** Non-Windows extension for taking a snapshot of the class counters. Fills up to "capacity" entries and returns the
+    total number of counted classes, so that the call can be repeated with a larger array if needed. */
+ULONG CoGetClassCounters (CoClassCounters* classes, ULONG capacity);
+/** Non-Windows extension for taking a snapshot of the per-interface QueryInterface counters. Same semantics as CoGetClassCounters. */
+ULONG CoGetInterfaceCounters (CoInterfaceCounters* interfaces, ULONG capacity);
+/** Print a snapshot of all counters as a human-readable table. */
+void  CoDumpObjectCounters (FILE* file);
+
+enum ObjectCounter {
+    OBJECT_COUNTER_CREATED,
+    OBJECT_COUNTER_DESTROYED,
+    OBJECT_COUNTER_ADDREF,
+    OBJECT_COUNTER_RELEASE,
+    OBJECT_COUNTER_QI_HIT,
+    OBJECT_COUNTER_QI_MISS,
+    OBJECT_COUNTER_COUNT
+};
+/** Internal counter functions. SHALL ONLY be accessed through the COM map macros.
+    Counters are sharded per thread, so that counting doesn't introduce contention. */
+ULONG CoInternalRegisterCountedClass (const char* name);
+void  CoInternalCountObjectEvent (ULONG cls, ObjectCounter counter);
+void  CoInternalCountQueryInterface (ULONG cls, const GUID& iid, bool hit);
+
+#ifdef _ATL_OBJECT_COUNTERS
+#define _ATL_DECLARE_OBJECT_COUNTERS(CLASS) \
+    static ULONG _ObjectCountersIndex () { \
+        static const ULONG idx = CoInternalRegisterCountedClass(#CLASS); \
+        return idx; \
+    }
+#define _ATL_COUNT_OBJECT_EVENT(counter)     CoInternalCountObjectEvent(_ObjectCountersIndex(), counter);
+#define _ATL_COUNT_QUERY_INTERFACE(iid, hit) CoInternalCountQueryInterface(_ObjectCountersIndex(), iid, hit);
+#else
+#define _ATL_DECLARE_OBJECT_COUNTERS(CLASS)
+#define _ATL_COUNT_OBJECT_EVENT(counter)
+#define _ATL_COUNT_QUERY_INTERFACE(iid, hit)
+#endif
+
+/** Creation & destruction counting by CComObject & CComAggObject. Done in the wrappers instead of a BASE member,
+    so that the class layout doesn't depend on _ATL_OBJECT_COUNTERS. */
+template <class BASE, class = void>
+struct CComObjectCounters {
+    static void Count (ObjectCounter) {
+    }
+};
+template <class BASE>
+struct CComObjectCounters<BASE, std::void_t<decltype(&BASE::_ObjectCountersIndex)>> {
+    static void Count (ObjectCounter counter) {
+        CoInternalCountObjectEvent(BASE::_ObjectCountersIndex(), counter);
+    }
+};
+
+/** Non-Windows extension for leak diagnostics. Prints all live CComObject & CComAggObject instances grouped by class & creation backtrace.
+    Tracking is enabled by setting the COM_LEAK_TRACKER environment variable to a value other than "0" before the first object is created.
+    Objects that are still alive at process exit are then also printed to stderr. Returns the number of live objects, or 0 if tracking is disabled. */
+ULONG CoDumpLiveObjects (FILE* file);
+
+/** Internal leak tracker functions. SHALL ONLY be accessed through CComObject & CComAggObject.
+    Returns immediately if tracking is disabled. */
+void CoInternalTrackObject (const void* obj, const std::type_info& type, const std::atomic<ULONG>* refs);
+void CoInternalUntrackObject (const void* obj);
+
+class CComBiasedRefCount;
+
+/** Per-thread state of CComBiasedRefCount owners. Kept alive by the owned objects after the thread exits. */
+struct CComBiasedOwner {
+    std::atomic<CComBiasedRefCount*> queue {nullptr}; ///< objects with more releases than AddRefs from other threads
+    std::atomic<bool>                exited {false};
+    std::atomic<ULONG>               refs {1};        ///< owned objects + 1 while the thread is alive
+
+    /** Internal thread-exit cleanup. */
+    static void ThreadExit ();
+};
+
+/** Biased reference-count, after Choi et al. "Biased Reference Counting" (PACT 2018). The thread that creates the object
+    counts its references with a non-atomic counter, while other threads use an atomic shared counter. The counters are merged
+    when the owner's count drops to zero. Objects that other threads release more than they AddRef are queued to the owner,
+    and merged on its next AddRef, Release or creation of a biased object, by CoProcessApartmentCalls, by idle thread pool
+    workers or at thread exit. Destruction is therefore delayed until then, so threads that own biased objects and then
+    block or stop using them for a long time should call ProcessQueue periodically.
+    Selected with CComObjectRootEx<CComBiasedThreadModel>. */
+class CComBiasedRefCount {
+public:
+    CComBiasedRefCount ();
+    CComBiasedRefCount (const CComBiasedRefCount&) : CComBiasedRefCount() {
+    }
+    ~CComBiasedRefCount ();
+
+    CComBiasedRefCount& operator = (const CComBiasedRefCount&) {
+        return *this; // reference-count is not copied
+    }
+
+    ULONG BiasedAddRef () {
+        CComBiasedOwner* owner = m_owner;
+        if (owner && (owner == t_owner) && (m_biased != DETACHED)) {
+            ULONG ref = ++m_biased;
+            if (owner->queue.load(std::memory_order_relaxed))
+                ProcessQueue(); // bound the delay of deferred destruction
+            return ref;
+        }
+        int64_t shared = m_shared.fetch_add(ONE, std::memory_order_relaxed) + ONE;
+        return (shared >= ONE) ? static_cast<ULONG>(shared >> SHIFT) : 1;
+    }
+    /** Returns zero if the caller shall delete the object. */
+    ULONG BiasedRelease (IUnknown* obj) {
+        CComBiasedOwner* owner = m_owner;
+        if (owner && (owner == t_owner) && (m_biased > 1) && (m_biased != DETACHED) && !owner->queue.load(std::memory_order_relaxed))
+            return --m_biased;
+        return ReleaseSlow(obj);
+    }
+
+    /** Merge the counters of queued objects owned by the current thread. Returns the number of processed objects. */
+    static size_t ProcessQueue ();
+
+private:
+    friend struct CComBiasedOwner;
+
+    ULONG ReleaseSlow (IUnknown* obj);
+    /** Move the owner's count to the shared counter. Called by the owner thread, or by any thread after the owner exited. */
+    void  Merge ();
+
+    static constexpr int64_t MERGED = 1; ///< shared counter holds the total count
+    static constexpr int64_t QUEUED = 2; ///< object is in the owner's queue
+    static constexpr int     SHIFT = 2;
+    static constexpr int64_t ONE = int64_t(1) << SHIFT;
+    static constexpr ULONG   DETACHED = ~ULONG(0); ///< m_biased value after merge
+
+    static thread_local CComBiasedOwner* t_owner;
+
+    CComBiasedOwner*     m_owner = nullptr;       ///< owner state, kept alive until destruction. Null if created during thread exit
+    ULONG                m_biased = 0;            ///< owner thread references, or DETACHED after merge
+    int32_t              m_object_offset = 0;     ///< IUnknown offset for deletion by the owner after queuing
+    std::atomic<int64_t> m_shared {0};            ///< other thread references (might be negative) & flags
+    CComBiasedRefCount*  m_next = nullptr;        ///< owner queue link
+};
+
+/** Reference-counting used by END_COM_MAP. Classes derived from CComObjectRootEx<CComBiasedThreadModel> use the biased
+    counters of CComBiasedRefCount instead of the m_ref atomic. Release returns zero if the caller shall delete the object. */
+template <class T>
+ULONG CComInternalAddRef (T* obj) {
+    if constexpr (std::is_base_of_v<CComBiasedRefCount, T>) {
+        return obj->BiasedAddRef();
+    } else {
+        assert((obj->m_ref < 0xFFFF) && "IUnknown::AddRef negative ref count.");
+        return ++obj->m_ref;
+    }
+}
+template <class T>
+ULONG CComInternalRelease (T* obj) {
+    if constexpr (std::is_base_of_v<CComBiasedRefCount, T>) {
+        return obj->BiasedRelease(static_cast<IUnknown*>(obj));
+    } else {
+        ULONG ref = --obj->m_ref;
+        assert((ref < 0xFFFF) && "IUnknown::Release negative ref count.");
+        return ref;
+    }
+}
 
+/** Reference-count of a class with a COM map. Returns nullptr for classes with custom or biased reference-counting. */
+template <class BASE, class = void>
+struct CComRefCount {
+    static const std::atomic<ULONG>* Get (const BASE* /*obj*/) {
+        return nullptr;
+    }
+};
+template <class BASE>
+struct CComRefCount<BASE, std::enable_if_t<std::is_same_v<decltype(BASE::m_ref), std::atomic<ULONG>> && !std::is_base_of_v<CComBiasedRefCount, BASE>>> {
+    static const std::atomic<ULONG>* Get (const BASE* obj) {
+        return &obj->m_ref;
+    }
+};
 
 // error handler required by generated wrapper API headers
 inline void _com_issue_errorex(HRESULT hr, IUnknown*, const IID &) {
     throw _com_error(hr);
 }
 
+/** Default object allocation policy. */
+struct CComGlobalAllocator {
+    static void* Allocate (size_t size) {
+        void* ptr = CoTaskMemAlloc(size);
+        if (!ptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    static void Free (void* ptr, size_t /*size*/) {
+        CoTaskMemFree(ptr);
+    }
+};
+
+/** Opt-in object allocation policy backed by thread-local, size-classed free lists.
+    Objects released on other threads are returned to the allocating thread in batches.
+    Freed memory is retained by the pool for reuse and never returned to the OS. */
+struct CComPooledAllocator {
+    static void* Allocate (size_t size);
+    static void  Free (void* ptr, size_t size);
+};
+
+/** Make CComObject & CComAggObject allocate the class from CComPooledAllocator. */
+#define DECLARE_POOLED_ALLOCATOR() typedef CComPooledAllocator _ObjectAllocatorClass;
+
+/** Allocation policy for a COM class. Use CComGlobalAllocator unless overridden with _ObjectAllocatorClass. */
+template <class BASE, class = void>
+struct CComObjectAllocator {
+    typedef CComGlobalAllocator type;
+};
+template <class BASE>
+struct CComObjectAllocator<BASE, std::void_t<typename BASE::_ObjectAllocatorClass>> {
+    typedef typename BASE::_ObjectAllocatorClass type;
+};
+
+/** Control block in front of CComObject instances of DECLARE_WEAK_REFERENCES classes. Implements IWeakRef for the object,
+    and keeps the allocation alive until the last weak reference is released, so that upgrades can safely check
+    the strong reference-count of a destroyed object (std::atomic is trivially destructible). */
+class CComWeakRefBlock : public IWeakRef {
+public:
+    typedef void (*FreeFunction)(void* ptr, size_t size);
+
+    CComWeakRefBlock (FreeFunction free, size_t size) : m_free(free), m_size(size) {
+    }
+
+    /** Space reserved in front of the object. Preserves the alignment of the allocation. */
+    static constexpr size_t Prefix () {
+        return (sizeof(CComWeakRefBlock) + alignof(std::max_align_t) - 1)/alignof(std::max_align_t)*alignof(std::max_align_t);
+    }
+    static CComWeakRefBlock* Of (const void* obj) {
+        return std::launder(reinterpret_cast<CComWeakRefBlock*>(static_cast<char*>(const_cast<void*>(obj)) - Prefix()));
+    }
+    void Attach (IUnknown* obj, std::atomic<ULONG>* strong) {
+        m_object = obj;
+        m_strong = strong;
+    }
+
+    /** Returns E_NOT_SET if the object is dead. */
+    HRESULT QueryInterface (const GUID& iid, void** obj) override;
+    ULONG   AddRef () override;
+    /** The allocation is freed when the last weak reference is released. */
+    ULONG   Release () override;
+
+private:
+    std::atomic<ULONG>  m_weak {1};         ///< weak references + 1 while the object is alive
+    std::atomic<ULONG>* m_strong = nullptr; ///< m_ref of the COM map
+    IUnknown*           m_object = nullptr;
+    FreeFunction        m_free = nullptr;
+    size_t              m_size = 0;         ///< allocation size [bytes]
+};
+
+/** Make CComObject support weak references through a control block in the same allocation, instead of wrapping
+    the class in SharedRef. Requires COM_INTERFACE_ENTRY_WEAKREF in the COM map. Not supported for aggregation & bulk creation. */
+#define DECLARE_WEAK_REFERENCES() typedef CComWeakRefBlock _WeakRefBlockClass;
+
+template <class BASE, class = void>
+struct CComHasWeakRefs : std::false_type {};
+template <class BASE>
+struct CComHasWeakRefs<BASE, std::void_t<typename BASE::_WeakRefBlockClass>> : std::true_type {};
+
+template <class BASE>
+class CComSlabObject;
+
 template <class BASE>
 class CComObject : public BASE {
 public:
+    CComObject () {
+        static_assert(!(CComHasWeakRefs<BASE>::value && std::is_base_of_v<CComBiasedRefCount, BASE>), "DECLARE_WEAK_REFERENCES not supported with biased reference-counting");
+        if constexpr (CComHasWeakRefs<BASE>::value)
+            CComWeakRefBlock::Of(this)->Attach(static_cast<IUnknown*>(this), &this->m_ref);
+        CoInternalTrackObject(this, typeid(BASE), CComRefCount<BASE>::Get(this));
+        CComObjectCounters<BASE>::Count(OBJECT_COUNTER_CREATED);
+    }
+    ~CComObject () {
+        CComObjectCounters<BASE>::Count(OBJECT_COUNTER_DESTROYED);
+        CoInternalUntrackObject(this);
+    }
+
+    static void* operator new (size_t size) {
+        typedef typename CComObjectAllocator<BASE>::type Allocator;
+        if constexpr (CComHasWeakRefs<BASE>::value) {
+            const size_t total = CComWeakRefBlock::Prefix() + size;
+            auto* mem = static_cast<char*>(Allocator::Allocate(total));
+            ::new (mem) CComWeakRefBlock(&Allocator::Free, total);
+            return mem + CComWeakRefBlock::Prefix();
+        } else {
+            return Allocator::Allocate(size);
+        }
+    }
+    static void operator delete (void* ptr, size_t size) {
+        if constexpr (CComHasWeakRefs<BASE>::value)
+            CComWeakRefBlock::Of(ptr)->Release(); // weak reference held by the object
+        else
+            CComObjectAllocator<BASE>::type::Free(ptr, size);
+    }
+
     static HRESULT CreateInstance (CComObject<BASE> ** arg) {
         assert(arg);
         assert(!*arg);
@@ -410,6 +927,85 @@ public:
         *arg = ptr;
         return hr;
     }
+
+    /** Non-Windows extension for creating "count" objects in one call. The objects are packed contiguously in a single slab
+        that is freed when all of them have been released. Objects are returned with reference-count zero, like CreateInstance.
+        No objects are returned if FinalConstruct fails for any of them. */
+    static HRESULT CreateInstances (ULONG count, CComObject<BASE> ** arg) {
+        assert(arg || !count);
+        return CComSlabObject<BASE>::Create(count, [arg](ULONG idx, CComObject<BASE>* obj) {
+            arg[idx] = obj;
+        });
+    }
+};
+
+/** Header of a slab with objects created by CComObject<BASE>::CreateInstances. */
+struct CComObjectSlab {
+    std::atomic<size_t> live; ///< objects not yet deleted
+    size_t              size; ///< allocation size [bytes]
+};
+
+/** CComObject allocated in a slab. Each object is preceded by a pointer to the slab header,
+    so that deleting the last object in a slab frees the whole slab. */
+template <class BASE>
+class CComSlabObject final : public CComObject<BASE> {
+    static_assert(!CComHasWeakRefs<BASE>::value, "bulk creation not supported for classes with DECLARE_WEAK_REFERENCES");
+public:
+    static void operator delete (void* ptr) {
+        CComObjectSlab* slab = *reinterpret_cast<CComObjectSlab**>(static_cast<char*>(ptr) - PREFIX);
+        if (--slab->live == 0) {
+            size_t size = slab->size;
+            slab->~CComObjectSlab();
+            CComObjectAllocator<BASE>::type::Free(slab, size);
+        }
+    }
+
+    /** Construct "count" objects in one slab & pass them to fun(idx, obj) if all of them succeeded FinalConstruct. */
+    template <class FUN>
+    static HRESULT Create (ULONG count, FUN fun) {
+        if (!count)
+            return S_OK;
+
+        const size_t size = HEADER + count*STRIDE;
+        auto* mem = static_cast<char*>(CComObjectAllocator<BASE>::type::Allocate(size));
+        auto* slab = new (mem) CComObjectSlab{{count}, size};
+
+        HRESULT hr = S_OK;
+        ULONG constructed = 0;
+        while ((constructed < count) && SUCCEEDED(hr)) {
+            char* elm = mem + HEADER + constructed*STRIDE;
+            *reinterpret_cast<CComObjectSlab**>(elm) = slab;
+            auto* obj = ::new (elm + PREFIX) CComSlabObject<BASE>();
+            constructed++;
+            hr = obj->FinalConstruct();
+        }
+        if (FAILED(hr)) {
+            // destroy without going through operator delete, since the slab is freed below
+            for (ULONG idx = 0; idx < constructed; ++idx)
+                At(mem, idx)->~CComSlabObject<BASE>();
+            slab->~CComObjectSlab();
+            CComObjectAllocator<BASE>::type::Free(mem, size);
+            return hr;
+        }
+
+        for (ULONG idx = 0; idx < count; ++idx)
+            fun(idx, At(mem, idx));
+        return S_OK;
+    }
+
+private:
+    static constexpr size_t RoundUp (size_t size, size_t align) {
+        return (size + align - 1)/align*align;
+    }
+    static constexpr size_t ALIGN  = alignof(CComObject<BASE>) > alignof(CComObjectSlab) ? alignof(CComObject<BASE>) : alignof(CComObjectSlab);
+    static constexpr size_t HEADER = RoundUp(sizeof(CComObjectSlab), ALIGN);
+    static constexpr size_t PREFIX = RoundUp(sizeof(CComObjectSlab*), ALIGN); ///< slab pointer in front of each object
+    static constexpr size_t STRIDE = PREFIX + RoundUp(sizeof(CComObject<BASE>), ALIGN);
+    static_assert(ALIGN <= alignof(std::max_align_t), "over-aligned classes not supported");
+
+    static CComSlabObject<BASE>* At (char* mem, ULONG idx) {
+        return std::launder(reinterpret_cast<CComSlabObject<BASE>*>(mem + HEADER + idx*STRIDE + PREFIX));
+    }
 };
 
 template <class BASE>
@@ -438,10 +1034,22 @@ private:
 
 template <class BASE>
 class CComAggObject : public IUnknown {
+    static_assert(!CComHasWeakRefs<BASE>::value, "aggregation not supported for classes with DECLARE_WEAK_REFERENCES");
 public:
     CComAggObject (IUnknown* pOuterUnknown) : m_contained(pOuterUnknown) {
+        CoInternalTrackObject(this, typeid(BASE), &m_ref);
+        CComObjectCounters<BASE>::Count(OBJECT_COUNTER_CREATED);
     }
     ~CComAggObject () {
+        CComObjectCounters<BASE>::Count(OBJECT_COUNTER_DESTROYED);
+        CoInternalUntrackObject(this);
+    }
+
+    static void* operator new (size_t size) {
+        return CComObjectAllocator<BASE>::type::Allocate(size);
+    }
+    static void operator delete (void* ptr, size_t size) {
+        CComObjectAllocator<BASE>::type::Free(ptr, size);
     }
     
     ULONG AddRef () override {
@@ -491,8 +1099,12 @@ private:
 template <class T>
 class Buffer {
 public:
-    Buffer(size_t size = 0) : m_size(size) {
-        if (size > 0) {
+    /** Wraps "external" zero-initialized memory without taking ownership if non-null. */
+    Buffer(size_t size = 0, T* external = nullptr) : m_size(size) {
+        if (external) {
+            m_ptr = external;
+            m_owning = false;
+        } else if (size > 0) {
             m_ptr = Allocate(size);
             m_owning = true;
         }
@@ -531,6 +1143,21 @@ public:
         return m_ptr[idx];
     }
 
+    bool owning () const {
+        return m_owning;
+    }
+
+    /** Switch from external to owned memory by copying the content. */
+    void make_owning () {
+        if (m_owning)
+            return;
+        T * new_ptr = m_size ? Allocate(m_size) : nullptr;
+        for (size_t i = 0; i < m_size; ++i)
+            new_ptr[i] = m_ptr[i];
+        m_ptr = new_ptr;
+        m_owning = true;
+    }
+
     void resize (size_t size, T val = T()) noexcept {
         assert(m_owning);
 
@@ -561,7 +1188,7 @@ public:
 
 private:
     static T* Allocate(size_t size) {
-        auto* ptr = (T*)malloc(sizeof(T)*size);
+        auto* ptr = (T*)CoTaskMemAlloc(sizeof(T)*size);
         for (size_t i = 0; i < size; i++)
             new (&ptr[i]) T();
 
@@ -571,7 +1198,7 @@ private:
     static void Free (T* ptr, size_t size) {
         for (size_t i = 0; i < size; i++)
             ptr[i].~T();
-        free(ptr);
+        CoTaskMemFree(ptr);
     }
     
     size_t m_size = 0;
@@ -586,18 +1213,15 @@ class IUnknownFactory {
     friend class _com_ptr_t;
     template<typename T>
     friend class ATL::CComPtr;
+    friend HRESULT CLSIDFromProgID (const wchar_t* prog_id, GUID* clsid);
 
-private:
+public:
     typedef HRESULT(*Factory)(IUnknown*, IUnknown**);
-    
-    struct Entry {
-        GUID          clsid{};
-        ATL::CComBSTR name;
-        Factory       factory = nullptr;
-    };
+    typedef HRESULT(*BulkFactory)(ULONG, IUnknown**);
 
-    /** Create COM class based on "[<Program>.]<Component>[.<Version>]" ProgID string. */
-    static IUnknown* CreateInstance (std::wstring class_name, IUnknown* outer) {
+private:
+    /** Extract "<Component>" from a "[<Program>.]<Component>[.<Version>]" ProgID string. */
+    static std::wstring ComponentName (std::wstring class_name) {
         // remove "<Program>." prefix and ".<Version>" suffix if present
         size_t idx1 = class_name.find(L'.');
         if (idx1 != std::wstring::npos) {
@@ -617,35 +1241,55 @@ private:
                 }
             }
         }
-
-        for (size_t i = 0; i < Factories().size(); i++) {
-            const auto & elm = Factories()[i];
-            if (elm.name == ATL::CComBSTR(class_name.c_str())) {
-                IUnknown* obj = nullptr;
-                HRESULT hr = elm.factory(outer, &obj);
-                assert(hr == S_OK);
-                if (SUCCEEDED(hr))
-                    return obj;
+        return class_name;
+    }
+
+    /** Create COM class based on "[<Program>.]<Component>[.<Version>]" ProgID string & class context.
+        Local servers are found through CLSIDFromProgID. Failures are logged unless CLSCTX_NO_FAILURE_LOG is set. */
+    static HRESULT CreateInstance (const std::wstring& prog_id, IUnknown* outer, DWORD context, IUnknown** obj) {
+        *obj = nullptr;
+        const std::wstring class_name = ComponentName(prog_id);
+        if (context & CLSCTX_INPROC_SERVER) {
+            Factory factory = FindFactory(class_name.c_str());
+            if (!factory && (CoInternalLoadClassLibrary(nullptr, prog_id.c_str(), context) == S_OK))
+                factory = FindFactory(class_name.c_str()); // retry after loading library from class catalog
+            if (factory)
+                return factory(outer, obj);
+        }
+        if (context & CLSCTX_LOCAL_SERVER) {
+            GUID clsid {};
+            if (CLSIDFromProgID(prog_id.c_str(), &clsid) == S_OK) {
+                HRESULT hr = outer ? CLASS_E_NOAGGREGATION : CoInternalCreateLocalInstance(clsid, obj);
+                if (hr != REGDB_E_CLASSNOTREG)
+                    return hr;
             }
         }
+        if (context & CLSCTX_NO_FAILURE_LOG)
+            return REGDB_E_CLASSNOTREG;
 
         std::wcerr << L"CoCreateInstance error: Unknown class " << class_name << std::endl;
         assert(false);
-        return nullptr;
-    }
-
-    /** Create COM class based on CLSID. */
-    static IUnknown* CreateInstance (GUID clsid, IUnknown* outer) {
-        for (size_t i = 0; i < Factories().size(); i++) {
-            const auto & elm = Factories()[i];
-            if (elm.clsid == clsid) {
-                IUnknown* obj = nullptr;
-                HRESULT hr = elm.factory(outer, &obj);
-                assert(hr == S_OK);
-                if (SUCCEEDED(hr))
-                    return obj;
-            }
+        return REGDB_E_CLASSNOTREG;
+    }
+
+    /** Create COM class based on CLSID & class context. In-process classes take precedence over local servers.
+        Failures to find the class are logged unless CLSCTX_NO_FAILURE_LOG is set. */
+    static HRESULT CreateInstance (GUID clsid, IUnknown* outer, DWORD context, IUnknown** obj) {
+        *obj = nullptr;
+        if (context & CLSCTX_INPROC_SERVER) {
+            Factory factory = FindFactory(clsid);
+            if (!factory && (CoInternalLoadClassLibrary(&clsid, nullptr, context) == S_OK))
+                factory = FindFactory(clsid); // retry after loading library from class catalog
+            if (factory)
+                return factory(outer, obj);
+        }
+        if (context & CLSCTX_LOCAL_SERVER) {
+            HRESULT hr = outer ? CLASS_E_NOAGGREGATION : CoInternalCreateLocalInstance(clsid, obj);
+            if (hr != REGDB_E_CLASSNOTREG)
+                return hr;
         }
+        if (context & CLSCTX_NO_FAILURE_LOG)
+            return REGDB_E_CLASSNOTREG;
 
         char guid_str[39] = {};
         snprintf(guid_str, sizeof(guid_str), "{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
@@ -655,7 +1299,7 @@ private:
 
         std::cerr << "CoCreateInstance error: Unknown clsid " << guid_str << std::endl;
         assert(false);
-        return nullptr;
+        return REGDB_E_CLASSNOTREG;
     }
     
 public:
@@ -666,24 +1310,67 @@ public:
         mbstowcs(const_cast<wchar_t*>(w_class_name.data()), class_name, w_class_name.size());
 
         //printf("IUnknownFactory::RegisterClass(%s)\n", class_name);
-        size_t prev_size = Factories().size();
-        Factories().resize(prev_size + 1, {clsid, w_class_name.c_str(), CreateClass<CLS>});
+        Register(clsid, w_class_name.c_str(), CreateClass<CLS>, CreateClasses<CLS>);
         return class_name; // pass-through name
     }
 
+    /** Non-Windows extension for creating "count" instances of a class in one call, e.g. when loading large datasets.
+        In-process classes are packed contiguously in slabs, see CComObject<BASE>::CreateInstances. Other classes are created one by one.
+        Returns AddRef'ed IUnknown pointers. No objects are returned on failure. */
+    static HRESULT CreateInstances (const GUID& clsid, DWORD context, ULONG count, IUnknown** objs) {
+        if (!objs && count)
+            return E_POINTER;
+        if (context & CLSCTX_INPROC_SERVER) {
+            BulkFactory factory = FindBulkFactory(clsid);
+            if (!factory && (CoInternalLoadClassLibrary(&clsid, nullptr, context) == S_OK))
+                factory = FindBulkFactory(clsid); // retry after loading library from class catalog
+            if (factory)
+                return factory(count, objs);
+        }
+
+        for (ULONG idx = 0; idx < count; ++idx) {
+            HRESULT hr = CreateInstance(clsid, nullptr, context, &objs[idx]);
+            if (FAILED(hr)) {
+                for (ULONG prev = 0; prev < idx; ++prev) {
+                    objs[prev]->Release();
+                    objs[prev] = nullptr;
+                }
+                return hr;
+            }
+        }
+        return S_OK;
+    }
+
+    /** Remove a class registration, e.g. before unloading the module that implements it. Returns S_FALSE if the class isn't registered.
+        Activation doesn't block on unregistration, so the caller must ensure that no other thread is still activating the class. */
+    static HRESULT UnregisterClass (const GUID& clsid);
+
 private:
+    /** Detect DECLARE_CLASSFACTORY_SINGLETON or similar per-class activation policies. */
+    template <class CLS, class = void>
+    struct HasClassFactoryCreator : std::false_type {};
+    template <class CLS>
+    struct HasClassFactoryCreator<CLS, std::void_t<typename CLS::_ClassFactoryCreatorClass>> : std::true_type {};
+
     template <class CLS>
     static HRESULT CreateClass (IUnknown* outer, IUnknown** obj) {
-        if (outer) {
-            // create an object (with ref. count zero)
-            CComAggObject<CLS> * tmp = nullptr;
-            HRESULT hr = CComAggObject<CLS>::CreateInstance(outer, &tmp);
-            if (FAILED(hr))
+        if constexpr (HasClassFactoryCreator<CLS>::value) {
+            // delegate to class-specific activation policy
+            return CLS::_ClassFactoryCreatorClass::CreateInstance(outer, obj);
+        } else if (outer) {
+            if constexpr (CComHasWeakRefs<CLS>::value) {
+                return CLASS_E_NOAGGREGATION; // weak reference control block requires CComObject
+            } else {
+                // create an object (with ref. count zero)
+                CComAggObject<CLS> * tmp = nullptr;
+                HRESULT hr = CComAggObject<CLS>::CreateInstance(outer, &tmp);
+                if (FAILED(hr))
+                    return hr;
+
+                tmp->AddRef(); // incr. ref-count to one
+                *obj = tmp;
                 return hr;
-
-            tmp->AddRef(); // incr. ref-count to one
-            *obj = tmp;
-            return hr;
+            }
         } else {
             // create an object (with ref. count zero)
             CComObject<CLS> * tmp = nullptr;
@@ -697,11 +1384,103 @@ private:
         }
     }
 
-    static Buffer<Entry> & Factories ();
+    template <class CLS>
+    static HRESULT CreateClasses (ULONG count, IUnknown** objs) {
+        if constexpr (HasClassFactoryCreator<CLS>::value || CComHasWeakRefs<CLS>::value) {
+            // delegate to class-specific activation policy, or separate allocations with weak reference control blocks
+            for (ULONG idx = 0; idx < count; ++idx) {
+                HRESULT hr = CreateClass<CLS>(nullptr, &objs[idx]);
+                if (FAILED(hr)) {
+                    for (ULONG prev = 0; prev < idx; ++prev) {
+                        objs[prev]->Release();
+                        objs[prev] = nullptr;
+                    }
+                    return hr;
+                }
+            }
+            return S_OK;
+        } else {
+            // create objects in one slab
+            return CComSlabObject<CLS>::Create(count, [objs](ULONG idx, CComObject<CLS>* obj) {
+                obj->AddRef(); // incr. ref-count to one
+                objs[idx] = obj;
+            });
+        }
+    }
+
+    /** Registry with copy-on-write snapshots, so that lookups are lock-free & safe during concurrent (un)registration. */
+    static void        Register (const GUID& clsid, const wchar_t* name, Factory factory, BulkFactory bulk_factory);
+    static Factory     FindFactory (const GUID& clsid);
+    static Factory     FindFactory (const wchar_t* name);
+    static bool        FindClassId (const wchar_t* name, GUID& clsid);
+    static BulkFactory FindBulkFactory (const GUID& clsid);
+
+public:
+    /** Factory functions for OBJECT_ENTRY_AUTO. */
+    template <class CLS>
+    static constexpr Factory ClassFactory = &CreateClass<CLS>;
+    template <class CLS>
+    static constexpr BulkFactory ClassBulkFactory = &CreateClasses<CLS>;
+};
+
+/** Non-Windows extension for unregistering all classes implemented in the shared library that contains "address",
+    e.g. from an __attribute__((destructor)) function in a plugin, or by the host before calling dlclose.
+    Also drops the class catalog's reference to the library, so that it's unloaded once the host's references are closed
+    and loaded again on next activation. Returns S_FALSE if no classes were registered from the library. */
+HRESULT CoRevokeModuleClasses (const void* address);
+
+
+#ifdef __ELF__
+/** Constant-initialized class registration emitted by OBJECT_ENTRY_AUTO into the "com_object_entries" section. */
+struct ObjectEntry {
+    GUID                     clsid;
+    const char*              name;
+    IUnknownFactory::Factory     factory;
+    IUnknownFactory::BulkFactory bulk_factory;
+};
+
+/** Bounds of the "com_object_entries" section in a module (executable or shared library). */
+struct ObjectEntrySection {
+    const ObjectEntry*  begin;
+    const ObjectEntry*  end;
+    ObjectEntrySection* next; ///< list of sections that are pending registration
+};
+
+/** Internal function. Queue the section of a module for registration on first activation. Doesn't allocate. */
+bool CoInternalRegisterObjectSection (ObjectEntrySection* section);
+/** Internal function. Drop the section of a module that is unloaded while its registration is still pending. */
+void CoInternalUnregisterObjectSection (ObjectEntrySection* section);
+
+/** Queues the section of a module on load, and drops it on unload if no lookup registered it in the meantime. */
+struct ObjectEntrySectionRegistration {
+    ObjectEntrySectionRegistration (ObjectEntrySection* section) : m_section(section), m_queued(CoInternalRegisterObjectSection(section)) {
+    }
+    ~ObjectEntrySectionRegistration () {
+        if (m_queued)
+            CoInternalUnregisterObjectSection(m_section);
+    }
+
+    ObjectEntrySection* const m_section;
+    const bool                m_queued;
 };
 
+// section bounds provided by the linker. Hidden, so that each module refers to its own section
+extern "C" __attribute__((weak, visibility("hidden"))) ObjectEntry __start_com_object_entries[];
+extern "C" __attribute__((weak, visibility("hidden"))) ObjectEntry __stop_com_object_entries[];
+
+/** One section per module. Only the registration object is dynamically initialized, and only once per module. */
+__attribute__((visibility("hidden"))) inline ObjectEntrySection s_object_entry_section = {__start_com_object_entries, __stop_com_object_entries, nullptr};
+__attribute__((visibility("hidden"))) inline ObjectEntrySectionRegistration s_object_entry_section_registration {&s_object_entry_section};
+
+// explicit alignment prevents the compiler from over-aligning entries, which would leave gaps in the section
+#define OBJECT_ENTRY_AUTO(clsid, cls) \
+    __attribute__((weak)) __attribute__((used)) __attribute__((section("com_object_entries"))) __attribute__((aligned(alignof(ObjectEntry)))) \
+    ObjectEntry tmp_factory_##cls = {clsid, #cls, IUnknownFactory::ClassFactory<cls>, IUnknownFactory::ClassBulkFactory<cls>};
+#else
+// fallback to registration from dynamic initializers on platforms without linker-provided section bounds
 #define OBJECT_ENTRY_AUTO(clsid, cls) \
     __attribute__((weak)) __attribute__((used)) const char* tmp_factory_##cls = IUnknownFactory::RegisterClass<cls>(clsid, #cls);
+#endif
 
 
 /** Mostly API-compatible subset of the Microsoft _com_ptr_t class documented on https://docs.microsoft.com/en-us/cpp/cpp/com-ptr-t-class */
@@ -833,11 +1612,11 @@ public:
     }
 
     HRESULT CreateInstance (const GUID& clsid, IUnknown* outer = nullptr, DWORD context = CLSCTX_ALL) noexcept {
-        (void)context;
-
-        _com_ptr_t<IUnknown> tmp1(IUnknownFactory::CreateInstance(clsid, outer), /*addref*/false);
-        if (!tmp1)
-            return E_FAIL;
+        IUnknown* tmp0 = nullptr;
+        HRESULT hr = IUnknownFactory::CreateInstance(clsid, outer, context, &tmp0);
+        if (FAILED(hr))
+            return hr;
+        _com_ptr_t<IUnknown> tmp1(tmp0, /*addref*/false);
 
         _com_ptr_t tmp2 = tmp1; // cast
         if (!tmp2)
@@ -848,14 +1627,14 @@ public:
     }
 
     HRESULT CreateInstance(const wchar_t* name, IUnknown* outer = nullptr, DWORD context = CLSCTX_ALL) noexcept {
-        (void)context;
-
         if (!name)
             return E_INVALIDARG;
 
-        _com_ptr_t<IUnknown> tmp1(IUnknownFactory::CreateInstance(name, outer), /*addref*/false);
-        if (!tmp1)
-            return E_FAIL;
+        IUnknown* tmp0 = nullptr;
+        HRESULT hr = IUnknownFactory::CreateInstance(name, outer, context, &tmp0);
+        if (FAILED(hr))
+            return hr;
+        _com_ptr_t<IUnknown> tmp1(tmp0, /*addref*/false);
 
         _com_ptr_t tmp2 = tmp1; // cast
         if (!tmp2)
@@ -983,11 +1762,10 @@ public:
     }
 
     HRESULT CoCreateInstance (std::wstring name, IUnknown* outer = NULL, DWORD context = CLSCTX_ALL) {
-        (void)context;
-
-        IUnknown* tmp0 = IUnknownFactory::CreateInstance(name, outer); // RefCount=1
-        if (!tmp0)
-            return E_FAIL;
+        IUnknown* tmp0 = nullptr;
+        HRESULT hr = IUnknownFactory::CreateInstance(name, outer, context, &tmp0); // RefCount=1
+        if (FAILED(hr))
+            return hr;
 
         CComPtr<IUnknown> tmp1;
         tmp1.Attach(tmp0);
@@ -1002,10 +1780,10 @@ public:
     }
 
     HRESULT CoCreateInstance (GUID clsid, IUnknown* outer = NULL, DWORD context = CLSCTX_ALL) {
-        (void)context;
-        IUnknown* tmp0 = IUnknownFactory::CreateInstance(clsid, outer); // RefCount=1
-        if (!tmp0)
-            return E_FAIL;
+        IUnknown* tmp0 = nullptr;
+        HRESULT hr = IUnknownFactory::CreateInstance(clsid, outer, context, &tmp0); // RefCount=1
+        if (FAILED(hr))
+            return hr;
 
         CComPtr<IUnknown> tmp1;
         tmp1.Attach(tmp0);
@@ -1071,10 +1849,54 @@ struct CComSafeArray;
 
 } // namespace ATL
 
+typedef unsigned short VARTYPE;
+
+/** VARIANT type tags (subset of VARENUM). */
+enum VARENUM {
+    VT_EMPTY    = 0,
+    VT_NULL     = 1,
+    VT_I2       = 2,
+    VT_I4       = 3,
+    VT_R4       = 4,
+    VT_R8       = 5,
+    VT_BSTR     = 8,
+    VT_DISPATCH = 9,
+    VT_ERROR    = 10,
+    VT_BOOL     = 11,
+    VT_VARIANT  = 12,
+    VT_UNKNOWN  = 13,
+    VT_I1       = 16,
+    VT_UI1      = 17,
+    VT_UI2      = 18,
+    VT_UI4      = 19,
+    VT_I8       = 20,
+    VT_UI8      = 21,
+    VT_INT      = 22,
+    VT_UINT     = 23,
+    VT_RECORD   = 36,
+    VT_ARRAY    = 0x2000,
+    VT_BYREF    = 0x4000,
+    VT_TYPEMASK = 0x0FFF,
+};
+
+/** Record (UDT) types with IRecordInfo metadata. Specialized in headers generated by IdlParse.py for IDL structs,
+    so that CComSafeArray<T> stores them as VT_RECORD arrays with owned members. */
+template <class T>
+struct IsRecordType : std::false_type {};
+/** Static IRecordInfo instance for a record type. Specialized in headers generated by IdlParse.py. */
+template <class T>
+IRecordInfo* RecordInfoOf ();
+
 /** Internal class that SHALL ONLY be accessed through CComSafeArray<T> to preserve Windows compatibility. */
 struct SAFEARRAY {
     template<typename T>
     friend struct ATL::CComSafeArray;
+    friend HRESULT SafeArrayDestroy (SAFEARRAY* psa);
+    friend HRESULT SafeArrayCopy (SAFEARRAY* psa, SAFEARRAY** ppsaOut);
+    friend HRESULT SafeArrayGetRecordInfo (SAFEARRAY* psa, IRecordInfo** prinfo);
+    friend HRESULT SafeArrayGetVartype (SAFEARRAY* psa, VARTYPE* pvt);
+    friend HRESULT SafeArrayChangeType (SAFEARRAY* psa, VARTYPE vt, SAFEARRAY** ppsaOut);
+    friend struct SafeArrayMarshaler; // out-of-process marshaling (see Marshal.hpp)
 
 private:
     enum TYPE {
@@ -1082,48 +1904,88 @@ private:
         TYPE_DATA,
         TYPE_STRINGS,
         TYPE_POINTERS,
+        TYPE_RECORDS, ///< contiguous records in "data", described by "record"
     };
 
-    SAFEARRAY (TYPE t) : type(t), elm_size(sizeof(void*)) {
+    SAFEARRAY (TYPE t) : type(t), elm_size(sizeof(void*)), vt((t == TYPE_STRINGS) ? VT_BSTR : VT_UNKNOWN) {
         assert(t == TYPE_STRINGS || t == TYPE_POINTERS);
     }
-    SAFEARRAY (unsigned int _elm_size, unsigned int count) : type(TYPE_DATA), data(_elm_size*count), elm_size(_elm_size) {
+    SAFEARRAY (VARTYPE _vt, unsigned int _elm_size, unsigned int count) : type(TYPE_DATA), data(_elm_size*count), elm_size(_elm_size), vt(_vt) {
+    }
+    SAFEARRAY (VARTYPE _vt, unsigned int _elm_size, unsigned int count, IUnknown* _storage, void* _data) : type(TYPE_DATA), storage(_storage), data(_elm_size*count, static_cast<unsigned char*>(_data)), elm_size(_elm_size), vt(_vt) {
     }
-    SAFEARRAY(const SAFEARRAY& other, bool deep_copy) : type(other.type), data(other.data, deep_copy), strings(other.strings, deep_copy), pointers(other.pointers, deep_copy), elm_size(other.elm_size) {
+    /** Zero-initialized records. */
+    SAFEARRAY (IRecordInfo* info, unsigned int _elm_size, unsigned int count) : type(TYPE_RECORDS), data(_elm_size*count), record(info), elm_size(_elm_size), vt(VT_RECORD) {
+    }
+    SAFEARRAY(const SAFEARRAY& other, bool deep_copy) : type(other.type), data(other.data, deep_copy), strings(other.strings, deep_copy), pointers(other.pointers, deep_copy), record(other.record), elm_size(other.elm_size), vt(other.vt) {
+        if ((type == TYPE_RECORDS) && deep_copy) {
+            // replace bitwise copy with owned members
+            memset(data.data(), 0, data.size());
+            for (size_t offset = 0; offset < data.size(); offset += elm_size)
+                record->RecordCopy(const_cast<unsigned char*>(&other.data[offset]), &data[offset]);
+        }
     }
 
     ~SAFEARRAY() {
+        if ((type == TYPE_RECORDS) && data.owning()) {
+            for (size_t offset = 0; offset < data.size(); offset += elm_size)
+                record->RecordClear(&data[offset]);
+        }
     }
 
     SAFEARRAY () = delete;
     SAFEARRAY& operator = (const SAFEARRAY&) = delete;
     
     static SAFEARRAY* Create(TYPE t) {
-        auto* ptr = (SAFEARRAY*)malloc(sizeof(SAFEARRAY));
+        auto* ptr = (SAFEARRAY*)CoTaskMemAlloc(sizeof(SAFEARRAY));
         new (ptr) SAFEARRAY(t);
         return ptr;
     }
-    static SAFEARRAY* Create(unsigned int _elm_size, unsigned int count) {
-        auto* ptr = (SAFEARRAY*)malloc(sizeof(SAFEARRAY));
-        new (ptr) SAFEARRAY(_elm_size, count);
+    static SAFEARRAY* Create(VARTYPE _vt, unsigned int _elm_size, unsigned int count) {
+        auto* ptr = (SAFEARRAY*)CoTaskMemAlloc(sizeof(SAFEARRAY));
+        new (ptr) SAFEARRAY(_vt, _elm_size, count);
+        return ptr;
+    }
+    /** Wrap data owned by "storage". */
+    static SAFEARRAY* Create(VARTYPE _vt, unsigned int _elm_size, unsigned int count, IUnknown* storage, void* data) {
+        auto* ptr = (SAFEARRAY*)CoTaskMemAlloc(sizeof(SAFEARRAY));
+        new (ptr) SAFEARRAY(_vt, _elm_size, count, storage, data);
+        return ptr;
+    }
+    static SAFEARRAY* Create(IRecordInfo* info, unsigned int count) {
+        ULONG size = 0;
+        info->GetSize(&size);
+        auto* ptr = (SAFEARRAY*)CoTaskMemAlloc(sizeof(SAFEARRAY));
+        new (ptr) SAFEARRAY(info, size, count);
         return ptr;
     }
     static SAFEARRAY* Create(const SAFEARRAY& other, bool deep_copy = true) {
-        auto* ptr = (SAFEARRAY*)malloc(sizeof(SAFEARRAY));
+        auto* ptr = (SAFEARRAY*)CoTaskMemAlloc(sizeof(SAFEARRAY));
         new (ptr) SAFEARRAY(other, deep_copy);
         return ptr;
     }
     
     static void Destroy(SAFEARRAY* obj) {
         obj->~SAFEARRAY();
-        free(obj);
+        CoTaskMemFree(obj);
+    }
+
+    /** Switch from shared to CoTaskMemAlloc memory before resizing. */
+    void Unshare () {
+        if (!storage)
+            return;
+        data.make_owning();
+        storage.Release();
     }
 
     const TYPE                     type = TYPE_EMPTY; ///< \todo: Replace with std::variant when upgrading to C++17
+    ATL::CComPtr<IUnknown>         storage;           ///< owner of received shared-memory "data" (optional)
     Buffer<unsigned char>          data;
     Buffer<ATL::CComBSTR>          strings;
     Buffer<ATL::CComPtr<IUnknown>> pointers;
+    ATL::CComPtr<IRecordInfo>      record;            ///< TYPE_RECORDS layout
     const unsigned int             elm_size = 0;
+    const VARTYPE                  vt = VT_EMPTY;     ///< element type. VT_EMPTY for data without a VARTYPE mapping
 };
 
 
@@ -1142,20 +2004,35 @@ struct CComTypeWrapper<IUnknown*> {
     typedef CComPtr<IUnknown> type; // wrap IUnknown* in CComPtr
 };
 
+template <typename T>
+struct CVarTypeInfo;
+
+/** Element VARTYPE of CComSafeArray<T>. VT_EMPTY for types without a CVarTypeInfo mapping, which are only checked by size. */
+template <class T, class = void>
+struct CComSafeArrayType : std::integral_constant<VARTYPE, IsRecordType<T>::value ? VT_RECORD : VT_EMPTY> {};
+template <class T>
+struct CComSafeArrayType<T, std::void_t<decltype(CVarTypeInfo<T>::VT)>> : std::integral_constant<VARTYPE, CVarTypeInfo<T>::VT> {};
+
 template <class T>
 struct CComSafeArray {
     CComSafeArray () {
     }
 
     CComSafeArray (UINT size) {
-        m_ptr = SAFEARRAY::Create(sizeof(T), size);
+        if constexpr (IsRecordType<T>::value)
+            m_ptr = SAFEARRAY::Create(RecordInfoOf<T>(), size);
+        else
+            m_ptr = SAFEARRAY::Create(CComSafeArrayType<T>::value, sizeof(T), size);
     }
 
+    /** Deep copy. Arrays of another element type are not copied, leaving this array empty, and assert in debug builds. */
     CComSafeArray (SAFEARRAY * obj) {
-        if (obj) {
-            assert(obj->elm_size == sizeof(T));
+        if (!obj)
+            return;
+        bool compatible = IsCompatible(obj);
+        assert(compatible && "CComSafeArray element type doesn't match the array.");
+        if (compatible)
             m_ptr = SAFEARRAY::Create(*obj);
-        }
     }
 
     ~CComSafeArray () {
@@ -1181,9 +2058,11 @@ struct CComSafeArray {
         return S_OK;
     }
 
+    /** Take over ownership. Fails with E_INVALIDARG without taking ownership if the element type doesn't match. */
     HRESULT Attach (SAFEARRAY * obj) {
         assert(obj);
-        assert(obj->elm_size == sizeof(T));
+        if (!IsCompatible(obj))
+            return E_INVALIDARG;
         Destroy();
         m_ptr = obj;
         return S_OK;
@@ -1198,9 +2077,24 @@ struct CComSafeArray {
         return m_ptr;
     }
 
+    VARTYPE GetType () const {
+        assert(m_ptr);
+        return m_ptr->vt;
+    }
+
+    /** Check if an array can be accessed as CComSafeArray<T>. */
+    static bool IsCompatible (const SAFEARRAY* obj) {
+        constexpr VARTYPE vt = CComSafeArrayType<T>::value;
+        if ((obj->elm_size != sizeof(T)) || ((vt != VT_EMPTY) && (obj->vt != VT_EMPTY) && (obj->vt != vt)))
+            return false;
+        if constexpr (IsRecordType<T>::value)
+            return (obj->type == SAFEARRAY::TYPE_RECORDS) && obj->record->IsMatchingType(RecordInfoOf<T>());
+        return true;
+    }
+
     typename CComTypeWrapper<T>::type& GetAt (int idx) const {
         assert(m_ptr);
-        assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
+        assert((m_ptr->type == SAFEARRAY::TYPE_DATA) || (m_ptr->type == SAFEARRAY::TYPE_RECORDS));
         unsigned char * ptr = &m_ptr->data[idx*m_ptr->elm_size];
         return reinterpret_cast<T&>(*ptr);
     }
@@ -1212,37 +2106,55 @@ struct CComSafeArray {
     HRESULT SetAt (int idx, const T& val, bool copy = true) {
         (void)copy; // mute unreferenced argument warning
         assert(m_ptr);
-        assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
         assert(sizeof(T) == m_ptr->elm_size);
         unsigned char * ptr = &m_ptr->data[idx*m_ptr->elm_size];
-        reinterpret_cast<T&>(*ptr) = val;
-        return S_OK;
+        if constexpr (IsRecordType<T>::value) {
+            assert(m_ptr->type == SAFEARRAY::TYPE_RECORDS);
+            return m_ptr->record->RecordCopy(const_cast<T*>(&val), ptr); // deep copy
+        } else {
+            assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
+            reinterpret_cast<T&>(*ptr) = val;
+            return S_OK;
+        }
     }
 
     HRESULT Add (const typename CComTypeWrapper<T>::type& t, BOOL copy = true) {
         (void)copy; // mute unreferenced argument warning
         
-        if (!m_ptr)
-            m_ptr = SAFEARRAY::Create(sizeof(T), 0); // lazy initialization
-
-        assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
-        assert(sizeof(T) == m_ptr->elm_size);
-        const size_t prev_size = m_ptr->data.size();
-        m_ptr->data.resize(prev_size + sizeof(T), 0);
-        reinterpret_cast<T&>(m_ptr->data[prev_size]) = t;
-        return S_OK;
+        if constexpr (IsRecordType<T>::value) {
+            if (!m_ptr)
+                m_ptr = SAFEARRAY::Create(RecordInfoOf<T>(), 0); // lazy initialization
+
+            // records are moved bitwise on reallocation, since they're owned by the array
+            assert(m_ptr->type == SAFEARRAY::TYPE_RECORDS);
+            const size_t prev_size = m_ptr->data.size();
+            m_ptr->data.resize(prev_size + sizeof(T), 0);
+            return m_ptr->record->RecordCopy(const_cast<T*>(&t), &m_ptr->data[prev_size]);
+        } else {
+            if (!m_ptr)
+                m_ptr = SAFEARRAY::Create(CComSafeArrayType<T>::value, sizeof(T), 0); // lazy initialization
+
+            assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
+            assert(sizeof(T) == m_ptr->elm_size);
+            m_ptr->Unshare();
+            const size_t prev_size = m_ptr->data.size();
+            m_ptr->data.resize(prev_size + sizeof(T), 0);
+            reinterpret_cast<T&>(m_ptr->data[prev_size]) = t;
+            return S_OK;
+        }
     }
 
     unsigned int GetCount () const {
         assert(m_ptr);
-        assert(m_ptr->type == SAFEARRAY::TYPE_DATA);
+        assert((m_ptr->type == SAFEARRAY::TYPE_DATA) || (m_ptr->type == SAFEARRAY::TYPE_RECORDS));
         return static_cast<unsigned int>(m_ptr->data.size()/m_ptr->elm_size);
     }
     
     /** Internal function. Do NOT call unless you know what you're doing. */
     static typename CComTypeWrapper<T>::type* InternalDataPointer(SAFEARRAY* obj) {
         CComSafeArray<T> sa;
-        sa.Attach(obj);
+        if (FAILED(sa.Attach(obj)))
+            return nullptr;
         typename CComTypeWrapper<T>::type* ptr = &sa.GetAt(0);
         sa.Detach();
         return ptr;
@@ -1251,7 +2163,8 @@ struct CComSafeArray {
     /** Internal function. Do NOT call unless you know what you're doing. */
     static unsigned int InternalElementCount(SAFEARRAY* obj) {
         CComSafeArray<T> sa;
-        sa.Attach(obj);
+        if (FAILED(sa.Attach(obj)))
+            return 0;
         unsigned int count = sa.GetCount();
         sa.Detach();
         return count;
@@ -1274,7 +2187,556 @@ template <> HRESULT                      CComSafeArray<BSTR>::Add (const typenam
 template <> HRESULT                 CComSafeArray<IUnknown*>::Add (const typename CComTypeWrapper<IUnknown*>::type& t, BOOL copy);
 template <> unsigned int CComSafeArray<BSTR>::GetCount () const;
 template <> unsigned int CComSafeArray<IUnknown*>::GetCount () const;
+} // namespace ATL
+
+/** Destroy an array and its content. */
+HRESULT SafeArrayDestroy (SAFEARRAY* psa);
+/** Deep copy of an array. */
+HRESULT SafeArrayCopy (SAFEARRAY* psa, SAFEARRAY** ppsaOut);
+/** Record layout of a VT_RECORD array. Fails with E_INVALIDARG for other arrays. */
+HRESULT SafeArrayGetRecordInfo (SAFEARRAY* psa, IRecordInfo** prinfo);
+/** Element type of an array. VT_EMPTY for arrays of types without a VARTYPE mapping. */
+HRESULT SafeArrayGetVartype (SAFEARRAY* psa, VARTYPE* pvt);
+/** Non-Windows extension: Convert a numeric array to another element type, like VariantChangeType for each element.
+    Supports VT_UI1, VT_I2, VT_I4, VT_R4 & VT_R8. Converts 8 elements per step with SSE2 instructions on x86.
+    Real numbers are rounded half to even. Fails with DISP_E_OVERFLOW if any element is out of range & DISP_E_BADVARTYPE for other types. */
+HRESULT SafeArrayChangeType (SAFEARRAY* psa, VARTYPE vt, SAFEARRAY** ppsaOut);
+
+
+// Automation types
+typedef LONG           DISPID;
+typedef DWORD          LCID;
+typedef wchar_t        OLECHAR;
+typedef OLECHAR*       LPOLESTR;
+
+#define VARIANT_TRUE  static_cast<VARIANT_BOOL>(-1)
+#define VARIANT_FALSE static_cast<VARIANT_BOOL>(0)
+
+struct IDispatch;
+
+/** Tagged union with the same memory layout as on Windows. */
+struct VARIANT {
+    VARTYPE vt;
+    WORD    wReserved1;
+    WORD    wReserved2;
+    WORD    wReserved3;
+    union {
+        LONGLONG      llVal;
+        LONG          lVal;
+        BYTE          bVal;
+        short         iVal;
+        float         fltVal;
+        double        dblVal;
+        VARIANT_BOOL  boolVal;
+        LONG          scode;
+        BSTR          bstrVal;
+        IUnknown*     punkVal;
+        IDispatch*    pdispVal;
+        SAFEARRAY*    parray;
+        char          cVal;
+        USHORT        uiVal;
+        ULONG         ulVal;
+        ULONGLONG     ullVal;
+        int           intVal;
+        unsigned int  uintVal;
+        VARIANT*      pvarVal; ///< VT_BYREF | VT_VARIANT
+        void*         byref;   ///< other VT_BYREF types
+        struct {
+            void*     pvRecord;
+            void*     pRecInfo;
+        }             brecVal; ///< VT_RECORD (not supported)
+    };
+};
+typedef VARIANT VARIANTARG;
+static_assert(sizeof(VARIANT) == 8 + 2*sizeof(void*), "VARIANT size mismatch");
+
+/** Member of a record type. Members of VT_BSTR, VT_UNKNOWN, VT_DISPATCH, VT_VARIANT & VT_ARRAY types are owned by
+    the record, and are deep-copied & freed. Other members are copied bitwise. */
+struct RecordField {
+    const wchar_t* name;
+    ULONG          offset;
+    VARTYPE        vt;
+};
+
+/** IRecordInfo implementation for record types with RecordInfoOf<T>() metadata generated by IdlParse.py.
+    Instances are static, so reference-counting is a no-op. Only owned members are visited when clearing & copying.
+    IsMatchingType compares GUIDs, or the name & field layout for structs without uuid, which all have the null GUID. */
+class CComRecordInfo : public IRecordInfo {
+public:
+    CComRecordInfo (const GUID& guid, const wchar_t* name, ULONG size, const RecordField* fields, ULONG count);
+    ~CComRecordInfo () override;
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override;
+    ULONG   AddRef () override;
+    ULONG   Release () override;
+
+    HRESULT RecordInit (void* pvNew) override;
+    HRESULT RecordClear (void* pvExisting) override;
+    HRESULT RecordCopy (void* pvExisting, void* pvNew) override;
+    HRESULT GetGuid (GUID* pguid) override;
+    HRESULT GetName (BSTR* pbstrName) override;
+    HRESULT GetSize (ULONG* pcbSize) override;
+    HRESULT GetFieldNames (ULONG* pcNames, BSTR* rgBstrNames) override;
+    BOOL    IsMatchingType (IRecordInfo* pRecordInfo) override;
+    void*   RecordCreate () override;
+    HRESULT RecordCreateCopy (void* pvSource, void** ppvDest) override;
+    HRESULT RecordDestroy (void* pvRecord) override;
+
+    CComRecordInfo (const CComRecordInfo&) = delete;
+    CComRecordInfo& operator = (const CComRecordInfo&) = delete;
+
+private:
+    GUID               m_guid;
+    const wchar_t*     m_name = nullptr;
+    ULONG              m_size = 0;   ///< record size [bytes]
+    const RecordField* m_fields = nullptr;
+    ULONG              m_count = 0;
+    RecordField*       m_owned = nullptr; ///< subset of m_fields with owned members
+    ULONG              m_owned_count = 0;
+};
+
+#define VARIANT_NOVALUEPROP 0x01
+#define VARIANT_ALPHABOOL   0x02 ///< convert VT_BOOL to "True"/"False" instead of "-1"/"0"
+
+/** Set vt to VT_EMPTY. */
+void    VariantInit (VARIANT* pvarg);
+/** Free BSTR, SAFEARRAY or interface content & set vt to VT_EMPTY. */
+HRESULT VariantClear (VARIANT* pvarg);
+/** Free pvargDest content & replace with a copy of pvargSrc. Strings & arrays are deep-copied, and interfaces AddRef'ed. */
+HRESULT VariantCopy (VARIANT* pvargDest, const VARIANT* pvargSrc);
+/** Type conversion between numeric types (including VT_BOOL), VT_BSTR & VT_EMPTY, between VT_DISPATCH & VT_UNKNOWN,
+    and between numeric arrays (see SafeArrayChangeType). Strings are parsed & formatted with the C locale. VT_BYREF sources are dereferenced.
+    Fails with DISP_E_OVERFLOW if the value is out of range & DISP_E_TYPEMISMATCH for other types. */
+HRESULT VariantChangeType (VARIANT* pvargDest, const VARIANT* pvarSrc, USHORT wFlags, VARTYPE vt);
+
+/** IDispatch::Invoke arguments. */
+struct DISPPARAMS {
+    VARIANTARG* rgvarg;            ///< arguments in reverse order
+    DISPID*     rgdispidNamedArgs;
+    UINT        cArgs;
+    UINT        cNamedArgs;
+};
+
+/** IDispatch::Invoke error details. */
+struct EXCEPINFO {
+    WORD    wCode;
+    WORD    wReserved;
+    BSTR    bstrSource;
+    BSTR    bstrDescription;
+    BSTR    bstrHelpFile;
+    DWORD   dwHelpContext;
+    void*   pvReserved;
+    HRESULT (*pfnDeferredFillIn)(EXCEPINFO*);
+    LONG    scode;
+};
+
+struct ITypeInfo; ///< type libraries are not supported
+
+#define DISPATCH_METHOD         0x1
+#define DISPATCH_PROPERTYGET    0x2
+#define DISPATCH_PROPERTYPUT    0x4
+#define DISPATCH_PROPERTYPUTREF 0x8
+
+#define DISPID_UNKNOWN     (-1)
+#define DISPID_VALUE       0
+#define DISPID_PROPERTYPUT (-3)
+
+extern "C" {
+static constexpr GUID IID_NULL      = {0x00000000,0x0000,0x0000,{0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}};
+static constexpr GUID IID_IDispatch = {0x00020400,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+
+/** Late-binding interface for automation clients. */
+struct IDispatch : virtual public IUnknown {
+    virtual HRESULT GetTypeInfoCount (UINT* pctinfo) = 0;
+    virtual HRESULT GetTypeInfo (UINT iTInfo, LCID lcid, ITypeInfo** ppTInfo) = 0;
+    virtual HRESULT GetIDsOfNames (const IID& riid, LPOLESTR* rgszNames, UINT cNames, LCID lcid, DISPID* rgDispId) = 0;
+    virtual HRESULT Invoke (DISPID dispIdMember, const IID& riid, LCID lcid, WORD wFlags, DISPPARAMS* pDispParams, VARIANT* pVarResult, EXCEPINFO* pExcepInfo, UINT* puArgErr) = 0;
+};
+} // extern "C"
+DEFINE_UUIDOF(IDispatch)
+
+
+namespace ATL {
+
+/** Compile-time mapping from C++ type to VARTYPE & VARIANT member. */
+template <typename T>
+struct CVarTypeInfo;
+#define VARTYPE_INFO_ENTRY(TYPE, VARTYPE_, MEMBER) \
+    template <> struct CVarTypeInfo<TYPE> { \
+        static constexpr VARTYPE VT = VARTYPE_; \
+        static constexpr TYPE VARIANT::* pmField = &VARIANT::MEMBER; \
+    };
+VARTYPE_INFO_ENTRY(char, VT_I1, cVal)
+VARTYPE_INFO_ENTRY(BYTE, VT_UI1, bVal)
+VARTYPE_INFO_ENTRY(short, VT_I2, iVal)
+VARTYPE_INFO_ENTRY(USHORT, VT_UI2, uiVal)
+VARTYPE_INFO_ENTRY(LONG, VT_I4, lVal)
+VARTYPE_INFO_ENTRY(ULONG, VT_UI4, ulVal)
+VARTYPE_INFO_ENTRY(LONGLONG, VT_I8, llVal)
+VARTYPE_INFO_ENTRY(ULONGLONG, VT_UI8, ullVal)
+VARTYPE_INFO_ENTRY(float, VT_R4, fltVal)
+VARTYPE_INFO_ENTRY(double, VT_R8, dblVal)
+VARTYPE_INFO_ENTRY(BSTR, VT_BSTR, bstrVal)
+VARTYPE_INFO_ENTRY(IUnknown*, VT_UNKNOWN, punkVal)
+VARTYPE_INFO_ENTRY(IDispatch*, VT_DISPATCH, pdispVal)
+#undef VARTYPE_INFO_ENTRY
+template <>
+struct CVarTypeInfo<VARIANT> {
+    static constexpr VARTYPE VT = VT_VARIANT;
+};
+
+/** VARIANT with automatic cleanup. Scalars are stored inline without heap allocations.
+    Moves, Attach/Detach & construction from CComBSTR or CComSafeArray rvalues transfer ownership without copying.
+    Copies follow VariantCopy semantics. */
+class CComVariant : public VARIANT {
+public:
+    CComVariant () noexcept {
+        VariantInit(this);
+    }
+    ~CComVariant () {
+        Clear();
+    }
+
+    CComVariant (const CComVariant& src) {
+        VariantInit(this);
+        InternalCopy(&src);
+    }
+    CComVariant (const VARIANT& src) {
+        VariantInit(this);
+        InternalCopy(&src);
+    }
+    CComVariant (CComVariant&& src) noexcept {
+        static_cast<VARIANT&>(*this) = src;
+        VariantInit(&src);
+    }
+
+    CComVariant (const wchar_t* src) {
+        VariantInit(this);
+        vt = VT_BSTR;
+        bstrVal = SysAllocString(src);
+    }
+    CComVariant (CComBSTR&& src) noexcept {
+        VariantInit(this);
+        vt = VT_BSTR;
+        bstrVal = src.Detach();
+    }
+    CComVariant (bool src) noexcept {
+        VariantInit(this);
+        vt = VT_BOOL;
+        boolVal = src ? VARIANT_TRUE : VARIANT_FALSE;
+    }
+    CComVariant (char src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (BYTE src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (short src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (USHORT src) noexcept {
+        SetScalar(src);
+    }
+    /** "vtSrc" can be VT_I4 or VT_INT. */
+    CComVariant (int src, VARTYPE vtSrc = VT_I4) noexcept {
+        VariantInit(this);
+        vt = vtSrc;
+        intVal = src;
+    }
+    /** "vtSrc" can be VT_UI4 or VT_UINT. */
+    CComVariant (unsigned int src, VARTYPE vtSrc = VT_UI4) noexcept {
+        VariantInit(this);
+        vt = vtSrc;
+        uintVal = src;
+    }
+    CComVariant (LONGLONG src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (ULONGLONG src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (float src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (double src) noexcept {
+        SetScalar(src);
+    }
+    CComVariant (IUnknown* src) noexcept {
+        SetScalar(src);
+        if (punkVal)
+            punkVal->AddRef();
+    }
+    CComVariant (IDispatch* src) noexcept {
+        SetScalar(src);
+        if (pdispVal)
+            pdispVal->AddRef();
+    }
+    /** Deep copy of an array. */
+    template <class T>
+    CComVariant (const CComSafeArray<T>& src) {
+        VariantInit(this);
+        vt = VT_ARRAY | CVarTypeInfo<T>::VT;
+        HRESULT hr = SafeArrayCopy(src.m_ptr, &parray);
+        if (FAILED(hr)) {
+            vt = VT_ERROR;
+            scode = hr;
+        }
+    }
+    template <class T>
+    CComVariant (CComSafeArray<T>&& src) noexcept {
+        VariantInit(this);
+        vt = VT_ARRAY | CVarTypeInfo<T>::VT;
+        parray = src.Detach();
+    }
+
+    CComVariant& operator = (const CComVariant& src) {
+        if (&src != this)
+            InternalCopy(&src);
+        return *this;
+    }
+    CComVariant& operator = (const VARIANT& src) {
+        if (&src != this)
+            InternalCopy(&src);
+        return *this;
+    }
+    CComVariant& operator = (CComVariant&& src) noexcept {
+        if (&src != this) {
+            Clear();
+            static_cast<VARIANT&>(*this) = src;
+            VariantInit(&src);
+        }
+        return *this;
+    }
+    /** Assign any type with a CComVariant constructor. */
+    template <class T, class = std::enable_if_t<!std::is_base_of<VARIANT, std::decay_t<T>>::value>>
+    CComVariant& operator = (T&& src) {
+        return operator = (CComVariant(std::forward<T>(src)));
+    }
+
+    /** Equality comparison of type & value. Strings are compared by content and interfaces by pointer. */
+    bool operator == (const VARIANT& other) const;
+    bool operator != (const VARIANT& other) const {
+        return !operator == (other);
+    }
+
+    HRESULT Clear () {
+        return VariantClear(this);
+    }
+    HRESULT Copy (const VARIANT* src) {
+        return VariantCopy(this, src);
+    }
+    /** Take over ownership of "src" content. "src" is left as VT_EMPTY. */
+    HRESULT Attach (VARIANT* src) {
+        if (!src)
+            return E_INVALIDARG;
+        HRESULT hr = Clear();
+        if (FAILED(hr))
+            return hr;
+        static_cast<VARIANT&>(*this) = *src;
+        VariantInit(src);
+        return S_OK;
+    }
+    /** Transfer ownership of the content to "dest", after clearing it. */
+    HRESULT Detach (VARIANT* dest) {
+        if (!dest)
+            return E_POINTER;
+        HRESULT hr = VariantClear(dest);
+        if (FAILED(hr))
+            return hr;
+        *dest = *this;
+        VariantInit(this);
+        return S_OK;
+    }
+    /** Convert in-place, or from "src" if non-null. */
+    HRESULT ChangeType (VARTYPE vtNew, const VARIANT* src = nullptr) {
+        return VariantChangeType(this, src ? src : this, 0, vtNew);
+    }
+
+private:
+    template <class T>
+    void SetScalar (T src) noexcept {
+        VariantInit(this);
+        vt = CVarTypeInfo<T>::VT;
+        this->*CVarTypeInfo<T>::pmField = src;
+    }
+    /** Copy with failure stored as VT_ERROR, like ATL without exceptions. */
+    void InternalCopy (const VARIANT* src) {
+        HRESULT hr = VariantCopy(this, src);
+        if (FAILED(hr)) {
+            vt = VT_ERROR;
+            scode = hr;
+        }
+    }
+};
+static_assert(sizeof(CComVariant) == sizeof(VARIANT), "CComVariant size mismatch");
 
+} // namespace ATL
+
+
+/** Generated IDispatch member thunk. Unpacks "params", calls the interface method on "itf" & stores any [out,retval] value in "result".
+    Returns DISP_E_* argument errors, or S_OK with the method HRESULT in "method_hr". */
+typedef HRESULT (*DispatchThunk)(void* itf, DISPPARAMS* params, VARIANT* result, UINT* arg_err, HRESULT* method_hr);
+
+struct DispatchMember {
+    const wchar_t* name;
+    DISPID         dispid;
+    WORD           flags;     ///< DISPATCH_METHOD, DISPATCH_PROPERTYGET, DISPATCH_PROPERTYPUT or DISPATCH_PROPERTYPUTREF
+    UINT           arg_count; ///< number of [in] arguments
+    DispatchThunk  thunk;
+};
+
+/** Member lookup for IDispatchImpl. Names & DISPIDs are hashed once on construction,
+    so that GetIDsOfNames & Invoke are O(1) without string comparisons of other members. */
+class DispatchTable {
+public:
+    DispatchTable (const DispatchMember* members, UINT count);
+    ~DispatchTable ();
+
+    /** Case-insensitive member name lookup. Argument names are not supported. */
+    HRESULT GetIDsOfNames (const IID& riid, LPOLESTR* names, UINT count, DISPID* dispids) const;
+    HRESULT Invoke (void* itf, DISPID dispid, const IID& riid, WORD flags, DISPPARAMS* params, VARIANT* result, EXCEPINFO* excepinfo, UINT* arg_err) const;
+
+    /** Find member with matching DISPATCH_* flag. Returns nullptr if not found. */
+    const DispatchMember* Find (DISPID dispid, WORD flag) const;
+
+    DispatchTable (const DispatchTable&) = delete;
+    DispatchTable& operator = (const DispatchTable&) = delete;
+
+private:
+    const DispatchMember* m_members = nullptr;
+    UINT                  m_count = 0;
+    UINT                  m_mask = 0;         ///< hash table size - 1
+    int*                  m_names = nullptr;  ///< open-addressing table of member indices, keyed by lower-case name
+    int*                  m_ids = nullptr;    ///< open-addressing table of member indices, keyed by DISPID & flag
+};
+
+/** Dispatch table for a dual interface. Specialized in headers generated by IdlParse.py. */
+template <class T>
+const DispatchTable& DispatchTableOf ();
+
+
+/** Compile-time VARTYPE to VARIANT member mapping for dispatch thunks. The primary template handles VT_ARRAY types. */
+template <VARTYPE VT>
+struct VariantType {
+    static_assert(VT & VT_ARRAY, "unsupported VARTYPE");
+    typedef SAFEARRAY* type;
+    static type& Ref (VARIANT& v) {
+        return v.parray;
+    }
+};
+#define VARIANT_TYPE_ENTRY(VT, TYPE, MEMBER) \
+    template <> struct VariantType<VT> { \
+        typedef TYPE type; \
+        static type& Ref (VARIANT& v) { return v.MEMBER; } \
+    };
+VARIANT_TYPE_ENTRY(VT_I1, char, cVal)
+VARIANT_TYPE_ENTRY(VT_UI1, BYTE, bVal)
+VARIANT_TYPE_ENTRY(VT_I2, short, iVal)
+VARIANT_TYPE_ENTRY(VT_UI2, USHORT, uiVal)
+VARIANT_TYPE_ENTRY(VT_I4, LONG, lVal)
+VARIANT_TYPE_ENTRY(VT_UI4, ULONG, ulVal)
+VARIANT_TYPE_ENTRY(VT_I8, LONGLONG, llVal)
+VARIANT_TYPE_ENTRY(VT_UI8, ULONGLONG, ullVal)
+VARIANT_TYPE_ENTRY(VT_INT, int, intVal)
+VARIANT_TYPE_ENTRY(VT_UINT, unsigned int, uintVal)
+VARIANT_TYPE_ENTRY(VT_R4, float, fltVal)
+VARIANT_TYPE_ENTRY(VT_R8, double, dblVal)
+VARIANT_TYPE_ENTRY(VT_BOOL, VARIANT_BOOL, boolVal)
+VARIANT_TYPE_ENTRY(VT_ERROR, LONG, scode)
+VARIANT_TYPE_ENTRY(VT_BSTR, BSTR, bstrVal)
+VARIANT_TYPE_ENTRY(VT_UNKNOWN, IUnknown*, punkVal)
+VARIANT_TYPE_ENTRY(VT_DISPATCH, IDispatch*, pdispVal)
+#undef VARIANT_TYPE_ENTRY
+template <>
+struct VariantType<VT_VARIANT> {
+    typedef VARIANT type;
+    static type& Ref (VARIANT& v) {
+        return v;
+    }
+};
+
+/** Argument unpacking for generated dispatch thunks. Owns temporaries created by type coercion. */
+template <UINT N>
+class DispatchArgs {
+public:
+    DispatchArgs (DISPPARAMS* params, UINT* arg_err) : m_params(params), m_arg_err(arg_err) {
+        for (UINT i = 0; i < N; ++i) {
+            VariantInit(&m_tmp[i]);
+            m_itfs[i] = nullptr;
+        }
+    }
+    ~DispatchArgs () {
+        for (UINT i = 0; i < N; ++i) {
+            VariantClear(&m_tmp[i]);
+            if (m_itfs[i])
+                m_itfs[i]->Release();
+        }
+    }
+
+    /** Borrow [in] argument "idx" (in declaration order), coercing it to VT if needed. */
+    template <VARTYPE VT, class T>
+    HRESULT Get (UINT idx, T& val) {
+        VARIANT* arg = &m_params->rgvarg[m_params->cArgs - 1 - idx]; // reverse order
+        if (arg->vt == (VT_BYREF | VT_VARIANT))
+            arg = arg->pvarVal;
+        if constexpr (VT != VT_VARIANT) {
+            if (arg->vt != VT) {
+                HRESULT hr = VariantChangeType(&m_tmp[idx], arg, 0, VT);
+                if (FAILED(hr))
+                    return Fail(idx, hr);
+                arg = &m_tmp[idx];
+            }
+        }
+        val = static_cast<T>(VariantType<VT>::Ref(*arg));
+        return S_OK;
+    }
+
+    /** Borrow [in] interface argument "idx" through QueryInterface. */
+    template <class T>
+    HRESULT GetInterface (UINT idx, T*& val) {
+        val = nullptr;
+        IUnknown* unk = nullptr;
+        HRESULT hr = Get<VT_UNKNOWN>(idx, unk);
+        if (FAILED(hr) || !unk)
+            return hr;
+        if (FAILED(unk->QueryInterface(__uuidof(T), reinterpret_cast<void**>(&val))))
+            return Fail(idx, DISP_E_TYPEMISMATCH);
+        m_itfs[idx] = static_cast<IUnknown*>(val);
+        return S_OK;
+    }
+
+    /** Store [out,retval] value, taking over ownership. */
+    template <VARTYPE VT, class T>
+    static void SetResult (VARIANT* result, const T& val) {
+        VARIANT tmp;
+        VariantInit(&tmp);
+        if constexpr (VT == VT_VARIANT) {
+            tmp = val;
+        } else {
+            tmp.vt = VT;
+            VariantType<VT>::Ref(tmp) = static_cast<typename VariantType<VT>::type>(val);
+        }
+        if (result)
+            *result = tmp;
+        else
+            VariantClear(&tmp);
+    }
+
+private:
+    HRESULT Fail (UINT idx, HRESULT hr) {
+        if (m_arg_err)
+            *m_arg_err = m_params->cArgs - 1 - idx;
+        return hr;
+    }
+
+    DISPPARAMS* m_params = nullptr;
+    UINT*       m_arg_err = nullptr;
+    VARIANT     m_tmp[N ? N : 1];  ///< coerced arguments
+    IUnknown*   m_itfs[N ? N : 1]; ///< QueryInterface results
+};
+
+
+namespace ATL {
 
 // COM calling convention (use default on non-Windows)
 #define STDMETHODCALLTYPE
@@ -1282,7 +2744,8 @@ template <> unsigned int CComSafeArray<IUnknown*>::GetCount () const;
 #define ATL_NO_VTABLE 
 
 // QueryInterface support macros
-#define BEGIN_COM_MAP(CLASS)         HRESULT QueryInterface (const GUID & iid, /*out*/void **obj) override { \
+#define BEGIN_COM_MAP(CLASS)         _ATL_DECLARE_OBJECT_COUNTERS(CLASS) \
+                                     HRESULT QueryInterface (const GUID & iid, /*out*/void **obj) override { \
                                            static_assert(std::is_same_v<CLASS, std::remove_pointer_t<decltype(this)>>, \
                                                "Argument to BEGIN_COM_MAP doesn't match name of surrounding class."); \
                                            *obj = nullptr;
@@ -1294,36 +2757,98 @@ template <> unsigned int CComSafeArray<IUnknown*>::GetCount () const;
                                        if (iid == __uuidof(INTERFACE)) \
                                            *obj = static_cast<INTERFACE*>(&punk->m_contained); \
                                        else
+/** IWeakRef entry for classes with DECLARE_WEAK_REFERENCES. Answered by the control block in front of the object. */
+#define COM_INTERFACE_ENTRY_WEAKREF()  if (iid == __uuidof(IWeakRef)) { \
+                                           _ATL_COUNT_QUERY_INTERFACE(iid, true) \
+                                           return CComWeakRefBlock::Of(static_cast<CComObject<std::remove_pointer_t<decltype(this)>>*>(this))->QueryInterface(iid, obj); \
+                                       } else
 #define END_COM_MAP()                  if (iid == __uuidof(IUnknown)) \
                                            *obj = static_cast<IUnknown*>(this); \
-                                       else \
+                                       else { \
+                                           _ATL_COUNT_QUERY_INTERFACE(iid, false) \
                                            return E_NOINTERFACE; \
+                                       } \
+                                       _ATL_COUNT_QUERY_INTERFACE(iid, true) \
                                        AddRef(); \
                                        return S_OK; \
                                      } \
                                      ULONG AddRef () override { \
-                                         assert((m_ref < 0xFFFF) && "IUnknown::AddRef negative ref count."); \
-                                         return ++m_ref; \
+                                         _ATL_COUNT_OBJECT_EVENT(OBJECT_COUNTER_ADDREF) \
+                                         return CComInternalAddRef(this); \
                                      } \
                                      ULONG Release () override { \
-                                         ULONG ref = --m_ref; \
-                                         assert((m_ref < 0xFFFF) && "IUnknown::Release negative ref count."); \
+                                         _ATL_COUNT_OBJECT_EVENT(OBJECT_COUNTER_RELEASE) \
+                                         ULONG ref = CComInternalRelease(this); \
                                          if (!ref) \
                                              delete this; \
                                          return ref; \
-                                     } \
-                                     std::atomic<ULONG> m_ref {0};
+                                     }
 
 #define DECLARE_PROTECT_FINAL_CONSTRUCT()
 
 #define DECLARE_REGISTRY_RESOURCEID(dummy)
 
+#define DECLARE_CLASSFACTORY()
+#define DECLARE_CLASSFACTORY_EX(cf)         typedef cf _ClassFactoryCreatorClass;
+#define DECLARE_CLASSFACTORY_SINGLETON(obj) DECLARE_CLASSFACTORY_EX(ATL::CComClassFactorySingleton<obj>)
+
+
+/** Activation policy that makes all activations of T return the same shared instance.
+    The instance is created on first activation and kept alive until process exit. */
+template <class T>
+class CComClassFactorySingleton {
+public:
+    static HRESULT CreateInstance (IUnknown* outer, IUnknown** obj) {
+        if (outer)
+            return CLASS_E_NOAGGREGATION; // shared instance cannot have a controlling outer
+
+        static Instance s_instance; // thread-safe initialization on first activation
+        if (FAILED(s_instance.hr))
+            return s_instance.hr;
+
+        s_instance.ptr->AddRef();
+        *obj = s_instance.ptr;
+        return S_OK;
+    }
+
+private:
+    struct Instance {
+        Instance() {
+            hr = CComObject<T>::CreateInstance(&ptr);
+            if (SUCCEEDED(hr))
+                ptr->AddRef(); // reference held until process exit
+        }
+        ~Instance() {
+            if (ptr)
+                ptr->Release();
+        }
+
+        CComObject<T>* ptr = nullptr;
+        HRESULT        hr = E_FAIL;
+    };
+};
+
 
 class CComSingleThreadModel {};
 class CComMultiThreadModel {};
+/** Non-Windows extension for objects that are mostly referenced by the creating thread. See CComBiasedRefCount.
+    WARNING: Objects whose last reference is released by another thread are only destroyed when the creating thread next
+    uses biased objects, calls CComBiasedRefCount::ProcessQueue or exits. Until then, they leak. */
+class CComBiasedThreadModel {};
 
 template <class ThreadModel>
 class CComObjectRootEx {
+public:
+    HRESULT FinalConstruct() {
+        return S_OK;
+    }
+
+    std::atomic<ULONG> m_ref {0}; ///< used by END_COM_MAP
+};
+
+/** Without m_ref, since CComBiasedRefCount holds the reference-count. */
+template <>
+class CComObjectRootEx<CComBiasedThreadModel> : public CComBiasedRefCount {
 public:
     HRESULT FinalConstruct() {
         return S_OK;
@@ -1334,9 +2859,599 @@ template <class T, const GUID* pclsid = nullptr>
 class CComCoClass {
 };
 
+/** IDispatch implementation for dual interfaces, based on DispatchTableOf<T>() metadata generated by IdlParse.py.
+    The type library arguments are only accepted for source compatibility. */
+template <class T, const IID* piid = nullptr, const GUID* plibid = nullptr, WORD wMajor = 1, WORD wMinor = 0>
+class IDispatchImpl : public T {
+public:
+    HRESULT GetTypeInfoCount (UINT* pctinfo) override {
+        if (!pctinfo)
+            return E_POINTER;
+        *pctinfo = 0;
+        return S_OK;
+    }
+    HRESULT GetTypeInfo (UINT /*iTInfo*/, LCID /*lcid*/, ITypeInfo** ppTInfo) override {
+        if (ppTInfo)
+            *ppTInfo = nullptr;
+        return E_NOTIMPL;
+    }
+    HRESULT GetIDsOfNames (const IID& riid, LPOLESTR* rgszNames, UINT cNames, LCID /*lcid*/, DISPID* rgDispId) override {
+        return DispatchTableOf<T>().GetIDsOfNames(riid, rgszNames, cNames, rgDispId);
+    }
+    HRESULT Invoke (DISPID dispIdMember, const IID& riid, LCID /*lcid*/, WORD wFlags, DISPPARAMS* pDispParams, VARIANT* pVarResult, EXCEPINFO* pExcepInfo, UINT* puArgErr) override {
+        return DispatchTableOf<T>().Invoke(static_cast<T*>(this), dispIdMember, riid, wFlags, pDispParams, pVarResult, pExcepInfo, puArgErr);
+    }
+};
+
 
 } // namespace ATL
 
+/** Base class for cross-apartment proxies. Forwards calls through Invoke to the apartment that owns the target object.
+    Derived classes implement each INTERFACE method as "return Invoke([&] { return m_target->Method(args...); });". */
+template <class INTERFACE>
+class CApartmentProxy : public INTERFACE {
+public:
+    CApartmentProxy (IUnknown* apartment, INTERFACE* target) : m_apartment(apartment), m_target(target) {
+    }
+    virtual ~CApartmentProxy () {
+        CoInternalApartmentRelease(m_apartment, m_target); // release in owner apartment
+    }
+
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if (!obj)
+            return E_POINTER;
+        if ((iid == __uuidof(IUnknown)) || (iid == __uuidof(INTERFACE))) {
+            *obj = static_cast<INTERFACE*>(this);
+            AddRef();
+            return S_OK;
+        }
+        // create a new proxy for the other interface
+        return CoInternalApartmentQueryInterface(m_apartment, m_target, iid, obj);
+    }
+    ULONG AddRef () override {
+        return ++m_ref;
+    }
+    ULONG Release () override {
+        ULONG ref = --m_ref;
+        if (!ref)
+            delete this;
+        return ref;
+    }
+
+    /** Factory function for CoRegisterApartmentProxy. Takes over the target reference. */
+    template <class PROXY>
+    static HRESULT Create (IUnknown* apartment, void* target, void** proxy) {
+        *proxy = static_cast<INTERFACE*>(new PROXY(apartment, static_cast<INTERFACE*>(target)));
+        static_cast<INTERFACE*>(*proxy)->AddRef();
+        return S_OK;
+    }
+    /** Release function for CoRegisterApartmentProxy. */
+    static void ReleaseTarget (void* itf) {
+        static_cast<INTERFACE*>(itf)->Release();
+    }
+
+protected:
+    /** Execute fun() in the owner apartment and wait for completion.
+        The calling STA thread keeps processing incoming calls while waiting. */
+    template <class FUN>
+    HRESULT Invoke (FUN fun) {
+        struct Call : ApartmentCall {
+            FUN*    fun = nullptr;
+            HRESULT result = E_FAIL;
+        };
+        Call call;
+        call.fun = &fun;
+        call.ApartmentCall::fun = [](ApartmentCall* c) {
+            auto* self = static_cast<Call*>(c);
+            self->result = (*self->fun)();
+        };
+        HRESULT hr = CoInternalApartmentCall(m_apartment, &call);
+        if (FAILED(hr))
+            return hr;
+        return call.result;
+    }
+
+    ATL::CComPtr<IUnknown> m_apartment;
+    INTERFACE*             m_target = nullptr; ///< only accessed from the owner apartment
+    std::atomic<ULONG>     m_ref {0};
+};
+
+#define APARTMENT_PROXY_ENTRY_AUTO(INTERFACE, PROXY) \
+    __attribute__((weak)) __attribute__((used)) HRESULT tmp_apartment_proxy_##INTERFACE = CoRegisterApartmentProxy(__uuidof(INTERFACE), CApartmentProxy<INTERFACE>::Create<PROXY>, CApartmentProxy<INTERFACE>::ReleaseTarget);
+
+
+
+/** Non-Windows extension for running fun(arg) on a shared work-stealing thread pool with one worker per CPU core.
+    Work submitted from a worker is queued on that worker and stolen by idle workers. Tasks must not block, e.g. in
+    ISynchronize::Wait, Finish_X or out-of-process calls, since each blocked task occupies a worker. Use CoSubmitBlockingWork instead. */
+HRESULT CoSubmitWork (void (*fun)(void* arg), void* arg);
+
+/** Non-Windows extension for running fun(arg) on a thread that may block without delaying CoSubmitWork tasks.
+    Idle threads are reused, and new threads are started when all are busy, up to 4 threads per CPU core.
+    Further work is queued until a thread becomes available. Returns E_OUTOFMEMORY if no thread could be started. */
+HRESULT CoSubmitBlockingWork (void (*fun)(void* arg), void* arg);
+
+extern "C" {
+static constexpr GUID IID_ISynchronize       = {0x00000030,0x0000,0x0000,{0xC0,0x00,0x00,0x00,0x00,0x00,0x00,0x46}};
+static constexpr GUID IID_ICallFactory       = {0x1c733a30,0x2a1c,0x11ce,{0xad,0xe5,0x00,0xaa,0x00,0x44,0x77,0x3d}};
+static constexpr GUID IID_ISynchronizeNotify = {0x5e2b7a41,0x9c3d,0x4f18,{0x8a,0x6e,0x2d,0x4c,0x91,0x0b,0x73,0xf5}};
+
+/** Completion signal of an asynchronous call. */
+struct ISynchronize : virtual public IUnknown {
+    /** Returns RPC_S_CALLPENDING on timeout. */
+    virtual HRESULT Wait (DWORD dwFlags, DWORD dwMilliseconds) = 0;
+    virtual HRESULT Signal () = 0;
+    virtual HRESULT Reset () = 0;
+};
+
+/** Non-Windows extension for running fun(arg) on the thread pool when signaled, instead of blocking a thread in Wait. */
+struct ISynchronizeNotify : public ISynchronize {
+    /** Only one notification per call. Returns E_UNEXPECTED if no call is pending or completed. */
+    virtual HRESULT Notify (void (*fun)(void* arg), void* arg) = 0;
+};
+
+/** Creates asynchronous call objects, e.g. AsyncIFoo for an IFoo object. */
+struct ICallFactory : virtual public IUnknown {
+    virtual HRESULT CreateCall (const IID& riid, IUnknown* pCtrlUnk, const IID& riid2, IUnknown** ppv) = 0;
+};
+} // extern "C"
+DEFINE_UUIDOF(ISynchronize)
+DEFINE_UUIDOF(ISynchronizeNotify)
+DEFINE_UUIDOF(ICallFactory)
+
+typedef HRESULT(*AsyncCallFactory)(IUnknown* server, IUnknown** call);
+/** Non-Windows extension for registering client-side call objects for an [async_uuid] interface. Used by code generated by IdlParse.py. */
+HRESULT CoRegisterAsyncCall (const IID& async_iid, AsyncCallFactory factory);
+
+/** Non-Windows extension for creating an asynchronous call object for "server". Delegates to ICallFactory if implemented by
+    the server, so that components can complete calls without occupying a thread. Otherwise, a call object registered with
+    CoRegisterAsyncCall executes the synchronous method with CoSubmitBlockingWork. Returns an AddRef'ed call object. */
+HRESULT CoCreateAsyncCall (IUnknown* server, const IID& async_iid, IUnknown** call);
+
+
+/** ISynchronizeNotify implementation for call objects. */
+class CAsyncCallState : public ISynchronizeNotify {
+public:
+    enum State : ULONG {
+        IDLE,     ///< no call in progress
+        PENDING,  ///< call in progress
+        NOTIFY,   ///< call in progress with pending notification
+        SIGNALED, ///< call completed
+    };
+
+    HRESULT Wait (DWORD dwFlags, DWORD dwMilliseconds) override;
+    HRESULT Signal () override;
+    HRESULT Reset () override;
+    HRESULT Notify (void (*fun)(void* arg), void* arg) override;
+
+protected:
+    std::atomic<ULONG> m_state {IDLE};
+    void (*m_notify_fun)(void* arg) = nullptr;
+    void*  m_notify_arg = nullptr;
+};
+
+/** Argument storage for asynchronous calls. The default handles trivially copyable types. */
+template <class T, class = void>
+struct CAsyncArg {
+    void Set (const T& val) {
+        value = val;
+    }
+    /** Move value to caller. */
+    void Take (T* out) {
+        *out = value;
+        value = T();
+    }
+    void Clear () {
+        value = T();
+    }
+
+    T value = T();
+};
+template <>
+struct CAsyncArg<BSTR> {
+    ~CAsyncArg () {
+        Clear();
+    }
+    void Set (BSTR val) {
+        Clear();
+        value = val ? SysAllocStringLen(val, SysStringLen(val)) : nullptr;
+    }
+    void Take (BSTR* out) {
+        *out = value;
+        value = nullptr;
+    }
+    void Clear () {
+        SysFreeString(value);
+        value = nullptr;
+    }
+
+    BSTR value = nullptr;
+};
+template <>
+struct CAsyncArg<SAFEARRAY*> {
+    ~CAsyncArg () {
+        Clear();
+    }
+    void Set (SAFEARRAY* val) {
+        Clear();
+        if (val)
+            SafeArrayCopy(val, &value);
+    }
+    void Take (SAFEARRAY** out) {
+        *out = value;
+        value = nullptr;
+    }
+    void Clear () {
+        if (value)
+            SafeArrayDestroy(value);
+        value = nullptr;
+    }
+
+    SAFEARRAY* value = nullptr;
+};
+template <class T>
+struct CAsyncArg<T*, std::enable_if_t<std::is_base_of<IUnknown, T>::value>> {
+    ~CAsyncArg () {
+        Clear();
+    }
+    void Set (T* val) {
+        if (val)
+            val->AddRef();
+        Clear();
+        value = val;
+    }
+    void Take (T** out) {
+        *out = value;
+        value = nullptr;
+    }
+    void Clear () {
+        if (value)
+            value->Release();
+        value = nullptr;
+    }
+
+    T* value = nullptr;
+};
+
+/** Base class for client-side call objects generated by IdlParse.py for [async_uuid] interfaces.
+    Begin_X copies the [in] arguments & executes the synchronous INTERFACE method with CoSubmitBlockingWork, so that slow
+    methods aren't limited by the number of CPU cores. Each in-flight call occupies a thread, and calls beyond the
+    CoSubmitBlockingWork thread limit are queued. Servers that implement ICallFactory can complete calls without a thread. Finish_X waits for completion & returns the [out] arguments, and
+    blocks if the call hasn't completed, so use CoAwaitCall instead on CoSubmitWork threads.
+    Only one call can be in progress at a time. */
+template <class INTERFACE, class ASYNC>
+class CAsyncCall : public ATL::CComObjectRootEx<ATL::CComMultiThreadModel>, public ASYNC, public CAsyncCallState {
+public:
+    BEGIN_COM_MAP(CAsyncCall)
+        COM_INTERFACE_ENTRY(ASYNC)
+        COM_INTERFACE_ENTRY(ISynchronize)
+        COM_INTERFACE_ENTRY(ISynchronizeNotify)
+    END_COM_MAP()
+
+    /** Factory function for CoRegisterAsyncCall. */
+    template <class CALL>
+    static HRESULT Create (IUnknown* server, IUnknown** call) {
+        ATL::CComPtr<INTERFACE> itf;
+        HRESULT hr = server->QueryInterface(__uuidof(INTERFACE), reinterpret_cast<void**>(&itf));
+        if (FAILED(hr))
+            return hr;
+
+        CComObject<CALL>* obj = nullptr;
+        hr = CComObject<CALL>::CreateInstance(&obj);
+        if (FAILED(hr))
+            return hr;
+        obj->m_server = itf;
+        *call = static_cast<ASYNC*>(obj);
+        (*call)->AddRef();
+        return S_OK;
+    }
+
+protected:
+    /** Copy arguments with set_args() & start invoke(this) on a blocking thread. */
+    template <class FUN>
+    HRESULT BeginCall (unsigned int method, FUN set_args, HRESULT (*invoke)(CAsyncCall* call)) {
+        ULONG state = IDLE;
+        if (!m_state.compare_exchange_strong(state, PENDING))
+            return RPC_S_CALLPENDING;
+
+        set_args();
+        m_method = method;
+        m_invoke = invoke;
+        this->AddRef(); // keep alive until completed
+        HRESULT hr = CoSubmitBlockingWork(&Run, this);
+        if (FAILED(hr)) {
+            m_state = IDLE;
+            this->Release();
+        }
+        return hr;
+    }
+
+    /** Wait for completion of "method" & return [out] arguments with take_args(succeeded). Returns the method HRESULT. */
+    template <class FUN>
+    HRESULT FinishCall (unsigned int method, FUN take_args) {
+        if ((m_state == IDLE) || (m_method.load() != method))
+            return RPC_E_CALL_COMPLETE;
+        Wait(0, INFINITE);
+        HRESULT hr = m_hr;
+        take_args(SUCCEEDED(hr));
+        Reset();
+        return hr;
+    }
+
+    ATL::CComPtr<INTERFACE> m_server;
+
+private:
+    static void Run (void* arg) {
+        auto* self = static_cast<CAsyncCall*>(arg);
+        self->m_hr = self->m_invoke(self);
+        self->Signal();
+        self->Release();
+    }
+
+    std::atomic<unsigned int> m_method {0}; ///< read by FinishCall before waiting for completion
+    HRESULT                 (*m_invoke)(CAsyncCall* call) = nullptr;
+    HRESULT                   m_hr = S_OK;
+};
+
+#define ASYNC_CALL_ENTRY_AUTO(ASYNC, CALL) \
+    __attribute__((used)) inline const HRESULT tmp_async_call_##ASYNC = CoRegisterAsyncCall(__uuidof(ASYNC), CALL::Create<CALL>);
+
+#ifdef __cpp_impl_coroutine
+/** C++20 awaitable for a call object after calling Begin_X. The awaiting coroutine is resumed on the thread pool
+    when the call has completed, so that the following Finish_X doesn't block. Call objects without ISynchronizeNotify are
+    waited for on a CoSubmitBlockingWork thread instead of a pool worker. Usage: "co_await CoAwaitCall(call);" */
+class CoAwaitCall {
+public:
+    CoAwaitCall (IUnknown* call) {
+        call->QueryInterface(__uuidof(ISynchronizeNotify), reinterpret_cast<void**>(&m_notify));
+        if (!m_notify)
+            call->QueryInterface(__uuidof(ISynchronize), reinterpret_cast<void**>(&m_sync));
+    }
+
+    bool await_ready () const {
+        if (m_notify)
+            return m_notify->Wait(0, 0) == S_OK;
+        return !m_sync || (m_sync->Wait(0, 0) == S_OK);
+    }
+    bool await_suspend (std::coroutine_handle<> handle) {
+        m_handle = handle;
+        if (m_notify)
+            return SUCCEEDED(m_notify->Notify(&Resume, this));
+
+        // call object without notification support: wait on a blocking thread instead of a pool worker,
+        // and resume on the pool when signaled
+        return SUCCEEDED(CoSubmitBlockingWork([](void* arg) {
+            static_cast<CoAwaitCall*>(arg)->m_sync->Wait(0, INFINITE);
+            CoSubmitWork(&Resume, arg);
+        }, this));
+    }
+    void await_resume () const {
+    }
+
+private:
+    static void Resume (void* arg) {
+        static_cast<CoAwaitCall*>(arg)->m_handle.resume();
+    }
+
+    ATL::CComPtr<ISynchronizeNotify> m_notify;
+    ATL::CComPtr<ISynchronize>       m_sync;
+    std::coroutine_handle<>          m_handle;
+};
+#endif
+
+
+
+extern "C" {
+static constexpr GUID IID_IConnectionPointContainer = {0xB196B284,0xBAB4,0x101A,{0xB6,0x9C,0x00,0xAA,0x00,0x34,0x1D,0x07}};
+static constexpr GUID IID_IEnumConnectionPoints     = {0xB196B285,0xBAB4,0x101A,{0xB6,0x9C,0x00,0xAA,0x00,0x34,0x1D,0x07}};
+static constexpr GUID IID_IConnectionPoint          = {0xB196B286,0xBAB4,0x101A,{0xB6,0x9C,0x00,0xAA,0x00,0x34,0x1D,0x07}};
+static constexpr GUID IID_IEnumConnections          = {0xB196B287,0xBAB4,0x101A,{0xB6,0x9C,0x00,0xAA,0x00,0x34,0x1D,0x07}};
+
+struct IConnectionPoint;
+struct IConnectionPointContainer;
+
+struct CONNECTDATA {
+    IUnknown* pUnk;
+    DWORD     dwCookie;
+};
+
+struct IEnumConnections : virtual public IUnknown {
+    virtual HRESULT Next (ULONG cConnections, CONNECTDATA* rgcd, ULONG* pcFetched) = 0;
+    virtual HRESULT Skip (ULONG cConnections) = 0;
+    virtual HRESULT Reset () = 0;
+    virtual HRESULT Clone (IEnumConnections** ppEnum) = 0;
+};
+
+struct IEnumConnectionPoints : virtual public IUnknown {
+    virtual HRESULT Next (ULONG cConnections, IConnectionPoint** ppCP, ULONG* pcFetched) = 0;
+    virtual HRESULT Skip (ULONG cConnections) = 0;
+    virtual HRESULT Reset () = 0;
+    virtual HRESULT Clone (IEnumConnectionPoints** ppEnum) = 0;
+};
+
+/** Outgoing event interface of an object. */
+struct IConnectionPoint : virtual public IUnknown {
+    virtual HRESULT GetConnectionInterface (IID* pIID) = 0;
+    virtual HRESULT GetConnectionPointContainer (IConnectionPointContainer** ppCPC) = 0;
+    virtual HRESULT Advise (IUnknown* pUnkSink, DWORD* pdwCookie) = 0;
+    virtual HRESULT Unadvise (DWORD dwCookie) = 0;
+    virtual HRESULT EnumConnections (IEnumConnections** ppEnum) = 0;
+};
+
+struct IConnectionPointContainer : virtual public IUnknown {
+    virtual HRESULT EnumConnectionPoints (IEnumConnectionPoints** ppEnum) = 0;
+    virtual HRESULT FindConnectionPoint (const IID& riid, IConnectionPoint** ppCP) = 0;
+};
+} // extern "C"
+DEFINE_UUIDOF(IEnumConnections)
+DEFINE_UUIDOF(IEnumConnectionPoints)
+DEFINE_UUIDOF(IConnectionPoint)
+DEFINE_UUIDOF(IConnectionPointContainer)
+
+namespace ATL {
+
+/** Connected sinks of a connection point. Advise & Unadvise publish a new immutable, reference-counted snapshot,
+    so that events are fired from the current snapshot without locking, and sinks can (un)advise from event handlers.
+    Replaces the mutex-protected CComDynamicUnkArray. */
+class CComConnectionList {
+public:
+    struct Entry {
+        void*     sink;   ///< [piid] interface pointer of a strongly-held sink, or nullptr
+        IUnknown* unk;    ///< same object as "sink", for reference-counting
+        IWeakRef* weak;   ///< weakly-held sink (not kept alive by the connection), or nullptr
+        DWORD     cookie;
+    };
+    struct Snapshot {
+        std::atomic<ULONG> refs;
+        ULONG              count;
+        Entry*             entries;
+    };
+
+    CComConnectionList () = default;
+    ~CComConnectionList ();
+
+    /** Add an AddRef'ed sink. Sinks that implement IWeakRef are held weakly & dropped once dead, in which case "sink" is released. */
+    HRESULT Add (void* sink, IUnknown* unk, DWORD* cookie);
+    /** Returns CONNECT_E_NOCONNECTION if the cookie is not connected. */
+    HRESULT Remove (DWORD cookie);
+
+    /** Current snapshot with an extra reference, or nullptr if no sinks are connected. */
+    Snapshot*   Acquire ();
+    static void Release (Snapshot* snapshot);
+
+    /** Enumerator over the current snapshot. */
+    HRESULT     Enumerate (IEnumConnections** ppEnum);
+
+    CComConnectionList (const CComConnectionList&) = delete;
+    CComConnectionList& operator = (const CComConnectionList&) = delete;
+
+private:
+    Snapshot* Publish (Snapshot* next);
+
+    std::atomic<Snapshot*> m_current {nullptr};
+    std::atomic<ULONG>     m_epoch {0};
+    std::atomic<ULONG>     m_readers[2] = {}; ///< in-flight Acquire calls per epoch parity
+    DWORD                  m_next_cookie = 0; ///< protected by writer lock
+};
+
+/** Connection point lookup by IID. Terminated by a nullptr entry. */
+struct _ATL_CONNMAP_ENTRY {
+    const IID*          piid;
+    IConnectionPoint* (*locate)(void* obj);
+};
+
+/** Base class that distinguishes connection points of a class by IID. */
+template <const IID* piid>
+class _ICPLocator : public IConnectionPoint {
+};
+
+/** Connection point for the *piid outgoing interface. Non-Windows deviation: The 3rd template argument is the sink
+    interface type instead of ATL's container class, since interface pointers cannot be cast from IUnknown* on this platform.
+    Events are fired with ForEachSink. QueryInterface, AddRef & Release are provided by the COM map of T. */
+template <class T, const IID* piid, class SINK = IDispatch>
+class IConnectionPointImpl : public _ICPLocator<piid> {
+public:
+    HRESULT GetConnectionInterface (IID* pIID) override {
+        if (!pIID)
+            return E_POINTER;
+        *pIID = *piid;
+        return S_OK;
+    }
+    HRESULT GetConnectionPointContainer (IConnectionPointContainer** ppCPC) override {
+        if (!ppCPC)
+            return E_POINTER;
+        return static_cast<T*>(this)->QueryInterface(IID_IConnectionPointContainer, reinterpret_cast<void**>(ppCPC));
+    }
+    HRESULT Advise (IUnknown* pUnkSink, DWORD* pdwCookie) override {
+        if (!pUnkSink || !pdwCookie)
+            return E_POINTER;
+        *pdwCookie = 0;
+
+        void* sink = nullptr;
+        if (FAILED(pUnkSink->QueryInterface(*piid, &sink)))
+            return CONNECT_E_CANNOTCONNECT;
+        return m_vec.Add(sink, static_cast<IUnknown*>(static_cast<SINK*>(sink)), pdwCookie);
+    }
+    HRESULT Unadvise (DWORD dwCookie) override {
+        return m_vec.Remove(dwCookie);
+    }
+    HRESULT EnumConnections (IEnumConnections** ppEnum) override {
+        return m_vec.Enumerate(ppEnum);
+    }
+
+protected:
+    /** Call fun(sink) for all connected sinks. Dead weakly-held sinks are skipped. Returns the number of sinks called. */
+    template <class FUN>
+    ULONG ForEachSink (FUN fun) {
+        CComConnectionList::Snapshot* snapshot = m_vec.Acquire();
+        if (!snapshot)
+            return 0;
+
+        ULONG called = 0;
+        for (ULONG i = 0; i < snapshot->count; ++i) {
+            const CComConnectionList::Entry& entry = snapshot->entries[i];
+            if (entry.sink) {
+                fun(static_cast<SINK*>(entry.sink));
+                called++;
+            } else {
+                // upgrade weak reference. Fails if the sink is dead
+                void* sink = nullptr;
+                if (FAILED(entry.weak->QueryInterface(*piid, &sink)))
+                    continue;
+                fun(static_cast<SINK*>(sink));
+                static_cast<IUnknown*>(static_cast<SINK*>(sink))->Release();
+                called++;
+            }
+        }
+        CComConnectionList::Release(snapshot);
+        return called;
+    }
+
+    CComConnectionList m_vec;
+};
+
+/** Connection point container based on the connection point map of T. */
+template <class T>
+class IConnectionPointContainerImpl : public IConnectionPointContainer {
+public:
+    HRESULT EnumConnectionPoints (IEnumConnectionPoints** ppEnum) override {
+        if (!ppEnum)
+            return E_POINTER;
+        *ppEnum = nullptr;
+        return E_NOTIMPL;
+    }
+    HRESULT FindConnectionPoint (const IID& riid, IConnectionPoint** ppCP) override {
+        if (!ppCP)
+            return E_POINTER;
+        *ppCP = nullptr;
+        for (const _ATL_CONNMAP_ENTRY* entry = T::GetConnMap(nullptr); entry->piid; ++entry) {
+            if (*entry->piid == riid) {
+                *ppCP = entry->locate(static_cast<T*>(this));
+                (*ppCP)->AddRef();
+                return S_OK;
+            }
+        }
+        return CONNECT_E_NOCONNECTION;
+    }
+};
+
+#define BEGIN_CONNECTION_POINT_MAP(CLASS) \
+    typedef CLASS _CPMapClass; \
+    static const _ATL_CONNMAP_ENTRY* GetConnMap (int* pnEntries) { \
+        static const _ATL_CONNMAP_ENTRY entries[] = {
+#define CONNECTION_POINT_ENTRY(iid) \
+            {&iid, [](void* obj) -> IConnectionPoint* { return static_cast<_ICPLocator<&iid>*>(static_cast<_CPMapClass*>(obj)); }},
+#define END_CONNECTION_POINT_MAP() \
+            {nullptr, nullptr} \
+        }; \
+        if (pnEntries) \
+            *pnEntries = static_cast<int>(sizeof(entries)/sizeof(entries[0])) - 1; \
+        return entries; \
+    }
+
+} // namespace ATL
+
+
 #ifndef _ATL_NO_AUTOMATIC_NAMESPACE
   using namespace ATL;
 #endif
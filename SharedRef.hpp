@@ -7,14 +7,18 @@
 #endif
 
 
+#ifdef _WIN32
 /** IUnknown-based alternative to Microsoft's IWeakReference.
     References to this interface are weak, meaning they do not extend the lifetime of the object.
-    Casting back to IUnknown and other interfaces only succeed if the object is still alive. */
+    Casting back to IUnknown and other interfaces only succeed if the object is still alive.
+    Declared in NonWindows.hpp on other platforms, so that connection points can hold sinks weakly. */
 struct DECLSPEC_UUID("146532F9-763D-44C9-875A-7B5B732B9046")
 IWeakRef : public IUnknown {
 };
+#endif
 
-/** COM wrapper class that provides support for weak references through the IWeakRef interface. */
+/** COM wrapper class that provides support for weak references through the IWeakRef interface.
+    Classes that can be modified should rather use DECLARE_WEAK_REFERENCES on non-Windows, which avoids the aggregation layer. */
 class SharedRefBase : public IUnknown {
 public:
     SharedRefBase() : m_weak(*this) {
@@ -103,16 +107,10 @@ protected:
                 return S_OK;
             } else {
                 // all other interfaces require a preexisting strong reference
-                if (!m_parent.Inner())
-                    return E_NOT_SET;
-
-                // add temporarily strong reference to avoid concurrent deletion by other threads 
-                ULONG strong = m_parent.AddRef();
-                if (strong <= 1) {
-                    // object was just destroyed
-                    m_parent.Release();
+                // add temporarily strong reference to avoid concurrent deletion by other threads.
+                // never resurrect a zero strong ref-count, since the object is then already being destroyed
+                if (!m_parent.m_refs.TryAddStrong())
                     return E_NOT_SET;
-                }
 
                 // forward call to parent object
                 HRESULT hr = m_parent.QueryInterface(iid, ptr);
@@ -153,6 +151,16 @@ protected:
             }
         }
 
+        /** Add a strong reference unless the strong ref-count already reached zero. */
+        bool TryAddStrong() {
+            uint32_t cur = strong.load();
+            do {
+                if (!cur)
+                    return false;
+            } while (!strong.compare_exchange_weak(cur, cur + 1));
+            return true;
+        }
+
         ULONG Release(bool _strong) {
             if (_strong) {
                 //std::cout << "  strong=" << (strong - 1) << " weak=" << weak << std::endl;
@@ -172,9 +180,9 @@ protected:
     virtual IUnknown* Inner() = 0;
     virtual void     ClearInner() = 0;
 
-    AtomicRefBlock        m_refs; // Reference-counts. Only touched once per method for thread safety.
-    WeakRef               m_weak;
-    static inline ULONG   s_obj_count = 0;
+    AtomicRefBlock                   m_refs; // Reference-counts. Only touched once per method for thread safety.
+    WeakRef                          m_weak;
+    static inline std::atomic<ULONG> s_obj_count {0};
 };
 
 
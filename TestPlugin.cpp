@@ -0,0 +1,18 @@
+/* Component library for testing on-demand loading through CoRegisterClassCatalog.
+   Built as libTestPlugin.so by run_tests.sh, with unresolved symbols bound to the test executable. */
+#include "NonWindows.hpp"
+
+
+static constexpr GUID CLSID_PluginClass = {0x2d9f5b31,0x6c4e,0x4f70,{0xa1,0xb2,0xc3,0xd4,0xe5,0xf6,0x07,0x18}};
+
+/** Class that is only available after the library has been loaded. */
+class PluginClass : public CComObjectRootEx<CComMultiThreadModel>, public CComCoClass<PluginClass, &CLSID_PluginClass>, public IUnknown {
+public:
+    BEGIN_COM_MAP(PluginClass)
+    END_COM_MAP()
+};
+OBJECT_ENTRY_AUTO(CLSID_PluginClass, PluginClass)
+
+/** Address inside the library for CoRevokeModuleClasses. */
+extern "C" void TestPluginAnchor () {
+}
@@ -3,7 +3,13 @@
 # * Change TLI include from absolute to relative path
 # * Replace C-style structs with C++ RAII structs from cpp_quote lines in the IDL files
 # * Insert free functions from cpp_quote lines in the IDL files
+# Batch mode (--batch) patches many TLH/TLI pairs in parallel, parsing the IDL files only once
+# and skipping outputs whose inputs haven't changed.
+import argparse
+import concurrent.futures
 import fileinput
+import hashlib
+import json
 import os
 import sys
 
@@ -12,12 +18,12 @@ def ExtractCppQuoteFromIDLs(folder):
     '''Extract cpp_quote lines from all IDL files in the given folder''' 
     cpp_content = []
     
-    for file in os.listdir(folder):
+    for file in sorted(os.listdir(folder)):
         if file[-4:] != '.idl':
             continue
         
         #print("Parsing "+file+"...")
-        with open(folder+"\\"+file, 'r') as f:
+        with open(os.path.join(folder, file), 'r') as f:
             for line in f.readlines():
                 if (line[:11] != 'cpp_quote("'):
                     continue
@@ -29,23 +35,31 @@ def ExtractCppQuoteFromIDLs(folder):
     return cpp_content
 
 
-def GetCppStruct(name, cpp_content):
-    '''Get the C++ struct body from cpp_quote lines in the IDL files'''
+def IndexCppStructs(cpp_content):
+    '''Map struct names to C++ struct bodies from cpp_quote lines in the IDL files'''
+    structs = {}
+    pending = [] # struct start lines without end of struct yet
     for i in range(len(cpp_content)):
-        if cpp_content[i] != ("struct "+name+" {\n"):
-            continue
-        
-        for j in range(i+1, len(cpp_content)):
-            if cpp_content[j] != "};\n": # end of struct check
-                continue
-        
-            # Found struct on lines [i:j+1]
-            return "".join(cpp_content[i:j+1])
+        line = cpp_content[i]
+        if (line[:7] == "struct ") and (line[-3:] == " {\n"):
+            pending.append(i)
+        elif line == "};\n": # end of struct check
+            for start in pending:
+                # Found struct on lines [start:i+1]. Keep first definition
+                structs.setdefault(cpp_content[start][7:-3], "".join(cpp_content[start:i+1]))
+            pending = []
+    return structs
+
+
+def GetCppStruct(name, structs):
+    '''Get the C++ struct body from the IndexCppStructs result'''
+    if name in structs:
+        return structs[name]
     
     print("  Could not find cpp_quote for "+name)
     return ""
 
-def ReplaceStructs(source, cpp_content):
+def ReplaceStructs(source, structs):
     '''Replace C-style structs with cpp_quote C++ RAII structs from the IDL files'''
     for i in range(len(source)):
         line = source[i]
@@ -67,7 +81,7 @@ def ReplaceStructs(source, cpp_content):
                 
             # try to replace struct defined on lines [i:j+1]
             print("Replacing "+name)
-            cpp_struct = GetCppStruct(name, cpp_content)
+            cpp_struct = GetCppStruct(name, structs)
             if len(cpp_struct) > 0:
                 source[i] = cpp_struct
                 for k in range(i+1,j+1):
@@ -135,8 +149,8 @@ def AddFunctionsToSource(source, functions):
 def MakeTliIncludeRelative(source, tli_file):
     '''Replace #include "<absolute-path>\\<filename>.tli" with #include "<filename>.tli"'''
     # remove path prefix
-    idx = tli_file.rfind('\\')
-    if idx:
+    idx = max(tli_file.rfind('\\'), tli_file.rfind('/'))
+    if idx >= 0:
         tli_file = tli_file[idx+1:]
     
     for i in range(len(source)):
@@ -263,9 +277,20 @@ def ExtractIncludes(cpp_content):
     return list(sorted(includes))
 
 
-def PatchTlhFile(tlh_file_in, tlh_file_out, tli_file_in, remove_header, cross_platorm):
-    this_script_dir = os.path.dirname(os.path.abspath(__file__))
-    cpp_content = ExtractCppQuoteFromIDLs(this_script_dir)
+class CppQuotes:
+    '''cpp_quote content from a folder of IDL files, indexed for patching many TLH files'''
+    def __init__(self, folder):
+        self.content   = ExtractCppQuoteFromIDLs(folder)
+        self.structs   = IndexCppStructs(self.content)
+        self.functions = GetCppFunctions(self.content)
+        self.includes  = ExtractIncludes(self.content)
+        self.hash      = hashlib.sha256("".join(self.content).encode()).hexdigest()
+
+
+def PatchTlhFile(tlh_file_in, tlh_file_out, tli_file_in, remove_header, cross_platorm, cpp_quotes=None):
+    if cpp_quotes is None:
+        this_script_dir = os.path.dirname(os.path.abspath(__file__))
+        cpp_quotes = CppQuotes(this_script_dir)
     
     with open(tlh_file_in, 'r') as f:
         source = f.readlines()
@@ -276,21 +301,20 @@ def PatchTlhFile(tlh_file_in, tlh_file_out, tli_file_in, remove_header, cross_pl
         source = source[6:]
     
     source = MakeTliIncludeRelative(source, tli_file_in)
-    source = ReplaceStructs(source, cpp_content)
+    source = ReplaceStructs(source, cpp_quotes.structs)
     if cross_platorm:
         source = MakeInterfacesPortable(source)
         source = MakeUUIDsPortable(source)
         source = MakeEnumsPortable(source)
     
-    functions = GetCppFunctions(cpp_content)
-    source = AddFunctionsToSource(source, functions)
+    source = AddFunctionsToSource(source, cpp_quotes.functions)
     
     if cross_platorm:
         # make <comdef.h> include Windows-only
         source = source[:4] + ["#ifdef _WIN32\n"] + [source[4]] + ["#endif\n"] + source[5:]
     
     # add includes at the top of the file
-    source = ExtractIncludes(cpp_content) + source
+    source = cpp_quotes.includes + source
     
     with open(tlh_file_out, 'w', newline='\r\n') as f:
         for line in source:
@@ -325,11 +349,81 @@ def UpdateCallingConventions(tlh_file):
         print(line, end="")
 
 
+def TliFileName(tlh_file):
+    return tlh_file[:tlh_file.rfind(".")]+".tli" # change extension
+
+
+def FileHash(filename):
+    with open(filename, 'rb') as f:
+        return hashlib.sha256(f.read()).hexdigest()
+
+
+def PatchFilePair(tlh_file_in, tlh_file_out, cpp_quotes):
+    '''Patch a TLH file & the corresponding TLI file'''
+    PatchTlhFile(tlh_file_in, tlh_file_out, TliFileName(tlh_file_in), True, True, cpp_quotes)
+    PatchTliFile(TliFileName(tlh_file_in), TliFileName(tlh_file_out), True, True)
+
+
+# cache of input hashes for skipping unchanged files. Stored in the output folder
+CACHE_FILE = '.tlhpatch_cache.json'
+
+def BatchMain(args):
+    parser = argparse.ArgumentParser(prog='TlhFilePatch.py --batch', description='Patch many TLH/TLI file pairs into an output folder.')
+    parser.add_argument('out_dir', help='output folder')
+    parser.add_argument('tlh_files', nargs='+', help='TLH files, with TLI files next to them')
+    parser.add_argument('--idl-dir', default=os.path.dirname(os.path.abspath(__file__)), help='folder with IDL files (default: script folder)')
+    parser.add_argument('-j', '--jobs', type=int, default=os.cpu_count() or 1, help='number of parallel processes (default: CPU count)')
+    parser.add_argument('--no-cache', action='store_true', help='patch all files, also if unchanged')
+    args = parser.parse_args(args)
+
+    cpp_quotes = CppQuotes(args.idl_dir) # parsed once for all files
+    with open(os.path.abspath(__file__), 'rb') as f:
+        tool_hash = hashlib.sha256(f.read()).hexdigest()
+
+    cache_file = os.path.join(args.out_dir, CACHE_FILE)
+    cache = {}
+    if not args.no_cache and os.path.isfile(cache_file):
+        with open(cache_file, 'r') as f:
+            cache = json.load(f)
+
+    keys = {}
+    pending = []
+    for tlh_file_in in args.tlh_files:
+        tlh_file_out = os.path.join(args.out_dir, os.path.basename(tlh_file_in))
+        key = hashlib.sha256((tool_hash+cpp_quotes.hash+FileHash(tlh_file_in)+FileHash(TliFileName(tlh_file_in))).encode()).hexdigest()
+        keys[tlh_file_out] = key
+        if (cache.get(tlh_file_out) == key) and os.path.isfile(tlh_file_out) and os.path.isfile(TliFileName(tlh_file_out)):
+            continue # unchanged
+        pending.append((tlh_file_in, tlh_file_out))
+
+    try:
+        if (args.jobs > 1) and (len(pending) > 1):
+            with concurrent.futures.ProcessPoolExecutor(max_workers=args.jobs) as executor:
+                futures = {executor.submit(PatchFilePair, tlh_file_in, tlh_file_out, cpp_quotes): tlh_file_out for tlh_file_in, tlh_file_out in pending}
+                for future in concurrent.futures.as_completed(futures):
+                    future.result()
+                    cache[futures[future]] = keys[futures[future]]
+        else:
+            for tlh_file_in, tlh_file_out in pending:
+                PatchFilePair(tlh_file_in, tlh_file_out, cpp_quotes)
+                cache[tlh_file_out] = keys[tlh_file_out]
+    finally:
+        # also store progress on failure
+        with open(cache_file, 'w') as f:
+            json.dump(cache, f, indent=1, sort_keys=True)
+    print("Patched "+str(len(pending))+" of "+str(len(args.tlh_files))+" files.")
+
+
 if __name__ == "__main__":
     if len(sys.argv) < 2:
         print("Usage: TlhFilePatch.py <tlh-file-in> <tlh-file-out>")
+        print("       TlhFilePatch.py --batch <out-dir> <tlh-file-in>...")
         sys.exit(1)
     
+    if sys.argv[1] == "--batch":
+        BatchMain(sys.argv[2:])
+        sys.exit(0)
+    
     tlh_file_in  = sys.argv[1] # e.g. "appapi.tlh"
     
     if len(sys.argv) == 2:
@@ -0,0 +1,799 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "NonWindows.hpp"
+#include "Marshal.hpp"
+#include "SharedRef.hpp"
+#include "TestInterfaces.h" // generated by IdlParse.py
+
+
+/** Class allocated with the global allocator. */
+class GlobalClass : public CComObjectRootEx<CComMultiThreadModel>, public IUnknown {
+public:
+    BEGIN_COM_MAP(GlobalClass)
+    END_COM_MAP()
+
+    double payload[4] = {};
+};
+
+/** Class allocated from the thread-local object pool. */
+class PooledClass : public CComObjectRootEx<CComMultiThreadModel>, public IUnknown {
+public:
+    DECLARE_POOLED_ALLOCATOR()
+
+    BEGIN_COM_MAP(PooledClass)
+    END_COM_MAP()
+
+    double payload[4] = {};
+};
+
+/** Class used for in-process vs. out-of-process call overhead comparison. */
+class BenchCalc : public CComObjectRootEx<CComMultiThreadModel>, public CComCoClass<BenchCalc, &CLSID_RemoteCalc>, public IRemoteCalc {
+public:
+    HRESULT Add (int a, int b, int* sum) override {
+        *sum = a + b;
+        return S_OK;
+    }
+    HRESULT Concat (BSTR a, BSTR b, BSTR* result) override {
+        CComBSTR tmp(a);
+        tmp += b;
+        *result = tmp.Detach();
+        return S_OK;
+    }
+    HRESULT Scale (SAFEARRAY* values, double factor, SAFEARRAY** result) override {
+        CComSafeArray<double> src(values);
+        CComSafeArray<double> dst(src.GetCount());
+        for (unsigned int i = 0; i < src.GetCount(); ++i)
+            dst[i] = factor*src[i];
+        *result = dst.Detach();
+        return S_OK;
+    }
+    HRESULT Overwrite (SAFEARRAY* /*values*/, double /*value*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT Accumulate (float /*pos*/[3], double* /*total*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT Echo (IUnknown* /*obj*/, IUnknown** /*result*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT Subscribe (IRemoteCallback* /*callback*/, int /*value*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT RawBuffer (int /*size*/, BYTE* /*data*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT ProcessId (int* /*pid*/) override {
+        return E_NOTIMPL;
+    }
+    HRESULT Crash () override {
+        return E_NOTIMPL;
+    }
+
+    BEGIN_COM_MAP(BenchCalc)
+        COM_INTERFACE_ENTRY(IRemoteCalc)
+    END_COM_MAP()
+};
+OBJECT_ENTRY_AUTO(CLSID_RemoteCalc, BenchCalc)
+
+
+/** Interfaces for QueryInterface lookup cost on shallow vs. deep COM maps. */
+#define BENCH_INTERFACE(N) \
+    static constexpr GUID IID_IBench##N = {0x5e1c0a0##N,0x2b3c,0x4d5e,{0x8f,0x90,0xa1,0xb2,0xc3,0xd4,0xe5,0xf6}}; \
+    struct IBench##N : virtual public IUnknown { \
+        virtual HRESULT Value (/*out*/int* val) = 0; \
+    }; \
+    DEFINE_UUIDOF(IBench##N)
+BENCH_INTERFACE(0)
+BENCH_INTERFACE(1)
+BENCH_INTERFACE(2)
+BENCH_INTERFACE(3)
+BENCH_INTERFACE(4)
+BENCH_INTERFACE(5)
+BENCH_INTERFACE(6)
+BENCH_INTERFACE(7)
+#undef BENCH_INTERFACE
+
+/** Class with a single COM map entry. */
+class ShallowClass : public CComObjectRootEx<CComMultiThreadModel>, public IBench0 {
+public:
+    HRESULT Value (int* val) override {
+        *val = 0;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(ShallowClass)
+        COM_INTERFACE_ENTRY(IBench0)
+    END_COM_MAP()
+};
+
+/** ShallowClass with biased reference-counting for the creating thread. */
+class BiasedClass : public CComObjectRootEx<CComBiasedThreadModel>, public IBench0 {
+public:
+    HRESULT Value (int* val) override {
+        *val = 0;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(BiasedClass)
+        COM_INTERFACE_ENTRY(IBench0)
+    END_COM_MAP()
+};
+
+/** Class with weak references through DECLARE_WEAK_REFERENCES instead of SharedRef. */
+class WeakClass : public CComObjectRootEx<CComMultiThreadModel>, public IBench0 {
+public:
+    HRESULT Value (int* val) override {
+        *val = 0;
+        return S_OK;
+    }
+
+    DECLARE_WEAK_REFERENCES()
+
+    BEGIN_COM_MAP(WeakClass)
+        COM_INTERFACE_ENTRY(IBench0)
+        COM_INTERFACE_ENTRY_WEAKREF()
+    END_COM_MAP()
+};
+
+/** Class with eight COM map entries. */
+class DeepClass : public CComObjectRootEx<CComMultiThreadModel>, public IBench0, public IBench1, public IBench2, public IBench3,
+                  public IBench4, public IBench5, public IBench6, public IBench7 {
+public:
+    HRESULT Value (int* val) override {
+        *val = 7;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(DeepClass)
+        COM_INTERFACE_ENTRY(IBench0)
+        COM_INTERFACE_ENTRY(IBench1)
+        COM_INTERFACE_ENTRY(IBench2)
+        COM_INTERFACE_ENTRY(IBench3)
+        COM_INTERFACE_ENTRY(IBench4)
+        COM_INTERFACE_ENTRY(IBench5)
+        COM_INTERFACE_ENTRY(IBench6)
+        COM_INTERFACE_ENTRY(IBench7)
+    END_COM_MAP()
+};
+
+/** Event source with an IBench0 connection point. ShallowClass objects serve as sinks. */
+class EventSource : public CComObjectRootEx<CComMultiThreadModel>, public IConnectionPointContainerImpl<EventSource>, public IConnectionPointImpl<EventSource, &IID_IBench0, IBench0> {
+public:
+    int Fire () {
+        int sum = 0;
+        ForEachSink([&sum](IBench0* sink) {
+            int val = 0;
+            sink->Value(&val);
+            sum += val;
+        });
+        return sum;
+    }
+
+    BEGIN_COM_MAP(EventSource)
+        COM_INTERFACE_ENTRY(IConnectionPointContainer)
+    END_COM_MAP()
+
+    BEGIN_CONNECTION_POINT_MAP(EventSource)
+        CONNECTION_POINT_ENTRY(IID_IBench0)
+    END_CONNECTION_POINT_MAP()
+};
+
+
+/** Run fun(thread_idx, iterations) on the given number of threads. Returns total operations per second. */
+template <class FUN>
+double MeasureThroughput (unsigned int threads, size_t iterations, FUN fun) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t)
+        workers.emplace_back(fun, t, iterations);
+    for (auto& w : workers)
+        w.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return threads*iterations/elapsed.count();
+}
+
+/** Create & release objects, keeping a window of live objects to mimic real usage. */
+template <class CLS>
+void CreateRelease (unsigned int /*thread_idx*/, size_t iterations) {
+    const size_t WINDOW = 64;
+    CComObject<CLS>* live[WINDOW] = {};
+    for (size_t i = 0; i < iterations; ++i) {
+        CComObject<CLS>*& slot = live[i % WINDOW];
+        if (slot)
+            slot->Release();
+        slot = nullptr;
+        CHECK(CComObject<CLS>::CreateInstance(&slot));
+        slot->AddRef();
+    }
+    for (auto* obj : live) {
+        if (obj)
+            obj->Release();
+    }
+}
+
+void BenchmarkObjectAllocation (size_t iterations) {
+    printf("Object create/release throughput [Mops/s]:\n");
+    printf("threads     global     pooled\n");
+    for (unsigned int threads = 1; threads <= 32; threads *= 2) {
+        double global = MeasureThroughput(threads, iterations, CreateRelease<GlobalClass>);
+        double pooled = MeasureThroughput(threads, iterations, CreateRelease<PooledClass>);
+        printf("%7u %10.2f %10.2f\n", threads, global/1e6, pooled/1e6);
+    }
+}
+
+/** Mixed-type variant array mimicking property-bag content: mostly scalars with some strings & objects. */
+std::vector<CComVariant> MakeVariantArray (size_t count) {
+    CComPtr<IUnknown> obj;
+    {
+        CComObject<GlobalClass>* tmp = nullptr;
+        CHECK(CComObject<GlobalClass>::CreateInstance(&tmp));
+        obj = static_cast<IUnknown*>(tmp);
+    }
+    std::vector<CComVariant> result;
+    for (size_t i = 0; i < count; ++i) {
+        switch (i % 8) {
+        case 0: result.emplace_back(L"property value"); break;
+        case 1: result.emplace_back(static_cast<IUnknown*>(obj)); break;
+        case 2: result.emplace_back(i % 3 == 0); break;
+        case 3: result.emplace_back(static_cast<float>(i)); break;
+        case 4: result.emplace_back(static_cast<LONGLONG>(i)); break;
+        default: result.emplace_back(static_cast<int>(i)); break;
+        }
+    }
+    return result;
+}
+
+void BenchmarkVariants (size_t iterations) {
+    const size_t COUNT = 1000;
+    const std::vector<CComVariant> src = MakeVariantArray(COUNT);
+    size_t loops = std::max<size_t>(iterations/COUNT, 1);
+
+    printf("\nMixed-type variant array throughput [Mvariants/s]:\n");
+    printf("      copy       move    convert\n");
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loops; ++i) {
+        std::vector<CComVariant> copy(src);
+    }
+    std::chrono::duration<double> copy_time = std::chrono::steady_clock::now() - start;
+
+    std::vector<CComVariant> a(src), b(COUNT);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loops; ++i) {
+        for (size_t j = 0; j < COUNT; ++j)
+            b[j] = std::move(a[j]);
+        a.swap(b);
+    }
+    std::chrono::duration<double> move_time = std::chrono::steady_clock::now() - start;
+
+    std::vector<CComVariant> dst(COUNT);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < loops; ++i) {
+        for (size_t j = 0; j < COUNT; ++j) {
+            // numbers to double & other types to string
+            if (FAILED(dst[j].ChangeType(VT_R8, &src[j])))
+                dst[j].ChangeType(VT_BSTR, &src[j]);
+        }
+    }
+    std::chrono::duration<double> convert_time = std::chrono::steady_clock::now() - start;
+
+    double total = static_cast<double>(loops*COUNT);
+    printf("%10.2f %10.2f %10.2f\n", total/copy_time.count()/1e6, total/move_time.count()/1e6, total/convert_time.count()/1e6);
+}
+
+/** Prevent the compiler from optimizing away a computed value. */
+template <class T>
+inline void DoNotOptimize (const T& val) {
+    asm volatile("" : : "r,m"(val) : "memory");
+}
+
+/** Single-threaded latency of one hot-path operation. */
+struct MicroResult {
+    const char* name = nullptr;
+    size_t      iterations = 0;
+    double      ns_per_op = 0;
+};
+
+/** Run fun(iterations) once untimed as warm-up and once timed. */
+template <class FUN>
+MicroResult MeasureLatency (const char* name, size_t iterations, FUN fun) {
+    fun(std::min<size_t>(iterations, 1000));
+    auto start = std::chrono::steady_clock::now();
+    fun(iterations);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return {name, iterations, elapsed.count()/iterations};
+}
+
+template <class CLS>
+CComPtr<IUnknown> CreateObject () {
+    CComObject<CLS>* tmp = nullptr;
+    CHECK(CComObject<CLS>::CreateInstance(&tmp));
+    return CComPtr<IUnknown>(static_cast<IUnknown*>(static_cast<IBench0*>(tmp)));
+}
+
+/** QueryInterface & release loop. The returned pointer is cast to the requested interface, since IUnknown is a virtual base. */
+template <class Q>
+auto QueryLoop (IUnknown* obj) {
+    return [obj](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            Q* itf = nullptr;
+            if (SUCCEEDED(obj->QueryInterface(__uuidof(Q), reinterpret_cast<void**>(&itf))))
+                itf->Release();
+            DoNotOptimize(itf);
+        }
+    };
+}
+
+/** Append "count" elements to a fresh array, in batches of 1024 to keep the working set realistic. */
+template <class T, class ELM>
+void SafeArrayAdd (size_t count, const ELM& elm) {
+    const size_t BATCH = 1024;
+    for (size_t i = 0; i < count; i += BATCH) {
+        CComSafeArray<T> sa;
+        for (size_t j = 0; j < std::min(BATCH, count - i); ++j)
+            sa.Add(elm);
+        DoNotOptimize(sa.m_ptr);
+    }
+}
+
+/** Read "count" elements from a 1024-element array. */
+template <class T>
+void SafeArrayGetAt (const CComSafeArray<T>& sa, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        auto& elm = sa.GetAt(static_cast<int>(i % 1024));
+        DoNotOptimize(elm);
+    }
+}
+
+/** Hot paths of the COM runtime timed in isolation on a single thread. */
+std::vector<MicroResult> RunMicroBenchmarks (size_t iterations) {
+    std::vector<MicroResult> results;
+
+    results.push_back(MeasureLatency("activation/clsid", iterations, [](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _com_ptr_t<IRemoteCalc> obj;
+            CHECK(obj.CreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_INPROC_SERVER));
+            DoNotOptimize(obj);
+        }
+    }));
+    results.push_back(MeasureLatency("activation/progid", iterations, [](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _com_ptr_t<IRemoteCalc> obj;
+            CHECK(obj.CreateInstance(L"Bench.BenchCalc.1"));
+            DoNotOptimize(obj);
+        }
+    }));
+    results.push_back(MeasureLatency("activation/bulk", iterations, [](size_t count) {
+        IUnknown* objs[1024] = {};
+        for (size_t i = 0; i < count; i += 1024) {
+            auto batch = static_cast<ULONG>(std::min<size_t>(count - i, 1024));
+            CHECK(IUnknownFactory::CreateInstances(CLSID_RemoteCalc, CLSCTX_INPROC_SERVER, batch, objs));
+            for (ULONG j = 0; j < batch; ++j)
+                objs[j]->Release();
+        }
+    }));
+
+    CComPtr<IUnknown> shallow = CreateObject<ShallowClass>();
+    CComPtr<IUnknown> deep = CreateObject<DeepClass>();
+    results.push_back(MeasureLatency("qi/shallow/hit", iterations, QueryLoop<IBench0>(shallow)));
+    results.push_back(MeasureLatency("qi/shallow/miss", iterations, QueryLoop<IDispatch>(shallow)));
+    results.push_back(MeasureLatency("qi/deep/hit_first", iterations, QueryLoop<IBench0>(deep)));
+    results.push_back(MeasureLatency("qi/deep/hit_last", iterations, QueryLoop<IBench7>(deep)));
+    results.push_back(MeasureLatency("qi/deep/miss", iterations, QueryLoop<IDispatch>(deep)));
+
+    results.push_back(MeasureLatency("refcount/addref_release", iterations, [&shallow](size_t count) {
+        IUnknown* obj = shallow;
+        for (size_t i = 0; i < count; ++i) {
+            obj->AddRef();
+            DoNotOptimize(obj->Release());
+        }
+    }));
+
+    CComPtr<IUnknown> biased = CreateObject<BiasedClass>();
+    results.push_back(MeasureLatency("refcount/biased_addref_release", iterations, [&biased](size_t count) {
+        IUnknown* obj = biased;
+        for (size_t i = 0; i < count; ++i) {
+            obj->AddRef();
+            DoNotOptimize(obj->Release());
+        }
+    }));
+
+    _com_ptr_t<IBench0> deep0;
+    CHECK(deep.QueryInterface(&deep0));
+    results.push_back(MeasureLatency("com_ptr/cast", iterations, [&deep0](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _com_ptr_t<IBench7> deep7 = deep0; // QueryInterface
+            DoNotOptimize(deep7);
+        }
+    }));
+    results.push_back(MeasureLatency("com_ptr/copy", iterations, [&deep0](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _com_ptr_t<IBench0> copy = deep0; // AddRef
+            DoNotOptimize(copy);
+        }
+    }));
+
+    const CComBSTR str(L"The quick brown fox jumps over the lazy dog");
+    results.push_back(MeasureLatency("safearray/data/add", iterations, [](size_t count) {
+        SafeArrayAdd<double>(count, 3.14);
+    }));
+    results.push_back(MeasureLatency("safearray/bstr/add", iterations, [&str](size_t count) {
+        SafeArrayAdd<BSTR>(count, str);
+    }));
+    results.push_back(MeasureLatency("safearray/unknown/add", iterations, [&shallow](size_t count) {
+        SafeArrayAdd<IUnknown*>(count, shallow);
+    }));
+
+    CComSafeArray<double> data_arr(1024);
+    CComSafeArray<BSTR> bstr_arr;
+    CComSafeArray<IUnknown*> unk_arr;
+    for (int i = 0; i < 1024; ++i) {
+        bstr_arr.Add(str);
+        unk_arr.Add(shallow);
+    }
+    CComSafeArray<TestRow> record_arr(1024);
+    for (int i = 0; i < 1024; ++i) {
+        TestRow& row = record_arr.GetAt(i);
+        row.id = i;
+        row.name = SysAllocString(str);
+        row.obj = shallow;
+        row.obj->AddRef();
+    }
+    results.push_back(MeasureLatency("safearray/record/copy", iterations, [&record_arr](size_t count) {
+        for (size_t i = 0; i < count; i += 1024) {
+            SAFEARRAY* copy = nullptr;
+            CHECK(SafeArrayCopy(record_arr, &copy)); // per-row cost
+            SafeArrayDestroy(copy);
+        }
+    }));
+
+    CComSafeArray<short> samples(1024);
+    for (int i = 0; i < 1024; ++i)
+        samples.SetAt(i, static_cast<short>(i*31));
+    SAFEARRAY* converted = nullptr;
+    CHECK(SafeArrayChangeType(samples, VT_R4, &converted));
+    CComSafeArray<float> floats;
+    CHECK(floats.Attach(converted));
+    results.push_back(MeasureLatency("safearray/convert/i2_to_r4", iterations, [&samples](size_t count) {
+        for (size_t i = 0; i < count; i += 1024) {
+            SAFEARRAY* out = nullptr;
+            CHECK(SafeArrayChangeType(samples, VT_R4, &out)); // per-element cost
+            SafeArrayDestroy(out);
+        }
+    }));
+    results.push_back(MeasureLatency("safearray/convert/r4_to_i2", iterations, [&floats](size_t count) {
+        for (size_t i = 0; i < count; i += 1024) {
+            SAFEARRAY* out = nullptr;
+            CHECK(SafeArrayChangeType(floats, VT_I2, &out)); // per-element cost, including range checks
+            SafeArrayDestroy(out);
+        }
+    }));
+
+    results.push_back(MeasureLatency("safearray/data/getat", iterations, [&data_arr](size_t count) {
+        SafeArrayGetAt(data_arr, count);
+    }));
+    results.push_back(MeasureLatency("safearray/bstr/getat", iterations, [&bstr_arr](size_t count) {
+        SafeArrayGetAt(bstr_arr, count);
+    }));
+    results.push_back(MeasureLatency("safearray/unknown/getat", iterations, [&unk_arr](size_t count) {
+        SafeArrayGetAt(unk_arr, count);
+    }));
+
+    results.push_back(MeasureLatency("bstr/ccombstr/copy", iterations, [&str](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            CComBSTR copy(str);
+            DoNotOptimize(copy.m_str);
+        }
+    }));
+    results.push_back(MeasureLatency("bstr/ccombstr/append", iterations, [&str](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            CComBSTR copy(str);
+            copy += str;
+            DoNotOptimize(copy.m_str);
+        }
+    }));
+    const _bstr_t bstr(str);
+    results.push_back(MeasureLatency("bstr/bstr_t/copy", iterations, [&bstr](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _bstr_t copy(bstr);
+            DoNotOptimize(copy);
+        }
+    }));
+    results.push_back(MeasureLatency("bstr/bstr_t/concat", iterations, [&bstr](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            _bstr_t sum = bstr + bstr;
+            DoNotOptimize(sum);
+        }
+    }));
+
+    CComPtr<IUnknown> shared(new SharedRef<ShallowClass>());
+    CComPtr<IWeakRef> weak;
+    CHECK(shared->QueryInterface(__uuidof(IWeakRef), reinterpret_cast<void**>(&weak)));
+    results.push_back(MeasureLatency("sharedref/weak_upgrade", iterations, [&weak](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            IUnknown* strong = nullptr;
+            CHECK(weak->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&strong)));
+            strong->Release();
+        }
+    }));
+
+    CComPtr<IUnknown> intrusive = CreateObject<WeakClass>();
+    CComPtr<IWeakRef> intrusive_weak;
+    CHECK(intrusive->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&intrusive_weak)));
+    results.push_back(MeasureLatency("weakref/intrusive_upgrade", iterations, [&intrusive_weak](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            IUnknown* strong = nullptr;
+            CHECK(intrusive_weak->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&strong)));
+            strong->Release();
+        }
+    }));
+
+    CComPtr<IGlobalInterfaceTable> git;
+    CHECK(git.CoCreateInstance(CLSID_StdGlobalInterfaceTable));
+    DWORD git_cookie = 0;
+    CHECK(git->RegisterInterfaceInGlobal(shallow, IID_IBench0, &git_cookie));
+    results.push_back(MeasureLatency("git/lookup", iterations, [&git, git_cookie](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            IBench0* ptr = nullptr;
+            CHECK(git->GetInterfaceFromGlobal(git_cookie, IID_IBench0, reinterpret_cast<void**>(&ptr)));
+            ptr->Release();
+        }
+    }));
+    CHECK(git->RevokeInterfaceFromGlobal(git_cookie));
+
+    CComObject<EventSource>* source = nullptr;
+    CHECK(CComObject<EventSource>::CreateInstance(&source));
+    CComPtr<IConnectionPointContainer> container(source);
+    CComPtr<IConnectionPoint> point;
+    CHECK(container->FindConnectionPoint(IID_IBench0, &point));
+    for (int i = 0; i < 4; ++i) {
+        DWORD cookie = 0;
+        CHECK(point->Advise(shallow, &cookie));
+    }
+    results.push_back(MeasureLatency("events/fire_4_sinks", iterations, [source](size_t count) {
+        for (size_t i = 0; i < count; ++i)
+            DoNotOptimize(source->Fire());
+    }));
+
+    CComPtr<IUnknown> calc;
+    CHECK(calc.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_INPROC_SERVER));
+    CComPtr<IUnknown> call_unk;
+    CHECK(CoCreateAsyncCall(calc, IID_AsyncIRemoteCalc, &call_unk));
+    CComPtr<AsyncIRemoteCalc> call;
+    CHECK(call_unk->QueryInterface(IID_AsyncIRemoteCalc, reinterpret_cast<void**>(&call)));
+    results.push_back(MeasureLatency("async/begin_finish", iterations, [&call](size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            int sum = 0;
+            CHECK(call->Begin_Add(1, 2));
+            CHECK(call->Finish_Add(&sum));
+            DoNotOptimize(sum);
+        }
+    }));
+
+    return results;
+}
+
+void PrintMicroBenchmarks (const std::vector<MicroResult>& results) {
+    printf("Hot-path latency [ns/op]:\n");
+    for (const MicroResult& r : results)
+        printf("%-28s %10.2f\n", r.name, r.ns_per_op);
+}
+
+/** Write a JSON number, or null for NaN & infinity that JSON cannot represent. */
+void WriteJsonNumber (FILE* file, const char* format, double val) {
+    if (std::isfinite(val))
+        fprintf(file, format, val);
+    else
+        fprintf(file, "null");
+}
+
+/** Machine-readable results for tracking regressions across commits. */
+bool WriteMicroBenchmarksJson (const char* filename, const std::vector<MicroResult>& results) {
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const MicroResult& r = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %zu, \"ns_per_op\": ", r.name, r.iterations);
+        WriteJsonNumber(file, "%.3f", r.ns_per_op);
+        fprintf(file, ", \"ops_per_sec\": ");
+        WriteJsonNumber(file, "%.0f", 1e9/r.ns_per_op);
+        fprintf(file, "}%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+/** AddRef/Release mostly of an object created by the same thread, with every 64th pair on the object of another thread. */
+template <class CLS>
+double MeasureRefCounting (unsigned int threads, size_t iterations) {
+    std::vector<std::atomic<IUnknown*>> objs(threads);
+    std::atomic<unsigned int> created = 0;
+    std::atomic<unsigned int> finished = 0;
+    return MeasureThroughput(threads, iterations, [&](unsigned int thread_idx, size_t count) {
+        CComObject<CLS>* obj = nullptr;
+        CHECK(CComObject<CLS>::CreateInstance(&obj));
+        obj->AddRef();
+        objs[thread_idx] = obj;
+        created++;
+        while (created < threads)
+            std::this_thread::yield();
+
+        IUnknown* own = objs[thread_idx];
+        IUnknown* other = objs[(thread_idx + 1) % threads];
+        for (size_t i = 0; i < count; ++i) {
+            IUnknown* target = (i % 64 == 63) ? other : own;
+            target->AddRef();
+            DoNotOptimize(target->Release());
+        }
+
+        finished++; // keep the object alive until the other threads are done with it
+        while (finished < threads)
+            std::this_thread::yield();
+        own->Release();
+    });
+}
+
+void BenchmarkRefCounting (size_t iterations) {
+    printf("\nAddRef/Release throughput [Mops/s]:\n");
+    printf("threads     atomic     biased\n");
+    for (unsigned int threads = 1; threads <= 32; threads *= 2) {
+        double atomic = MeasureRefCounting<ShallowClass>(threads, iterations);
+        double biased = MeasureRefCounting<BiasedClass>(threads, iterations);
+        printf("%7u %10.2f %10.2f\n", threads, atomic/1e6, biased/1e6);
+    }
+}
+
+/** Upgrade a weak reference shared by all threads to a strong reference & release it again. */
+double MeasureWeakUpgrades (unsigned int threads, size_t iterations, IWeakRef* weak) {
+    return MeasureThroughput(threads, iterations, [weak](unsigned int /*thread_idx*/, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            IUnknown* strong = nullptr;
+            CHECK(weak->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&strong)));
+            strong->Release();
+        }
+    });
+}
+
+void BenchmarkWeakRefs (size_t iterations) {
+    CComPtr<IUnknown> shared(new SharedRef<ShallowClass>());
+    CComPtr<IWeakRef> shared_weak;
+    CHECK(shared->QueryInterface(__uuidof(IWeakRef), reinterpret_cast<void**>(&shared_weak)));
+    CComPtr<IUnknown> intrusive = CreateObject<WeakClass>();
+    CComPtr<IWeakRef> intrusive_weak;
+    CHECK(intrusive->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&intrusive_weak)));
+
+    printf("\nContended weak reference upgrade throughput [Mops/s]:\n");
+    printf("threads  SharedRef  intrusive\n");
+    for (unsigned int threads = 1; threads <= 32; threads *= 2) {
+        double shared_ops = MeasureWeakUpgrades(threads, iterations, shared_weak);
+        double intrusive_ops = MeasureWeakUpgrades(threads, iterations, intrusive_weak);
+        printf("%7u %10.2f %10.2f\n", threads, shared_ops/1e6, intrusive_ops/1e6);
+    }
+}
+
+/** Look up GIT cookies in a loop. Threads share cookie 0 if "shared" is set, and otherwise use their own cookie. */
+double MeasureGitLookups (unsigned int threads, size_t iterations, IGlobalInterfaceTable* git, const std::vector<DWORD>& cookies, bool shared) {
+    return MeasureThroughput(threads, iterations, [&](unsigned int thread_idx, size_t count) {
+        DWORD cookie = cookies[shared ? 0 : thread_idx];
+        for (size_t i = 0; i < count; ++i) {
+            IBench0* ptr = nullptr;
+            CHECK(git->GetInterfaceFromGlobal(cookie, IID_IBench0, reinterpret_cast<void**>(&ptr)));
+            ptr->Release();
+        }
+    });
+}
+
+void BenchmarkGlobalInterfaceTable (size_t iterations) {
+    const unsigned int MAX_THREADS = 32;
+    CComPtr<IGlobalInterfaceTable> git;
+    CHECK(git.CoCreateInstance(CLSID_StdGlobalInterfaceTable));
+    std::vector<CComPtr<IUnknown>> objs;
+    std::vector<DWORD> cookies;
+    for (unsigned int t = 0; t < MAX_THREADS; ++t) {
+        objs.push_back(CreateObject<ShallowClass>());
+        DWORD cookie = 0;
+        CHECK(git->RegisterInterfaceInGlobal(objs.back(), IID_IBench0, &cookie));
+        cookies.push_back(cookie);
+    }
+
+    printf("\nGlobal interface table lookup throughput [Mops/s]:\n");
+    printf("threads     shared per-thread\n");
+    for (unsigned int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double shared_ops = MeasureGitLookups(threads, iterations, git, cookies, true);
+        double own_ops = MeasureGitLookups(threads, iterations, git, cookies, false);
+        printf("%7u %10.2f %10.2f\n", threads, shared_ops/1e6, own_ops/1e6);
+    }
+
+    for (DWORD cookie : cookies)
+        CHECK(git->RevokeInterfaceFromGlobal(cookie));
+}
+
+/** Call Add, Concat & Scale methods in a loop. */
+void CallMethods (IRemoteCalc* calc, size_t iterations) {
+    CComBSTR a(L"hello "), b(L"world");
+    CComSafeArray<double> values(1000);
+    for (size_t i = 0; i < iterations; ++i) {
+        int sum = 0;
+        CHECK(calc->Add(1, 2, &sum));
+
+        CComBSTR str;
+        CHECK(calc->Concat(a, b, &str));
+
+        SAFEARRAY* scaled_ptr = nullptr;
+        CHECK(calc->Scale(values, 2.0, &scaled_ptr));
+        CComSafeArray<double> scaled;
+        CHECK(scaled.Attach(scaled_ptr));
+    }
+}
+
+void BenchmarkRoundTrip (size_t iterations, const char* executable) {
+    CHECK(CoRegisterLocalServer(CLSID_RemoteCalc, executable));
+    CComPtr<IRemoteCalc> inproc, local;
+    CHECK(inproc.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_INPROC_SERVER));
+    CHECK(local.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_LOCAL_SERVER));
+
+    size_t local_iterations = std::max<size_t>(iterations/1000, 10); // round trips are orders of magnitude slower
+
+    printf("\nMethod call latency (Add + Concat + Scale of 1k doubles) [us]:\n");
+    printf("   in-proc      local\n");
+    auto start = std::chrono::steady_clock::now();
+    CallMethods(inproc, local_iterations);
+    std::chrono::duration<double> inproc_time = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    CallMethods(local, local_iterations);
+    std::chrono::duration<double> local_time = std::chrono::steady_clock::now() - start;
+    printf("%10.2f %10.2f\n", inproc_time.count()/local_iterations*1e6, local_time.count()/local_iterations*1e6);
+
+    printf("\nOut-of-process Add + Concat + Scale throughput [loops/s]:\n");
+    printf("threads      local\n");
+    for (unsigned int threads = 1; threads <= 8; threads *= 2) {
+        double local_tp = MeasureThroughput(threads, local_iterations, [&local](unsigned int /*thread_idx*/, size_t count) {
+            CallMethods(local, count);
+        });
+        printf("%7u %10.0f\n", threads, local_tp);
+    }
+}
+
+
+int main (int argc, char* argv[]) {
+    if (CoRunLocalServer(argc, argv) == S_OK)
+        return 0; // started as local server for BenchmarkRoundTrip
+
+    // usage: benchmarks [iterations] [--micro] [--json <file>]
+    size_t iterations = 1000000; // per thread
+    bool micro_only = false;
+    const char* json_file = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--micro") == 0)
+            micro_only = true;
+        else if ((strcmp(argv[i], "--json") == 0) && (i + 1 < argc))
+            json_file = argv[++i];
+        else
+            iterations = strtoul(argv[i], nullptr, 10);
+    }
+
+    std::vector<MicroResult> micro = RunMicroBenchmarks(iterations);
+    PrintMicroBenchmarks(micro);
+    if (json_file && !WriteMicroBenchmarksJson(json_file, micro)) {
+        fprintf(stderr, "Unable to write %s\n", json_file);
+        return 1;
+    }
+    if (micro_only)
+        return 0;
+
+    printf("\n");
+    BenchmarkObjectAllocation(iterations);
+    BenchmarkRefCounting(iterations);
+    BenchmarkWeakRefs(iterations);
+    BenchmarkGlobalInterfaceTable(iterations);
+    BenchmarkVariants(iterations);
+    BenchmarkRoundTrip(iterations, argv[0]);
+}
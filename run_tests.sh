@@ -3,10 +3,31 @@ cd "$(dirname "$0")"
 set -e # stop on first failure
 
 # clean up
-rm -f a.out
+rm -f a.out tests_tsan tests_asan benchmarks benchmarks.json libTestPlugin.so TestInterfaces.h TestInterfaces_i.c TestInterfaces_p.cpp
 
-# build test suite
-g++ NonWindows.cpp tests.cpp
+# generate headers & proxy/stub code for out-of-process tests
+python3 IdlParse.py TestInterfaces.idl
+
+# build test suite with object counters & C++20 coroutines enabled. Symbols are exported for the plugin library
+# -fno-gnu-unique keeps the library unloadable despite function-local statics in inline methods
+g++ -D_ATL_OBJECT_COUNTERS -fPIC -shared -fno-gnu-unique TestPlugin.cpp -o libTestPlugin.so
+g++ -std=c++20 -D_ATL_OBJECT_COUNTERS -rdynamic NonWindows.cpp Marshal.cpp TestInterfaces_p.cpp tests.cpp -ldl
+
+# build benchmarks (run manually with ./benchmarks [iterations] [--micro] [--json <file>])
+g++ -O2 -DNDEBUG NonWindows.cpp Marshal.cpp TestInterfaces_p.cpp benchmarks.cpp -o benchmarks -ldl
 
 # run test suite
 ./a.out
+
+# smoke-test hot-path micro-benchmarks
+./benchmarks 1000 --micro --json benchmarks.json > /dev/null
+
+# optional ThreadSanitizer & AddressSanitizer variants of the test suite (run_tests.sh --sanitize)
+if [ "$1" == "--sanitize" ]; then
+    g++ -std=c++20 -g -D_ATL_OBJECT_COUNTERS -rdynamic -fsanitize=thread NonWindows.cpp Marshal.cpp TestInterfaces_p.cpp tests.cpp -ldl -o tests_tsan
+    TSAN_OPTIONS=halt_on_error=1 ./tests_tsan
+
+    # leak detection disabled, since process-wide registries are intentionally leaked at exit
+    g++ -std=c++20 -g -D_ATL_OBJECT_COUNTERS -rdynamic -fsanitize=address,undefined -fno-sanitize-recover=undefined NonWindows.cpp Marshal.cpp TestInterfaces_p.cpp tests.cpp -ldl -o tests_asan
+    ASAN_OPTIONS=detect_leaks=0 ./tests_asan
+fi
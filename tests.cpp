@@ -1,6 +1,126 @@
 #include <cassert>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <climits>
+#include <dlfcn.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "NonWindows.hpp"
+#include "Marshal.hpp"
+#include "SharedRef.hpp"
+#include "TestInterfaces.h" // generated by IdlParse.py
+
+// comments right after literals & identifiers are passed through unchanged by IdlParse.py
+static_assert((TEST_FLAG_A == 0x1) && (TEST_FLAG_B == 0x2), "IdlParse.py comment handling");
+
+
+/** Instrumented allocator that tracks the COM heap footprint. */
+class CountingMalloc : public IMalloc {
+public:
+    HRESULT QueryInterface (const GUID& iid, void** obj) override {
+        if ((iid == IID_IUnknown) || (iid == IID_IMalloc)) {
+            *obj = static_cast<IMalloc*>(this);
+            return S_OK;
+        }
+        *obj = nullptr;
+        return E_NOINTERFACE;
+    }
+    ULONG AddRef () override {
+        return 1;
+    }
+    ULONG Release () override {
+        return 1;
+    }
+
+    void* Alloc (size_t cb) override {
+        ++allocations;
+        return malloc(cb);
+    }
+    void* Realloc (void* pv, size_t cb) override {
+        if (!pv)
+            ++allocations;
+        return realloc(pv, cb);
+    }
+    void Free (void* pv) override {
+        if (pv)
+            --allocations;
+        free(pv);
+    }
+    size_t GetSize (void* /*pv*/) override {
+        return static_cast<size_t>(-1);
+    }
+    int DidAlloc (void* /*pv*/) override {
+        return -1;
+    }
+    void HeapMinimize () override {
+    }
+
+    std::atomic<int> allocations = 0; ///< live allocations
+};
+static CountingMalloc* s_counting_malloc = nullptr;
+
+/** Install allocator before any static initializer allocates memory. */
+__attribute__((constructor(101))) static void InstallCountingMalloc () {
+    static CountingMalloc instance; // constructed on demand, since global objects aren't initialized yet
+    s_counting_malloc = &instance;
+    CHECK(CoSetMalloc(s_counting_malloc));
+}
+
+
+static constexpr GUID CLSID_SingletonClass = {0x6b9f4c5e,0x2d1a,0x4f3b,{0x9a,0x6e,0x1c,0x7d,0x3e,0x5f,0x80,0x21}};
+
+/** Class that only exist as one shared instance. */
+class SingletonClass : public CComObjectRootEx<CComMultiThreadModel>, public CComCoClass<SingletonClass, &CLSID_SingletonClass>, public IUnknown {
+public:
+    SingletonClass() {
+        ++s_instances;
+    }
+
+    DECLARE_CLASSFACTORY_SINGLETON(SingletonClass)
+
+    BEGIN_COM_MAP(SingletonClass)
+    END_COM_MAP()
+
+    static inline std::atomic<int> s_instances = 0;
+};
+OBJECT_ENTRY_AUTO(CLSID_SingletonClass, SingletonClass)
+
+
+/** Class that is allocated from the thread-local object pool. */
+class PooledClass : public CComObjectRootEx<CComMultiThreadModel>, public IUnknown {
+public:
+    DECLARE_POOLED_ALLOCATOR()
+
+    BEGIN_COM_MAP(PooledClass)
+    END_COM_MAP()
+
+    int value = 0;
+};
+
+
+/** Class that fails FinalConstruct for one of the objects in a batch. */
+class BulkClass : public CComObjectRootEx<CComMultiThreadModel>, public IUnknown {
+public:
+    HRESULT FinalConstruct () {
+        ++s_constructed;
+        return (s_constructed == s_fail_at) ? E_OUTOFMEMORY : S_OK;
+    }
+    ~BulkClass () {
+        ++s_destroyed;
+    }
+
+    BEGIN_COM_MAP(BulkClass)
+    END_COM_MAP()
+
+    int value = 0;
+
+    static inline int s_constructed = 0;
+    static inline int s_destroyed = 0;
+    static inline int s_fail_at = -1;
+};
 
 
 /** Convert raw array to SafeArray. */
@@ -32,7 +152,2211 @@ void TestCComSafeArray() {
     }
 }
 
-int main() {
+/** Object referenced by record members. */
+class RecordMember : public CComObjectRootEx<CComMultiThreadModel>, public IUnknown {
+public:
+    BEGIN_COM_MAP(RecordMember)
+    END_COM_MAP()
+};
+
+void TestRecordSafeArray () {
+    printf("record arrays...\n");
+    CComObject<RecordMember>* member = nullptr;
+    CHECK(CComObject<RecordMember>::CreateInstance(&member));
+    CComPtr<IUnknown> member_ref(member);
+    {
+        CComSafeArray<TestRow> rows(3);
+        assert(rows.GetCount() == 3);
+        assert(&rows.GetAt(2) == &rows.GetAt(0) + 2); // contiguous storage
+        assert(!rows.GetAt(1).name && !rows.GetAt(1).obj && (rows.GetAt(1).tag.vt == VT_EMPTY)); // zero-initialized
+
+        TestRow& row = rows.GetAt(1);
+        row.id = 42;
+        row.name = SysAllocString(L"second");
+        row.obj = member;
+        member->AddRef();
+        CComVariant(L"tag").Detach(&row.tag);
+        CComSafeArray<double> samples(2);
+        samples.SetAt(1, 3.5);
+        row.samples = samples.Detach();
+        row.pos[2] = 1.5f;
+        assert(member->m_ref == 2);
+
+        // deep copy of owned members
+        CComSafeArray<TestRow> copy(static_cast<SAFEARRAY*>(rows));
+        assert(copy.GetCount() == 3);
+        const TestRow& dup = copy.GetAt(1);
+        assert(dup.id == 42);
+        assert(dup.name != row.name);
+        assert(wcscmp(dup.name, L"second") == 0);
+        assert(dup.obj == member);
+        assert(member->m_ref == 3);
+        assert((dup.tag.vt == VT_BSTR) && (dup.tag.bstrVal != row.tag.bstrVal) && (wcscmp(dup.tag.bstrVal, L"tag") == 0));
+        assert(dup.samples != row.samples);
+        assert(CComSafeArray<double>::InternalDataPointer(dup.samples)[1] == 3.5);
+        assert(dup.pos[2] == 1.5f);
+
+        // Add & SetAt copy the row
+        copy.Add(row);
+        assert(copy.GetCount() == 4);
+        assert(member->m_ref == 4);
+        assert(copy.GetAt(3).name != row.name);
+        CHECK(copy.SetAt(0, row));
+        assert(member->m_ref == 5);
+        CHECK(copy.SetAt(0, TestRow()));
+        assert(!copy.GetAt(0).name && !copy.GetAt(0).obj);
+        assert(member->m_ref == 4);
+
+        // layout metadata
+        CComPtr<IRecordInfo> info;
+        CHECK(SafeArrayGetRecordInfo(copy, &info));
+        ULONG size = 0;
+        CHECK(info->GetSize(&size));
+        assert(size == sizeof(TestRow));
+        CComBSTR name;
+        CHECK(info->GetName(&name));
+        assert(wcscmp(name, L"TestRow") == 0);
+        assert(info->IsMatchingType(RecordInfoOf<TestRow>()));
+        ULONG field_count = 0;
+        CHECK(info->GetFieldNames(&field_count, nullptr));
+        assert(field_count == 7);
+        CComSafeArray<double> plain(1);
+        assert(SafeArrayGetRecordInfo(plain, &info) == E_INVALIDARG);
+    }
+    {
+        // records without uuid are matched by name & layout instead of the shared null GUID
+        assert(RecordInfoOf<TestPoint>()->IsMatchingType(RecordInfoOf<TestPoint>()));
+        assert(!RecordInfoOf<TestPoint>()->IsMatchingType(RecordInfoOf<TestLabel>()));
+        assert(!RecordInfoOf<TestLabel>()->IsMatchingType(RecordInfoOf<TestRow>()));
+        CComSafeArray<TestPoint> points(2);
+        CComSafeArray<TestLabel> labels;
+        assert(labels.Attach(points) == E_INVALIDARG);
+    }
+    assert(member->m_ref == 1); // owned members released with the arrays
+
+    // one million rows in a single block
+    {
+        const UINT COUNT = 1000000;
+        CComSafeArray<TestRow> rows(COUNT);
+        for (UINT i = 0; i < COUNT; i += 1000) {
+            rows.GetAt(i).id = static_cast<int>(i);
+            rows.GetAt(i).name = SysAllocString(L"row");
+        }
+        assert(&rows.GetAt(COUNT - 1) == &rows.GetAt(0) + (COUNT - 1));
+        SAFEARRAY* copy = nullptr;
+        CHECK(SafeArrayCopy(rows, &copy));
+        CComSafeArray<TestRow> dup;
+        CHECK(dup.Attach(copy));
+        assert(dup.GetCount() == COUNT);
+        assert((dup.GetAt(999000).id == 999000) && (wcscmp(dup.GetAt(999000).name, L"row") == 0));
+    }
+}
+
+/** Compare converted elements against VariantChangeType results. */
+template <class D>
+void CheckConverted (SAFEARRAY* sa, const std::vector<CComVariant>& expected) {
+    CComSafeArray<D> arr;
+    CHECK(arr.Attach(sa));
+    assert(arr.GetCount() == expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        D val = expected[i].*CVarTypeInfo<D>::pmField;
+        assert(memcmp(&arr.GetAt(static_cast<int>(i)), &val, sizeof(D)) == 0); // bitwise to also match NaN
+    }
+}
+
+/** Convert arrays with each test value at a different position to all types, and compare with per-element conversion. */
+template <class S>
+void CheckChangeType (const std::vector<double>& values) {
+    const VARTYPE types[] = {VT_UI1, VT_I2, VT_I4, VT_R4, VT_R8};
+    const UINT COUNT = 11; // one SIMD step & a tail
+    for (size_t v = 0; v < values.size(); ++v) {
+        // skip values that aren't representable in the source type
+        VARIANT tmp;
+        tmp.vt = VT_R8;
+        tmp.dblVal = values[v];
+        CComVariant val;
+        if (FAILED(VariantChangeType(&val, &tmp, 0, CVarTypeInfo<S>::VT)))
+            continue;
+
+        CComSafeArray<S> src(COUNT);
+        for (UINT i = 0; i < COUNT; ++i)
+            src.SetAt(i, (i == v % COUNT) ? val.*CVarTypeInfo<S>::pmField : static_cast<S>(i*7 % 100));
+
+        for (VARTYPE vt : types) {
+            std::vector<CComVariant> expected(COUNT);
+            HRESULT expected_hr = S_OK;
+            for (UINT i = 0; i < COUNT; ++i) {
+                CComVariant elm;
+                elm.vt = CVarTypeInfo<S>::VT;
+                elm.*CVarTypeInfo<S>::pmField = src.GetAt(i);
+                HRESULT hr = VariantChangeType(&expected[i], &elm, 0, vt);
+                if (FAILED(hr))
+                    expected_hr = hr;
+            }
+
+            SAFEARRAY* out = nullptr;
+            HRESULT hr = SafeArrayChangeType(src, vt, &out);
+            assert(hr == expected_hr);
+            if (FAILED(hr)) {
+                assert(!out);
+                continue;
+            }
+            switch (vt) {
+            case VT_UI1: CheckConverted<BYTE>(out, expected);   break;
+            case VT_I2:  CheckConverted<short>(out, expected);  break;
+            case VT_I4:  CheckConverted<LONG>(out, expected);   break;
+            case VT_R4:  CheckConverted<float>(out, expected);  break;
+            case VT_R8:  CheckConverted<double>(out, expected); break;
+            }
+        }
+    }
+}
+
+void TestSafeArrayChangeType () {
+    printf("SAFEARRAY element types...\n");
+    {
+        CComSafeArray<float> floats(4);
+        assert(floats.GetType() == VT_R4);
+        VARTYPE vt = VT_EMPTY;
+        CHECK(SafeArrayGetVartype(floats, &vt));
+        assert(vt == VT_R4);
+
+        // same element size, but different type
+        CComSafeArray<LONG> ints;
+        SAFEARRAY* raw = floats.Detach();
+        assert(ints.Attach(raw) == E_INVALIDARG);
+        {
+            // copy is left empty, and asserts in debug builds
+            pid_t pid = fork();
+            if (pid == 0) {
+                freopen("/dev/null", "w", stderr); // expected assertion message
+                CComSafeArray<LONG> copy(raw);
+                _exit(copy.m_ptr ? 1 : 0);
+            }
+            int status = 0;
+            assert(waitpid(pid, &status, 0) == pid);
+#ifdef NDEBUG
+            assert(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+#else
+            assert(WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT));
+#endif
+        }
+        CHECK(floats.Attach(raw)); // ownership not taken on failure
+
+        CComSafeArray<double> doubles(2);
+        CComSafeArray<IUnknown*> pointers(2);
+        assert(doubles.Attach(pointers) == E_INVALIDARG);
+        CComSafeArray<TestRow> rows;
+        assert(rows.Attach(doubles) == E_INVALIDARG);
+        assert(SafeArrayChangeType(pointers, VT_R8, &raw) == DISP_E_BADVARTYPE);
+        assert(SafeArrayChangeType(doubles, VT_BSTR, &raw) == DISP_E_BADVARTYPE);
+    }
+
+    printf("SAFEARRAY conversion...\n");
+    {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        const double inf = std::numeric_limits<double>::infinity();
+        const std::vector<double> values = {0, 1, -1, 0.5, 1.5, 2.5, -2.5, -0.5, -0.51, 0.49, 99.99, -1234.5678,
+            127.5, 254.5, 255.49, 255.5, 256, 32766.5, 32767, 32767.5, 32768, -32768, -32768.5, -32769,
+            65536.25, 2147483520, 2147483647, 2147483647.5, 2147483648.0, -2147483648.0, -2147483648.5, -2147483649.0,
+            8388607.5, 8388609, 1e20, -1e20, 3.4e38, 3.5e38, -3.5e38, 1e-40, nan, inf, -inf};
+        CheckChangeType<BYTE>(values);
+        CheckChangeType<short>(values);
+        CheckChangeType<LONG>(values);
+        CheckChangeType<float>(values);
+        CheckChangeType<double>(values);
+    }
+    {
+        // sensor samples round-trip, also through VariantChangeType
+        const UINT COUNT = 1000003;
+        CComSafeArray<short> samples(COUNT);
+        for (UINT i = 0; i < COUNT; ++i)
+            samples.SetAt(i, static_cast<short>(i*31));
+
+        SAFEARRAY* raw = nullptr;
+        CHECK(SafeArrayChangeType(samples, VT_R4, &raw));
+        CComSafeArray<float> floats;
+        CHECK(floats.Attach(raw));
+        assert(floats.GetCount() == COUNT);
+        assert(floats.GetAt(COUNT - 1) == static_cast<short>((COUNT - 1)*31));
+
+        CComVariant var(std::move(floats));
+        CHECK(var.ChangeType(VT_ARRAY | VT_I2));
+        VARIANT result;
+        VariantInit(&result);
+        CHECK(var.Detach(&result));
+        CComSafeArray<short> back;
+        CHECK(back.Attach(result.parray));
+        assert(memcmp(&back.GetAt(0), &samples.GetAt(0), COUNT*sizeof(short)) == 0);
+    }
+}
+
+void TestSingletonFactory() {
+    printf("singleton activation...\n");
+    std::vector<IUnknown*> objs(8, nullptr);
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < objs.size(); ++i) {
+            threads.emplace_back([&objs, i] {
+                CComPtr<IUnknown> obj;
+                CHECK(obj.CoCreateInstance(CLSID_SingletonClass));
+                objs[i] = obj.Detach();
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+    assert(SingletonClass::s_instances == 1);
+    for (IUnknown* obj : objs) {
+        assert(obj == objs[0]);
+        obj->Release();
+    }
+
+    CComPtr<IUnknown> obj;
+    obj.CoCreateInstance(L"SingletonClass");
+    assert(obj == objs[0]); // still alive
+    assert(SingletonClass::s_instances == 1);
+}
+
+void TestPooledAllocator() {
+    printf("pooled allocation...\n");
+    // create objects on one thread and release them on another
+    const size_t N = 10000;
+    std::vector<CComObject<PooledClass>*> objs(N, nullptr);
+    for (int round = 0; round < 3; ++round) {
+        std::thread creator([&objs] {
+            for (auto& obj : objs) {
+                CHECK(CComObject<PooledClass>::CreateInstance(&obj));
+                obj->AddRef();
+                obj->value = 42;
+            }
+        });
+        creator.join();
+
+        std::thread releaser([&objs] {
+            for (auto& obj : objs) {
+                assert(obj->value == 42);
+                obj->Release();
+                obj = nullptr;
+            }
+        });
+        releaser.join();
+    }
+
+    // freed blocks are reused by the same thread
+    CComObject<PooledClass>* obj1 = nullptr;
+    CHECK(CComObject<PooledClass>::CreateInstance(&obj1));
+    void* addr = obj1;
+    obj1->AddRef();
+    obj1->Release();
+    CComObject<PooledClass>* obj2 = nullptr;
+    CHECK(CComObject<PooledClass>::CreateInstance(&obj2));
+    assert(obj2 == addr);
+    obj2->AddRef();
+    obj2->Release();
+
+    {
+        // partial batch of an idle thread is reclaimed when the owner runs out of slab space
+        CComObject<PooledClass>* obj = nullptr;
+        CHECK(CComObject<PooledClass>::CreateInstance(&obj));
+        obj->AddRef();
+        void* released = obj;
+        std::atomic<bool> freed = false, quit = false;
+        std::thread idle([&] {
+            obj->Release();
+            freed = true;
+            while (!quit)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        });
+        while (!freed)
+            std::this_thread::yield();
+
+        std::vector<CComObject<PooledClass>*> more;
+        bool reused = false;
+        for (size_t i = 0; (i < 100000) && !reused; ++i) { // free blocks of the cache & at most one slab
+            more.push_back(nullptr);
+            CHECK(CComObject<PooledClass>::CreateInstance(&more.back()));
+            more.back()->AddRef();
+            reused = (more.back() == released);
+        }
+        assert(reused);
+        for (auto* tmp : more)
+            tmp->Release();
+        quit = true;
+        idle.join();
+    }
+}
+
+void TestBulkCreation() {
+    printf("bulk creation...\n");
+    const int N = 1000;
+    int before = s_counting_malloc->allocations;
+    {
+        // objects are packed contiguously in one allocation
+        std::vector<CComObject<BulkClass>*> objs(N, nullptr);
+        CHECK(CComObject<BulkClass>::CreateInstances(N, objs.data()));
+        assert(s_counting_malloc->allocations == before + 1);
+        ptrdiff_t stride = reinterpret_cast<char*>(objs[1]) - reinterpret_cast<char*>(objs[0]);
+        assert(stride >= static_cast<ptrdiff_t>(sizeof(CComObject<BulkClass>)));
+        for (int i = 0; i < N; ++i) {
+            assert(reinterpret_cast<char*>(objs[i]) - reinterpret_cast<char*>(objs[0]) == i*stride);
+            objs[i]->AddRef();
+            objs[i]->value = i;
+        }
+
+        // slab is freed when the last object is released, regardless of order & thread
+        std::thread releaser([&objs] {
+            for (int i = 0; i < N; i += 2)
+                objs[i]->Release();
+        });
+        releaser.join();
+        assert(s_counting_malloc->allocations == before + 1);
+        for (int i = N - 1; i > 0; i -= 2) {
+            assert(objs[i]->value == i);
+            objs[i]->Release();
+        }
+        assert(s_counting_malloc->allocations == before);
+        assert(BulkClass::s_destroyed == N);
+    }
+    {
+        // all objects are destroyed if one of them fails FinalConstruct
+        BulkClass::s_constructed = 0;
+        BulkClass::s_destroyed = 0;
+        BulkClass::s_fail_at = 10;
+        std::vector<CComObject<BulkClass>*> objs(N, nullptr);
+        assert(CComObject<BulkClass>::CreateInstances(N, objs.data()) == E_OUTOFMEMORY);
+        assert(BulkClass::s_destroyed == 10);
+        for (auto* obj : objs)
+            assert(!obj);
+        assert(s_counting_malloc->allocations == before);
+        BulkClass::s_fail_at = -1;
+    }
+    {
+        // activation by CLSID returns AddRef'ed objects
+        static constexpr GUID CLSID_BulkClass = {0x4e1a7c92,0x3f5d,0x4b68,{0x8c,0x2e,0x71,0x0a,0x9d,0x4b,0x36,0xe5}};
+        IUnknownFactory::RegisterClass<BulkClass>(CLSID_BulkClass, "BulkClass");
+        std::vector<IUnknown*> objs(N, nullptr);
+        CHECK(IUnknownFactory::CreateInstances(CLSID_BulkClass, CLSCTX_INPROC_SERVER, N, objs.data()));
+        for (auto* obj : objs)
+            assert(obj->Release() == 0);
+        assert(s_counting_malloc->allocations == before);
+        CHECK(IUnknownFactory::UnregisterClass(CLSID_BulkClass));
+
+        // per-class activation policies are respected
+        int instances = SingletonClass::s_instances;
+        CHECK(IUnknownFactory::CreateInstances(CLSID_SingletonClass, CLSCTX_INPROC_SERVER, 10, objs.data()));
+        for (int i = 0; i < 10; ++i) {
+            assert(objs[i] == objs[0]);
+            objs[i]->Release();
+        }
+        assert(SingletonClass::s_instances <= instances + 1);
+    }
+}
+
+void TestCoTaskMemAlloc() {
+    printf("IMalloc replacement...\n");
+    {
+        CComPtr<IMalloc> malloc;
+        CHECK(CoGetMalloc(MEMCTX_TASK, &malloc));
+        assert(malloc == s_counting_malloc);
+    }
+    assert(CoSetMalloc(s_counting_malloc) == E_ILLEGAL_METHOD_CALL); // too late
+
+    int before = s_counting_malloc->allocations;
+    {
+        CComBSTR str(L"hello");
+        _bstr_t str2(str);
+        CComSafeArray<double> sa(4);
+        assert(s_counting_malloc->allocations == before + 4); // 2 strings + array header & payload
+    }
+    assert(s_counting_malloc->allocations == before);
+
+    void* ptr = CoTaskMemAlloc(16);
+    ptr = CoTaskMemRealloc(ptr, 32);
+    assert(s_counting_malloc->allocations == before + 1);
+    CoTaskMemFree(ptr);
+    assert(s_counting_malloc->allocations == before);
+}
+
+
+static constexpr GUID IID_ICounter = {0x3f2a9b1c,0x7d4e,0x4a5b,{0x8c,0x6d,0x1e,0x2f,0x3a,0x4b,0x5c,0x6d}};
+
+struct ICounter : public IUnknown {
+    virtual HRESULT Increment (/*out*/int* value) = 0;
+};
+DEFINE_UUIDOF(ICounter)
+
+/** Apartment-confined counter without internal synchronization. */
+class SingleThreadedCounter : public CComObjectRootEx<CComSingleThreadModel>, public ICounter {
+public:
+    HRESULT Increment (int* value) override {
+        assert(std::this_thread::get_id() == owner);
+        *value = ++m_count;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(SingleThreadedCounter)
+        COM_INTERFACE_ENTRY(ICounter)
+    END_COM_MAP()
+
+    std::thread::id owner = std::this_thread::get_id();
+private:
+    int m_count = 0;
+};
+
+/** Cross-apartment proxy for ICounter. */
+class CounterProxy : public CApartmentProxy<ICounter> {
+public:
+    using CApartmentProxy::CApartmentProxy;
+
+    HRESULT Increment (int* value) override {
+        return Invoke([&] { return m_target->Increment(value); });
+    }
+};
+APARTMENT_PROXY_ENTRY_AUTO(ICounter, CounterProxy)
+
+/** Class for counting object lifecycle & QueryInterface events. */
+class CountedClass : public CComObjectRootEx<CComMultiThreadModel>, public ICounter {
+public:
+    HRESULT Increment (int* value) override {
+        *value = 1;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(CountedClass)
+        COM_INTERFACE_ENTRY(ICounter)
+    END_COM_MAP()
+};
+
+CoClassCounters FindClassCounters (const char* name) {
+    std::vector<CoClassCounters> classes(CoGetClassCounters(nullptr, 0));
+    classes.resize(CoGetClassCounters(classes.data(), static_cast<ULONG>(classes.size())));
+    for (const CoClassCounters& c : classes) {
+        if (strcmp(c.name, name) == 0)
+            return c;
+    }
+    return {name, 0, 0, 0, 0, 0, 0};
+}
+
+void TestObjectCounters () {
+#ifdef _ATL_OBJECT_COUNTERS
+    printf("object counters...\n");
+    const int THREADS = 4;
+    const int OBJECTS = 100;
+
+    // counters from exited threads are retained
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([] {
+            for (int i = 0; i < OBJECTS; ++i) {
+                CComObject<CountedClass>* obj = nullptr;
+                CHECK(CComObject<CountedClass>::CreateInstance(&obj));
+                obj->AddRef();
+                CComPtr<ICounter> counter;
+                CHECK(obj->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&counter)));
+                CComPtr<IDispatch> disp;
+                assert(obj->QueryInterface(IID_IDispatch, reinterpret_cast<void**>(&disp)) == E_NOINTERFACE);
+                obj->Release();
+            }
+        });
+    }
+    for (auto& t : threads)
+        t.join();
+
+    CComObject<CountedClass>* live = nullptr;
+    CHECK(CComObject<CountedClass>::CreateInstance(&live));
+    live->AddRef();
+
+    CoClassCounters c = FindClassCounters("CountedClass");
+    assert(c.created == THREADS*OBJECTS + 1);
+    assert(c.created - c.destroyed == 1);
+    assert(c.addrefs == 2*THREADS*OBJECTS + 1);
+    assert(c.releases == 2*THREADS*OBJECTS);
+    assert(c.qi_hits == THREADS*OBJECTS);
+    assert(c.qi_misses == THREADS*OBJECTS);
+
+    std::vector<CoInterfaceCounters> interfaces(CoGetInterfaceCounters(nullptr, 0));
+    CoGetInterfaceCounters(interfaces.data(), static_cast<ULONG>(interfaces.size()));
+    size_t matches = 0;
+    for (const CoInterfaceCounters& i : interfaces) {
+        if (strcmp(i.name, "CountedClass") != 0)
+            continue;
+        if (i.iid == IID_ICounter)
+            assert((i.hits == THREADS*OBJECTS) && (i.misses == 0));
+        else if (i.iid == IID_IDispatch)
+            assert((i.hits == 0) && (i.misses == THREADS*OBJECTS));
+        matches++;
+    }
+    assert(matches == 2);
+
+    live->Release();
+    c = FindClassCounters("CountedClass");
+    assert(c.created == c.destroyed);
+    assert(c.addrefs == c.releases);
+#endif
+}
+
+void TestLeakTracker () {
+    printf("leak tracker...\n");
+    FILE* file = tmpfile();
+    ULONG before = CoDumpLiveObjects(file);
+
+    std::vector<CComPtr<IUnknown>> objs;
+    for (int i = 0; i < 3; ++i) {
+        CComObject<CountedClass>* obj = nullptr;
+        CHECK(CComObject<CountedClass>::CreateInstance(&obj));
+        objs.push_back(static_cast<IUnknown*>(obj));
+    }
+    objs.push_back(objs[0]); // refs=2
+
+    ULONG live = CoDumpLiveObjects(file);
+    assert(live == before + 3);
+
+    std::string content(ftell(file), '\0');
+    rewind(file);
+    content.resize(fread(&content[0], 1, content.size(), file));
+    fclose(file);
+    assert(content.find("3 x CountedClass:") != std::string::npos);
+    assert(content.find("(refs=2)") != std::string::npos);
+
+    objs.clear();
+    file = fopen("/dev/null", "w");
+    assert(CoDumpLiveObjects(file) == before);
+    fclose(file);
+}
+
+/** Class implemented in libTestPlugin.so. */
+static constexpr GUID CLSID_PluginClass = {0x2d9f5b31,0x6c4e,0x4f70,{0xa1,0xb2,0xc3,0xd4,0xe5,0xf6,0x07,0x18}};
+
+/** Absolute path of libTestPlugin.so built by run_tests.sh. */
+std::string PluginLibraryPath () {
+    char library[PATH_MAX] = {};
+    if (!realpath("libTestPlugin.so", library))
+        throw std::runtime_error("libTestPlugin.so not found");
+    return library;
+}
+
+void TestClassRegistry () {
+    printf("class registry...\n");
+    static constexpr GUID CLSID_CountedClass = {0x1c8e4a20,0x5b3d,0x4e6f,{0x90,0xa1,0xb2,0xc3,0xd4,0xe5,0xf6,0x07}};
+    IUnknownFactory::RegisterClass<CountedClass>(CLSID_CountedClass, "CountedClass");
+    {
+        CComPtr<ICounter> obj;
+        CHECK(obj.CoCreateInstance(CLSID_CountedClass));
+    }
+
+    // activate while other classes are registered & unregistered, which repeatedly replaces the snapshot
+    std::atomic<bool> quit = false;
+    std::thread activator([&quit] {
+        while (!quit) {
+            CComPtr<ICounter> obj;
+            CHECK(obj.CoCreateInstance(CLSID_CountedClass));
+            CComPtr<IUnknown> obj2;
+            CHECK(obj2.CoCreateInstance(L"CountedClass"));
+        }
+    });
+    for (unsigned int round = 0; round < 10; ++round) {
+        const unsigned int CLASSES = 200;
+        for (unsigned int i = 0; i < CLASSES; ++i)
+            IUnknownFactory::RegisterClass<PooledClass>({i, 0, 0, {1, 2, 3, 4, 5, 6, 7, 8}}, "PooledClass");
+        for (unsigned int i = 0; i < CLASSES; ++i)
+            CHECK(IUnknownFactory::UnregisterClass({i, 0, 0, {1, 2, 3, 4, 5, 6, 7, 8}}));
+    }
+    quit = true;
+    activator.join();
+
+    CHECK(IUnknownFactory::UnregisterClass(CLSID_CountedClass));
+    assert(IUnknownFactory::UnregisterClass(CLSID_CountedClass) == S_FALSE);
+    CComPtr<ICounter> obj;
+    assert(obj.CoCreateInstance(CLSID_CountedClass, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG) == REGDB_E_CLASSNOTREG);
+
+    // library unloaded before its OBJECT_ENTRY_AUTO section was registered by a lookup
+    const std::string library = PluginLibraryPath();
+    void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    assert(handle);
+    dlclose(handle);
+    assert(!dlopen(library.c_str(), RTLD_NOW | RTLD_NOLOAD));
+    CComPtr<IUnknown> plugin;
+    assert(plugin.CoCreateInstance(CLSID_PluginClass, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG) == REGDB_E_CLASSNOTREG);
+
+    // unregistration before the first lookup
+    handle = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+    assert(handle);
+    CHECK(IUnknownFactory::UnregisterClass(CLSID_PluginClass));
+    assert(plugin.CoCreateInstance(CLSID_PluginClass, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG) == REGDB_E_CLASSNOTREG);
+    dlclose(handle);
+}
+
+void TestClassCatalog () {
+    printf("class catalog...\n");
+    const std::string library = PluginLibraryPath();
+
+    char filename[] = "/tmp/catalog_XXXXXX";
+    int fd = mkstemp(filename);
+    assert(fd >= 0);
+    std::string content = "# test catalog\n"
+                          "{2d9f5b31-6c4e-4f70-a1b2-c3d4e5f60718} Test.PluginClass.1 " + library + "\n"
+                          "{00000000-1111-2222-3333-444444444444} - missing/libMissing.so\n";
+    ssize_t written = write(fd, content.data(), content.size());
+    assert(written == static_cast<ssize_t>(content.size()));
+    close(fd);
+    CHECK(CoRegisterClassCatalog(filename));
+    unlink(filename); // no longer needed after indexing
+
+    // library is loaded on first activation by ProgID
+    assert(!dlopen(library.c_str(), RTLD_NOW | RTLD_NOLOAD));
+    {
+        CComPtr<IUnknown> obj;
+        CHECK(obj.CoCreateInstance(L"Test.PluginClass.1", nullptr, CLSCTX_INPROC_SERVER));
+    }
+    void* handle = dlopen(library.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    assert(handle);
+
+    // revocation drops the catalog's reference, so that the library is unloaded & loaded again on next activation by CLSID
+    CHECK(CoRevokeModuleClasses(dlsym(handle, "TestPluginAnchor")));
+    dlclose(handle);
+    assert(!dlopen(library.c_str(), RTLD_NOW | RTLD_NOLOAD));
+
+    CComPtr<IUnknown> obj;
+    CHECK(obj.CoCreateInstance(CLSID_PluginClass, nullptr, CLSCTX_INPROC_SERVER));
+    handle = dlopen(library.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    assert(handle);
+    dlclose(handle);
+
+    CComPtr<IUnknown> obj2;
+    CHECK(obj2.CoCreateInstance(L"Test.PluginClass.1"));
+
+    // missing library. Not logged with CLSCTX_NO_FAILURE_LOG
+    CComPtr<IUnknown> obj3;
+    assert(FAILED(obj3.CoCreateInstance({0x00000000,0x1111,0x2222,{0x33,0x33,0x44,0x44,0x44,0x44,0x44,0x44}}, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG)));
+}
+
+/** Unregister all classes in the test executable. Must therefore be called last. */
+void TestRevokeModuleClasses () {
+    printf("module unregistration...\n");
+    CHECK(CoRevokeModuleClasses(reinterpret_cast<const void*>(&TestRevokeModuleClasses)));
+    assert(CoRevokeModuleClasses(reinterpret_cast<const void*>(&TestRevokeModuleClasses)) == S_FALSE);
+    CComPtr<IUnknown> obj;
+    assert(obj.CoCreateInstance(CLSID_SingletonClass, nullptr, CLSCTX_INPROC_SERVER | CLSCTX_NO_FAILURE_LOG) == REGDB_E_CLASSNOTREG);
+}
+
+void TestSingleThreadedApartment() {
+    printf("single-threaded apartment...\n");
+    const int THREADS = 4;
+    const int CALLS = 1000;
+
+    std::atomic<IStream*> stream = nullptr;
+    std::atomic<bool> quit = false;
+    std::thread sta([&] {
+        CHECK(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+        {
+            CComObject<SingleThreadedCounter>* obj = nullptr;
+            CHECK(CComObject<SingleThreadedCounter>::CreateInstance(&obj));
+            CComPtr<ICounter> counter(obj);
+
+            IStream* tmp = nullptr;
+            assert(CoMarshalInterThreadInterfaceInStream(IID_IDispatch, counter, &tmp) == E_NOINTERFACE); // not implemented
+            assert(!tmp);
+            CHECK(CoMarshalInterThreadInterfaceInStream(IID_ICounter, counter, &tmp));
+            stream = tmp;
+        }
+        while (!quit)
+            CoProcessApartmentCalls(10); // message loop
+        CoUninitialize();
+    });
+
+    while (!stream)
+        std::this_thread::yield();
+    CComPtr<ICounter> proxy;
+    CHECK(CoGetInterfaceAndReleaseStream(stream, IID_ICounter, reinterpret_cast<void**>(&proxy)));
+
+    // call from multiple threads without locking
+    std::vector<std::thread> callers;
+    for (int t = 0; t < THREADS; ++t) {
+        callers.emplace_back([&proxy] {
+            for (int i = 0; i < CALLS; ++i) {
+                int value = 0;
+                CHECK(proxy->Increment(&value));
+            }
+        });
+    }
+    for (auto& t : callers)
+        t.join();
+
+    int value = 0;
+    CHECK(proxy->Increment(&value));
+    assert(value == THREADS*CALLS + 1);
+    proxy.Release(); // releases object on STA thread
+
+    quit = true;
+    sta.join();
+}
+
+/** Counter whose QueryInterface blocks while "gated" is set, to hold lookups in flight. */
+class GatedCounter : public ICounter {
+public:
+    HRESULT QueryInterface (const IID& iid, void** obj) override {
+        if ((iid != IID_IUnknown) && (iid != IID_ICounter)) {
+            *obj = nullptr;
+            return E_NOINTERFACE;
+        }
+        if ((iid == IID_ICounter) && gated) {
+            entered = true;
+            while (gated)
+                std::this_thread::yield();
+        }
+        *obj = static_cast<ICounter*>(this);
+        AddRef();
+        return S_OK;
+    }
+    ULONG AddRef () override {
+        return ++refs;
+    }
+    ULONG Release () override {
+        return --refs;
+    }
+    HRESULT Increment (int* value) override {
+        *value = 0;
+        return S_OK;
+    }
+
+    std::atomic<ULONG> refs = 1;
+    std::atomic<bool>  gated = false;
+    std::atomic<bool>  entered = false;
+};
+
+/** Counter that looks itself up in the global interface table on every call. */
+class LookupCounter : public CComObjectRootEx<CComSingleThreadModel>, public ICounter {
+public:
+    HRESULT Increment (int* value) override {
+        CComPtr<ICounter> self;
+        CHECK(git->GetInterfaceFromGlobal(cookie, IID_ICounter, reinterpret_cast<void**>(&self)));
+        assert(self == this);
+        *value = ++m_count;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(LookupCounter)
+        COM_INTERFACE_ENTRY(ICounter)
+    END_COM_MAP()
+
+    IGlobalInterfaceTable* git = nullptr;
+    DWORD                  cookie = 0;
+private:
+    int m_count = 0;
+};
+
+void TestGlobalInterfaceTable () {
+    printf("global interface table...\n");
+    CComPtr<IGlobalInterfaceTable> git;
+    CHECK(git.CoCreateInstance(CLSID_StdGlobalInterfaceTable));
+
+    CComObject<CountedClass>* obj = nullptr;
+    CHECK(CComObject<CountedClass>::CreateInstance(&obj));
+    CComPtr<ICounter> counter(obj);
+    DWORD cookie = 0;
+    assert(git->RegisterInterfaceInGlobal(counter, IID_IDispatch, &cookie) == E_NOINTERFACE);
+    CHECK(git->RegisterInterfaceInGlobal(counter, IID_ICounter, &cookie));
+    assert(cookie != 0);
+    {
+        // lookups from many threads
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&git, cookie, obj] {
+                for (int i = 0; i < 1000; ++i) {
+                    CComPtr<ICounter> ptr;
+                    CHECK(git->GetInterfaceFromGlobal(cookie, IID_ICounter, reinterpret_cast<void**>(&ptr)));
+                    assert(ptr == obj);
+                }
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+    }
+    counter.Release(); // kept alive by the table
+    CHECK(git->RevokeInterfaceFromGlobal(cookie));
+
+    // stale & invalid cookies are rejected
+    void* ptr = reinterpret_cast<void*>(0x1);
+    assert(git->GetInterfaceFromGlobal(cookie, IID_ICounter, &ptr) == E_INVALIDARG);
+    assert(ptr == nullptr);
+    assert(git->RevokeInterfaceFromGlobal(cookie) == E_INVALIDARG);
+    assert(git->GetInterfaceFromGlobal(0, IID_ICounter, &ptr) == E_INVALIDARG);
+    assert(git->GetInterfaceFromGlobal(0x000FFFFF, IID_ICounter, &ptr) == E_INVALIDARG); // unallocated slot
+    {
+        // slot is reused with a new generation tag
+        CComObject<CountedClass>* obj2 = nullptr;
+        CHECK(CComObject<CountedClass>::CreateInstance(&obj2));
+        CComPtr<ICounter> counter2(obj2);
+        DWORD cookie2 = 0;
+        CHECK(git->RegisterInterfaceInGlobal(counter2, IID_ICounter, &cookie2));
+        assert(cookie2 != cookie);
+        assert(git->GetInterfaceFromGlobal(cookie, IID_ICounter, &ptr) == E_INVALIDARG);
+        CHECK(git->RevokeInterfaceFromGlobal(cookie2));
+    }
+
+    // objects in a single-threaded apartment are returned as proxies
+    std::atomic<DWORD> sta_cookie = 0;
+    std::atomic<bool> quit = false;
+    std::thread sta([&] {
+        CHECK(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+        {
+            CComObject<SingleThreadedCounter>* sta_obj = nullptr;
+            CHECK(CComObject<SingleThreadedCounter>::CreateInstance(&sta_obj));
+            CComPtr<ICounter> sta_counter(sta_obj);
+            DWORD tmp = 0;
+            CHECK(git->RegisterInterfaceInGlobal(sta_counter, IID_ICounter, &tmp));
+            sta_cookie = tmp;
+        }
+        while (!quit)
+            CoProcessApartmentCalls(10); // message loop
+        CoUninitialize();
+    });
+    while (!sta_cookie)
+        std::this_thread::yield();
+    {
+        // concurrent lookups & revocation. The object is released on the STA thread once the last lookup is done
+        std::vector<std::thread> threads;
+        std::atomic<int> calls = 0;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&] {
+                for (;;) {
+                    CComPtr<ICounter> proxy;
+                    if (FAILED(git->GetInterfaceFromGlobal(sta_cookie, IID_ICounter, reinterpret_cast<void**>(&proxy))))
+                        break; // revoked
+                    int value = 0;
+                    CHECK(proxy->Increment(&value));
+                    calls++;
+                }
+            });
+        }
+        while (calls < 100)
+            std::this_thread::yield();
+        CHECK(git->RevokeInterfaceFromGlobal(sta_cookie));
+        for (auto& t : threads)
+            t.join();
+    }
+    {
+        // a lookup nested in a call that an STA thread processes while waiting on its own lookup keeps the outer
+        // slot protected, so that revoking it meanwhile doesn't free the slot
+        GatedCounter gated;
+        std::atomic<DWORD> gated_cookie = 0, lookup_cookie = 0;
+        std::thread gated_sta([&] {
+            CHECK(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+            DWORD tmp = 0;
+            CHECK(git->RegisterInterfaceInGlobal(&gated, IID_ICounter, &tmp));
+            gated.gated = true;
+            gated_cookie = tmp;
+            while (!quit)
+                CoProcessApartmentCalls(10);
+            CoUninitialize();
+        });
+        std::atomic<bool> done = false;
+        std::thread lookup_sta([&] {
+            CHECK(CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED));
+            {
+                CComObject<LookupCounter>* lookup = nullptr;
+                CHECK(CComObject<LookupCounter>::CreateInstance(&lookup));
+                CComPtr<ICounter> lookup_counter(lookup);
+                lookup->git = git;
+                CHECK(git->RegisterInterfaceInGlobal(lookup_counter, IID_ICounter, &lookup->cookie));
+                lookup_cookie = lookup->cookie;
+            }
+            while (!gated_cookie)
+                std::this_thread::yield();
+            {
+                CComPtr<ICounter> proxy; // processes incoming calls while waiting
+                CHECK(git->GetInterfaceFromGlobal(gated_cookie, IID_ICounter, reinterpret_cast<void**>(&proxy)));
+            }
+            done = true;
+            while (!quit)
+                CoProcessApartmentCalls(10);
+            CoUninitialize();
+        });
+        while (!gated.entered || !lookup_cookie)
+            std::this_thread::yield();
+
+        CComPtr<ICounter> lookup_proxy;
+        CHECK(git->GetInterfaceFromGlobal(lookup_cookie, IID_ICounter, reinterpret_cast<void**>(&lookup_proxy)));
+        int value = 0;
+        CHECK(lookup_proxy->Increment(&value)); // nested lookup
+        assert(value == 1);
+
+        CHECK(git->RevokeInterfaceFromGlobal(gated_cookie));
+        CComObject<CountedClass>* obj2 = nullptr;
+        CHECK(CComObject<CountedClass>::CreateInstance(&obj2));
+        CComPtr<ICounter> counter2(obj2);
+        DWORD cookie2 = 0;
+        CHECK(git->RegisterInterfaceInGlobal(counter2, IID_ICounter, &cookie2));
+        assert((cookie2 & 0x000FFFFF) != (gated_cookie & 0x000FFFFF)); // revoked slot not yet freed
+        CHECK(git->RevokeInterfaceFromGlobal(cookie2));
+
+        gated.gated = false;
+        while (!done)
+            std::this_thread::yield();
+        lookup_proxy.Release();
+        CHECK(git->RevokeInterfaceFromGlobal(lookup_cookie));
+        quit = true;
+        lookup_sta.join();
+        gated_sta.join();
+        assert(gated.refs == 1);
+    }
+    quit = true;
+    sta.join();
+}
+
+/** Class with weak references through a control block in the same allocation. */
+class WeakClass : public CComObjectRootEx<CComMultiThreadModel>, public ICounter {
+public:
+    ~WeakClass () {
+        ++s_destroyed;
+    }
+
+    HRESULT Increment (int* value) override {
+        *value = ++m_count;
+        return S_OK;
+    }
+
+    DECLARE_WEAK_REFERENCES()
+
+    BEGIN_COM_MAP(WeakClass)
+        COM_INTERFACE_ENTRY(ICounter)
+        COM_INTERFACE_ENTRY_WEAKREF()
+    END_COM_MAP()
+
+    static inline std::atomic<int> s_destroyed = 0;
+private:
+    std::atomic<int> m_count = 0;
+};
+
+void TestWeakReferences () {
+    printf("weak references...\n");
+    int before = s_counting_malloc->allocations;
+    CComPtr<IWeakRef> weak;
+    {
+        CComObject<WeakClass>* obj = nullptr;
+        CHECK(CComObject<WeakClass>::CreateInstance(&obj));
+        assert(s_counting_malloc->allocations == before + 1); // control block in same allocation
+        CComPtr<ICounter> strong(obj);
+        CHECK(strong->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&weak)));
+        assert(obj->m_ref == 1); // weak references don't keep the object alive
+
+        // upgrade while alive
+        CComPtr<ICounter> upgraded;
+        CHECK(weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded)));
+        assert(upgraded == strong);
+        CComPtr<IWeakRef> weak2;
+        CHECK(weak->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&weak2)));
+        assert(weak2 == weak);
+        CComPtr<IUnknown> unknown;
+        assert(weak->QueryInterface(IID_IDispatch, reinterpret_cast<void**>(&unknown)) == E_NOINTERFACE);
+        assert(obj->m_ref == 2);
+    }
+    // upgrade fails after the last strong reference is released, but the allocation is kept for the weak reference
+    assert(WeakClass::s_destroyed == 1);
+    assert(s_counting_malloc->allocations == before + 1);
+    {
+        CComPtr<ICounter> upgraded;
+        assert(weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded)) == E_NOT_SET);
+        assert(!upgraded);
+    }
+    weak.Release();
+    assert(s_counting_malloc->allocations == before);
+
+    // concurrent upgrades while the last strong reference is released
+    for (int round = 0; round < 100; ++round) {
+        CComObject<WeakClass>* obj = nullptr;
+        CHECK(CComObject<WeakClass>::CreateInstance(&obj));
+        CComPtr<ICounter> strong(obj);
+        CHECK(strong->QueryInterface(IID_IWeakRef, reinterpret_cast<void**>(&weak)));
+        std::atomic<int> started = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&weak, &started] {
+                started++;
+                for (int i = 0; i < 1000; ++i) {
+                    CComPtr<ICounter> upgraded;
+                    if (FAILED(weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded))))
+                        break; // object is dead
+                    int value = 0;
+                    CHECK(upgraded->Increment(&value));
+                }
+            });
+        }
+        while (started < 4)
+            std::this_thread::yield();
+        strong.Release();
+        for (auto& t : threads)
+            t.join();
+        CComPtr<ICounter> upgraded;
+        assert(weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded)) == E_NOT_SET);
+        weak.Release();
+    }
+    assert(WeakClass::s_destroyed == 101);
+    assert(s_counting_malloc->allocations == before);
+
+    // bulk activation falls back to separate allocations
+    static constexpr GUID CLSID_WeakClass = {0x9b3f2e61,0x4c7a,0x4d18,{0xa5,0x0e,0x62,0xd9,0x1b,0x7c,0x83,0xf4}};
+    IUnknownFactory::RegisterClass<WeakClass>(CLSID_WeakClass, "WeakClass");
+    IUnknown* objs[3] = {};
+    CHECK(IUnknownFactory::CreateInstances(CLSID_WeakClass, CLSCTX_INPROC_SERVER, 3, objs));
+    assert(s_counting_malloc->allocations == before + 3);
+    for (IUnknown* obj : objs)
+        assert(obj->Release() == 0);
+    assert(s_counting_malloc->allocations == before);
+    CHECK(IUnknownFactory::UnregisterClass(CLSID_WeakClass));
+}
+
+
+/** Class wrapped in SharedRef for weak reference stress-testing. */
+class SharedTarget : public CComObjectRootEx<CComMultiThreadModel>, public ICounter {
+public:
+    ~SharedTarget () {
+        ++s_destroyed;
+    }
+
+    HRESULT Increment (int* value) override {
+        *value = ++m_count;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(SharedTarget)
+        COM_INTERFACE_ENTRY(ICounter)
+    END_COM_MAP()
+
+    static inline std::atomic<int> s_destroyed = 0;
+private:
+    std::atomic<int> m_count = 0;
+};
+
+/** Concurrent upgrade, release & destruction of SharedRef objects. Intended to also be run in ThreadSanitizer &
+    AddressSanitizer builds (run_tests.sh --sanitize). */
+void TestSharedRefStress () {
+    printf("SharedRef stress...\n");
+    const ULONG objects_before = SharedRefBase::ObjectCount();
+    const int ROUNDS = 200;
+    const int THREADS = 4;
+
+    // weak upgrades & weak reference churn racing with the last strong Release
+    for (int round = 0; round < ROUNDS; ++round) {
+        CComPtr<IUnknown> strong(new SharedRef<SharedTarget>());
+        CComPtr<IWeakRef> weak;
+        CHECK(strong->QueryInterface(__uuidof(IWeakRef), reinterpret_cast<void**>(&weak)));
+        std::atomic<int> started = 0;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < THREADS; ++t) {
+            threads.emplace_back([&weak, &started] {
+                started++;
+                for (int i = 0; i < 1000; ++i) {
+                    CComPtr<IWeakRef> weak_copy;
+                    CHECK(weak->QueryInterface(__uuidof(IWeakRef), reinterpret_cast<void**>(&weak_copy)));
+                    CComPtr<ICounter> upgraded;
+                    if (FAILED(weak_copy->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded))))
+                        break; // object is dead
+                    int value = 0;
+                    CHECK(upgraded->Increment(&value));
+                    CComPtr<IUnknown> identity;
+                    CHECK(upgraded->QueryInterface(IID_IUnknown, reinterpret_cast<void**>(&identity)));
+                }
+            });
+        }
+        while (started < THREADS)
+            std::this_thread::yield();
+        strong.Release();
+        for (auto& t : threads)
+            t.join();
+
+        CComPtr<ICounter> upgraded;
+        assert(weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded)) == E_NOT_SET);
+        assert(SharedTarget::s_destroyed == round + 1);
+        assert(SharedRefBase::ObjectCount() == objects_before + 1); // kept alive by the weak reference
+        weak.Release();
+        assert(SharedRefBase::ObjectCount() == objects_before);
+    }
+
+    // last strong & last weak references released concurrently from different threads
+    for (int round = 0; round < ROUNDS; ++round) {
+        IUnknown* strong = new SharedRef<SharedTarget>();
+        strong->AddRef();
+        IWeakRef* weak = nullptr;
+        CHECK(strong->QueryInterface(__uuidof(IWeakRef), reinterpret_cast<void**>(&weak)));
+        std::atomic<bool> go = false;
+        std::thread strong_thread([strong, &go] {
+            while (!go)
+                std::this_thread::yield();
+            strong->Release();
+        });
+        std::thread weak_thread([weak, &go] {
+            while (!go)
+                std::this_thread::yield();
+            CComPtr<ICounter> upgraded;
+            weak->QueryInterface(IID_ICounter, reinterpret_cast<void**>(&upgraded)); // might fail
+            upgraded.Release();
+            weak->Release();
+        });
+        go = true;
+        strong_thread.join();
+        weak_thread.join();
+    }
+    assert(SharedTarget::s_destroyed == 2*ROUNDS);
+    assert(SharedRefBase::ObjectCount() == objects_before);
+}
+
+class BiasedClass : public CComObjectRootEx<CComBiasedThreadModel>, public ICounter {
+public:
+    ~BiasedClass () {
+        ++s_destroyed;
+    }
+
+    HRESULT Increment (int* value) override {
+        *value = ++m_count;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(BiasedClass)
+        COM_INTERFACE_ENTRY(ICounter)
+    END_COM_MAP()
+
+    static inline std::atomic<int> s_destroyed = 0;
+private:
+    std::atomic<int> m_count = 0;
+};
+
+void TestBiasedRefCount () {
+    printf("biased reference-counting...\n");
+    static_assert(sizeof(CComObjectRootEx<CComBiasedThreadModel>) == sizeof(CComBiasedRefCount), "biased classes shall not have an m_ref");
+    {
+        // owner thread only
+        CComObject<BiasedClass>* obj = nullptr;
+        CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+        assert(obj->AddRef() == 1);
+        assert(obj->AddRef() == 2);
+        assert(obj->Release() == 1);
+        assert(obj->Release() == 0);
+        assert(BiasedClass::s_destroyed == 1);
+    }
+    {
+        // other thread references while the owner holds one, destroyed by the owner's last Release
+        CComObject<BiasedClass>* obj = nullptr;
+        CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+        obj->AddRef();
+        std::thread([obj] {
+            CComPtr<ICounter> counter(obj);
+            int value = 0;
+            CHECK(counter->Increment(&value));
+        }).join();
+        assert(obj->Release() == 0);
+        assert(BiasedClass::s_destroyed == 2);
+    }
+    {
+        // last reference released by another thread is queued to the owner
+        CComObject<BiasedClass>* obj = nullptr;
+        CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+        obj->AddRef();
+        std::thread([obj] {
+            assert(obj->Release() != 0);
+        }).join();
+        assert(BiasedClass::s_destroyed == 2);
+        assert(CComBiasedRefCount::ProcessQueue() == 1);
+        assert(BiasedClass::s_destroyed == 3);
+        assert(CComBiasedRefCount::ProcessQueue() == 0);
+    }
+    {
+        // queued objects are also destroyed on the owner's next AddRef of another biased object
+        CComObject<BiasedClass>* obj = nullptr;
+        CComObject<BiasedClass>* other = nullptr;
+        CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+        CHECK(CComObject<BiasedClass>::CreateInstance(&other));
+        obj->AddRef();
+        std::thread([obj] {
+            obj->Release();
+        }).join();
+        assert(BiasedClass::s_destroyed == 3);
+        other->AddRef();
+        assert(BiasedClass::s_destroyed == 4);
+        other->Release();
+        assert(BiasedClass::s_destroyed == 5);
+    }
+    {
+        // and by idle thread pool workers that own them
+        std::atomic<CComObject<BiasedClass>*> obj = nullptr;
+        CHECK(CoSubmitWork([](void* arg) {
+            CComObject<BiasedClass>* tmp = nullptr;
+            CHECK(CComObject<BiasedClass>::CreateInstance(&tmp));
+            tmp->AddRef();
+            *static_cast<std::atomic<CComObject<BiasedClass>*>*>(arg) = tmp;
+        }, &obj));
+        while (!obj)
+            std::this_thread::yield();
+        obj.load()->Release();
+        while (BiasedClass::s_destroyed < 6)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    {
+        // owner thread exits before the object is released
+        CComObject<BiasedClass>* obj = nullptr;
+        std::thread([&obj] {
+            CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+            obj->AddRef();
+            obj->AddRef();
+            obj->Release();
+        }).join();
+        obj->AddRef();
+        obj->Release();
+        assert(BiasedClass::s_destroyed == 6);
+        obj->Release(); // merged by the releasing thread
+        assert(BiasedClass::s_destroyed == 7);
+    }
+
+    // concurrent AddRef/Release from other threads while the owner hands over its last reference
+    for (int round = 0; round < 100; ++round) {
+        CComObject<BiasedClass>* obj = nullptr;
+        CHECK(CComObject<BiasedClass>::CreateInstance(&obj));
+        CComPtr<ICounter> owned(obj);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            CComPtr<ICounter> counter(owned);
+            threads.emplace_back([counter] {
+                for (int i = 0; i < 1000; ++i) {
+                    CComPtr<ICounter> tmp(counter);
+                    int value = 0;
+                    CHECK(tmp->Increment(&value));
+                }
+            });
+        }
+        for (int i = 0; i < 1000; ++i)
+            CComPtr<ICounter> tmp(owned);
+        owned.Release();
+        for (auto& t : threads)
+            t.join();
+        CComBiasedRefCount::ProcessQueue();
+    }
+    assert(BiasedClass::s_destroyed == 107);
+}
+
+/** Class that is activated in a separate process. */
+class RemoteCalc : public CComObjectRootEx<CComMultiThreadModel>, public CComCoClass<RemoteCalc, &CLSID_RemoteCalc>, public IRemoteCalc {
+public:
+    HRESULT Add (int a, int b, int* sum) override {
+        *sum = a + b;
+        return S_OK;
+    }
+    HRESULT Concat (BSTR a, BSTR b, BSTR* result) override {
+        if (!b)
+            return E_INVALIDARG;
+        CComBSTR tmp(a ? a : L"");
+        tmp += b;
+        *result = tmp.Detach();
+        return S_OK;
+    }
+    HRESULT Scale (SAFEARRAY* values, double factor, SAFEARRAY** result) override {
+        CComSafeArray<double> src(values);
+        CComSafeArray<double> dst(src.GetCount());
+        for (unsigned int i = 0; i < src.GetCount(); ++i)
+            dst[i] = factor*src[i];
+        *result = dst.Detach();
+        return S_OK;
+    }
+    HRESULT Overwrite (SAFEARRAY* values, double value) override {
+        // write through the received array instead of a copy
+        CComSafeArray<double> dst;
+        HRESULT hr = dst.Attach(values);
+        if (FAILED(hr))
+            return hr;
+        for (unsigned int i = 0; i < dst.GetCount(); ++i)
+            dst[i] = value;
+        dst.Detach();
+        return S_OK;
+    }
+    HRESULT Accumulate (float pos[3], double* total) override {
+        *total += pos[0] + pos[1] + pos[2];
+        return S_OK;
+    }
+    HRESULT Echo (IUnknown* obj, IUnknown** result) override {
+        *result = obj;
+        if (obj)
+            obj->AddRef();
+        return S_OK;
+    }
+    HRESULT Subscribe (IRemoteCallback* callback, int value) override {
+        return callback->Notify(value); // nested call back to the client
+    }
+    HRESULT RawBuffer (int /*size*/, BYTE* /*data*/) override {
+        return S_OK;
+    }
+    HRESULT ProcessId (int* pid) override {
+        *pid = getpid();
+        return S_OK;
+    }
+    HRESULT Crash () override {
+        kill(getpid(), SIGKILL);
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(RemoteCalc)
+        COM_INTERFACE_ENTRY(IRemoteCalc)
+    END_COM_MAP()
+};
+OBJECT_ENTRY_AUTO(CLSID_RemoteCalc, RemoteCalc)
+
+/** Client-side callback object. */
+class CallbackSink : public CComObjectRootEx<CComMultiThreadModel>, public IRemoteCallback {
+public:
+    HRESULT Notify (int val) override {
+        value = val;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(CallbackSink)
+        COM_INTERFACE_ENTRY(IRemoteCallback)
+    END_COM_MAP()
+
+    std::atomic<int> value = 0;
+};
+
+/** Callback that blocks until "count" callbacks are in progress. */
+class BarrierSink : public CComObjectRootEx<CComMultiThreadModel>, public IRemoteCallback {
+public:
+    HRESULT Notify (int /*val*/) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        entered++;
+        cv.notify_all();
+        return cv.wait_for(lock, std::chrono::seconds(10), [this] { return entered >= count; }) ? S_OK : E_FAIL;
+    }
+
+    BEGIN_COM_MAP(BarrierSink)
+        COM_INTERFACE_ENTRY(IRemoteCallback)
+    END_COM_MAP()
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    int                     entered = 0;
+    int                     count = 0;
+};
+
+/** Server that provides its own call objects. */
+class CallFactoryServer : public CComObjectRootEx<CComMultiThreadModel>, public ICallFactory {
+public:
+    HRESULT CreateCall (const IID& riid, IUnknown* /*pCtrlUnk*/, const IID& riid2, IUnknown** ppv) override {
+        if (riid != IID_AsyncIRemoteCalc)
+            return E_NOINTERFACE;
+        calls++;
+        CComObject<RemoteCalc>* calc = nullptr;
+        CHECK(CComObject<RemoteCalc>::CreateInstance(&calc));
+        CComPtr<IUnknown> server(static_cast<IRemoteCalc*>(calc));
+        CComPtr<IUnknown> call;
+        CHECK(AsyncIRemoteCalc_Call::Create<AsyncIRemoteCalc_Call>(server, &call));
+        return call->QueryInterface(riid2, reinterpret_cast<void**>(ppv));
+    }
+
+    BEGIN_COM_MAP(CallFactoryServer)
+        COM_INTERFACE_ENTRY(ICallFactory)
+    END_COM_MAP()
+
+    std::atomic<int> calls = 0;
+};
+
+#ifdef __cpp_impl_coroutine
+/** Fire-and-forget coroutine. */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object () {
+            return {};
+        }
+        std::suspend_never initial_suspend () {
+            return {};
+        }
+        std::suspend_never final_suspend () noexcept {
+            return {};
+        }
+        void return_void () {
+        }
+        void unhandled_exception () {
+            std::terminate();
+        }
+    };
+};
+
+DetachedTask AwaitAdd (IRemoteCalc* calc, int a, int b, std::atomic<int>* total, std::atomic<int>* done) {
+    CComPtr<IUnknown> unk;
+    CHECK(CoCreateAsyncCall(calc, IID_AsyncIRemoteCalc, &unk));
+    CComPtr<AsyncIRemoteCalc> call;
+    CHECK(unk->QueryInterface(IID_AsyncIRemoteCalc, reinterpret_cast<void**>(&call)));
+    CHECK(call->Begin_Add(a, b));
+    co_await CoAwaitCall(call);
+    int sum = 0;
+    CHECK(call->Finish_Add(&sum)); // completed, so doesn't block
+    *total += sum;
+    (*done)++;
+}
+#endif
+
+void TestAsyncCalls () {
+    printf("asynchronous calls...\n");
+    CComObject<RemoteCalc>* obj = nullptr;
+    CHECK(CComObject<RemoteCalc>::CreateInstance(&obj));
+    CComPtr<IRemoteCalc> calc(obj);
+
+    CComPtr<AsyncIRemoteCalc> call;
+    {
+        CComPtr<IUnknown> unk;
+        CHECK(CoCreateAsyncCall(calc, IID_AsyncIRemoteCalc, &unk));
+        CHECK(unk->QueryInterface(IID_AsyncIRemoteCalc, reinterpret_cast<void**>(&call)));
+    }
+    int sum = 0;
+    assert(call->Finish_Add(&sum) == RPC_E_CALL_COMPLETE); // no call in progress
+    CHECK(call->Begin_Add(2, 3));
+    assert(call->Begin_Add(4, 5) == RPC_S_CALLPENDING); // one call at a time
+    assert(call->Finish_Concat(nullptr) == RPC_E_CALL_COMPLETE); // other method
+    CHECK(call->Finish_Add(&sum));
+    assert(sum == 5);
+
+    {
+        // [in] arguments are copied, so that they can be freed after Begin_X
+        CComBSTR a(L"async"), b(L" call");
+        CHECK(call->Begin_Concat(a, b));
+        a.Empty();
+        b.Empty();
+        CComBSTR result;
+        CHECK(call->Finish_Concat(&result));
+        assert(wcscmp(result, L"async call") == 0);
+
+        // method errors are returned from Finish_X with zeroed [out] arguments
+        CHECK(call->Begin_Concat(nullptr, nullptr));
+        BSTR failed = reinterpret_cast<BSTR>(0x1);
+        assert(call->Finish_Concat(&failed) == E_INVALIDARG);
+        assert(!failed);
+    }
+    {
+        CComSafeArray<double> values(2);
+        values[0] = 1.0;
+        values[1] = 2.0;
+        CHECK(call->Begin_Scale(values, 3.0));
+        values.Destroy();
+        SAFEARRAY* result = nullptr;
+        CHECK(call->Finish_Scale(&result));
+        CComSafeArray<double> scaled;
+        CHECK(scaled.Attach(result));
+        assert((scaled.GetCount() == 2) && (scaled[1] == 6.0));
+
+        float pos[3] = {1, 2, 3};
+        double total = 10;
+        CHECK(call->Begin_Accumulate(pos, &total));
+        CHECK(call->Finish_Accumulate(&total));
+        assert(total == 16);
+
+        CComPtr<IUnknown> echo;
+        CHECK(call->Begin_Echo(calc));
+        CHECK(call->Finish_Echo(&echo));
+        assert(echo == calc);
+    }
+    {
+        // blocking calls aren't limited by the number of pool workers, also when finished from a pool worker
+        const int CALLS = 2*std::max(2u, std::thread::hardware_concurrency()) + 2;
+        CComObject<BarrierSink>* sink = nullptr;
+        CHECK(CComObject<BarrierSink>::CreateInstance(&sink));
+        CComPtr<IRemoteCallback> sink_ref(sink);
+        sink->count = CALLS;
+        struct Pending {
+            CComPtr<AsyncIRemoteCalc> call;
+            std::atomic<int>*         finished;
+        };
+        std::vector<Pending> calls(CALLS);
+        std::atomic<int> finished = 0;
+        for (Pending& pending : calls) {
+            CComPtr<IUnknown> unk;
+            CHECK(CoCreateAsyncCall(calc, IID_AsyncIRemoteCalc, &unk));
+            CHECK(unk->QueryInterface(IID_AsyncIRemoteCalc, reinterpret_cast<void**>(&pending.call)));
+            pending.finished = &finished;
+            CHECK(pending.call->Begin_Subscribe(sink, 1));
+            CHECK(CoSubmitWork([](void* arg) {
+                auto* pending = static_cast<Pending*>(arg);
+                CHECK(pending->call->Finish_Subscribe());
+                (*pending->finished)++;
+            }, &pending));
+        }
+        while (finished < CALLS)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(finished == CALLS);
+    }
+    {
+        // blocking work beyond the thread limit is queued instead of starting more threads
+        const int TASKS = 200;
+        const int LIMIT = static_cast<int>(std::max(16u, 4*std::thread::hardware_concurrency()));
+        struct Blocked {
+            std::atomic<int>  running = 0;
+            std::atomic<int>  peak = 0;
+            std::atomic<int>  done = 0;
+            std::atomic<bool> release = false;
+        } blocked;
+        for (int i = 0; i < TASKS; ++i) {
+            CHECK(CoSubmitBlockingWork([](void* arg) {
+                auto* state = static_cast<Blocked*>(arg);
+                int running = ++state->running;
+                int peak = state->peak;
+                while ((running > peak) && !state->peak.compare_exchange_weak(peak, running)) {
+                }
+                while (!state->release)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                state->running--;
+                state->done++;
+            }, &blocked));
+        }
+        while (blocked.running < std::min(TASKS, LIMIT))
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        assert(blocked.peak <= LIMIT);
+        blocked.release = true;
+        while (blocked.done < TASKS)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    {
+        // server-provided call objects take precedence
+        CComObject<CallFactoryServer>* server = nullptr;
+        CHECK(CComObject<CallFactoryServer>::CreateInstance(&server));
+        CComPtr<ICallFactory> factory(server);
+        CComPtr<IUnknown> unk;
+        CHECK(CoCreateAsyncCall(factory, IID_AsyncIRemoteCalc, &unk));
+        assert(server->calls == 1);
+        unk.Release();
+        assert(CoCreateAsyncCall(factory, IID_IRemoteCalc, &unk) == E_NOINTERFACE);
+    }
+#ifdef __cpp_impl_coroutine
+    {
+        // many in-flight calls served by the thread pool without blocking the caller
+        const int CALLS = 2000;
+        std::atomic<int> total = 0, done = 0;
+        for (int i = 0; i < CALLS; ++i)
+            AwaitAdd(calc, i, 1, &total, &done);
+        while (done < CALLS)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        assert(total == CALLS*(CALLS - 1)/2 + CALLS);
+    }
+#endif
+}
+
+/** Event source with an IRemoteCallback connection point. */
+class EventSource : public CComObjectRootEx<CComMultiThreadModel>, public IConnectionPointContainerImpl<EventSource>, public IConnectionPointImpl<EventSource, &IID_IRemoteCallback, IRemoteCallback> {
+public:
+    /** Returns the number of notified sinks. */
+    ULONG Fire (int val) {
+        return ForEachSink([val](IRemoteCallback* sink) {
+            sink->Notify(val);
+        });
+    }
+
+    BEGIN_COM_MAP(EventSource)
+        COM_INTERFACE_ENTRY(IConnectionPointContainer)
+    END_COM_MAP()
+
+    BEGIN_CONNECTION_POINT_MAP(EventSource)
+        CONNECTION_POINT_ENTRY(IID_IRemoteCallback)
+    END_CONNECTION_POINT_MAP()
+};
+
+/** Sink that disconnects itself on the first event. */
+class OneShotSink : public CComObjectRootEx<CComMultiThreadModel>, public IRemoteCallback {
+public:
+    HRESULT Notify (int /*val*/) override {
+        CHECK(point->Unadvise(cookie));
+        calls++;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(OneShotSink)
+        COM_INTERFACE_ENTRY(IRemoteCallback)
+    END_COM_MAP()
+
+    IConnectionPoint* point = nullptr;
+    DWORD             cookie = 0;
+    int               calls = 0;
+};
+
+/** Weakly-held sink that unadvises another connection when a reference is released, like a sink destructor might. */
+class ReentrantSink : public IRemoteCallback, public IWeakRef {
+public:
+    HRESULT QueryInterface (const IID& iid, void** obj) override {
+        if ((iid == IID_IUnknown) || (iid == IID_IRemoteCallback))
+            *obj = static_cast<IRemoteCallback*>(this);
+        else if (iid == IID_IWeakRef)
+            *obj = static_cast<IWeakRef*>(this);
+        else {
+            *obj = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        return S_OK;
+    }
+    ULONG AddRef () override {
+        return ++refs;
+    }
+    ULONG Release () override {
+        ULONG ref = --refs;
+        if (DWORD cookie = unadvise_cookie.exchange(0))
+            CHECK(point->Unadvise(cookie));
+        return ref;
+    }
+    HRESULT Notify (int /*val*/) override {
+        return S_OK;
+    }
+
+    std::atomic<ULONG> refs = 1;
+    IConnectionPoint*  point = nullptr;
+    std::atomic<DWORD> unadvise_cookie = 0;
+};
+
+void TestConnectionPoints () {
+    printf("connection points...\n");
+    CComObject<EventSource>* source = nullptr;
+    CHECK(CComObject<EventSource>::CreateInstance(&source));
+    CComPtr<IConnectionPointContainer> container(source);
+
+    CComPtr<IConnectionPoint> point;
+    assert(container->FindConnectionPoint(IID_IRemoteCalc, &point) == CONNECT_E_NOCONNECTION);
+    CHECK(container->FindConnectionPoint(IID_IRemoteCallback, &point));
+    IID iid {};
+    CHECK(point->GetConnectionInterface(&iid));
+    assert(iid == IID_IRemoteCallback);
+    {
+        CComPtr<IConnectionPointContainer> parent;
+        CHECK(point->GetConnectionPointContainer(&parent));
+        assert(parent == container);
+    }
+    assert(source->Fire(1) == 0);
+
+    // strongly-held sink
+    CComObject<CallbackSink>* strong = nullptr;
+    CHECK(CComObject<CallbackSink>::CreateInstance(&strong));
+    CComPtr<IRemoteCallback> strong_ref(strong);
+    DWORD strong_cookie = 0;
+    CHECK(point->Advise(strong, &strong_cookie));
+    assert(source->Fire(2) == 1);
+    assert(strong->value == 2);
+    {
+        DWORD cookie = 0;
+        assert(point->Advise(container, &cookie) == CONNECT_E_CANNOTCONNECT); // wrong interface
+        assert(cookie == 0);
+        assert(point->Unadvise(12345) == CONNECT_E_NOCONNECTION);
+    }
+
+    // weakly-held sink is skipped & dropped after destruction
+    {
+        auto* shared = new SharedRef<CallbackSink>();
+        CComPtr<IUnknown> weak_sink(shared);
+        DWORD weak_cookie = 0;
+        CHECK(point->Advise(weak_sink, &weak_cookie));
+        assert(weak_cookie != strong_cookie);
+        assert(source->Fire(3) == 2);
+        assert(shared->Internal()->value == 3);
+    }
+    assert(source->Fire(4) == 1);
+    {
+        CComPtr<IEnumConnections> connections;
+        CHECK(point->EnumConnections(&connections));
+        CONNECTDATA data[2] = {};
+        ULONG fetched = 0;
+        assert(connections->Next(2, data, &fetched) == S_FALSE);
+        assert((fetched == 1) && (data[0].dwCookie == strong_cookie));
+        assert(data[0].pUnk == static_cast<IUnknown*>(strong));
+        data[0].pUnk->Release();
+    }
+
+    // sinks can disconnect while events are fired
+    CComObject<OneShotSink>* one_shot = nullptr;
+    CHECK(CComObject<OneShotSink>::CreateInstance(&one_shot));
+    CComPtr<IRemoteCallback> one_shot_ref(one_shot);
+    one_shot->point = point;
+    CHECK(point->Advise(one_shot, &one_shot->cookie));
+    assert(source->Fire(5) == 2);
+    assert(source->Fire(6) == 1);
+    assert(one_shot->calls == 1);
+
+    // concurrent firing & (un)advising
+    {
+        std::atomic<bool> stop = false;
+        std::vector<std::thread> firing;
+        for (int i = 0; i < 4; ++i) {
+            firing.emplace_back([&] {
+                while (!stop)
+                    assert(source->Fire(7) >= 1);
+            });
+        }
+        for (int i = 0; i < 1000; ++i) {
+            CComObject<CallbackSink>* sink = nullptr;
+            CHECK(CComObject<CallbackSink>::CreateInstance(&sink));
+            CComPtr<IRemoteCallback> sink_ref(sink);
+            DWORD cookie = 0;
+            CHECK(point->Advise(sink, &cookie));
+            CHECK(point->Unadvise(cookie));
+        }
+        stop = true;
+        for (std::thread& t : firing)
+            t.join();
+    }
+
+    {
+        // releases while pruning dead sinks happen after unlocking, so that sinks can (un)advise from them
+        ReentrantSink reentrant;
+        reentrant.point = point;
+        DWORD reentrant_cookie = 0, target_cookie = 0;
+        CHECK(point->Advise(static_cast<IRemoteCallback*>(&reentrant), &reentrant_cookie));
+        CHECK(point->Advise(strong, &target_cookie));
+        reentrant.unadvise_cookie = target_cookie;
+        DWORD cookie = 0;
+        CHECK(point->Advise(strong, &cookie)); // probes the weakly-held sink
+        assert(reentrant.unadvise_cookie == 0);
+        assert(point->Unadvise(target_cookie) == CONNECT_E_NOCONNECTION);
+        CHECK(point->Unadvise(cookie));
+        CHECK(point->Unadvise(reentrant_cookie));
+    }
+
+    CHECK(point->Unadvise(strong_cookie));
+    assert(point->Unadvise(strong_cookie) == CONNECT_E_NOCONNECTION);
+    assert(source->Fire(8) == 0);
+}
+
+void TestLocalServer (const char* executable) {
+    printf("out-of-process activation...\n");
+    CHECK(CoRegisterLocalServer(CLSID_RemoteCalc, executable));
+
+    CComPtr<IRemoteCalc> calc;
+    CHECK(calc.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_LOCAL_SERVER));
+    int pid = 0;
+    CHECK(calc->ProcessId(&pid));
+    assert(pid != getpid());
+    {
+        // ProgID activation honors the class context too
+        CComPtr<IRemoteCalc> by_name;
+        CHECK(by_name.CoCreateInstance(L"RemoteCalc", nullptr, CLSCTX_LOCAL_SERVER));
+        int name_pid = 0;
+        CHECK(by_name->ProcessId(&name_pid));
+        assert(name_pid != getpid());
+    }
+
+    {
+        // asynchronous call through the proxy
+        CComPtr<IUnknown> unk;
+        CHECK(CoCreateAsyncCall(calc, IID_AsyncIRemoteCalc, &unk));
+        CComPtr<AsyncIRemoteCalc> call;
+        CHECK(unk->QueryInterface(IID_AsyncIRemoteCalc, reinterpret_cast<void**>(&call)));
+        CHECK(call->Begin_ProcessId());
+        int remote_pid = 0;
+        CHECK(call->Finish_ProcessId(&remote_pid));
+        assert(remote_pid == pid);
+    }
+
+    int sum = 0;
+    CHECK(calc->Add(2, 3, &sum));
+    assert(sum == 5);
+
+    CComBSTR str;
+    CHECK(calc->Concat(CComBSTR(L"foo"), CComBSTR(L"b\u00e6r"), &str));
+    assert(str == CComBSTR(L"foob\u00e6r"));
+    str.Empty();
+    CHECK(calc->Concat(nullptr, CComBSTR(L""), &str)); // null & empty strings
+    assert(str.m_str && (str.Length() == 0));
+    str.Empty();
+    assert(calc->Concat(CComBSTR(L"foo"), nullptr, &str) == E_INVALIDARG);
+    assert(!str.m_str); // zeroed on failure
+
+    std::vector<double> vals = {1.0, 2.0, 3.0};
+    CComSafeArray<double> sa_vals = ConvertToSafeArray(vals.data(), vals.size());
+    SAFEARRAY* scaled_ptr = nullptr;
+    CHECK(calc->Scale(sa_vals, 2.0, &scaled_ptr));
+    CComSafeArray<double> scaled;
+    CHECK(scaled.Attach(scaled_ptr));
+    assert(scaled.GetCount() == 3);
+    assert(scaled[2] == 6.0);
+
+    {
+        // record arrays cannot be marshaled, and are rejected before sending
+        CComSafeArray<TestRow> rows(2);
+        SAFEARRAY* result_ptr = reinterpret_cast<SAFEARRAY*>(0x1);
+        assert(calc->Scale(rows, 2.0, &result_ptr) == DISP_E_BADVARTYPE);
+        assert(!result_ptr);
+    }
+    {
+        // large arrays are passed as shared memory
+        CComSafeArray<double> big(1000000);
+        for (unsigned int i = 0; i < big.GetCount(); ++i)
+            big[i] = i;
+        SAFEARRAY* result_ptr = nullptr;
+        CHECK(calc->Scale(big, 0.5, &result_ptr));
+        CComSafeArray<double> result;
+        CHECK(result.Attach(result_ptr));
+        assert(result.GetCount() == big.GetCount());
+        assert(result[999999] == 999999*0.5);
+
+        // pass received array back
+        result_ptr = nullptr;
+        CHECK(calc->Scale(result, 4.0, &result_ptr));
+        CComSafeArray<double> result2;
+        CHECK(result2.Attach(result_ptr));
+        assert(result2[1234] == 1234*2.0);
+
+        // callee writes to the received mapping don't reach the sender
+        CHECK(calc->Overwrite(big, -1.0));
+        assert(big[0] == 0.0);
+        assert(big[999999] == 999999.0);
+
+        // received arrays are writable & resizable
+        result[0] = -1.0;
+        CHECK(result.Add(42.0)); // resize moves out of shared memory
+        assert(result.GetCount() == big.GetCount() + 1);
+        assert(result[0] == -1.0);
+        assert(result[999999] == 999999*0.5);
+    }
+
+    float pos[3] = {1.0f, 2.0f, 3.0f};
+    double total = 10.0;
+    CHECK(calc->Accumulate(pos, &total));
+    assert(total == 16.0);
+
+    assert(calc->RawBuffer(0, nullptr) == E_NOTIMPL); // method cannot be marshaled
+    CComPtr<IMalloc> malloc;
+    assert(calc->QueryInterface(IID_IMalloc, reinterpret_cast<void**>(&malloc)) == E_NOINTERFACE);
+
+    {
+        // local object passed to the server & back returns the original pointer
+        CComObject<CallbackSink>* sink = nullptr;
+        CHECK(CComObject<CallbackSink>::CreateInstance(&sink));
+        CComPtr<IRemoteCallback> callback(sink);
+        CComPtr<IUnknown> echo;
+        CHECK(calc->Echo(callback, &echo));
+        assert(callback.IsEqualObject(echo));
+
+        // remote object passed back to the server preserves identity
+        echo.Release();
+        CHECK(calc->Echo(calc, &echo));
+        assert(calc.IsEqualObject(echo));
+
+        // nested callback from the server
+        CHECK(calc->Subscribe(callback, 42));
+        assert(sink->value == 42);
+    }
+
+    // concurrent calls
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 4; ++t) {
+        callers.emplace_back([&calc, t] {
+            for (int i = 0; i < 100; ++i) {
+                int sum = 0;
+                CHECK(calc->Add(t, i, &sum));
+                assert(sum == t + i);
+            }
+        });
+    }
+    for (auto& t : callers)
+        t.join();
+
+    // server crash is reported to the client
+    CComPtr<IRemoteCalc> calc2;
+    CHECK(calc2.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_LOCAL_SERVER));
+    int pid2 = 0;
+    CHECK(calc2->ProcessId(&pid2));
+    assert(pid2 == pid); // shared server process
+    assert(calc->Crash() == RPC_E_DISCONNECTED);
+    assert(calc2->Add(1, 2, &sum) == RPC_E_DISCONNECTED);
+
+    // reactivation starts a new server
+    calc.Release();
+    CHECK(calc.CoCreateInstance(CLSID_RemoteCalc, nullptr, CLSCTX_LOCAL_SERVER));
+    CHECK(calc->ProcessId(&pid2));
+    assert(pid2 != pid);
+}
+
+
+void TestCComVariant () {
+    printf("CComVariant...\n");
+    int before = s_counting_malloc->allocations;
+    {
+        // scalars are stored inline
+        CComVariant a(42), b(2.5), c(true), d(static_cast<LONGLONG>(1) << 40);
+        assert((a.vt == VT_I4) && (a.lVal == 42));
+        assert((b.vt == VT_R8) && (b.dblVal == 2.5));
+        assert((c.vt == VT_BOOL) && (c.boolVal == VARIANT_TRUE));
+        assert((d.vt == VT_I8) && (d.llVal == (1LL << 40)));
+        CComVariant copy(b);
+        copy = a;
+        assert(copy == a);
+        assert(s_counting_malloc->allocations == before);
+    }
+    {
+        // strings are deep-copied, but moved & attached without copying
+        CComBSTR str(L"hello");
+        BSTR raw = str;
+        CComVariant a(std::move(str));
+        assert((a.vt == VT_BSTR) && (a.bstrVal == raw) && !str);
+        CComVariant b(a);
+        assert((b.bstrVal != raw) && (b == a));
+        assert(s_counting_malloc->allocations == before + 2);
+
+        CComVariant c(std::move(a));
+        assert((c.bstrVal == raw) && (a.vt == VT_EMPTY));
+        b = std::move(c);
+        assert((b.bstrVal == raw) && (c.vt == VT_EMPTY));
+        assert(s_counting_malloc->allocations == before + 1);
+
+        VARIANT out;
+        VariantInit(&out);
+        CHECK(b.Detach(&out));
+        assert((out.bstrVal == raw) && (b.vt == VT_EMPTY));
+        CHECK(b.Attach(&out));
+        assert((b.bstrVal == raw) && (out.vt == VT_EMPTY));
+    }
+    assert(s_counting_malloc->allocations == before);
+    {
+        // arrays
+        double vals[] = {1.0, 2.0};
+        CComSafeArray<double> sa = ConvertToSafeArray(vals, 2);
+        SAFEARRAY* raw = sa;
+        CComVariant copy(sa);
+        assert((copy.vt == (VT_ARRAY | VT_R8)) && (copy.parray != raw));
+        CComVariant moved(std::move(sa));
+        assert((moved.parray == raw) && !sa.m_ptr);
+    }
+    {
+        // type conversion
+        CComVariant v(L" 1234 ");
+        CHECK(v.ChangeType(VT_I2));
+        assert((v.vt == VT_I2) && (v.iVal == 1234));
+        assert(v.ChangeType(VT_I1) == DISP_E_OVERFLOW);
+        assert(v.iVal == 1234); // unchanged on failure
+        CHECK(v.ChangeType(VT_BSTR));
+        assert(v == CComVariant(L"1234"));
+
+        v = 0.1;
+        CHECK(v.ChangeType(VT_BSTR));
+        assert(v == CComVariant(L"0.1"));
+        CHECK(v.ChangeType(VT_R4));
+        assert((v.vt == VT_R4) && (v.fltVal == 0.1f));
+
+        v = L"18446744073709551615";
+        CHECK(v.ChangeType(VT_UI8));
+        assert(v.ullVal == 18446744073709551615ull);
+        v = L"abc";
+        assert(v.ChangeType(VT_R8) == DISP_E_TYPEMISMATCH);
+        v = L"false";
+        CHECK(v.ChangeType(VT_BOOL));
+        assert(v.boolVal == VARIANT_FALSE);
+
+        CComVariant str, flag(true);
+        CHECK(VariantChangeType(&str, &flag, VARIANT_ALPHABOOL, VT_BSTR));
+        assert(str == CComVariant(L"True"));
+        CHECK(str.ChangeType(VT_BSTR, &flag));
+        assert(str == CComVariant(L"-1"));
+    }
+    assert(s_counting_malloc->allocations == before);
+}
+
+/** Automation object accessed through IDispatch. */
+class DualCalc : public CComObjectRootEx<CComMultiThreadModel>, public IDispatchImpl<IDualCalc, &IID_IDualCalc, &LIBID_TestInterfacesLib> {
+public:
+    HRESULT Add (int a, int b, int* sum) override {
+        *sum = a + b;
+        return S_OK;
+    }
+    HRESULT Concat (BSTR a, BSTR b, BSTR* result) override {
+        CComBSTR tmp(a ? a : L"");
+        tmp += (b ? b : L"");
+        *result = tmp.Detach();
+        return S_OK;
+    }
+    HRESULT get_Factor (double* val) override {
+        *val = factor;
+        return S_OK;
+    }
+    HRESULT put_Factor (double val) override {
+        factor = val;
+        return S_OK;
+    }
+    HRESULT Scale (SAFEARRAY* values, SAFEARRAY** result) override {
+        CComSafeArray<double> src(values);
+        CComSafeArray<double> dst(src.GetCount());
+        for (unsigned int i = 0; i < src.GetCount(); ++i)
+            dst[i] = factor*src[i];
+        *result = dst.Detach();
+        return S_OK;
+    }
+    HRESULT Twin (IDualCalc** result) override {
+        *result = this;
+        AddRef();
+        return S_OK;
+    }
+    HRESULT Check (VARIANT_BOOL ok) override {
+        return (ok == VARIANT_TRUE) ? S_OK : E_INVALIDARG;
+    }
+    HRESULT Divide (long a, long b, long* quotient, long* remainder) override {
+        *quotient = a / b;
+        *remainder = a % b;
+        return S_OK;
+    }
+
+    BEGIN_COM_MAP(DualCalc)
+        COM_INTERFACE_ENTRY(IDualCalc)
+        COM_INTERFACE_ENTRY(IDispatch)
+    END_COM_MAP()
+
+    double factor = 1.0;
+};
+
+/** Late-bound call through IDispatch::Invoke. "args" are in declaration order. */
+static HRESULT InvokeHelper (IDispatch* obj, const wchar_t* name, WORD flags, std::vector<VARIANT> args, VARIANT* result, EXCEPINFO* excepinfo = nullptr, UINT* arg_err = nullptr) {
+    DISPID dispid = DISPID_UNKNOWN;
+    LPOLESTR names[] = {const_cast<LPOLESTR>(name)};
+    HRESULT hr = obj->GetIDsOfNames(IID_NULL, names, 1, 0, &dispid);
+    if (FAILED(hr))
+        return hr;
+
+    std::vector<VARIANT> reversed(args.rbegin(), args.rend());
+    DISPID put_id = DISPID_PROPERTYPUT;
+    DISPPARAMS params = {reversed.data(), nullptr, static_cast<UINT>(reversed.size()), 0};
+    if (flags & DISPATCH_PROPERTYPUT) {
+        params.rgdispidNamedArgs = &put_id;
+        params.cNamedArgs = 1;
+    }
+    return obj->Invoke(dispid, IID_NULL, 0, flags, &params, result, excepinfo, arg_err);
+}
+
+static VARIANT MakeVariant (VARTYPE vt, LONGLONG val) {
+    VARIANT v;
+    VariantInit(&v);
+    v.vt = vt;
+    v.llVal = val;
+    return v;
+}
+
+void TestDispatch () {
+    printf("IDispatch late binding...\n");
+    CComPtr<IDispatch> obj;
+    {
+        CComObject<DualCalc>* calc = nullptr;
+        CHECK(CComObject<DualCalc>::CreateInstance(&calc));
+        obj = static_cast<IDispatch*>(calc);
+    }
+
+    UINT count = 1;
+    CHECK(obj->GetTypeInfoCount(&count));
+    assert(count == 0);
+
+    // case-insensitive name lookup
+    DISPID dispid = DISPID_UNKNOWN;
+    LPOLESTR names[] = {const_cast<LPOLESTR>(L"fACTOR")};
+    CHECK(obj->GetIDsOfNames(IID_NULL, names, 1, 0, &dispid));
+    assert(dispid == 3);
+    names[0] = const_cast<LPOLESTR>(L"Divide"); // not accessible through IDispatch
+    assert(obj->GetIDsOfNames(IID_NULL, names, 1, 0, &dispid) == DISP_E_UNKNOWNNAME);
+    assert(dispid == DISPID_UNKNOWN);
+
+    VARIANT result;
+    VariantInit(&result);
+    CHECK(InvokeHelper(obj, L"Add", DISPATCH_METHOD, {MakeVariant(VT_I4, 2), MakeVariant(VT_I2, 3)}, &result));
+    assert((result.vt == VT_INT) && (result.intVal == 5));
+
+    {
+        // numeric coercion with range check
+        VARIANT a = MakeVariant(VT_R8, 0);
+        a.dblVal = 2.5; // rounded half to even
+        CHECK(InvokeHelper(obj, L"Add", DISPATCH_METHOD | DISPATCH_PROPERTYGET, {a, MakeVariant(VT_UI1, 1)}, &result));
+        assert((result.vt == VT_INT) && (result.intVal == 3));
+
+        UINT arg_err = 0;
+        assert(InvokeHelper(obj, L"Add", DISPATCH_METHOD, {MakeVariant(VT_I4, 1), MakeVariant(VT_I8, 1LL << 40)}, &result, nullptr, &arg_err) == DISP_E_OVERFLOW);
+        assert(arg_err == 0); // reverse order
+    }
+
+    {
+        // BSTR arguments & return value
+        CComBSTR a(L"foo"), b(L"bar");
+        VARIANT va = MakeVariant(VT_BSTR, 0), vb = MakeVariant(VT_BSTR, 0);
+        va.bstrVal = a;
+        vb.bstrVal = b;
+        CHECK(InvokeHelper(obj, L"concat", DISPATCH_METHOD, {va, vb}, &result));
+        assert((result.vt == VT_BSTR) && (CComBSTR(result.bstrVal) == CComBSTR(L"foobar")));
+        CHECK(VariantClear(&result));
+        assert(result.vt == VT_EMPTY);
+
+        UINT arg_err = 0;
+        assert(InvokeHelper(obj, L"Concat", DISPATCH_METHOD, {va, MakeVariant(VT_NULL, 0)}, &result, nullptr, &arg_err) == DISP_E_TYPEMISMATCH);
+        assert(arg_err == 0);
+        assert(InvokeHelper(obj, L"Concat", DISPATCH_METHOD, {va}, &result) == DISP_E_BADPARAMCOUNT);
+    }
+
+    {
+        // property get & put, with by-reference argument
+        VARIANT val = MakeVariant(VT_R8, 0);
+        val.dblVal = 2.0;
+        VARIANT ref = MakeVariant(VT_BYREF | VT_VARIANT, 0);
+        ref.pvarVal = &val;
+        CHECK(InvokeHelper(obj, L"Factor", DISPATCH_PROPERTYPUT, {ref}, nullptr));
+        CHECK(InvokeHelper(obj, L"Factor", DISPATCH_PROPERTYGET, {}, &result));
+        assert((result.vt == VT_R8) && (result.dblVal == 2.0));
+        assert(InvokeHelper(obj, L"Factor", DISPATCH_METHOD, {}, &result) == DISP_E_MEMBERNOTFOUND);
+    }
+
+    {
+        // SAFEARRAY argument & return value
+        double vals[] = {1.0, 2.0, 3.0};
+        CComSafeArray<double> sa = ConvertToSafeArray(vals, 3);
+        VARIANT arg = MakeVariant(VT_ARRAY | VT_R8, 0);
+        arg.parray = sa;
+        CHECK(InvokeHelper(obj, L"Scale", DISPATCH_METHOD, {arg}, &result));
+        assert(result.vt == (VT_ARRAY | VT_R8));
+        CComSafeArray<double> scaled;
+        CHECK(scaled.Attach(result.parray));
+        VariantInit(&result);
+        assert((scaled.GetCount() == 3) && (scaled[2] == 6.0));
+    }
+
+    {
+        // interface return value
+        CHECK(InvokeHelper(obj, L"Twin", DISPATCH_METHOD, {}, &result));
+        assert((result.vt == VT_DISPATCH) && obj.IsEqualObject(result.pdispVal));
+        CHECK(VariantClear(&result));
+    }
+
+    {
+        // method failure
+        EXCEPINFO excepinfo = {};
+        VARIANT ok = MakeVariant(VT_BOOL, 0);
+        assert(InvokeHelper(obj, L"Check", DISPATCH_METHOD, {ok}, nullptr, &excepinfo) == DISP_E_EXCEPTION);
+        assert(excepinfo.scode == E_INVALIDARG);
+        ok.boolVal = VARIANT_TRUE;
+        CHECK(InvokeHelper(obj, L"Check", DISPATCH_METHOD, {ok}, nullptr));
+    }
+
+    DISPPARAMS no_args = {};
+    assert(obj->Invoke(42, IID_NULL, 0, DISPATCH_METHOD, &no_args, &result, nullptr, nullptr) == DISP_E_MEMBERNOTFOUND);
+    assert(obj->Invoke(1, IID_IUnknown, 0, DISPATCH_METHOD, &no_args, &result, nullptr, nullptr) == DISP_E_UNKNOWNINTERFACE);
+}
+
+int main(int argc, char* argv[]) {
+    if (CoRunLocalServer(argc, argv) == S_OK)
+        return 0; // started as local server for TestLocalServer
+
+    setenv("COM_LEAK_TRACKER", "1", /*overwrite*/false); // must be set before the first object is created
+
     printf("Running tests...\n");
+    TestCoTaskMemAlloc();
     TestCComSafeArray();
+    TestRecordSafeArray();
+    TestSafeArrayChangeType();
+    TestSingletonFactory();
+    TestPooledAllocator();
+    TestBulkCreation();
+    TestWeakReferences();
+    TestBiasedRefCount();
+    TestSharedRefStress();
+    TestSingleThreadedApartment();
+    TestObjectCounters();
+    TestGlobalInterfaceTable();
+    TestLeakTracker();
+    TestClassRegistry();
+    TestClassCatalog();
+    TestCComVariant();
+    TestDispatch();
+    TestAsyncCalls();
+    TestConnectionPoints();
+    TestLocalServer(argv[0]);
+    TestRevokeModuleClasses();
 }